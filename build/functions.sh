@@ -19,6 +19,7 @@ usage() {
     echo "  - CMAKE_SHA256: Used to checksum CMAKE_URL (default: <none>)" >&2
     echo "  - CC: C compiler (default: gcc)" >&2
     echo "  - CXX: C++ compiler (default: g++)" >&2
+    echo "  - CMAKE_ARGS: Extra cmake arguments (default: <none>)" >&2
 }
 
 
@@ -39,6 +40,7 @@ docker_run() {
             --env "CMAKE_SHA256=${CMAKE_SHA256}" \
             --env "CC=${CC}" \
             --env "CXX=${CXX}" \
+            --env "CMAKE_ARGS=${CMAKE_ARGS}" \
             --env "DISTRO=${DOCKER_IMAGE}" \
             "$DOCKER_IMAGE" \
             $@
@@ -162,7 +164,7 @@ build() {
         mkdir release
         cd release
 
-        cmake -DCMAKE_BUILD_TYPE=release ..
+        cmake -DCMAKE_BUILD_TYPE=release ${CMAKE_ARGS} ..
         make
 
         ctest -V
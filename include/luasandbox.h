@@ -9,7 +9,11 @@
 #ifndef luasandbox_h_
 #define luasandbox_h_
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "luasandbox/error.h"
+#include "luasandbox/util/output_buffer.h"
 
 #ifdef _WIN32
 #ifdef luasandbox_EXPORTS
@@ -30,8 +34,11 @@
 #define LSB_SHUTTING_DOWN     "shutting down"
 #define LSB_CONFIG_TABLE      "lsb_config"
 #define LSB_THIS_PTR          "lsb_this_ptr"
+#define LSB_PRNG              "lsb_prng"
 #define LSB_MEMORY_LIMIT      "memory_limit"
+#define LSB_SOFT_MEMORY_LIMIT "soft_memory_limit"
 #define LSB_INSTRUCTION_LIMIT "instruction_limit"
+#define LSB_PROFILE_INTERVAL  "profile_interval"
 #define LSB_INPUT_LIMIT       "input_limit"
 #define LSB_OUTPUT_LIMIT      "output_limit"
 #define LSB_LOG_LEVEL         "log_level"
@@ -58,11 +65,42 @@ typedef enum {
   LSB_UT_MEMORY       = 0,
   LSB_UT_INSTRUCTION  = 1,
   LSB_UT_OUTPUT       = 2,
+  // limit: soft_memory_limit, current: number of collections it triggered,
+  // maximum: most bytes reclaimed by one of them
+  LSB_UT_SOFT_GC      = 3,
+  // current: last soft limit collection pause (ns), maximum: longest pause
+  LSB_UT_GC_PAUSE     = 4,
 
   LSB_UT_MAX
 } lsb_usage_type;
 
+typedef enum {
+  LSB_HT_STRING   = 0,
+  LSB_HT_TABLE    = 1,
+  LSB_HT_FUNCTION = 2,
+  LSB_HT_USERDATA = 3,
+  LSB_HT_THREAD   = 4,
+  LSB_HT_PROTO    = 5, // compiled function prototypes
+  LSB_HT_UPVALUE  = 6,
+
+  LSB_HT_MAX
+} lsb_heap_type;
+
+typedef struct lsb_heap_stats {
+  size_t count[LSB_HT_MAX];
+  size_t bytes[LSB_HT_MAX];
+  size_t other; // allocations not owned by an object (string table, buffers)
+} lsb_heap_stats;
+
+typedef struct lsb_heap_table {
+  char    path[LSB_ERROR_SIZE]; // i.e. _G["data"]["hosts"] (truncated if long)
+  size_t  bytes;                // the table's own array and hash part
+  size_t  entries;              // non nil slots
+} lsb_heap_table;
+
 typedef struct lsb_lua_sandbox lsb_lua_sandbox;
+typedef struct lsb_config lsb_config;
+typedef struct lsb_bytecode_cache lsb_bytecode_cache;
 
 #ifdef __cplusplus
 extern "C"
@@ -80,7 +118,10 @@ LSB_EXPORT extern lsb_err_id LSB_ERR_TERMINATED;
  * full specification of the sandbox configuration using a Lua configuration
  * string.
  * memory_limit = 1024*1024*1
+ * soft_memory_limit = 1024*768 -- optional, crossing it forces a full
+ *                               -- collection at the next GC safe point
  * instruction_limit = 10000
+ * profile_interval = 10000 -- optional, starts the sampling profiler
  * output_limit = 64*1024
  * path = '/modules/?.lua'
  * cpath = '/modules/?.so'
@@ -105,6 +146,108 @@ LSB_EXPORT lsb_lua_sandbox*
 lsb_create(void *parent, const char *lua_file, const char *cfg,
            lsb_logger *logger);
 
+/**
+ * Parses and validates a sandbox configuration string (see lsb_create) into an
+ * immutable object. The result can be shared, including across threads, and
+ * instantiated into any number of sandboxes with lsb_create_with_config
+ * without parsing the configuration again.
+ *
+ * @param cfg Lua structure defining the full sandbox restrictions
+ * @param logger Struct for error reporting (NULL to disable)
+ *
+ * @return lsb_config* NULL on failure
+ */
+LSB_EXPORT lsb_config* lsb_create_config(const char *cfg, lsb_logger *logger);
+
+/**
+ * Frees a configuration created by lsb_create_config. Sandboxes created from
+ * it keep their own copy and are unaffected.
+ *
+ * @param cfg Configuration
+ */
+LSB_EXPORT void lsb_destroy_config(lsb_config *cfg);
+
+/**
+ * Same as lsb_create but uses a previously parsed configuration.
+ *
+ * @param parent Pointer to associate the owner to this sandbox.
+ * @param lua_file Filename of the Lua script to run in this sandbox.
+ * @param cfg Configuration created by lsb_create_config
+ * @param logger Struct for error reporting/debug printing (NULL to disable)
+ * @return lsb_lua_sandbox Sandbox pointer or NULL on failure.
+ */
+LSB_EXPORT lsb_lua_sandbox*
+lsb_create_with_config(void *parent, const char *lua_file,
+                       const lsb_config *cfg, lsb_logger *logger);
+
+/**
+ * Creates a new, fully initialized sandbox from a running prototype by deep
+ * copying its Lua heap (globals, loaded modules, closures with their shared
+ * upvalues, function prototypes and metatables). The clone has its own config
+ * table and fresh usage accounting and does not reference the prototype after
+ * this call returns. Prototypes holding full userdata (other than shared data,
+ * which is referenced rather than copied) or coroutines cannot be cloned. The
+ * prototype must not be executing during the call; multiple clones
+ * may be created from it concurrently.
+ *
+ * @param proto Running sandbox to copy
+ * @param parent Pointer to associate the owner to the new sandbox
+ * @param cfg Configuration for the new sandbox (see lsb_create_config)
+ * @param logger Struct for error reporting/debug printing (NULL to disable)
+ *
+ * @return lsb_lua_sandbox* NULL on failure
+ */
+LSB_EXPORT lsb_lua_sandbox* lsb_clone(lsb_lua_sandbox *proto, void *parent,
+                                      const lsb_config *cfg,
+                                      lsb_logger *logger);
+
+/**
+ * Creates a cache of precompiled Lua chunks keyed by a hash of the chunk name
+ * and source content. The plugin file loaded by lsb_init and every module
+ * loaded through the Lua 'path' are looked up in it before being parsed.
+ * Lookups are lock free and the cache can be shared across threads.
+ *
+ * @param max_entries Maximum number of chunks held in memory (must be > 0)
+ * @param dir Optional directory where the compiled chunks are also persisted
+ *            (NULL for memory only, POSIX only). The directory and the
+ *            cached files must be owned by the effective user and not
+ *            writable by group/other, files failing the check are ignored.
+ *            Each file also stores the chunk source and is only used for an
+ *            identical source.
+ *
+ * @return lsb_bytecode_cache* NULL on failure (including an untrusted dir)
+ */
+LSB_EXPORT lsb_bytecode_cache*
+lsb_create_bytecode_cache(size_t max_entries, const char *dir);
+
+/**
+ * Frees the cache; it must not be in use by any sandbox. If it is the process
+ * wide cache it is unset.
+ *
+ * @param c Cache
+ */
+LSB_EXPORT void lsb_destroy_bytecode_cache(lsb_bytecode_cache *c);
+
+/**
+ * Sets the bytecode cache used by all sandboxes created after this call (NULL
+ * to disable). The cache must outlive those sandboxes since modules can be
+ * required at any time.
+ *
+ * @param c Cache
+ */
+LSB_EXPORT void lsb_set_bytecode_cache(lsb_bytecode_cache *c);
+
+/**
+ * Retrieves the cache hit/miss counters.
+ *
+ * @param c Cache
+ * @param hits Number of chunks loaded without parsing (may be NULL)
+ * @param misses Number of chunks compiled from source (may be NULL)
+ */
+LSB_EXPORT void lsb_get_bytecode_cache_stats(lsb_bytecode_cache *c,
+                                             unsigned long long *hits,
+                                             unsigned long long *misses);
+
 /**
  * Initializes the Lua sandbox and loads/runs the Lua script that was specified
  * in lua_create_sandbox.
@@ -170,6 +313,84 @@ LSB_EXPORT char* lsb_destroy(lsb_lua_sandbox *lsb);
 LSB_EXPORT size_t lsb_usage(lsb_lua_sandbox *lsb,
                             lsb_usage_type utype,
                             lsb_usage_stat ustat);
+
+/**
+ * Walks the Lua heap and breaks the memory usage down by object type. The
+ * walk is proportional to the number of objects so it is meant for on demand
+ * diagnostics; it must not be called while the sandbox is executing.
+ *
+ * @param lsb Pointer to the sandbox.
+ * @param collect True to run a full collection first so only live objects are
+ *                reported, otherwise unreachable objects that have not been
+ *                swept yet are included.
+ * @param stats Structure to populate (the byte counts plus 'other' add up to
+ *              the LSB_UT_MEMORY current usage)
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+LSB_EXPORT lsb_err_value lsb_get_heap_stats(lsb_lua_sandbox *lsb, bool collect,
+                                            lsb_heap_stats *stats);
+
+/**
+ * Walks every table reachable from the globals (through table values) and
+ * reports the largest ones by path, using the same naming as the global data
+ * preservation. Each table is reported once, under the first path found. It
+ * must not be called while the sandbox is executing.
+ *
+ * @param lsb Pointer to the sandbox.
+ * @param tables Array to populate, largest first
+ * @param n Number of elements in the array
+ *
+ * @return size_t Number of elements populated; 0 indicates a failure (invalid
+ *         arguments, a terminated sandbox or an allocation failure) since the
+ *         globals table is always reported otherwise
+ */
+LSB_EXPORT size_t lsb_get_largest_tables(lsb_lua_sandbox *lsb,
+                                         lsb_heap_table *tables, size_t n);
+
+/**
+ * Starts (or resumes) the sampling profiler. The Lua call stack is recorded
+ * every interval instructions and aggregated by unique stack. Sampling takes
+ * effect at the next call into the sandbox.
+ *
+ * @param lsb Pointer to the sandbox.
+ * @param interval Number of instructions between samples (0 for the default
+ *                 of 10000)
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+LSB_EXPORT lsb_err_value lsb_start_profiler(lsb_lua_sandbox *lsb,
+                                            unsigned interval);
+
+/**
+ * Stops sampling, the collected profile is retained.
+ *
+ * @param lsb Pointer to the sandbox.
+ */
+LSB_EXPORT void lsb_stop_profiler(lsb_lua_sandbox *lsb);
+
+/**
+ * Writes the collected profile in the folded stack format used by
+ * flamegraph.pl ("root;caller;leaf count" one stack per line). Functions are
+ * named after the global (or module table field) that references them
+ * followed by their source and line defined. It must not be called while the
+ * sandbox is executing.
+ *
+ * @param lsb Pointer to the sandbox.
+ * @param ob Output buffer to append the profile to
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+LSB_EXPORT lsb_err_value lsb_get_profile(lsb_lua_sandbox *lsb,
+                                         lsb_output_buffer *ob);
+
+/**
+ * Discards the collected profile.
+ *
+ * @param lsb Pointer to the sandbox.
+ */
+LSB_EXPORT void lsb_reset_profile(lsb_lua_sandbox *lsb);
+
 /**
  * Retrieve the current sandbox status.
  *
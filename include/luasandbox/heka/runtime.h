@@ -0,0 +1,103 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Reference multi-threaded Heka plugin runtime (POSIX only) @file */
+
+#ifndef luasandbox_heka_runtime_h_
+#define luasandbox_heka_runtime_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../error.h"
+#include "sandbox.h"
+
+typedef struct lsb_heka_runtime lsb_heka_runtime;
+typedef struct lsb_heka_runtime_task lsb_heka_runtime_task;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Creates a runtime owning a pool of worker threads. Sandboxes with pending
+ * messages or due timer events are placed on per worker run queues; idle
+ * workers steal from the others. A sandbox is never executed by more than one
+ * thread at a time.
+ *
+ * @param threads Number of worker threads (must be > 0)
+ * @param logger Struct for error reporting (NULL to disable)
+ *
+ * @return lsb_heka_runtime* NULL on failure
+ */
+LSB_HEKA_EXPORT lsb_heka_runtime*
+lsb_heka_create_runtime(unsigned threads, lsb_logger *logger);
+
+/**
+ * Stops and joins all threads and frees the runtime and its mailboxes. Queued
+ * messages are discarded; the sandboxes are not destroyed (they remain owned by
+ * the host).
+ *
+ * @param rt Runtime
+ */
+LSB_HEKA_EXPORT void lsb_heka_destroy_runtime(lsb_heka_runtime *rt);
+
+/**
+ * Hands an analysis or output sandbox over to the runtime. From this point on
+ * the host must not call any process_message/timer_event API on it; its
+ * inject_message/update_checkpoint callbacks are invoked from the worker
+ * threads.
+ *
+ * @param rt Runtime
+ * @param hsb Analysis or output sandbox
+ * @param mailbox_size Size of the message mailbox in bytes
+ * @param ticker_interval Seconds between timer_event calls (0 to disable)
+ *
+ * @return lsb_heka_runtime_task* Handle used to post messages (NULL on
+ *         failure)
+ */
+LSB_HEKA_EXPORT lsb_heka_runtime_task*
+lsb_heka_runtime_add(lsb_heka_runtime *rt, lsb_heka_sandbox *hsb,
+                     size_t mailbox_size, unsigned ticker_interval);
+
+/**
+ * Copies a Heka protobuf message into the sandbox mailbox and schedules the
+ * sandbox. Each task must only be posted to from one thread at a time.
+ *
+ * @param t Runtime task
+ * @param pb Heka protobuf encoded message
+ * @param len Length of pb
+ *
+ * @return lsb_err_value NULL on success, LSB_ERR_UTIL_FULL if the mailbox is
+ *         full (back off and retry), LSB_ERR_TERMINATED if the sandbox has
+ *         been terminated
+ */
+LSB_HEKA_EXPORT lsb_err_value
+lsb_heka_runtime_post(lsb_heka_runtime_task *t, const char *pb, size_t len);
+
+/**
+ * Blocks until every posted message has been processed (or discarded).
+ *
+ * @param rt Runtime
+ */
+LSB_HEKA_EXPORT void lsb_heka_runtime_drain(lsb_heka_runtime *rt);
+
+/**
+ * Returns the number of messages the task has failed to decode and discarded.
+ *
+ * @param t Runtime task
+ *
+ * @return unsigned long long
+ */
+LSB_HEKA_EXPORT unsigned long long
+lsb_heka_runtime_decode_failures(lsb_heka_runtime_task *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,11 +10,18 @@
 #define luasandbox_heka_sandbox_h_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <time.h>
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
 #include "../../luasandbox.h"
 #include "../error.h"
 #include "../util/heka_message.h"
+#include "../util/histogram.h"
+#include "../util/ring_buffer.h"
 
 #ifdef _WIN32
 #ifdef luasandboxheka_EXPORTS
@@ -52,6 +59,15 @@ enum lsb_heka_im_rv {
 
 typedef struct lsb_heka_sandbox lsb_heka_sandbox;
 
+#ifdef _WIN32
+typedef struct lsb_heka_iovec {
+  void    *iov_base;
+  size_t  iov_len;
+} lsb_heka_iovec;
+#else
+typedef struct iovec lsb_heka_iovec; // can be passed directly to writev
+#endif
+
 typedef struct lsb_heka_stats {
   unsigned long long mem_cur;
   unsigned long long mem_max;
@@ -65,6 +81,10 @@ typedef struct lsb_heka_stats {
   double             pm_sd;
   double             te_avg;
   double             te_sd;
+  unsigned long long pm_p99;
+  unsigned long long te_p99;
+  unsigned long long gc_soft_cnt;
+  unsigned long long gc_pause_max;
 } lsb_heka_stats;
 
 #ifdef __cplusplus
@@ -192,7 +212,8 @@ lsb_heka_sandbox* lsb_heka_create_analysis(void *parent,
  * Host access to the analysis sandbox process_message API
  *
  * @param hsb Heka analysis sandbox
- * @param msg Heka message to process
+ * @param msg Heka message to process (read only; the same message can be
+ *            handed to several sandboxes concurrently)
  * @param profile Take a timing sample on this execution
  *
  * @return int
@@ -256,7 +277,8 @@ lsb_heka_sandbox* lsb_heka_create_output_im(void *parent,
  * Host access to the output sandbox process_message API
  *
  * @param hsb Heka output sandbox
- * @param msg Heka message to process
+ * @param msg Heka message to process (read only; the same message can be
+ *            handed to several sandboxes concurrently)
  * @param sequence_id Opaque pointer to the message sequence id (only used for
  *                    async output plugin otherwise it should be NULL)
  * @param profile Take a timing sample on this execution
@@ -276,6 +298,24 @@ int lsb_heka_pm_output(lsb_heka_sandbox *hsb,
                        lsb_heka_message *msg,
                        void *sequence_id,
                        bool profile);
+/**
+ * Routes inject_message output from an analysis or output sandbox directly
+ * into a single producer/single consumer ring buffer instead of the synchronous
+ * inject_message callback. The sandbox is the producer; the host may drain the
+ * buffer from another thread with lsb_ring_buffer_peek/lsb_ring_buffer_pop. A
+ * full buffer is reported to the plugin the same way as LSB_HEKA_IM_LIMIT.
+ * Messages injected during sandbox creation (before this call) are still
+ * delivered to the callback. This call is not thread safe.
+ *
+ * @param hsb Heka analysis or output sandbox
+ * @param rb Ring buffer owned by the host (NULL to revert to the callback); it
+ *           must outlive the sandbox or be detached first
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+LSB_HEKA_EXPORT lsb_err_value
+lsb_heka_set_im_ring_buffer(lsb_heka_sandbox *hsb, lsb_ring_buffer *rb);
+
 /**
  * Requests a long running input sandbox to stop. This call is not thread safe.
  *
@@ -363,6 +403,22 @@ LSB_HEKA_EXPORT const char* lsb_heka_get_lua_file(lsb_heka_sandbox *hsb);
  */
 LSB_HEKA_EXPORT lsb_heka_stats lsb_heka_get_stats(lsb_heka_sandbox *hsb);
 
+/**
+ * Retrieve the process_message (profiled calls only) and timer_event latency
+ * histograms in nanoseconds. Histograms from multiple sandboxes can be
+ * combined with lsb_merge_histogram. This call accesses internal data and is
+ * not thread safe.
+ *
+ * @param hsb Heka sandbox
+ * @param pm Receives a copy of the process_message histogram (may be NULL)
+ * @param te Receives a copy of the timer_event histogram (may be NULL)
+ * @param reset True to clear the sandbox histograms after the copy so the next
+ *              call returns only the new samples
+ */
+LSB_HEKA_EXPORT void lsb_heka_get_latency(lsb_heka_sandbox *hsb,
+                                          lsb_histogram *pm,
+                                          lsb_histogram *te, bool reset);
+
 /**
  * Convenience function to test if a sandbox is running.
  *
@@ -393,6 +449,22 @@ LSB_HEKA_EXPORT lsb_state lsb_heka_get_state(lsb_heka_sandbox *hsb);
 LSB_HEKA_EXPORT const lsb_heka_message*
 lsb_heka_get_message(lsb_heka_sandbox *hsb);
 
+/**
+ * Retrieve the scatter/gather output appended by the output sandbox write_iov
+ * function. The segments reference the bytes of the message passed to
+ * lsb_heka_pm_output and strings pinned in the sandbox (nothing is copied);
+ * they remain valid until the next lsb_heka_pm_output or lsb_heka_timer_event
+ * call (so the host must keep the message until then). This call returns a
+ * handle to internal data and is not thread safe.
+ *
+ * @param hsb Heka sandbox
+ * @param cnt Set to the number of segments
+ *
+ * @return const lsb_heka_iovec* NULL if there is no output
+ */
+LSB_HEKA_EXPORT const lsb_heka_iovec*
+lsb_heka_get_iov(lsb_heka_sandbox *hsb, int *cnt);
+
 /**
  * Retrieve the sandbox type.
  * *
@@ -16,9 +16,10 @@
 
 typedef struct heka_stream_reader
 {
-  char             *name;
-  lsb_heka_message msg;
-  lsb_input_buffer buf;
+  char                 *name;
+  lsb_heka_message     msg;
+  lsb_heka_field_index field_index;
+  lsb_input_buffer     buf;
 } heka_stream_reader;
 
 #endif
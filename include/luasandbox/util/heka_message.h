@@ -96,6 +96,25 @@ typedef struct lsb_heka_message
   int       fields_size;
 } lsb_heka_message;
 
+// array value offsets of the fields read by lsb_read_indexed_heka_field; owned
+// by the reader so the message itself is never modified
+typedef struct lsb_heka_field_slice
+{
+  unsigned  gen;  // the slice is valid when it matches the index generation
+  int       pos;
+  int       len;
+} lsb_heka_field_slice;
+
+typedef struct lsb_heka_field_index
+{
+  unsigned              *offsets;
+  int                   offsets_len;
+  int                   offsets_size;
+  lsb_heka_field_slice  *slices; // by position in lsb_heka_message.fields
+  int                   slices_size;
+  unsigned              gen;
+} lsb_heka_field_index;
+
 typedef enum {
   LSB_READ_NIL,
   LSB_READ_NUMERIC,
@@ -196,6 +215,118 @@ LSB_UTIL_EXPORT bool lsb_read_heka_field(const lsb_heka_message *m,
                                          int ai,
                                          lsb_read_value *val);
 
+/**
+ * Reads a value out of an already located field (used when the caller resolves
+ * several fields in a single pass over lsb_heka_message.fields).
+ *
+ * @param f Heka message field
+ * @param ai Array index into the field
+ * @param val Value structure to be populated by the read
+ *
+ * @return bool True on success
+ */
+LSB_UTIL_EXPORT bool lsb_read_heka_field_value(const lsb_heka_field *f,
+                                               int ai,
+                                               lsb_read_value *val);
+
+/**
+ * Initializes an empty field index
+ *
+ * @param fx Field index
+ */
+LSB_UTIL_EXPORT void lsb_init_heka_field_index(lsb_heka_field_index *fx);
+
+/**
+ * Discards the recorded offsets; must be called whenever the message the index
+ * is used with changes (a new decode or a different message)
+ *
+ * @param fx Field index
+ */
+LSB_UTIL_EXPORT void lsb_reset_heka_field_index(lsb_heka_field_index *fx);
+
+/**
+ * Frees the memory held by the field index
+ *
+ * @param fx Field index
+ */
+LSB_UTIL_EXPORT void lsb_free_heka_field_index(lsb_heka_field_index *fx);
+
+/**
+ * Reads a dynamic field from the Heka message like lsb_read_heka_field. The
+ * first read of an array index > 0 records the offset of every value in the
+ * field into the caller's index so iterating over an array is linear instead
+ * of quadratic. The message is not modified (it can be shared between threads
+ * each using its own index).
+ *
+ * @param m Heka meassage structure
+ * @param fx Field index for this message (NULL to scan the values)
+ * @param name Field name
+ * @param fi Field index
+ * @param ai Array index into the field
+ * @param val Value structure to be populated by the read
+ *
+ * @return bool True on success
+ */
+LSB_UTIL_EXPORT bool
+lsb_read_indexed_heka_field(const lsb_heka_message *m,
+                            lsb_heka_field_index *fx,
+                            lsb_const_string *name,
+                            int fi,
+                            int ai,
+                            lsb_read_value *val);
+
+/**
+ * Reads all the values out of a field in a single pass
+ *
+ * @param f Heka message field
+ * @param vals Array to be populated with the values (can be NULL when n is 0)
+ * @param n Number of entries in the vals array
+ *
+ * @return int Number of values in the field (only the first n are stored)
+ */
+LSB_UTIL_EXPORT int lsb_read_heka_field_values(const lsb_heka_field *f,
+                                               lsb_read_value *vals,
+                                               int n);
+
+/**
+ * Decodes the next key/value pair of an encoded Heka message into the message
+ * headers, allowing a caller to stop as soon as the headers it needs have been
+ * seen. Fields are skipped (see lsb_read_encoded_heka_field). The message
+ * structure should be cleared before the first call.
+ *
+ * @param m Heka message structure
+ * @param p Current position in the protobuf array
+ * @param e End of the protobuf array
+ * @param tag Set to the tag of the pair that was processed
+ *
+ * @return const char* Position of the next pair, NULL at the end of the array
+ *         or on a malformed/unknown pair
+ */
+LSB_UTIL_EXPORT const char* lsb_decode_heka_header(lsb_heka_message *m,
+                                                   const char *p,
+                                                   const char *e,
+                                                   int *tag);
+
+/**
+ * Reads a dynamic field directly from an encoded Heka message (no full
+ * decode); the array is scanned up to the requested field.
+ *
+ * @param buf Protobuf array
+ * @param len Length of the protobuf array
+ * @param name Field name
+ * @param fi Field index
+ * @param ai Array index into the field
+ * @param val Value structure to be populated by the read
+ *
+ * @return bool True on success
+ */
+LSB_UTIL_EXPORT bool lsb_read_encoded_heka_field(const char *buf,
+                                                 size_t len,
+                                                 lsb_const_string *name,
+                                                 int fi,
+                                                 int ai,
+                                                 lsb_read_value *val);
+
 /**
  * Writes a binary UUID to the output buffer
  *
@@ -10,11 +10,20 @@
 #define luasandbox_util_heka_message_matcher_h_
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "heka_message.h"
 
 typedef struct lsb_message_matcher lsb_message_matcher;
 
+typedef struct lsb_message_matcher_stats {
+  unsigned long long evals; ///< number of times the test was evaluated
+  unsigned long long hits;  ///< number of times the test was true
+  unsigned long long timed; ///< number of evaluations sampled into ns
+  unsigned long long ns;    ///< time spent in the sampled evaluations
+  unsigned           test;  ///< zero based position of the test in the expression
+} lsb_message_matcher_stats;
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -31,7 +40,25 @@ LSB_UTIL_EXPORT lsb_message_matcher*
 lsb_create_message_matcher(const char *exp);
 
 /**
- * Frees all memory associated with a message matcher instance
+ * Returns a shared matcher for the expression, creating it on the first
+ * request. Matchers are interned process wide by their whitespace normalized
+ * expression so the parse and memory cost is paid once per distinct
+ * expression. The returned matcher is reference counted and immutable (it
+ * cannot be profiled) so it can be evaluated from multiple threads; release it
+ * with lsb_destroy_message_matcher. If the process wide table cannot grow a
+ * private (unshared) matcher is returned instead.
+ *
+ * @param exp Expression to parse into a matcher
+ *
+ * @return lsb_message_matcher* NULL if the expression is invalid or the
+ *         matcher could not be allocated
+ */
+LSB_UTIL_EXPORT lsb_message_matcher*
+lsb_acquire_message_matcher(const char *exp);
+
+/**
+ * Frees all memory associated with a message matcher instance (a shared
+ * matcher is only freed when its last reference is destroyed)
  *
  * @param mm Message matcher
  */
@@ -48,6 +75,64 @@ LSB_UTIL_EXPORT void lsb_destroy_message_matcher(lsb_message_matcher *mm);
 LSB_UTIL_EXPORT bool
 lsb_eval_message_matcher(lsb_message_matcher *mm, lsb_heka_message *m);
 
+/**
+ * Evaluates the message matcher directly against an encoded Heka message.
+ * Headers are only decoded once a test requires one (skipping over the fields)
+ * and fields are read in place, so a message rejected on a header test never
+ * has its fields decoded. The message is not validated (a missing
+ * Uuid/Timestamp is not detected and a malformed array is treated as ending at
+ * the error) so a match should still be decoded with lsb_decode_heka_message
+ * before use. If a header is repeated the last occurrence is tested, as it is
+ * kept by lsb_decode_heka_message.
+ *
+ * @param mm Message matcher
+ * @param buf Protobuf array
+ * @param len Length of the protobuf array
+ *
+ * @return bool True if the message is a match
+ */
+LSB_UTIL_EXPORT bool
+lsb_eval_message_matcher_raw(lsb_message_matcher *mm, const char *buf,
+                             size_t len);
+
+/**
+ * Enables the per test evaluation/hit counters (the cost is sampled on one in
+ * sixteen messages). When an interval is specified the operands of the AND/OR
+ * operators are periodically reordered so the cheapest, most selective tests
+ * run first; the result of the matcher is unchanged. A profiled matcher is
+ * modified by lsb_eval_message_matcher and cannot be shared between threads.
+ *
+ * @param mm Message matcher
+ * @param interval Number of evaluated messages between reorderings (0 only
+ *                 collects the counters)
+ *
+ * @return bool False if the counters could not be allocated or the matcher is
+ *         shared (lsb_acquire_message_matcher)
+ */
+LSB_UTIL_EXPORT bool
+lsb_profile_message_matcher(lsb_message_matcher *mm, unsigned interval);
+
+/**
+ * Retrieves the per test counters, in expression order
+ *
+ * @param mm Message matcher
+ * @param stats Array receiving the counters (indexed by test position)
+ * @param n Number of entries in the stats array
+ *
+ * @return size_t Number of tests in the matcher (0 if it is not profiled)
+ */
+LSB_UTIL_EXPORT size_t
+lsb_get_message_matcher_stats(const lsb_message_matcher *mm,
+                              lsb_message_matcher_stats *stats, size_t n);
+
+/**
+ * Reorders the AND/OR operands using the counters collected so far (no-op if
+ * the matcher is not profiled)
+ *
+ * @param mm Message matcher
+ */
+LSB_UTIL_EXPORT void lsb_optimize_message_matcher(lsb_message_matcher *mm);
+
 #ifdef __cplusplus
 }
 #endif
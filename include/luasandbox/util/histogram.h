@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Fixed size, mergeable log-linear histogram (HDR style) for latency
+ *  percentiles @file */
+
+#ifndef lsb_util_histogram_h_
+#define lsb_util_histogram_h_
+
+#include "util.h"
+
+// each power of two range is split into 2^LSB_HISTOGRAM_SUB_BITS linear
+// buckets bounding the relative error to 1/32; values at or above
+// 2^LSB_HISTOGRAM_MAX_BITS (~18 minutes in nanoseconds) share an overflow
+// bucket at the end
+#define LSB_HISTOGRAM_SUB_BITS 5
+#define LSB_HISTOGRAM_MAX_BITS 40
+#define LSB_HISTOGRAM_BUCKETS \
+  (((LSB_HISTOGRAM_MAX_BITS - LSB_HISTOGRAM_SUB_BITS + 1) \
+    << LSB_HISTOGRAM_SUB_BITS) + 1)
+
+typedef struct lsb_histogram
+{
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long min;
+  unsigned long long max;
+  unsigned long long buckets[LSB_HISTOGRAM_BUCKETS];
+} lsb_histogram;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Zeros out the histogram (a zero filled structure is a valid empty
+ * histogram)
+ *
+ * @param h Histogram to zero out
+ */
+LSB_UTIL_EXPORT void lsb_init_histogram(lsb_histogram *h);
+
+/**
+ * Records a value
+ *
+ * @param h Histogram
+ * @param v Value to add
+ */
+LSB_UTIL_EXPORT void lsb_update_histogram(lsb_histogram *h,
+                                          unsigned long long v);
+
+/**
+ * Adds all the values recorded in one histogram to another
+ *
+ * @param h Destination histogram
+ * @param src Histogram to merge
+ */
+LSB_UTIL_EXPORT void lsb_merge_histogram(lsb_histogram *h,
+                                         const lsb_histogram *src);
+
+/**
+ * Returns the value at the given percentile; the highest value equivalent to
+ * the bucket it falls in, clamped to the recorded min/max
+ *
+ * @param h Histogram
+ * @param p Percentile (0-100)
+ *
+ * @return unsigned long long Value (0 if the histogram is empty)
+ */
+LSB_UTIL_EXPORT unsigned long long
+lsb_histogram_percentile(const lsb_histogram *h, double p);
+
+/**
+ * Returns the mean of the recorded values
+ *
+ * @param h Histogram
+ *
+ * @return double Mean (0 if the histogram is empty)
+ */
+LSB_UTIL_EXPORT double lsb_histogram_mean(const lsb_histogram *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -16,6 +16,7 @@
 #include "util.h"
 
 #define LSB_MAX_VARINT_BYTES  10
+#define LSB_PB_FIXED_LENGTH_BYTES 4 // reserved length width (lengths < 256MiB)
 
 typedef enum {
   LSB_PB_WT_VARINT  = 0,
@@ -67,6 +68,22 @@ lsb_pb_write_key(lsb_output_buffer *ob, unsigned char tag,
 LSB_UTIL_EXPORT
 const char* lsb_pb_read_varint(const char *p, const char *e, long long *vi);
 
+/**
+ * Reads the values of a packed repeated varint field
+ *
+ * @param p Start of the packed values
+ * @param e End of the packed values
+ * @param vals Array receiving the values
+ * @param n In: size of the vals array, Out: number of values read
+ *
+ * @return const char* Position in the buffer after the last value read (reading
+ *         stops at the end of the buffer or when vals is full), NULL if a
+ *         malformed varint was encountered
+ */
+LSB_UTIL_EXPORT
+const char* lsb_pb_read_packed_varint(const char *p, const char *e,
+                                      long long *vals, size_t *n);
+
 
 /**
  * Outputs the varint to an existing buffer
@@ -136,6 +153,31 @@ lsb_pb_write_string(lsb_output_buffer *ob, char tag, const char *s, size_t len);
 LSB_UTIL_EXPORT lsb_err_value
 lsb_pb_update_field_length(lsb_output_buffer *ob, size_t len_pos);
 
+/**
+ * Reserves LSB_PB_FIXED_LENGTH_BYTES for a field length that is not known until
+ * the field has been written. Unlike the single byte placeholder used with
+ * lsb_pb_update_field_length the field never has to be moved once the length
+ * is known; the cost is a redundant (zero padded) varint on the wire.
+ *
+ * @param ob  Pointer to the output data buffer.
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+LSB_UTIL_EXPORT lsb_err_value
+lsb_pb_reserve_field_length(lsb_output_buffer *ob);
+
+/**
+ * Back patches a length reserved with lsb_pb_reserve_field_length. A field too
+ * long for the reserved width is moved to make room for the full varint.
+ *
+ * @param ob  Pointer to the output data buffer.
+ * @param len_pos Position in the output buffer where the length was reserved.
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+LSB_UTIL_EXPORT lsb_err_value
+lsb_pb_update_reserved_field_length(lsb_output_buffer *ob, size_t len_pos);
+
 #ifdef __cplusplus
 }
 #endif
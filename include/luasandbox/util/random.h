@@ -0,0 +1,83 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Lock free pseudo random number generator (xoshiro256**) @file */
+
+#ifndef luasandbox_util_random_h_
+#define luasandbox_util_random_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+typedef struct lsb_prng {
+  uint64_t s[4];
+} lsb_prng;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Seeds the generator deterministically (the seed is expanded with splitmix64
+ * so any value, including zero, is valid).
+ *
+ * @param p Generator state
+ * @param seed Seed value
+ */
+LSB_UTIL_EXPORT void lsb_prng_seed(lsb_prng *p, uint64_t seed);
+
+/**
+ * Seeds the generator from a process wide entropy pool. The operating system
+ * entropy source is only read the first time this is called; every subsequent
+ * call produces a distinct, non overlapping stream without any I/O.
+ *
+ * @param p Generator state
+ */
+LSB_UTIL_EXPORT void lsb_prng_seed_random(lsb_prng *p);
+
+/**
+ * Returns the next 64 bit value in the sequence.
+ *
+ * @param p Generator state
+ *
+ * @return uint64_t
+ */
+LSB_UTIL_EXPORT uint64_t lsb_prng_next(lsb_prng *p);
+
+/**
+ * Returns the next value in the sequence as a double.
+ *
+ * @param p Generator state
+ *
+ * @return double Uniformly distributed value in the range [0, 1)
+ */
+LSB_UTIL_EXPORT double lsb_prng_double(lsb_prng *p);
+
+/**
+ * Fills a buffer with pseudo random bytes.
+ *
+ * @param p Generator state
+ * @param buf Buffer to fill
+ * @param len Length of the buffer
+ */
+LSB_UTIL_EXPORT void lsb_prng_fill(lsb_prng *p, void *buf, size_t len);
+
+/**
+ * Retrieves the calling thread's generator (seeded with lsb_prng_seed_random
+ * on first use). Intended for library code that has no per instance state.
+ *
+ * @return lsb_prng*
+ */
+LSB_UTIL_EXPORT lsb_prng* lsb_prng_thread();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
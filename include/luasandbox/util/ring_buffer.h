@@ -0,0 +1,93 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Lock-free single producer/single consumer message ring buffer @file */
+
+#ifndef luasandbox_util_ring_buffer_h_
+#define luasandbox_util_ring_buffer_h_
+
+#include <stddef.h>
+
+#include "util.h"
+
+typedef struct lsb_ring_buffer lsb_ring_buffer;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * Allocates a ring buffer holding variable length records. Each record is
+ * stored contiguously so the consumer can access it in place. Exactly one
+ * thread may push and exactly one (possibly different) thread may peek/pop.
+ *
+ * @param size Capacity in bytes (rounded up to a power of two, minimum 64).
+ *             Every record has sizeof(size_t) bytes of overhead and is aligned
+ *             to sizeof(size_t).
+ *
+ * @return lsb_ring_buffer* NULL on failure
+ */
+LSB_UTIL_EXPORT lsb_ring_buffer* lsb_create_ring_buffer(size_t size);
+
+/**
+ * Frees all memory associated with the ring buffer. Neither side may be
+ * accessing the buffer during this call.
+ *
+ * @param rb Ring buffer
+ */
+LSB_UTIL_EXPORT void lsb_destroy_ring_buffer(lsb_ring_buffer *rb);
+
+/**
+ * Producer: copies a record into the ring buffer.
+ *
+ * @param rb Ring buffer
+ * @param s Record data
+ * @param len Length of the record
+ *
+ * @return lsb_err_value NULL on success, LSB_ERR_UTIL_FULL if there is
+ *         currently not enough free space (retry after the consumer drains),
+ *         LSB_ERR_UTIL_PRANGE if the record (plus overhead) is larger than
+ *         half the capacity and can never be stored
+ */
+LSB_UTIL_EXPORT lsb_err_value
+lsb_ring_buffer_push(lsb_ring_buffer *rb, const char *s, size_t len);
+
+/**
+ * Consumer: returns a pointer to the oldest record without removing it. The
+ * pointer remains valid until lsb_ring_buffer_pop is called.
+ *
+ * @param rb Ring buffer
+ * @param len Set to the length of the record
+ *
+ * @return const char* NULL if the buffer is empty
+ */
+LSB_UTIL_EXPORT const char*
+lsb_ring_buffer_peek(lsb_ring_buffer *rb, size_t *len);
+
+/**
+ * Consumer: releases the record returned by the last lsb_ring_buffer_peek
+ * making its space available to the producer.
+ *
+ * @param rb Ring buffer
+ */
+LSB_UTIL_EXPORT void lsb_ring_buffer_pop(lsb_ring_buffer *rb);
+
+/**
+ * Returns the number of bytes currently in use (records and overhead). The
+ * value is a snapshot and may be stale by the time it is used.
+ *
+ * @param rb Ring buffer
+ *
+ * @return size_t Bytes in use
+ */
+LSB_UTIL_EXPORT size_t lsb_ring_buffer_used(lsb_ring_buffer *rb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,6 +14,8 @@
 
 #include "util.h"
 
+typedef struct lsb_string_pattern lsb_string_pattern;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -43,6 +45,40 @@ LSB_UTIL_EXPORT bool lsb_string_match(const char *s, size_t len, const char *p);
  */
 LSB_UTIL_EXPORT bool lsb_string_find(const char *s, size_t ls, const char *p, size_t lp);
 
+/**
+ * Compiles a Lua string match pattern for repeated use with
+ * lsb_string_pattern_match. Patterns without %b, and a pattern that is a
+ * single (optionally anchored) %b item, run in time linear in the string length
+ * (times the pattern length) and are prefiltered on their longest literal run.
+ * Other patterns using %b are backtracked as by lsb_string_match.
+ *
+ * @param p Lua match pattern
+ *
+ * @return lsb_string_pattern* NULL if the pattern is invalid (it can never
+ *         match) or the allocation failed
+ */
+LSB_UTIL_EXPORT lsb_string_pattern* lsb_compile_string_pattern(const char *p);
+
+/**
+ * Frees a compiled pattern.
+ *
+ * @param sp Compiled pattern
+ */
+LSB_UTIL_EXPORT void lsb_destroy_string_pattern(lsb_string_pattern *sp);
+
+/**
+ * Matches a string using a compiled pattern (same result as
+ * lsb_string_match)
+ *
+ * @param sp Compiled pattern
+ * @param s String to match
+ * @param len Length of the string
+ *
+ * @return bool True if the string matches the pattern
+ */
+LSB_UTIL_EXPORT bool lsb_string_pattern_match(const lsb_string_pattern *sp,
+                                              const char *s, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -82,6 +82,17 @@ LSB_UTIL_EXPORT long long lsb_get_timestamp();
  */
 LSB_UTIL_EXPORT bool lsb_set_tz(const char *tz);
 
+/**
+ * Performs the process wide initialization exactly once (sets the TZ to UTC
+ * and seeds the C library rand() for any third party module still using it).
+ * Subsequent calls only return the cached result. It is called by lsb_create
+ * but since setenv is not thread safe a multi-threaded host should call it
+ * before starting its threads.
+ *
+ * @return bool True if the initialization succeeded
+ */
+LSB_UTIL_EXPORT bool lsb_process_init();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,138 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Read only data shared across sandboxes @file */
+
+#ifndef luasandbox_shared_data_h_
+#define luasandbox_shared_data_h_
+
+#include <stddef.h>
+
+#include "luasandbox.h"
+
+typedef struct lsb_shared_data lsb_shared_data;
+typedef struct lsb_shared_data_builder lsb_shared_data_builder;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+LSB_EXPORT extern lsb_err_id LSB_ERR_SHARED_DATA_IO;
+
+/**
+ * Creates a builder used to produce a shared data file; a sorted, immutable
+ * key/value blob that can be memory mapped by any number of sandboxes.
+ *
+ * @return lsb_shared_data_builder* NULL on failure
+ */
+LSB_EXPORT lsb_shared_data_builder* lsb_create_shared_data_builder();
+
+/**
+ * Frees the builder.
+ *
+ * @param b Builder
+ */
+LSB_EXPORT void lsb_destroy_shared_data_builder(lsb_shared_data_builder *b);
+
+/**
+ * Adds an entry to the builder. Keys and values are arbitrary binary strings;
+ * if a key is added more than once the last value wins.
+ *
+ * @param b Builder
+ * @param key Key
+ * @param klen Length of the key
+ * @param val Value
+ * @param vlen Length of the value
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+LSB_EXPORT lsb_err_value
+lsb_shared_data_builder_add(lsb_shared_data_builder *b, const char *key,
+                            size_t klen, const char *val, size_t vlen);
+
+/**
+ * Sorts the entries and writes the shared data file.
+ *
+ * @param b Builder
+ * @param filename Output file
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+LSB_EXPORT lsb_err_value
+lsb_shared_data_builder_write(lsb_shared_data_builder *b, const char *filename);
+
+/**
+ * Memory maps and validates a shared data file. The returned handle holds one
+ * reference to the mapping, each sandbox the data is added to holds another.
+ * Write updates to a new file: on Windows a mapped file cannot be replaced
+ * and on POSIX rewriting it in place corrupts the existing mappings.
+ *
+ * @param filename File produced by lsb_shared_data_builder_write
+ *
+ * @return lsb_shared_data* NULL on failure
+ */
+LSB_EXPORT lsb_shared_data* lsb_open_shared_data(const char *filename);
+
+/**
+ * Releases the host reference. The mapping is removed once every sandbox
+ * holding the data has been destroyed (or has collected the userdata).
+ *
+ * @param d Shared data
+ */
+LSB_EXPORT void lsb_close_shared_data(lsb_shared_data *d);
+
+/**
+ * Returns the number of entries.
+ *
+ * @param d Shared data
+ *
+ * @return size_t
+ */
+LSB_EXPORT size_t lsb_shared_data_count(const lsb_shared_data *d);
+
+/**
+ * Looks up a key without copying.
+ *
+ * @param d Shared data
+ * @param key Key
+ * @param klen Length of the key
+ * @param vlen Length of the value (may be NULL)
+ *
+ * @return const char* Pointer to the value inside the mapping (not NUL
+ *         terminated), NULL if the key does not exist
+ */
+LSB_EXPORT const char* lsb_shared_data_find(const lsb_shared_data *d,
+                                            const char *key, size_t klen,
+                                            size_t *vlen);
+
+/**
+ * Exposes the shared data to the sandbox as a read only global userdata.
+ *
+ * - data[key] returns the value string or nil
+ * - data(key) returns the entry with the greatest key <= key (key, value) or
+ *   nil; useful for range tables keyed by their lower bound
+ * - #data returns the number of entries
+ *
+ * The mapping is not charged against the sandbox memory limit (only the
+ * returned strings are) and the global is never serialized by the
+ * preservation code.
+ *
+ * @param lsb Pointer to the sandbox
+ * @param d Shared data
+ * @param name Global variable name
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+LSB_EXPORT lsb_err_value lsb_add_shared_data(lsb_lua_sandbox *lsb,
+                                             lsb_shared_data *d,
+                                             const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -317,12 +317,48 @@ encode_int(lua_State *lua, lsb_output_buffer *ob, char tag, const char *name,
  * @param representation String representation of the field
  *                       i.e., "ms"
  * @param value_type Protobuf value type
+ * @param len_pos Set to the position of the packed integer length placeholder
+ *                when first > 1 (may be NULL)
  *
  * @return lsb_err_value NULL on success error message on failure
  */
 static lsb_err_value
 encode_field_value(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
-                   int first, const char *representation, int value_type);
+                   int first, const char *representation, int value_type,
+                   size_t *len_pos);
+
+
+/**
+ * Writes the placeholder for a length that is known once the value has been
+ * encoded (see lsb_heka_sandbox.fixed_length_encoding).
+ *
+ * @param lsb  Pointer to the sandbox.
+ * @param ob  Pointer to the output data buffer.
+ * @param len_pos Set to the position of the placeholder
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+static lsb_err_value
+reserve_length(lsb_lua_sandbox *lsb, lsb_output_buffer *ob, size_t *len_pos)
+{
+  lsb_heka_sandbox *hsb = lsb_get_parent(lsb);
+  *len_pos = ob->pos;
+  if (hsb->fixed_length_encoding) {
+    return lsb_pb_reserve_field_length(ob);
+  }
+  return lsb_pb_write_varint(ob, 0);  // length tbd later
+}
+
+
+static lsb_err_value
+update_length(lsb_lua_sandbox *lsb, lsb_output_buffer *ob, size_t len_pos)
+{
+  lsb_heka_sandbox *hsb = lsb_get_parent(lsb);
+  if (hsb->fixed_length_encoding) {
+    return lsb_pb_update_reserved_field_length(ob, len_pos);
+  }
+  return lsb_pb_update_field_length(ob, len_pos);
+}
 
 
 /**
@@ -341,9 +377,9 @@ encode_field_array(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
                    int t, const char *representation, int value_type)
 {
   int alen = (int)lua_objlen(lua, -2);
+  size_t len_pos = 0;
   lsb_err_value ret = encode_field_value(lsb, lua, ob, alen, representation,
-                                         value_type);
-  size_t len_pos = ob->pos;
+                                         value_type, &len_pos);
   lua_pop(lua, 1);
   for (int idx = 2; !ret && idx <= alen; ++idx) {
     lua_rawgeti(lua, -1, idx);
@@ -351,24 +387,12 @@ encode_field_array(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
       snprintf(lsb->error_message, LSB_ERROR_SIZE, "array has mixed types");
       return LSB_ERR_HEKA_INPUT;
     }
-    ret = encode_field_value(lsb, lua, ob, 0, representation, value_type);
+    ret = encode_field_value(lsb, lua, ob, 0, representation, value_type,
+                             NULL);
     lua_pop(lua, 1);
   }
   if (!ret && alen > 1 && value_type == LSB_PB_INTEGER) {
-    // fix up the varint packed length
-    size_t i = len_pos - 2;
-    int y = 0;
-    // find the length byte
-    while (ob->buf[i] != 0 && y < LSB_MAX_VARINT_BYTES) {
-      --i;
-      ++y;
-    }
-    if (y == LSB_MAX_VARINT_BYTES) {
-      snprintf(lsb->error_message, LSB_ERROR_SIZE,
-               "unable set the length of the packed integer array");
-      return LSB_ERR_LUA;
-    }
-    ret = lsb_pb_update_field_length(ob, i);
+    ret = update_length(lsb, ob, len_pos);
   }
   return ret;
 }
@@ -400,7 +424,7 @@ encode_field_object(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob)
 
   lua_getfield(lua, -3, "value");
   lsb_err_value ret = encode_field_value(lsb, lua, ob, 1, representation,
-                                         value_type);
+                                         value_type, NULL);
   lua_pop(lua, 3); // remove representation, value_type and  value
   return ret;
 }
@@ -408,7 +432,8 @@ encode_field_object(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob)
 
 static lsb_err_value
 encode_field_value(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
-                   int first, const char *representation, int value_type)
+                   int first, const char *representation, int value_type,
+                   size_t *len_pos)
 {
   lsb_err_value ret = NULL;
   size_t len;
@@ -481,8 +506,10 @@ encode_field_value(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
         if (ret) return ret;
       } else { // pack array
         if (value_type == LSB_PB_INTEGER) {
+          size_t pos = 0; // patched by encode_field_array
           ret = lsb_pb_write_key(ob, LSB_PB_VALUE_INTEGER, LSB_PB_WT_LENGTH);
-          if (!ret) ret = lsb_pb_write_varint(ob, 0); // length tbd later
+          if (!ret) ret = reserve_length(lsb, ob, &pos);
+          if (len_pos) *len_pos = pos;
         } else {
           ret = lsb_pb_write_key(ob, LSB_PB_VALUE_DOUBLE, LSB_PB_WT_LENGTH);
           if (!ret) ret = lsb_pb_write_varint(ob, first * sizeof(double));
@@ -584,8 +611,7 @@ encode_field_value(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
       ret = lsb_pb_write_key(ob, LSB_PB_VALUE_BYTES, LSB_PB_WT_LENGTH);
       if (ret) return ret;
 
-      len_pos = ob->pos;
-      ret = lsb_pb_write_varint(ob, 0);  // length tbd later
+      ret = reserve_length(lsb, ob, &len_pos);
       if (ret) return ret;
 
       lua_pushlightuserdata(lua, ob);
@@ -596,7 +622,7 @@ encode_field_value(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
                  "userdata output callback failed: %d", result);
         return LSB_ERR_LUA;
       }
-      ret = lsb_pb_update_field_length(ob, len_pos);
+      ret = update_length(lsb, ob, len_pos);
     }
     if (t == LUA_TLIGHTUSERDATA) lua_pop(lua, 1); // remove the userdata
     break;
@@ -641,8 +667,7 @@ encode_fields(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
       ret = lsb_pb_write_key(ob, tag, LSB_PB_WT_LENGTH);
       if (ret) return ret;
 
-      len_pos = ob->pos;
-      ret = lsb_pb_write_varint(ob, 0);  // length tbd later
+      ret = reserve_length(lsb, ob, &len_pos);
       if (ret) return ret;
 
       lua_getfield(lua, -1, "name");
@@ -658,7 +683,7 @@ encode_fields(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
       if (ret) return ret;
 
       ret = encode_field_object(lsb, lua, ob);
-      if (!ret) ret = lsb_pb_update_field_length(ob, len_pos);
+      if (!ret) ret = update_length(lsb, ob, len_pos);
       if (ret) return ret;
 
       lua_pop(lua, 1); // remove the current field object
@@ -672,8 +697,7 @@ encode_fields(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
       ret = lsb_pb_write_key(ob, tag, LSB_PB_WT_LENGTH);
       if (ret) return ret;
 
-      len_pos = ob->pos;
-      ret = lsb_pb_write_varint(ob, 0);  // length tbd later
+      ret = reserve_length(lsb, ob, &len_pos);
       if (ret) return ret;
 
       if (lua_isstring(lua, -2)) {
@@ -686,8 +710,8 @@ encode_fields(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
       }
       if (ret) return ret;
 
-      ret = encode_field_value(lsb, lua, ob, 1, NULL, -1);
-      if (!ret) ret = lsb_pb_update_field_length(ob, len_pos);
+      ret = encode_field_value(lsb, lua, ob, 1, NULL, -1, NULL);
+      if (!ret) ret = update_length(lsb, ob, len_pos);
       if (ret) return ret;
 
       lua_pop(lua, 1); // Remove the value leaving the key on top for
@@ -699,10 +723,404 @@ encode_fields(lsb_lua_sandbox *lsb, lua_State *lua, lsb_output_buffer *ob,
 }
 
 
+static const char *proxy_metatable = "lsb.heka_message_proxy";
+static const char *proxy_env = "lsb.heka_message_proxy_env";
+static const char *fields_metatable = "lsb.heka_message_fields";
+
+// headers are indexed by their protobuf tag
+typedef struct message_proxy
+{
+  lsb_const_string  str[LSB_PB_FIELDS];
+  long long         num[LSB_PB_FIELDS];
+  unsigned          set;      // bit per tag
+  bool              cached;   // the environment is the per proxy value cache
+  int               fields;   // number of field records
+  size_t            len;
+  char              pb[];
+} message_proxy;
+
+
+static int proxy_tag(const char *key, size_t len)
+{
+#define PX_CMP(name) (memcmp(key, name, sizeof(name) - 1) == 0)
+  switch (len) {
+  case 3:
+    if (PX_CMP(LSB_PID)) return LSB_PB_PID;
+    break;
+  case 4:
+    if (PX_CMP(LSB_UUID)) return LSB_PB_UUID;
+    if (PX_CMP(LSB_TYPE)) return LSB_PB_TYPE;
+    break;
+  case 6:
+    if (PX_CMP(LSB_LOGGER)) return LSB_PB_LOGGER;
+    if (PX_CMP(LSB_FIELDS)) return LSB_PB_FIELDS;
+    break;
+  case 7:
+    if (PX_CMP(LSB_PAYLOAD)) return LSB_PB_PAYLOAD;
+    break;
+  case 8:
+    if (PX_CMP(LSB_SEVERITY)) return LSB_PB_SEVERITY;
+    if (PX_CMP(LSB_HOSTNAME)) return LSB_PB_HOSTNAME;
+    break;
+  case 9:
+    if (PX_CMP(LSB_TIMESTAMP)) return LSB_PB_TIMESTAMP;
+    break;
+  case 10:
+    if (PX_CMP(LSB_ENV_VERSION)) return LSB_PB_ENV_VERSION;
+    break;
+  }
+#undef PX_CMP
+  return 0;
+}
+
+
+// a Fields record located in the message proxy buffer
+typedef struct field_record
+{
+  const char        *p;       // record length (following the key)
+  lsb_const_string  name;
+} field_record;
+
+// read only view of the Fields array; a record is decoded into a new table each
+// time it is indexed
+typedef struct fields_proxy
+{
+  const char    *pb;          // owned by the message proxy in the environment
+  const char    *e;
+  int           cnt;
+  field_record  rec[];
+} fields_proxy;
+
+
+static int proxy_zc(lua_State *lua)
+{
+  message_proxy *mp = luaL_checkudata(lua, -1, proxy_metatable);
+  lua_pushlightuserdata(lua, mp->pb);
+  lua_pushinteger(lua, (int)mp->len);
+  return 2;
+}
+
+
+// locates the name of a Fields record without creating any Lua values
+static const char* field_name(const char *p, const char *e,
+                              lsb_const_string *name)
+{
+  long long len = 0;
+  int tag = 0;
+  int wiretype = 0;
+  p = lsb_pb_read_varint(p, e, &len);
+  if (!p || len < 0 || len > e - p) return NULL;
+  e = p + len;
+  name->s = NULL;
+  while (p && p < e) {
+    p = lsb_pb_read_key(p, &tag, &wiretype);
+    switch (wiretype) {
+    case LSB_PB_WT_VARINT:
+      p = lsb_pb_read_varint(p, e, &len);
+      break;
+    case LSB_PB_WT_FIXED64:
+      p = e - p >= (ptrdiff_t)sizeof(double) ? p + sizeof(double) : NULL;
+      break;
+    case LSB_PB_WT_LENGTH:
+      p = lsb_pb_read_varint(p, e, &len);
+      if (!p || len < 0 || len > e - p) return NULL;
+      if (tag == 1) {
+        name->s = p;
+        name->len = (size_t)len;
+      }
+      p += len;
+      break;
+    default:
+      p = NULL;
+      break;
+    }
+  }
+  return name->s ? p : NULL;
+}
+
+
+static int fields_index(lua_State *lua)
+{
+  fields_proxy *fp = luaL_checkudata(lua, 1, fields_metatable);
+  int i = 0;
+  if (lua_type(lua, 2) == LUA_TNUMBER) {
+    lua_Number n = lua_tonumber(lua, 2);
+    if (n >= 1 && n <= fp->cnt && n == (int)n) i = (int)n;
+  } else if (lua_type(lua, 2) == LUA_TSTRING) {
+    size_t len;
+    const char *name = lua_tolstring(lua, 2, &len);
+    for (int j = 0; j < fp->cnt && !i; ++j) {
+      if (fp->rec[j].name.len == len
+          && memcmp(fp->rec[j].name.s, name, len) == 0) {
+        i = j + 1;
+      }
+    }
+  }
+  if (!i) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  lua_settop(lua, 2);
+  lua_pushnil(lua); // process_fields builds the record at index 4
+  const char *p = fp->rec[i - 1].p;
+  if (!process_fields(lua, p, fp->e)) {
+    return luaL_error(lua, "error in tag: %d wiretype: %d offset: %d",
+                      LSB_PB_FIELDS, LSB_PB_WT_LENGTH, p - 1 - fp->pb);
+  }
+  return 1;
+}
+
+
+static int fields_len(lua_State *lua)
+{
+  fields_proxy *fp = luaL_checkudata(lua, 1, fields_metatable);
+  lua_pushinteger(lua, fp->cnt);
+  return 1;
+}
+
+
+static int fields_newindex(lua_State *lua)
+{
+  return luaL_error(lua, "message proxies are read only, convert it with "
+                    "decode_message() to modify it");
+}
+
+
+static const struct luaL_reg fieldslib_m[] =
+{
+  { "__index", fields_index },
+  { "__len", fields_len },
+  { "__newindex", fields_newindex },
+  { NULL, NULL }
+};
+
+
+// indexes the Fields records (stack: 1 proxy, 2 key)
+static void proxy_fields(lua_State *lua, message_proxy *mp)
+{
+  fields_proxy *fp = lua_newuserdata(lua, sizeof(fields_proxy)
+                                     + sizeof(field_record) * mp->fields);
+  fp->pb = mp->pb;
+  fp->e = mp->pb + mp->len;
+  fp->cnt = 0;
+
+  const char *p = mp->pb;
+  const char *lp = p;
+  int tag = 0;
+  int wiretype = 0;
+  long long len;
+  do {
+    p = lsb_pb_read_key(p, &tag, &wiretype);
+    if (tag == LSB_PB_FIELDS) {
+      field_record *r = &fp->rec[fp->cnt];
+      r->p = p;
+      p = field_name(p, fp->e, &r->name);
+      if (p) ++fp->cnt;
+    } else if (wiretype == LSB_PB_WT_VARINT) { // already validated
+      p = lsb_pb_read_varint(p, fp->e, &len);
+    } else {
+      p = lsb_pb_read_varint(p, fp->e, &len);
+      p += len;
+    }
+    if (p) lp = p;
+  } while (p && p < fp->e);
+
+  if (!p) {
+    luaL_error(lua, "error in tag: %d wiretype: %d offset: %d", tag, wiretype,
+               (const char *)lp - mp->pb);
+  }
+
+  if (luaL_newmetatable(lua, fields_metatable) == 1) {
+    luaL_register(lua, NULL, fieldslib_m);
+  }
+  lua_setmetatable(lua, -2);
+  lua_createtable(lua, 1, 0); // keeps the message buffer alive
+  lua_pushvalue(lua, 1);
+  lua_rawseti(lua, -2, 1);
+  lua_setfenv(lua, -2);
+}
+
+
+static int proxy_index(lua_State *lua)
+{
+  message_proxy *mp = luaL_checkudata(lua, 1, proxy_metatable);
+  size_t len;
+  const char *key = lua_type(lua, 2) == LUA_TSTRING ?
+      lua_tolstring(lua, 2, &len) : NULL;
+  int tag = key ? proxy_tag(key, len) : 0;
+  if (!tag || !(mp->set & (1u << tag))) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  switch (tag) {
+  case LSB_PB_TIMESTAMP:
+  case LSB_PB_SEVERITY:
+  case LSB_PB_PID:
+    lua_pushnumber(lua, (lua_Number)mp->num[tag]);
+    return 1;
+  }
+
+  lua_settop(lua, 2);
+  if (mp->cached) {
+    lua_getfenv(lua, 1);
+    lua_pushvalue(lua, 2);
+    lua_rawget(lua, 3);
+    if (!lua_isnil(lua, -1)) return 1;
+    lua_settop(lua, 2);
+  }
+
+  if (tag == LSB_PB_FIELDS) {
+    proxy_fields(lua, mp); // read only so it can be cached
+  } else {
+    lua_pushlstring(lua, mp->str[tag].s, mp->str[tag].len);
+  }
+
+  if (!mp->cached) {
+    lua_createtable(lua, 0, 4);
+    lua_getfenv(lua, 1); // copy the shared zero copy entry
+    lua_pushnil(lua);
+    while (lua_next(lua, -2)) {
+      lua_pushvalue(lua, -2);
+      lua_insert(lua, -2);
+      lua_rawset(lua, -5);
+    }
+    lua_pop(lua, 1); // shared environment
+    lua_setfenv(lua, 1);
+    mp->cached = true;
+  }
+  lua_getfenv(lua, 1);
+  lua_pushvalue(lua, 2);
+  lua_pushvalue(lua, 3);
+  lua_rawset(lua, -3);
+  lua_pop(lua, 1); // environment
+  return 1;
+}
+
+
+static int proxy_newindex(lua_State *lua)
+{
+  return luaL_error(lua, "message proxies are read only, convert it with "
+                    "decode_message() to modify it");
+}
+
+
+static const struct luaL_reg proxylib_m[] =
+{
+  { "__index", proxy_index },
+  { "__newindex", proxy_newindex },
+  { NULL, NULL }
+};
+
+
+// validates the message and indexes the headers without creating any Lua
+// values; the Fields records are only parsed when they are accessed
+static int create_message_proxy(lua_State *lua, const char *pbstr, size_t len)
+{
+  message_proxy *mp = lua_newuserdata(lua, sizeof(message_proxy) + len);
+  memset(mp, 0, sizeof(message_proxy));
+  memcpy(mp->pb, pbstr, len);
+  mp->len = len;
+
+  const char *p = mp->pb;
+  const char *lp = p;
+  const char *e = mp->pb + len;
+  int wiretype = 0;
+  int tag = 0;
+  long long vlen;
+
+  do {
+    p = lsb_pb_read_key(p, &tag, &wiretype);
+
+    switch (tag) {
+    case LSB_PB_UUID:
+    case LSB_PB_TYPE:
+    case LSB_PB_LOGGER:
+    case LSB_PB_PAYLOAD:
+    case LSB_PB_ENV_VERSION:
+    case LSB_PB_HOSTNAME:
+    case LSB_PB_FIELDS:
+      if (wiretype != LSB_PB_WT_LENGTH) {
+        p = NULL;
+        break;
+      }
+      p = lsb_pb_read_varint(p, e, &vlen);
+      if (!p || vlen < 0 || vlen > e - p
+          || (tag == LSB_PB_UUID && vlen != LSB_UUID_SIZE)) {
+        p = NULL;
+        break;
+      }
+      if (tag == LSB_PB_FIELDS) {
+        ++mp->fields;
+      } else {
+        mp->str[tag].s = p;
+        mp->str[tag].len = (size_t)vlen;
+      }
+      mp->set |= 1u << tag;
+      p += vlen;
+      break;
+
+    case LSB_PB_TIMESTAMP:
+    case LSB_PB_SEVERITY:
+    case LSB_PB_PID:
+      if (wiretype != LSB_PB_WT_VARINT) {
+        p = NULL;
+        break;
+      }
+      p = lsb_pb_read_varint(p, e, &mp->num[tag]);
+      if (p) mp->set |= 1u << tag;
+      break;
+
+    default:
+      p = NULL; // don't allow unknown tags
+      break;
+    }
+    if (p) lp = p;
+  } while (p && p < e);
+
+  if (!p) {
+    return luaL_error(lua, "error in tag: %d wiretype: %d offset: %d", tag,
+                      wiretype, (const char *)lp - mp->pb);
+  }
+
+  bool has_uuid = mp->set & (1u << LSB_PB_UUID);
+  bool has_timestamp = mp->set & (1u << LSB_PB_TIMESTAMP);
+  if (!has_uuid || !has_timestamp) {
+    return luaL_error(lua, "missing required field uuid: %s timestamp: %s",
+                      has_uuid ? "found" : "not found",
+                      has_timestamp ? "found" : "not found");
+  }
+
+  if (luaL_newmetatable(lua, proxy_metatable) == 1) {
+    luaL_register(lua, NULL, proxylib_m);
+  }
+  lua_setmetatable(lua, -2);
+
+  // share one environment (zero copy support) until a value is cached
+  lua_getfield(lua, LUA_REGISTRYINDEX, proxy_env);
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    lua_createtable(lua, 0, 1);
+    lsb_add_zero_copy_function(lua, proxy_zc);
+    lua_pushvalue(lua, -1);
+    lua_setfield(lua, LUA_REGISTRYINDEX, proxy_env);
+  }
+  lua_setfenv(lua, -2);
+  return 1;
+}
+
+
 int heka_decode_message(lua_State *lua)
 {
   int n = lua_gettop(lua);
-  luaL_argcheck(lua, n == 1, n, "incorrect number of arguments");
+  luaL_argcheck(lua, n == 1 || n == 2, n, "incorrect number of arguments");
+  bool lazy = false;
+  if (n == 2) {
+    luaL_checktype(lua, 2, LUA_TBOOLEAN);
+    lazy = lua_toboolean(lua, 2);
+    lua_pop(lua, 1);
+  }
 
   size_t len;
   const char *pbstr;
@@ -729,6 +1147,10 @@ int heka_decode_message(lua_State *lua)
     return luaL_error(lua, "invalid message, too short");
   }
 
+  if (lazy) {
+    return create_message_proxy(lua, pbstr, len);
+  }
+
   const char *p = pbstr;
   const char *lp = p;
   const char *e = pbstr + len;
@@ -899,6 +1321,17 @@ int heka_encode_message(lua_State *lua)
 }
 
 
+static lsb_err_value write_random_uuid(lsb_lua_sandbox *lsb,
+                                       lsb_output_buffer *ob)
+{
+  unsigned char uuid[LSB_UUID_SIZE];
+  lsb_prng_fill(&lsb->prng, uuid, sizeof(uuid));
+  uuid[6] = (uuid[6] & 0x0F) | 0x40;
+  uuid[8] = (uuid[8] & 0x0F) | 0xA0;
+  return lsb_write_heka_uuid(ob, (const char *)uuid, sizeof(uuid));
+}
+
+
 lsb_err_value
 heka_encode_message_table(lsb_lua_sandbox *lsb, lua_State *lua, int idx)
 {
@@ -909,7 +1342,7 @@ heka_encode_message_table(lsb_lua_sandbox *lsb, lua_State *lua, int idx)
 
   long long ts;
   if (hsb->restricted_headers) {
-    ret = lsb_write_heka_uuid(ob, NULL, 0);
+    ret = write_random_uuid(lsb, ob);
     if (ret) return ret;
     ts = lsb_get_timestamp();
     lua_pushstring(lua, hsb->name);
@@ -922,7 +1355,11 @@ heka_encode_message_table(lsb_lua_sandbox *lsb, lua_State *lua, int idx)
     lua_getfield(lua, idx, LSB_UUID);
     size_t len;
     const char *uuid = lua_tolstring(lua, -1, &len);
-    ret = lsb_write_heka_uuid(ob, uuid, len);
+    if (uuid) {
+      ret = lsb_write_heka_uuid(ob, uuid, len);
+    } else {
+      ret = write_random_uuid(lsb, ob);
+    }
     lua_pop(lua, 1); // remove uuid
 
     lua_getfield(lua, idx, LSB_TIMESTAMP);
@@ -952,73 +1389,154 @@ heka_encode_message_table(lsb_lua_sandbox *lsb, lua_State *lua, int idx)
 }
 
 
-int heka_read_message(lua_State *lua, lsb_heka_message *m)
+static const char *accessor_metatable = "lsb.read_message_accessor";
+
+static const char *projection_metatable = "lsb.read_message_projection";
+
+typedef struct projection_item
 {
-  int n = lua_gettop(lua);
-  if (n < 1 || n > 3) {
-    return luaL_error(lua, "%s() incorrect number of arguments", __func__);
+  heka_read_message_id id;
+  int                  fi;
+  int                  ai;
+  int                  cnt;   // scratch: occurrences of the field seen so far
+  lsb_const_string     name;
+  lsb_read_value       value; // scratch: resolved field value
+} projection_item;
+
+typedef struct read_message_projection
+{
+  int                  items_len;
+  int                  fields_len; // number of Fields[] items
+  projection_item      items[];
+  // followed by the items_len NUL terminated variable names
+} read_message_projection;
+
+typedef struct read_message_accessor
+{
+  heka_read_message_id id;
+  int                  fi;
+  int                  ai;
+  lsb_const_string     name;
+  char                 field[];
+} read_message_accessor;
+
+
+heka_read_message_id heka_resolve_read_message(const char *field, size_t len)
+{
+  if (len >= 8 && memcmp(field, LSB_FIELDS "[", 7) == 0
+      && field[len - 1] == ']') {
+    return HEKA_RM_FIELD;
   }
-  size_t field_len;
-  const char *field = luaL_checklstring(lua, 1, &field_len);
-  int fi = luaL_optint(lua, 2, 0);
-  luaL_argcheck(lua, fi >= 0, 2, "field index must be >= 0");
-  int ai = luaL_optint(lua, 3, 0);
-  luaL_argcheck(lua, ai >= 0, 3, "array index must be >= 0");
 
+#define RM_CMP(name) (memcmp(field, name, sizeof(name) - 1) == 0)
+  switch (len) {
+  case 3:
+    if (RM_CMP(LSB_PID)) return HEKA_RM_PID;
+    if (RM_CMP(LSB_RAW)) return HEKA_RM_RAW;
+    break;
+  case 4:
+    if (RM_CMP(LSB_UUID)) return HEKA_RM_UUID;
+    if (RM_CMP(LSB_TYPE)) return HEKA_RM_TYPE;
+    if (RM_CMP(LSB_SIZE)) return HEKA_RM_SIZE;
+    break;
+  case 6:
+    if (RM_CMP(LSB_LOGGER)) return HEKA_RM_LOGGER;
+    if (RM_CMP(LSB_FRAMED)) return HEKA_RM_FRAMED;
+    break;
+  case 7:
+    if (RM_CMP(LSB_PAYLOAD)) return HEKA_RM_PAYLOAD;
+    break;
+  case 8:
+    if (RM_CMP(LSB_SEVERITY)) return HEKA_RM_SEVERITY;
+    if (RM_CMP(LSB_HOSTNAME)) return HEKA_RM_HOSTNAME;
+    break;
+  case 9:
+    if (RM_CMP(LSB_TIMESTAMP)) return HEKA_RM_TIMESTAMP;
+    break;
+  case 10:
+    if (RM_CMP(LSB_ENV_VERSION)) return HEKA_RM_ENV_VERSION;
+    break;
+  }
+#undef RM_CMP
+  return HEKA_RM_UNKNOWN;
+}
+
+
+static void push_string(lua_State *lua, const lsb_const_string *s)
+{
+  if (s->s) {
+    lua_pushlstring(lua, s->s, s->len);
+  } else {
+    lua_pushnil(lua);
+  }
+}
+
+
+static void push_read_value(lua_State *lua, const lsb_read_value *v)
+{
+  switch (v->type) {
+  case LSB_READ_STRING:
+    lua_pushlstring(lua, v->u.s.s, v->u.s.len);
+    break;
+  case LSB_READ_NUMERIC:
+    lua_pushnumber(lua, v->u.d);
+    break;
+  case LSB_READ_BOOL:
+    lua_pushboolean(lua, v->u.d ? 1 : 0);
+    break;
+  default:
+    lua_pushnil(lua);
+    break;
+  }
+}
+
+
+static int push_message_value(lua_State *lua, lsb_heka_message *m,
+                              lsb_heka_field_index *fx,
+                              heka_read_message_id id,
+                              lsb_const_string *name, int fi, int ai)
+{
   if (!m || !m->raw.s) {
     lua_pushnil(lua);
     return 1;
   }
 
-  if (strcmp(field, LSB_UUID) == 0) {
-    if (m->uuid.s) {
-      lua_pushlstring(lua, m->uuid.s, m->uuid.len);
-    } else {
-      lua_pushnil(lua);
-    }
-  } else if (strcmp(field, LSB_TIMESTAMP) == 0) {
+  switch (id) {
+  case HEKA_RM_UUID:
+    push_string(lua, &m->uuid);
+    break;
+  case HEKA_RM_TIMESTAMP:
     lua_pushnumber(lua, (lua_Number)m->timestamp);
-  } else if (strcmp(field, LSB_TYPE) == 0) {
-    if (m->type.s) {
-      lua_pushlstring(lua, m->type.s, m->type.len);
-    } else {
-      lua_pushnil(lua);
-    }
-  } else if (strcmp(field, LSB_LOGGER) == 0) {
-    if (m->logger.s) {
-      lua_pushlstring(lua, m->logger.s, m->logger.len);
-    } else {
-      lua_pushnil(lua);
-    }
-  } else if (strcmp(field, LSB_SEVERITY) == 0) {
+    break;
+  case HEKA_RM_TYPE:
+    push_string(lua, &m->type);
+    break;
+  case HEKA_RM_LOGGER:
+    push_string(lua, &m->logger);
+    break;
+  case HEKA_RM_SEVERITY:
     lua_pushinteger(lua, m->severity);
-  } else if (strcmp(field, LSB_PAYLOAD) == 0) {
-    if (m->payload.s) {
-      lua_pushlstring(lua, m->payload.s, m->payload.len);
-    } else {
-      lua_pushnil(lua);
-    }
-  } else if (strcmp(field, LSB_ENV_VERSION) == 0) {
-    if (m->env_version.s) {
-      lua_pushlstring(lua, m->env_version.s, m->env_version.len);
-    } else {
-      lua_pushnil(lua);
-    }
-  } else if (strcmp(field, LSB_PID) == 0) {
+    break;
+  case HEKA_RM_PAYLOAD:
+    push_string(lua, &m->payload);
+    break;
+  case HEKA_RM_ENV_VERSION:
+    push_string(lua, &m->env_version);
+    break;
+  case HEKA_RM_PID:
     if (m->pid == INT_MIN) {
       lua_pushnil(lua);
     } else {
       lua_pushinteger(lua, m->pid);
     }
-  } else if (strcmp(field, LSB_HOSTNAME) == 0) {
-    if (m->hostname.s) {
-      lua_pushlstring(lua, m->hostname.s, m->hostname.len);
-    } else {
-      lua_pushnil(lua);
-    }
-  } else if (strcmp(field, "raw") == 0) {
+    break;
+  case HEKA_RM_HOSTNAME:
+    push_string(lua, &m->hostname);
+    break;
+  case HEKA_RM_RAW:
     lua_pushlstring(lua, m->raw.s, m->raw.len);
-  } else if (strcmp(field, "framed") == 0) {
+    break;
+  case HEKA_RM_FRAMED:
     {
       char header[LSB_MIN_HDR_SIZE];
       size_t hlen = lsb_write_heka_header(header, m->raw.len);
@@ -1028,33 +1546,364 @@ int heka_read_message(lua_State *lua, lsb_heka_message *m)
       luaL_addlstring(&b, m->raw.s, m->raw.len);
       luaL_pushresult(&b);
     }
-  } else if (strcmp(field, "size") == 0) {
+    break;
+  case HEKA_RM_SIZE:
     lua_pushnumber(lua, (lua_Number)m->raw.len);
-  } else {
-    if (field_len >= 8
-        && memcmp(field, LSB_FIELDS "[", 7) == 0
-        && field[field_len - 1] == ']') {
+    break;
+  case HEKA_RM_FIELD:
+    {
       lsb_read_value v;
-      lsb_const_string f = { .s = field + 7, .len = field_len - 8 };
-      lsb_read_heka_field(m, &f, fi, ai, &v);
-      switch (v.type) {
-      case LSB_READ_STRING:
-        lua_pushlstring(lua, v.u.s.s, v.u.s.len);
-        break;
-      case LSB_READ_NUMERIC:
-        lua_pushnumber(lua, v.u.d);
-        break;
-      case LSB_READ_BOOL:
-        lua_pushboolean(lua, v.u.d ? 1 : 0);
-        break;
-      default:
-        lua_pushnil(lua);
-        break;
+      lsb_read_indexed_heka_field(m, fx, name, fi, ai, &v);
+      push_read_value(lua, &v);
+    }
+    break;
+  default:
+    lua_pushnil(lua);
+    break;
+  }
+  return 1;
+}
+
+
+// maps the metatable on top of the stack back to its name so read_message()
+// can identify its userdata with a single registry lookup
+static void register_metatable(lua_State *lua, const char **name)
+{
+  lua_pushvalue(lua, -1);
+  lua_pushlightuserdata(lua, (void *)name);
+  lua_rawset(lua, LUA_REGISTRYINDEX);
+}
+
+
+// returns the registered name of the userdata's metatable (NULL if foreign)
+static const char** udata_metatable(lua_State *lua, int idx)
+{
+  if (!lua_getmetatable(lua, idx)) return NULL;
+  lua_rawget(lua, LUA_REGISTRYINDEX);
+  const char **name = lua_touserdata(lua, -1);
+  lua_pop(lua, 1);
+  return name;
+}
+
+
+int heka_create_message_accessor(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  if (n < 1 || n > 3) {
+    return luaL_error(lua, "%s() incorrect number of arguments", __func__);
+  }
+  size_t len;
+  const char *field = luaL_checklstring(lua, 1, &len);
+  int fi = luaL_optint(lua, 2, 0);
+  luaL_argcheck(lua, fi >= 0, 2, "field index must be >= 0");
+  int ai = luaL_optint(lua, 3, 0);
+  luaL_argcheck(lua, ai >= 0, 3, "array index must be >= 0");
+
+  heka_read_message_id id = heka_resolve_read_message(field, len);
+  if (id == HEKA_RM_UNKNOWN) {
+    return luaL_error(lua, "%s() field: '%s' not supported/recognized",
+                      __func__, field);
+  }
+
+  read_message_accessor *rma = lua_newuserdata(lua,
+                                               sizeof(read_message_accessor)
+                                               + len + 1);
+  rma->id = id;
+  rma->fi = fi;
+  rma->ai = ai;
+  memcpy(rma->field, field, len + 1);
+  if (id == HEKA_RM_FIELD) {
+    rma->name.s = rma->field + 7;
+    rma->name.len = len - 8;
+  } else {
+    rma->name.s = NULL;
+    rma->name.len = 0;
+  }
+
+  if (luaL_newmetatable(lua, accessor_metatable) == 1) {
+    lua_pushvalue(lua, -1);
+    lua_setfield(lua, -2, "__index");
+    register_metatable(lua, &accessor_metatable);
+  }
+  lua_setmetatable(lua, -2);
+  return 1;
+}
+
+
+static void check_projection_item(lua_State *lua, int idx, int i,
+                                  const char **field, size_t *len, int *fi,
+                                  int *ai)
+{
+  *fi = 0;
+  *ai = 0;
+  lua_rawgeti(lua, idx, i);
+  switch (lua_type(lua, -1)) {
+  case LUA_TSTRING:
+    *field = lua_tolstring(lua, -1, len);
+    break;
+  case LUA_TTABLE:
+    lua_rawgeti(lua, -1, 1);
+    lua_rawgeti(lua, -2, 2);
+    lua_rawgeti(lua, -3, 3);
+    *field = lua_type(lua, -3) == LUA_TSTRING ?
+        lua_tolstring(lua, -3, len) : NULL;
+    if (!lua_isnil(lua, -2)) {
+      if (lua_type(lua, -2) != LUA_TNUMBER) *field = NULL;
+      *fi = (int)lua_tointeger(lua, -2);
+    }
+    if (!lua_isnil(lua, -1)) {
+      if (lua_type(lua, -1) != LUA_TNUMBER) *field = NULL;
+      *ai = (int)lua_tointeger(lua, -1);
+    }
+    lua_pop(lua, 3); // the name string is still anchored by the item table
+    break;
+  default:
+    *field = NULL;
+    break;
+  }
+  if (!*field) {
+    luaL_error(lua, "create_message_projection() item %d must be a "
+               "variableName or {variableName, fieldIndex, arrayIndex}", i);
+  }
+  if (*fi < 0 || *ai < 0) {
+    luaL_error(lua, "create_message_projection() item %d indices must be >= 0",
+               i);
+  }
+  lua_pop(lua, 1);
+}
+
+
+int heka_create_message_projection(lua_State *lua)
+{
+  luaL_checktype(lua, 1, LUA_TTABLE);
+  int items_len = (int)lua_objlen(lua, 1);
+  luaL_argcheck(lua, items_len > 0, 1, "at least one variable is required");
+  luaL_argcheck(lua, lua_gettop(lua) == 1, 2, "incorrect number of arguments");
+
+  const char *field;
+  size_t len, names_size = 0;
+  int fi, ai;
+  for (int i = 1; i <= items_len; ++i) {
+    check_projection_item(lua, 1, i, &field, &len, &fi, &ai);
+    if (heka_resolve_read_message(field, len) == HEKA_RM_UNKNOWN) {
+      return luaL_error(lua, "%s() field: '%s' not supported/recognized",
+                        __func__, field);
+    }
+    names_size += len + 1;
+  }
+
+  size_t items_size = sizeof(read_message_projection)
+      + sizeof(projection_item) * items_len;
+  read_message_projection *rmp = lua_newuserdata(lua, items_size + names_size);
+  rmp->items_len = items_len;
+  rmp->fields_len = 0;
+  char *names = (char *)rmp + items_size;
+  for (int i = 0; i < items_len; ++i) {
+    projection_item *item = &rmp->items[i];
+    check_projection_item(lua, 1, i + 1, &field, &len, &item->fi, &item->ai);
+    memcpy(names, field, len + 1);
+    item->id = heka_resolve_read_message(names, len);
+    if (item->id == HEKA_RM_FIELD) {
+      item->name.s = names + 7;
+      item->name.len = len - 8;
+      ++rmp->fields_len;
+    } else {
+      item->name.s = NULL;
+      item->name.len = 0;
+    }
+    names += len + 1;
+  }
+
+  if (luaL_newmetatable(lua, projection_metatable) == 1) {
+    lua_pushvalue(lua, -1);
+    lua_setfield(lua, -2, "__index");
+    register_metatable(lua, &projection_metatable);
+  }
+  lua_setmetatable(lua, -2);
+  return 1;
+}
+
+
+// resolves every Fields[] item with one scan of the message fields
+static void resolve_projection_fields(read_message_projection *rmp,
+                                      lsb_heka_message *m)
+{
+  for (int j = 0; j < rmp->items_len; ++j) {
+    rmp->items[j].cnt = 0;
+    rmp->items[j].value.type = LSB_READ_NIL;
+  }
+
+  int remaining = rmp->fields_len;
+  for (int i = 0; i < m->fields_len && remaining; ++i) {
+    const lsb_heka_field *f = &m->fields[i];
+    for (int j = 0; j < rmp->items_len; ++j) {
+      projection_item *item = &rmp->items[j];
+      if (item->id != HEKA_RM_FIELD || item->cnt > item->fi) continue;
+      if (item->name.len == f->name.len
+          && memcmp(item->name.s, f->name.s, f->name.len) == 0) {
+        if (item->cnt++ == item->fi) {
+          lsb_read_heka_field_value(f, item->ai, &item->value);
+          --remaining;
+        }
       }
+    }
+  }
+}
+
+
+static int read_message_projection_values(lua_State *lua,
+                                          read_message_projection *rmp,
+                                          lsb_heka_message *m, int n)
+{
+  bool fill = false;
+  if (n == 2) {
+    luaL_checktype(lua, 2, LUA_TTABLE);
+    fill = true;
+  } else if (n != 1) {
+    return luaL_error(lua, "read_message() incorrect number of arguments");
+  } else {
+    luaL_checkstack(lua, rmp->items_len, "read_message() projection");
+  }
+
+  bool valid = m && m->raw.s;
+  if (valid && rmp->fields_len) {
+    resolve_projection_fields(rmp, m);
+  }
+
+  for (int j = 0; j < rmp->items_len; ++j) {
+    projection_item *item = &rmp->items[j];
+    if (!valid) {
+      lua_pushnil(lua);
+    } else if (item->id == HEKA_RM_FIELD) {
+      push_read_value(lua, &item->value);
     } else {
-      luaL_error(lua, "%s() field: '%s' not supported/recognized", __func__,
-                 field);
+      push_message_value(lua, m, NULL, item->id, NULL, 0, 0);
+    }
+    if (fill) {
+      lua_rawseti(lua, 2, j + 1);
+    }
+  }
+
+  if (fill) {
+    lua_settop(lua, 2);
+    return 1;
+  }
+  return rmp->items_len;
+}
+
+
+int heka_read_message(lua_State *lua, lsb_heka_message *m,
+                      lsb_heka_field_index *fx)
+{
+  int n = lua_gettop(lua);
+  if (n < 1 || n > 3) {
+    return luaL_error(lua, "%s() incorrect number of arguments", __func__);
+  }
+
+  if (lua_type(lua, 1) == LUA_TUSERDATA) {
+    const char **mt = udata_metatable(lua, 1);
+    if (mt == &projection_metatable) {
+      return read_message_projection_values(lua, lua_touserdata(lua, 1), m, n);
+    }
+    read_message_accessor *rma = lua_touserdata(lua, 1);
+    if (mt != &accessor_metatable) {
+      rma = luaL_checkudata(lua, 1, accessor_metatable); // throws
+    }
+    if (n != 1) {
+      return luaL_error(lua, "%s() incorrect number of arguments", __func__);
+    }
+    return push_message_value(lua, m, fx, rma->id, &rma->name, rma->fi,
+                              rma->ai);
+  }
+
+  size_t field_len;
+  const char *field = luaL_checklstring(lua, 1, &field_len);
+  int fi = luaL_optint(lua, 2, 0);
+  luaL_argcheck(lua, fi >= 0, 2, "field index must be >= 0");
+  int ai = luaL_optint(lua, 3, 0);
+  luaL_argcheck(lua, ai >= 0, 3, "array index must be >= 0");
+
+  if (!m || !m->raw.s) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  heka_read_message_id id = heka_resolve_read_message(field, field_len);
+  if (id == HEKA_RM_UNKNOWN) {
+    return luaL_error(lua, "%s() field: '%s' not supported/recognized",
+                      __func__, field);
+  }
+  lsb_const_string name = { .s = NULL, .len = 0 };
+  if (id == HEKA_RM_FIELD) {
+    name.s = field + 7;
+    name.len = field_len - 8;
+  }
+  return push_message_value(lua, m, fx, id, &name, fi, ai);
+}
+
+
+int heka_read_message_array(lua_State *lua, lsb_heka_message *m)
+{
+  int n = lua_gettop(lua);
+  if (n < 1 || n > 3) {
+    return luaL_error(lua, "%s() incorrect number of arguments", __func__);
+  }
+  size_t field_len;
+  const char *field = luaL_checklstring(lua, 1, &field_len);
+  if (heka_resolve_read_message(field, field_len) != HEKA_RM_FIELD) {
+    return luaL_error(lua, "%s() field: '%s' is not a Fields[] variable",
+                      __func__, field);
+  }
+  int fi = luaL_optint(lua, 2, 0);
+  luaL_argcheck(lua, fi >= 0, 2, "field index must be >= 0");
+  bool fill = n == 3;
+  if (fill) {
+    luaL_checktype(lua, 3, LUA_TTABLE);
+  }
+
+  if (!m || !m->raw.s) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  const lsb_heka_field *f = NULL;
+  lsb_const_string name = { .s = field + 7, .len = field_len - 8 };
+  for (int i = 0, fcnt = 0; i < m->fields_len; ++i) {
+    if (name.len == m->fields[i].name.len
+        && memcmp(name.s, m->fields[i].name.s, name.len) == 0
+        && fi == fcnt++) {
+      f = &m->fields[i];
+      break;
     }
   }
+  if (!f) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  lsb_read_value values[64];
+  lsb_read_value *vals = values;
+  int cnt = lsb_read_heka_field_values(f, vals, 64);
+  if (cnt > 64) {
+    vals = lua_newuserdata(lua, sizeof(lsb_read_value) * cnt);
+    lsb_read_heka_field_values(f, vals, cnt);
+  }
+
+  int t;
+  if (fill) {
+    t = 3;
+    for (int i = (int)lua_objlen(lua, t); i > cnt; --i) {
+      lua_pushnil(lua);
+      lua_rawseti(lua, t, i);
+    }
+  } else {
+    lua_createtable(lua, cnt, 0);
+    t = lua_gettop(lua);
+  }
+  for (int i = 0; i < cnt; ++i) {
+    push_read_value(lua, &vals[i]);
+    lua_rawseti(lua, t, i + 1);
+  }
+  lua_pushvalue(lua, t);
   return 1;
 }
@@ -16,6 +16,37 @@
 
 // these functions are intentionally not exported
 
+/**
+ * Message variables addressable by read_message (resolved once from the
+ * variable name so the accessors can dispatch with a switch)
+ */
+typedef enum {
+  HEKA_RM_UNKNOWN,
+  HEKA_RM_UUID,
+  HEKA_RM_TIMESTAMP,
+  HEKA_RM_TYPE,
+  HEKA_RM_LOGGER,
+  HEKA_RM_SEVERITY,
+  HEKA_RM_PAYLOAD,
+  HEKA_RM_ENV_VERSION,
+  HEKA_RM_PID,
+  HEKA_RM_HOSTNAME,
+  HEKA_RM_RAW,
+  HEKA_RM_FRAMED,
+  HEKA_RM_SIZE,
+  HEKA_RM_FIELD
+} heka_read_message_id;
+
+/**
+ * Maps a read_message variable name to its id.
+ *
+ * @param field Variable name i.e. "Type", "Fields[foo]"
+ * @param len Length of the name
+ *
+ * @return heka_read_message_id HEKA_RM_UNKNOWN if the name is not recognized
+ */
+heka_read_message_id heka_resolve_read_message(const char *field, size_t len);
+
 /**
  * Deserialize a Heka message protobuf string into a Lua table structure.
  *
@@ -56,11 +87,51 @@ heka_encode_message_table(lsb_lua_sandbox *lsb, lua_State *lua, int idx);
  * Breakout of the common code for the read_message API
  *
  * @param lua Pointer to the lua_State
- * @param m Heka message to extract the data from
+ * @param m Heka message to extract the data from (not modified)
+ * @param fx Field value index owned by the reader; it must be reset whenever m
+ *           changes (NULL scans the field on every call)
  *
  * @return int Number of items on the stack (1 value) or throws an error on
  *         failure
  */
-int heka_read_message(lua_State *lua, lsb_heka_message *m);
+int heka_read_message(lua_State *lua, lsb_heka_message *m,
+                      lsb_heka_field_index *fx);
+
+/**
+ * Breakout of the common code for the read_message_array API; returns all the
+ * values of a Fields[] array in a single pass (read_message_array(name, fi, t)
+ * fills t instead of creating a new table).
+ *
+ * @param lua Pointer to the lua_State
+ * @param m Heka message to extract the data from
+ *
+ * @return int Number of items on the stack (1 table or nil) or throws an error
+ *         on failure
+ */
+int heka_read_message_array(lua_State *lua, lsb_heka_message *m);
+
+/**
+ * Creates a read_message accessor userdata; the variable name is resolved
+ * once here so read_message(accessor) does not have to parse it again.
+ *
+ * @param lua Pointer to the lua_State
+ *
+ * @return int Number of items on the stack (1 userdata) or throws an error on
+ *         failure
+ */
+int heka_create_message_accessor(lua_State *lua);
+
+/**
+ * Creates a read_message projection userdata from an array of variable names
+ * (or {variableName, fieldIndex, arrayIndex} tables). read_message(projection)
+ * returns all the values (read_message(projection, t) fills t instead) with a
+ * single pass over the message fields.
+ *
+ * @param lua Pointer to the lua_State
+ *
+ * @return int Number of items on the stack (1 userdata) or throws an error on
+ *         failure
+ */
+int heka_create_message_projection(lua_State *lua);
 
 #endif
@@ -10,6 +10,7 @@
 #include <string.h>
 
 #include "../luasandbox_defines.h"
+#include "message_impl.h"
 #include "lauxlib.h"
 #include "lua.h"
 #include "lualib.h"
@@ -22,10 +23,11 @@ static const char *metatable_name = "lsb.read_message_zc";
 
 typedef struct read_message_zc
 {
-  lsb_const_string name;
-  int              fi;
-  int              ai;
-  char             field[];
+  heka_read_message_id id;
+  lsb_const_string     name; // Fields[] name (without the wrapper)
+  int                  fi;
+  int                  ai;
+  char                 field[];
 } read_message_zc;
 
 
@@ -49,36 +51,47 @@ static lsb_const_string read_message(lua_State *lua, read_message_zc *zc)
     return ret;
   }
 
-  if (strcmp(zc->name.s, LSB_RAW) == 0) {
-    if (m->raw.s) ret = m->raw;
-  } else if (strcmp(zc->name.s, LSB_PAYLOAD) == 0) {
-    if (m->payload.s) ret = m->payload;
-  } else if (strcmp(zc->name.s, LSB_LOGGER) == 0) {
-    if (m->logger.s) ret = m->logger;
-  } else if (strcmp(zc->name.s, LSB_TYPE) == 0) {
-    if (m->type.s) ret = m->type;
-  } else if (strcmp(zc->name.s, LSB_ENV_VERSION) == 0) {
-    if (m->env_version.s) ret = m->env_version;
-  } else if (strcmp(zc->name.s, LSB_HOSTNAME) == 0) {
-    if (m->hostname.s) ret = m->hostname;
-  } else if (strcmp(zc->name.s, LSB_UUID) == 0) {
-    if (m->uuid.s) ret = m->uuid;
-  } else if (zc->name.len >= 8
-             && memcmp(zc->name.s, LSB_FIELDS "[", 7) == 0
-             && zc->name.s[zc->name.len - 1] == ']') {
-    lsb_read_value v;
-    lsb_const_string f = { zc->name.s + 7, zc->name.len - 8 };
-    lsb_read_heka_field(m, &f, zc->fi, zc->ai, &v);
-    if (v.type == LSB_READ_STRING) {
-      ret = v.u.s;
-    } else if (v.type != LSB_READ_NIL) {
-      luaL_error(lua, "%s() zc->name.s: '%s' contains an unsupported type",
-                 __func__, zc->name.s);
+  switch (zc->id) {
+  case HEKA_RM_RAW:
+  case HEKA_RM_FRAMED:
+    ret = m->raw;
+    break;
+  case HEKA_RM_PAYLOAD:
+    ret = m->payload;
+    break;
+  case HEKA_RM_LOGGER:
+    ret = m->logger;
+    break;
+  case HEKA_RM_TYPE:
+    ret = m->type;
+    break;
+  case HEKA_RM_ENV_VERSION:
+    ret = m->env_version;
+    break;
+  case HEKA_RM_HOSTNAME:
+    ret = m->hostname;
+    break;
+  case HEKA_RM_UUID:
+    ret = m->uuid;
+    break;
+  case HEKA_RM_FIELD:
+    {
+      lsb_read_value v;
+      lsb_read_heka_field(m, &zc->name, zc->fi, zc->ai, &v);
+      if (v.type == LSB_READ_STRING) {
+        ret = v.u.s;
+      } else if (v.type != LSB_READ_NIL) {
+        luaL_error(lua, "%s() zc->field: '%s' contains an unsupported type",
+                   __func__, zc->field);
+      }
     }
-  } else {
-    luaL_error(lua, "%s() zc->name.s: '%s' not supported/recognized", __func__,
-               zc->name.s);
+    break;
+  default:
+    luaL_error(lua, "%s() zc->field: '%s' not supported/recognized", __func__,
+               zc->field);
+    break;
   }
+  if (!ret.s) ret.len = 0;
   return ret;
 }
 
@@ -91,7 +104,7 @@ static int zc_output(lua_State *lua)
   lsb_const_string f = read_message(lua, zc);
   if (!f.s) return 0;
 
-  if (strcmp(zc->field, LSB_FRAMED) == 0) {
+  if (zc->id == HEKA_RM_FRAMED) {
     char header[LSB_MIN_HDR_SIZE];
     size_t hlen = lsb_write_heka_header(header, f.len);
     if (lsb_outputs(ob, header, hlen)) return 1;
@@ -107,7 +120,7 @@ static int zc_return(lua_State *lua)
   lua_checkstack(lua, 3);
   int cnt = 2;
   lsb_const_string f = read_message(lua, zc);
-  if (strcmp(zc->field, LSB_FRAMED) == 0) {
+  if (zc->id == HEKA_RM_FRAMED) {
     char header[LSB_MIN_HDR_SIZE];
     size_t hlen = lsb_write_heka_header(header, f.len);
     lua_pushlstring(lua, header, hlen);
@@ -124,7 +137,7 @@ static int zc_tostring(lua_State *lua)
   read_message_zc *zc = luaL_checkudata(lua, -1, metatable_name);
   lsb_const_string f = read_message(lua, zc);
   if (f.s) {
-    if (strcmp(zc->field, LSB_FRAMED) == 0) {
+    if (zc->id == HEKA_RM_FRAMED) {
       char header[LSB_MIN_HDR_SIZE];
       size_t hlen = lsb_write_heka_header(header, f.len);
       lua_pushlstring(lua, header, hlen);
@@ -156,19 +169,22 @@ int heka_create_read_message_zc(lua_State *lua)
   int ai = luaL_optint(lua, 3, 0);
   luaL_argcheck(lua, ai >= 0, 3, "array index must be >= 0");
 
-  if (!(strcmp(field, LSB_UUID) == 0
-        || strcmp(field, LSB_TYPE) == 0
-        || strcmp(field, LSB_LOGGER) == 0
-        || strcmp(field, LSB_PAYLOAD) == 0
-        || strcmp(field, LSB_ENV_VERSION) == 0
-        || strcmp(field, LSB_HOSTNAME) == 0
-        || strcmp(field, LSB_RAW) == 0
-        || strcmp(field, LSB_FRAMED) == 0
-        || (len >= 8
-            && memcmp(field, LSB_FIELDS "[", 7) == 0
-            && field[len - 1] == ']'))) {
+  heka_read_message_id id = heka_resolve_read_message(field, len);
+  switch (id) {
+  case HEKA_RM_UUID:
+  case HEKA_RM_TYPE:
+  case HEKA_RM_LOGGER:
+  case HEKA_RM_PAYLOAD:
+  case HEKA_RM_ENV_VERSION:
+  case HEKA_RM_HOSTNAME:
+  case HEKA_RM_RAW:
+  case HEKA_RM_FRAMED:
+  case HEKA_RM_FIELD:
+    break;
+  default:
     luaL_error(lua, "%s() field: '%s' not supported/recognized", __func__,
                field);
+    break;
   }
 
   if (luaL_newmetatable(lua, metatable_name) == 1) {
@@ -183,15 +199,16 @@ int heka_create_read_message_zc(lua_State *lua)
   }
 
   read_message_zc *zc = lua_newuserdata(lua, sizeof(read_message_zc) + len + 1);
+  zc->id = id;
   zc->fi = fi;
   zc->ai = ai;
   memcpy(zc->field, field, len + 1);
-  if (strcmp(field, LSB_FRAMED) == 0) {
-    zc->name.s = LSB_RAW;
-    zc->name.len = sizeof(LSB_RAW) - 1;
+  if (id == HEKA_RM_FIELD) {
+    zc->name.s = zc->field + 7;
+    zc->name.len = len - 8;
   } else {
-    zc->name.s = zc->field;
-    zc->name.len = len;
+    zc->name.s = NULL;
+    zc->name.len = 0;
   }
 
   lua_pushvalue(lua, -2);
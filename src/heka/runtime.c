@@ -0,0 +1,535 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Reference multi-threaded Heka plugin runtime @file */
+
+#include "luasandbox/heka/runtime.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "luasandbox/util/ring_buffer.h"
+#include "luasandbox/util/util.h"
+
+#define BATCH_SIZE      64    // messages processed before yielding the worker
+#define TICK_NS         100000000LL // timer resolution
+#define IDLE_WAIT_NS    10000000LL  // upper bound on a missed wake up
+
+typedef enum {
+  TASK_IDLE,
+  TASK_QUEUED,
+  TASK_RUNNING,
+  TASK_DONE
+} task_state;
+
+struct lsb_heka_runtime_task {
+  lsb_heka_runtime    *rt;
+  lsb_heka_sandbox    *hsb;
+  lsb_ring_buffer     *mailbox;
+  pthread_mutex_t     discard_lock; // serializes consumers once terminated
+  lsb_heka_message    msg;
+  atomic_int          state;
+  atomic_bool         timer_due;
+  atomic_bool         parked; // output asked to retry, wait for the next tick
+  unsigned long long  next_timer; // owned by the ticker thread
+  unsigned long long  ticker_interval;
+  atomic_ullong       decode_failures;
+  lsb_heka_runtime_task *prev; // run queue links, owned by the deque lock
+  lsb_heka_runtime_task *next;
+};
+
+// intrusive list; a task is in at most one queue so a push cannot fail
+typedef struct task_deque {
+  pthread_mutex_t       lock;
+  lsb_heka_runtime_task *head;
+  lsb_heka_runtime_task *tail;
+  size_t                cnt;
+} task_deque;
+
+typedef struct worker {
+  lsb_heka_runtime  *rt;
+  pthread_t         thread;
+  unsigned          id;
+  task_deque        q;
+} worker;
+
+struct lsb_heka_runtime {
+  lsb_logger            logger;
+  worker                *workers;
+  unsigned              nworkers;
+  unsigned              started;
+  pthread_t             ticker;
+  bool                  ticker_started;
+  atomic_bool           stop;
+  atomic_uint           rr;
+  atomic_size_t         queued;
+  atomic_size_t         pending;
+  atomic_uint           sleepers;
+
+  pthread_mutex_t       lock;     // protects tasks and the condition variables
+  pthread_cond_t        work_cond;
+  pthread_cond_t        idle_cond;
+  pthread_cond_t        tick_cond;
+  lsb_heka_runtime_task **tasks;
+  size_t                tasks_len;
+  size_t                tasks_size;
+};
+
+
+static void abs_timeout(struct timespec *ts, long long ns)
+{
+  clock_gettime(CLOCK_REALTIME, ts);
+  ns += ts->tv_nsec;
+  ts->tv_sec += ns / 1000000000LL;
+  ts->tv_nsec = ns % 1000000000LL;
+}
+
+
+static void deque_push(task_deque *q, lsb_heka_runtime_task *t)
+{
+  pthread_mutex_lock(&q->lock);
+  t->next = NULL;
+  t->prev = q->tail;
+  if (q->tail) {
+    q->tail->next = t;
+  } else {
+    q->head = t;
+  }
+  q->tail = t;
+  ++q->cnt;
+  pthread_mutex_unlock(&q->lock);
+}
+
+
+static lsb_heka_runtime_task* deque_pop(task_deque *q)
+{
+  lsb_heka_runtime_task *t = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->cnt) {
+    t = q->head;
+    q->head = t->next;
+    if (q->head) {
+      q->head->prev = NULL;
+    } else {
+      q->tail = NULL;
+    }
+    --q->cnt;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return t;
+}
+
+
+// moves up to half of the victim's queue (taken from the back) to the thief
+static lsb_heka_runtime_task* steal(worker *self)
+{
+  lsb_heka_runtime *rt = self->rt;
+  for (unsigned i = 1; i < rt->nworkers; ++i) {
+    task_deque *q = &rt->workers[(self->id + i) % rt->nworkers].q;
+    lsb_heka_runtime_task *batch[BATCH_SIZE];
+    size_t n = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->cnt) {
+      n = (q->cnt + 1) / 2;
+      if (n > BATCH_SIZE) n = BATCH_SIZE;
+      for (size_t j = 0; j < n; ++j) {
+        batch[j] = q->tail;
+        q->tail = batch[j]->prev;
+      }
+      if (q->tail) {
+        q->tail->next = NULL;
+      } else {
+        q->head = NULL;
+      }
+      q->cnt -= n;
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (n) {
+      for (size_t j = 1; j < n; ++j) {
+        deque_push(&self->q, batch[j]);
+      }
+      return batch[0];
+    }
+  }
+  return NULL;
+}
+
+
+static void schedule(lsb_heka_runtime *rt, lsb_heka_runtime_task *t, int wid)
+{
+  int expected = TASK_IDLE;
+  if (!atomic_compare_exchange_strong(&t->state, &expected, TASK_QUEUED)) {
+    return; // already queued, running (it will recheck), or done
+  }
+  if (wid < 0) {
+    wid = (int)(atomic_fetch_add(&rt->rr, 1) % rt->nworkers);
+  }
+  atomic_fetch_add(&rt->queued, 1);
+  deque_push(&rt->workers[wid].q, t);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&rt->sleepers)) {
+    pthread_mutex_lock(&rt->lock);
+    pthread_cond_signal(&rt->work_cond);
+    pthread_mutex_unlock(&rt->lock);
+  }
+}
+
+
+static void consumed(lsb_heka_runtime *rt)
+{
+  if (atomic_fetch_sub(&rt->pending, 1) == 1) {
+    pthread_mutex_lock(&rt->lock);
+    pthread_cond_broadcast(&rt->idle_cond);
+    pthread_mutex_unlock(&rt->lock);
+  }
+}
+
+
+static void discard_mailbox(lsb_heka_runtime_task *t)
+{
+  size_t len;
+  pthread_mutex_lock(&t->discard_lock);
+  while (lsb_ring_buffer_peek(t->mailbox, &len)) {
+    lsb_ring_buffer_pop(t->mailbox);
+    consumed(t->rt);
+  }
+  pthread_mutex_unlock(&t->discard_lock);
+}
+
+
+// returns false if the sandbox is no longer running
+static bool run_task(lsb_heka_runtime_task *t)
+{
+  lsb_heka_runtime *rt = t->rt;
+  char type = lsb_heka_get_type(t->hsb);
+
+  if (atomic_exchange(&t->timer_due, false)) {
+    if (lsb_heka_timer_event(t->hsb, time(NULL), false)) {
+      return false;
+    }
+  }
+
+  size_t len;
+  const char *pb;
+  for (int i = 0; i < BATCH_SIZE
+       && (pb = lsb_ring_buffer_peek(t->mailbox, &len)); ++i) {
+    if (!lsb_decode_heka_message(&t->msg, pb, len, NULL)) {
+      atomic_fetch_add(&t->decode_failures, 1);
+      lsb_ring_buffer_pop(t->mailbox);
+      consumed(rt);
+      continue;
+    }
+    int rv;
+    if (type == 'o') {
+      rv = lsb_heka_pm_output(t->hsb, &t->msg, NULL, false);
+      if (rv == LSB_HEKA_PM_RETRY) {
+        // leave the message in the mailbox and wait for the next tick
+        atomic_store(&t->parked, true);
+        return true;
+      }
+    } else {
+      rv = lsb_heka_pm_analysis(t->hsb, &t->msg, false);
+    }
+    lsb_ring_buffer_pop(t->mailbox);
+    consumed(rt);
+    if (rv > 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static bool has_work(lsb_heka_runtime_task *t)
+{
+  return atomic_load(&t->timer_due) || lsb_ring_buffer_used(t->mailbox) > 0;
+}
+
+
+static void* worker_thread(void *arg)
+{
+  worker *self = arg;
+  lsb_heka_runtime *rt = self->rt;
+
+  while (!atomic_load(&rt->stop)) {
+    lsb_heka_runtime_task *t = deque_pop(&self->q);
+    if (!t) t = steal(self);
+    if (!t) {
+      pthread_mutex_lock(&rt->lock);
+      atomic_fetch_add(&rt->sleepers, 1);
+      atomic_thread_fence(memory_order_seq_cst);
+      if (atomic_load(&rt->queued) == 0 && !atomic_load(&rt->stop)) {
+        struct timespec ts;
+        abs_timeout(&ts, IDLE_WAIT_NS);
+        pthread_cond_timedwait(&rt->work_cond, &rt->lock, &ts);
+      }
+      atomic_fetch_sub(&rt->sleepers, 1);
+      pthread_mutex_unlock(&rt->lock);
+      continue;
+    }
+    atomic_fetch_sub(&rt->queued, 1);
+
+    atomic_store(&t->state, TASK_RUNNING);
+    if (!run_task(t)) {
+      atomic_store(&t->state, TASK_DONE);
+      discard_mailbox(t);
+      continue;
+    }
+    atomic_store(&t->state, TASK_IDLE);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load(&t->parked) && has_work(t)) {
+      schedule(rt, t, (int)self->id);
+    }
+  }
+  return NULL;
+}
+
+
+static void* ticker_thread(void *arg)
+{
+  lsb_heka_runtime *rt = arg;
+
+  pthread_mutex_lock(&rt->lock);
+  while (!atomic_load(&rt->stop)) {
+    struct timespec ts;
+    abs_timeout(&ts, TICK_NS);
+    pthread_cond_timedwait(&rt->tick_cond, &rt->lock, &ts);
+
+    unsigned long long now = lsb_get_time();
+    for (size_t i = 0; i < rt->tasks_len; ++i) {
+      lsb_heka_runtime_task *t = rt->tasks[i];
+      bool due = atomic_exchange(&t->parked, false);
+      if (t->ticker_interval && now >= t->next_timer) {
+        t->next_timer += t->ticker_interval;
+        if (t->next_timer < now) t->next_timer = now + t->ticker_interval;
+        atomic_store(&t->timer_due, true);
+        due = true;
+      }
+      if (due) {
+        atomic_thread_fence(memory_order_seq_cst);
+        pthread_mutex_unlock(&rt->lock);
+        schedule(rt, t, -1);
+        pthread_mutex_lock(&rt->lock);
+      }
+    }
+  }
+  pthread_mutex_unlock(&rt->lock);
+  return NULL;
+}
+
+
+lsb_heka_runtime* lsb_heka_create_runtime(unsigned threads, lsb_logger *logger)
+{
+  if (threads == 0) {
+    if (logger && logger->cb) {
+      logger->cb(logger->context, __func__, 3, "threads must be > 0");
+    }
+    return NULL;
+  }
+
+  lsb_heka_runtime *rt = calloc(1, sizeof(lsb_heka_runtime));
+  if (!rt) goto oom;
+  if (logger) rt->logger = *logger;
+
+  rt->workers = calloc(threads, sizeof(worker));
+  if (!rt->workers) {
+    free(rt);
+    goto oom;
+  }
+  pthread_mutex_init(&rt->lock, NULL);
+  pthread_cond_init(&rt->work_cond, NULL);
+  pthread_cond_init(&rt->idle_cond, NULL);
+  pthread_cond_init(&rt->tick_cond, NULL);
+  atomic_init(&rt->stop, false);
+  atomic_init(&rt->rr, 0);
+  atomic_init(&rt->queued, 0);
+  atomic_init(&rt->pending, 0);
+  atomic_init(&rt->sleepers, 0);
+
+  rt->nworkers = threads;
+  for (unsigned i = 0; i < threads; ++i) {
+    worker *w = &rt->workers[i];
+    w->rt = rt;
+    w->id = i;
+    pthread_mutex_init(&w->q.lock, NULL);
+  }
+  for (unsigned i = 0; i < threads; ++i) {
+    if (pthread_create(&rt->workers[i].thread, NULL, worker_thread,
+                       &rt->workers[i])) {
+      if (rt->logger.cb) {
+        rt->logger.cb(rt->logger.context, __func__, 3, "thread creation "
+                      "failed: %s", strerror(errno));
+      }
+      rt->started = i;
+      lsb_heka_destroy_runtime(rt);
+      return NULL;
+    }
+  }
+  rt->started = threads;
+  if (pthread_create(&rt->ticker, NULL, ticker_thread, rt)) {
+    lsb_heka_destroy_runtime(rt);
+    return NULL;
+  }
+  rt->ticker_started = true;
+  return rt;
+
+oom:
+  if (logger && logger->cb) {
+    logger->cb(logger->context, __func__, 3, "memory allocation failed");
+  }
+  return NULL;
+}
+
+
+void lsb_heka_destroy_runtime(lsb_heka_runtime *rt)
+{
+  if (!rt) return;
+
+  atomic_store(&rt->stop, true);
+  pthread_mutex_lock(&rt->lock);
+  pthread_cond_broadcast(&rt->work_cond);
+  pthread_cond_signal(&rt->tick_cond);
+  pthread_mutex_unlock(&rt->lock);
+
+  for (unsigned i = 0; i < rt->started; ++i) {
+    pthread_join(rt->workers[i].thread, NULL);
+  }
+  if (rt->ticker_started) {
+    pthread_join(rt->ticker, NULL);
+  }
+
+  for (size_t i = 0; i < rt->tasks_len; ++i) {
+    lsb_heka_runtime_task *t = rt->tasks[i];
+    lsb_destroy_ring_buffer(t->mailbox);
+    lsb_free_heka_message(&t->msg);
+    pthread_mutex_destroy(&t->discard_lock);
+    free(t);
+  }
+  free(rt->tasks);
+
+  for (unsigned i = 0; i < rt->nworkers; ++i) {
+    pthread_mutex_destroy(&rt->workers[i].q.lock);
+  }
+  free(rt->workers);
+  pthread_cond_destroy(&rt->tick_cond);
+  pthread_cond_destroy(&rt->idle_cond);
+  pthread_cond_destroy(&rt->work_cond);
+  pthread_mutex_destroy(&rt->lock);
+  free(rt);
+}
+
+
+lsb_heka_runtime_task*
+lsb_heka_runtime_add(lsb_heka_runtime *rt, lsb_heka_sandbox *hsb,
+                     size_t mailbox_size, unsigned ticker_interval)
+{
+  if (!rt || !hsb) return NULL;
+
+  char type = lsb_heka_get_type(hsb);
+  if (type != 'a' && type != 'o') {
+    if (rt->logger.cb) {
+      rt->logger.cb(rt->logger.context, __func__, 3, "only analysis and "
+                    "output sandboxes are supported");
+    }
+    return NULL;
+  }
+
+  lsb_heka_runtime_task *t = calloc(1, sizeof(lsb_heka_runtime_task));
+  if (!t) return NULL;
+  t->rt = rt;
+  t->hsb = hsb;
+  t->ticker_interval = ticker_interval * 1000000000ULL;
+  t->next_timer = lsb_get_time() + t->ticker_interval;
+  atomic_init(&t->state, TASK_IDLE);
+  atomic_init(&t->timer_due, false);
+  atomic_init(&t->parked, false);
+  atomic_init(&t->decode_failures, 0);
+  t->mailbox = lsb_create_ring_buffer(mailbox_size);
+  if (!t->mailbox || lsb_init_heka_message(&t->msg, 8)) {
+    lsb_destroy_ring_buffer(t->mailbox);
+    free(t);
+    return NULL;
+  }
+  pthread_mutex_init(&t->discard_lock, NULL);
+
+  pthread_mutex_lock(&rt->lock);
+  if (rt->tasks_len == rt->tasks_size) {
+    size_t size = rt->tasks_size ? rt->tasks_size * 2 : 16;
+    lsb_heka_runtime_task **tmp = realloc(rt->tasks, size * sizeof(*tmp));
+    if (!tmp) {
+      pthread_mutex_unlock(&rt->lock);
+      lsb_destroy_ring_buffer(t->mailbox);
+      lsb_free_heka_message(&t->msg);
+      pthread_mutex_destroy(&t->discard_lock);
+      free(t);
+      return NULL;
+    }
+    rt->tasks = tmp;
+    rt->tasks_size = size;
+  }
+  rt->tasks[rt->tasks_len++] = t;
+  pthread_mutex_unlock(&rt->lock);
+  return t;
+}
+
+
+lsb_err_value
+lsb_heka_runtime_post(lsb_heka_runtime_task *t, const char *pb, size_t len)
+{
+  if (!t || !pb) return LSB_ERR_UTIL_NULL;
+  if (atomic_load(&t->state) == TASK_DONE) return LSB_ERR_TERMINATED;
+
+  atomic_fetch_add(&t->rt->pending, 1);
+  lsb_err_value ret = lsb_ring_buffer_push(t->mailbox, pb, len);
+  if (ret) {
+    consumed(t->rt);
+    return ret;
+  }
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&t->state) == TASK_DONE) {
+    // raced with the termination; the worker may have already emptied the
+    // mailbox so nothing else will remove this message
+    return NULL;
+  }
+  if (!atomic_load(&t->parked)) {
+    schedule(t->rt, t, -1);
+  }
+  return NULL;
+}
+
+
+void lsb_heka_runtime_drain(lsb_heka_runtime *rt)
+{
+  if (!rt) return;
+
+  pthread_mutex_lock(&rt->lock);
+  while (atomic_load(&rt->pending)) {
+    struct timespec ts;
+    abs_timeout(&ts, IDLE_WAIT_NS);
+    pthread_cond_timedwait(&rt->idle_cond, &rt->lock, &ts);
+    for (size_t i = 0; i < rt->tasks_len; ++i) {
+      lsb_heka_runtime_task *t = rt->tasks[i];
+      if (atomic_load(&t->state) == TASK_DONE) {
+        // sweep messages that raced the termination; consumed() takes the
+        // runtime lock when the last one is removed
+        pthread_mutex_unlock(&rt->lock);
+        discard_mailbox(t);
+        pthread_mutex_lock(&rt->lock);
+      }
+    }
+  }
+  pthread_mutex_unlock(&rt->lock);
+}
+
+
+unsigned long long lsb_heka_runtime_decode_failures(lsb_heka_runtime_task *t)
+{
+  return t ? atomic_load(&t->decode_failures) : 0;
+}
@@ -74,7 +74,19 @@ static int read_message(lua_State *lua)
     }
     lua_pop(lua, 1); // remove the zc flag
   }
-  return heka_read_message(lua, hsb->msg);
+  return heka_read_message(lua, hsb->msg, &hsb->field_index);
+}
+
+
+static int read_message_array(lua_State *lua)
+{
+  lua_getfield(lua, LUA_REGISTRYINDEX, LSB_HEKA_THIS_PTR);
+  lsb_heka_sandbox *hsb = lua_touserdata(lua, -1);
+  lua_pop(lua, 1); // remove this ptr
+  if (!hsb) {
+    return luaL_error(lua, "%s() invalid " LSB_HEKA_THIS_PTR, __func__);
+  }
+  return heka_read_message_array(lua, hsb->msg);
 }
 
 
@@ -125,7 +137,7 @@ static int mm_create(lua_State *lua)
   }
   lua_setmetatable(lua, -2);
 
-  *ppmm = lsb_create_message_matcher(exp);
+  *ppmm = lsb_acquire_message_matcher(exp);
   if (!*ppmm) {
     return luaL_error(lua, "invalid message matcher expression");
   }
@@ -248,7 +260,19 @@ static int inject_message_analysis(lua_State *lua)
   size_t output_len = 0;
   const char *output = lsb_get_output(lsb, &output_len);
   lsb_heka_sandbox *hsb = lsb_get_parent(lsb);
-  int rv = hsb->cb.aim(hsb->parent, output, output_len);
+  int rv;
+  if (hsb->im_rb) {
+    lsb_err_value ret = lsb_ring_buffer_push(hsb->im_rb, output, output_len);
+    if (!ret) {
+      rv = LSB_HEKA_IM_SUCCESS;
+    } else if (ret == LSB_ERR_UTIL_FULL) {
+      rv = LSB_HEKA_IM_LIMIT;
+    } else {
+      rv = LSB_HEKA_IM_ERROR;
+    }
+  } else {
+    rv = hsb->cb.aim(hsb->parent, output, output_len);
+  }
   switch (rv) {
   case LSB_HEKA_IM_SUCCESS:
     break;
@@ -458,6 +482,12 @@ static void set_restrictions(lua_State *lua, lsb_heka_sandbox *hsb)
   }
   lua_pop(lua, 1); // remove the restricted_headers boolean
 
+  lua_getfield(lua, 1, "fixed_length_encoding");
+  if (lua_type(lua, -1) == LUA_TBOOLEAN) {
+    hsb->fixed_length_encoding = lua_toboolean(lua, -1);
+  }
+  lua_pop(lua, 1); // remove the fixed_length_encoding boolean
+
   lua_pop(lua, 1); // remove the lsb_config table
 }
 
@@ -495,6 +525,7 @@ lsb_heka_sandbox* lsb_heka_create_input(void *parent,
   hsb->type = 'i';
   hsb->parent = parent;
   hsb->msg = NULL;
+  lsb_init_heka_field_index(&hsb->field_index);
   hsb->cb.iim = im;
   hsb->name = NULL;
   hsb->hostname = NULL;
@@ -540,6 +571,7 @@ static int process_message(lsb_heka_sandbox *hsb, lsb_heka_message *msg,
   unsigned long long start, end;
 
   hsb->msg = msg;
+  lsb_reset_heka_field_index(&hsb->field_index);
   if (profile) {
     start = lsb_get_time();
   }
@@ -560,6 +592,7 @@ static int process_message(lsb_heka_sandbox *hsb, lsb_heka_message *msg,
   if (profile) {
     end = lsb_get_time();
     lsb_update_running_stats(&hsb->stats.pm, (double)(end - start));
+    lsb_update_histogram(&hsb->stats.pm_latency, end - start);
   }
   hsb->msg = NULL;
 
@@ -688,6 +721,7 @@ lsb_heka_sandbox* lsb_heka_create_analysis(void *parent,
   hsb->type = 'a';
   hsb->parent = parent;
   hsb->msg = NULL;
+  lsb_init_heka_field_index(&hsb->field_index);
   hsb->cb.aim = im;
   hsb->name = NULL;
   hsb->hostname = NULL;
@@ -704,6 +738,11 @@ lsb_heka_sandbox* lsb_heka_create_analysis(void *parent,
 
   lsb_add_function(hsb->lsb, heka_decode_message, "decode_message");
   lsb_add_function(hsb->lsb, read_message, "read_message");
+  lsb_add_function(hsb->lsb, read_message_array, "read_message_array");
+  lsb_add_function(hsb->lsb, heka_create_message_accessor,
+                   "create_message_accessor");
+  lsb_add_function(hsb->lsb, heka_create_message_projection,
+                   "create_message_projection");
   lsb_add_function(hsb->lsb, inject_message_analysis, "inject_message");
   lsb_add_function(hsb->lsb, inject_payload, "inject_payload");
   // rename output to add_to_payload
@@ -870,6 +909,149 @@ static int zc_luaopen_io(lua_State *lua)
 // End IO write zero copy replacement
 
 
+// Scatter/gather output
+static const char *iov_pins = "lsb_heka_iov_pins";
+
+static void reset_iov(lsb_heka_sandbox *hsb, lua_State *lua)
+{
+  if (hsb->iov_pins) {
+    lua_getfield(lua, LUA_REGISTRYINDEX, iov_pins);
+    for (int i = 1; i <= hsb->iov_pins; ++i) {
+      lua_pushnil(lua);
+      lua_rawseti(lua, -2, i);
+    }
+    lua_pop(lua, 1); // remove the pins table
+    hsb->iov_pins = 0;
+  }
+  hsb->iov_len = 0;
+  hsb->iov_bytes = 0;
+}
+
+
+// keeps the value at idx alive until the next reset_iov
+static void pin_iov(lua_State *lua, lsb_heka_sandbox *hsb, int pins, int idx)
+{
+  lua_pushvalue(lua, idx);
+  lua_rawseti(lua, pins, ++hsb->iov_pins);
+}
+
+
+static void append_iov(lua_State *lua, lsb_heka_sandbox *hsb, const char *s,
+                       size_t len)
+{
+  if (!s || len == 0) return;
+
+  size_t limit = hsb->lsb->output.maxsize;
+  if (limit && hsb->iov_bytes + len > limit) {
+    luaL_error(lua, "output_limit exceeded");
+  }
+  hsb->iov_bytes += len;
+  lsb_lua_sandbox *lsb = hsb->lsb;
+  lsb->usage[LSB_UT_OUTPUT][LSB_US_CURRENT] = hsb->iov_bytes;
+  if (lsb->usage[LSB_UT_OUTPUT][LSB_US_CURRENT]
+      > lsb->usage[LSB_UT_OUTPUT][LSB_US_MAXIMUM]) {
+    lsb->usage[LSB_UT_OUTPUT][LSB_US_MAXIMUM] =
+        lsb->usage[LSB_UT_OUTPUT][LSB_US_CURRENT];
+  }
+
+  if (hsb->iov_len) { // extend the previous segment when contiguous
+    lsb_heka_iovec *prev = &hsb->iov[hsb->iov_len - 1];
+    if ((const char *)prev->iov_base + prev->iov_len == s) {
+      prev->iov_len += len;
+      return;
+    }
+  }
+
+  if (hsb->iov_len == hsb->iov_size) {
+    int size = hsb->iov_size ? hsb->iov_size * 2 : 16;
+    lsb_heka_iovec *iov = realloc(hsb->iov, sizeof(lsb_heka_iovec) * size);
+    if (!iov) {
+      luaL_error(lua, "%s() memory allocation failed", __func__);
+    }
+    hsb->iov = iov;
+    hsb->iov_size = size;
+  }
+  hsb->iov[hsb->iov_len].iov_base = (void *)s;
+  hsb->iov[hsb->iov_len].iov_len = len;
+  ++hsb->iov_len;
+}
+
+
+static int write_iov(lua_State *lua)
+{
+  lua_getfield(lua, LUA_REGISTRYINDEX, LSB_HEKA_THIS_PTR);
+  lsb_heka_sandbox *hsb = lua_touserdata(lua, -1);
+  lua_pop(lua, 1); // remove this ptr
+  if (!hsb) {
+    return luaL_error(lua, "%s() invalid " LSB_HEKA_THIS_PTR, __func__);
+  }
+
+  int n = lua_gettop(lua);
+  int pins = n + 1;
+  lua_getfield(lua, LUA_REGISTRYINDEX, iov_pins);
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    lua_newtable(lua);
+    lua_pushvalue(lua, -1);
+    lua_setfield(lua, LUA_REGISTRYINDEX, iov_pins);
+  }
+
+  size_t len;
+  const char *s;
+  for (int arg = 1; arg <= n; ++arg) {
+    switch (lua_type(lua, arg)) {
+    case LUA_TNUMBER:
+      lua_pushvalue(lua, arg);
+      s = lua_tolstring(lua, -1, &len); // converts the copy
+      lua_rawseti(lua, pins, ++hsb->iov_pins);
+      append_iov(lua, hsb, s, len);
+      break;
+    case LUA_TSTRING:
+      s = lua_tolstring(lua, arg, &len);
+      pin_iov(lua, hsb, pins, arg);
+      append_iov(lua, hsb, s, len);
+      break;
+    case LUA_TUSERDATA:
+      {
+        lua_CFunction fp = lsb_get_zero_copy_function(lua, arg);
+        if (!fp) {
+          return luaL_argerror(lua, arg, "no zero copy support");
+        }
+        pin_iov(lua, hsb, pins, arg); // it may own the referenced memory
+
+        lua_pushvalue(lua, arg);
+        int results = fp(lua);
+        int start = n + 3;
+        int end = start + results;
+        for (int i = start; i < end; ++i) {
+          switch (lua_type(lua, i)) {
+          case LUA_TSTRING:
+            s = lua_tolstring(lua, i, &len);
+            pin_iov(lua, hsb, pins, i);
+            append_iov(lua, hsb, s, len);
+            break;
+          case LUA_TLIGHTUSERDATA:
+            s = lua_touserdata(lua, i++);
+            len = (size_t)lua_tointeger(lua, i);
+            append_iov(lua, hsb, s, len);
+            break;
+          default:
+            return luaL_error(lua, "invalid zero copy return");
+          }
+        }
+        lua_pop(lua, results + 1); // remove the returns values and
+                                   // the copy of the userdata
+      }
+      break;
+    default:
+      return luaL_typerror(lua, arg, "number, string or userdata");
+    }
+  }
+  return 0;
+}
+// End scatter/gather output
+
+
 lsb_heka_sandbox* lsb_heka_create_output(void *parent,
                                          const char *lua_file,
                                          const char *state_file,
@@ -916,6 +1098,7 @@ lsb_heka_sandbox* lsb_heka_create_output_im(void *parent,
   hsb->type = 'o';
   hsb->parent = parent;
   hsb->msg = NULL;
+  lsb_init_heka_field_index(&hsb->field_index);
   hsb->ucp = ucp;
   hsb->cb.aim = im;
   hsb->name = NULL;
@@ -931,10 +1114,16 @@ lsb_heka_sandbox* lsb_heka_create_output_im(void *parent,
   set_restrictions(lua, hsb);
 
   lsb_add_function(hsb->lsb, read_message, "read_message");
+  lsb_add_function(hsb->lsb, read_message_array, "read_message_array");
+  lsb_add_function(hsb->lsb, heka_create_message_accessor,
+                   "create_message_accessor");
+  lsb_add_function(hsb->lsb, heka_create_message_projection,
+                   "create_message_projection");
   lsb_add_function(hsb->lsb, heka_decode_message, "decode_message");
   lsb_add_function(hsb->lsb, heka_encode_message, "encode_message");
   lsb_add_function(hsb->lsb, update_checkpoint, LSB_HEKA_UPDATE_CHECKPOINT);
   lsb_add_function(hsb->lsb, mm_create, "create_message_matcher");
+  lsb_add_function(hsb->lsb, write_iov, "write_iov");
   if (im) {
     lsb_add_function(hsb->lsb, inject_message_analysis, "inject_message");
     // inject_payload is intentionally excluded from output plugins
@@ -969,6 +1158,16 @@ lsb_heka_sandbox* lsb_heka_create_output_im(void *parent,
 
 
 
+lsb_err_value
+lsb_heka_set_im_ring_buffer(lsb_heka_sandbox *hsb, lsb_ring_buffer *rb)
+{
+  if (!hsb) return LSB_ERR_UTIL_NULL;
+  if (hsb->type != 'a' && hsb->type != 'o') return LSB_ERR_HEKA_INPUT;
+  hsb->im_rb = rb;
+  return NULL;
+}
+
+
 void lsb_heka_stop_sandbox_clean(lsb_heka_sandbox *hsb)
 {
   lsb_stop_sandbox_clean(hsb->lsb);
@@ -993,6 +1192,8 @@ char* lsb_heka_destroy_sandbox(lsb_heka_sandbox *hsb)
   if (!hsb) return NULL;
 
   char *msg = lsb_destroy(hsb->lsb);
+  lsb_free_heka_field_index(&hsb->field_index);
+  free(hsb->iov);
   free(hsb->hostname);
   free(hsb->name);
   free(hsb);
@@ -1016,6 +1217,7 @@ int lsb_heka_pm_output(lsb_heka_sandbox *hsb,
 
   lua_State *lua = lsb_get_lua(hsb->lsb);
   if (!lua) return 1;
+  reset_iov(hsb, lua);
 
   int nargs = 0;
   if (sequence_id) {
@@ -1043,6 +1245,7 @@ int lsb_heka_timer_event(lsb_heka_sandbox *hsb, time_t t, bool shutdown)
     lsb_terminate(hsb->lsb, err);
     return 1;
   }
+  if (hsb->type == 'o') reset_iov(hsb, lua);
   lua_pushnumber(lua, t * 1e9);
   lua_pushboolean(lua, shutdown);
 
@@ -1061,6 +1264,7 @@ int lsb_heka_timer_event(lsb_heka_sandbox *hsb, time_t t, bool shutdown)
   }
   end = lsb_get_time();
   lsb_update_running_stats(&hsb->stats.te, (double)(end - start));
+  lsb_update_histogram(&hsb->stats.te_latency, end - start);
   lsb_pcall_teardown(hsb->lsb);
   lua_gc(lua, LUA_GCCOLLECT, 0);
   return 0;
@@ -1081,7 +1285,10 @@ const char* lsb_heka_get_lua_file(lsb_heka_sandbox *hsb)
 
 lsb_heka_stats lsb_heka_get_stats(lsb_heka_sandbox *hsb)
 {
-  if (!hsb) return (struct lsb_heka_stats){ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  if (!hsb) {
+    return (struct lsb_heka_stats){ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0 };
+  }
 
   return (struct lsb_heka_stats){
     .mem_cur      = lsb_usage(hsb->lsb, LSB_UT_MEMORY, LSB_US_CURRENT),
@@ -1095,11 +1302,33 @@ lsb_heka_stats lsb_heka_get_stats(lsb_heka_sandbox *hsb)
     .pm_avg       = hsb->stats.pm.mean,
     .pm_sd        = lsb_sd_running_stats(&hsb->stats.pm),
     .te_avg       = hsb->stats.te.mean,
-    .te_sd        = lsb_sd_running_stats(&hsb->stats.te)
+    .te_sd        = lsb_sd_running_stats(&hsb->stats.te),
+    .pm_p99       = lsb_histogram_percentile(&hsb->stats.pm_latency, 99),
+    .te_p99       = lsb_histogram_percentile(&hsb->stats.te_latency, 99),
+    .gc_soft_cnt  = lsb_usage(hsb->lsb, LSB_UT_SOFT_GC, LSB_US_CURRENT),
+    .gc_pause_max = lsb_usage(hsb->lsb, LSB_UT_GC_PAUSE, LSB_US_MAXIMUM)
   };
 }
 
 
+void lsb_heka_get_latency(lsb_heka_sandbox *hsb, lsb_histogram *pm,
+                          lsb_histogram *te, bool reset)
+{
+  if (!hsb) {
+    if (pm) lsb_init_histogram(pm);
+    if (te) lsb_init_histogram(te);
+    return;
+  }
+
+  if (pm) *pm = hsb->stats.pm_latency;
+  if (te) *te = hsb->stats.te_latency;
+  if (reset) {
+    lsb_init_histogram(&hsb->stats.pm_latency);
+    lsb_init_histogram(&hsb->stats.te_latency);
+  }
+}
+
+
 bool lsb_heka_is_running(lsb_heka_sandbox *hsb)
 {
   if (!hsb) return false;
@@ -1127,3 +1356,12 @@ char lsb_heka_get_type(lsb_heka_sandbox *hsb)
   if (!hsb) return '\0';
   return hsb->type;
 }
+
+
+const lsb_heka_iovec* lsb_heka_get_iov(lsb_heka_sandbox *hsb, int *cnt)
+{
+  if (cnt) *cnt = 0;
+  if (!hsb || !cnt || hsb->type != 'o' || hsb->iov_len == 0) return NULL;
+  *cnt = hsb->iov_len;
+  return hsb->iov;
+}
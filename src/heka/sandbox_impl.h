@@ -12,6 +12,8 @@
 #include "luasandbox.h"
 #include "luasandbox/heka/sandbox.h"
 #include "luasandbox/util/heka_message.h"
+#include "luasandbox/util/histogram.h"
+#include "luasandbox/util/ring_buffer.h"
 #include "luasandbox/util/running_stats.h"
 
 struct heka_stats {
@@ -23,6 +25,9 @@ struct heka_stats {
 
   lsb_running_stats pm;
   lsb_running_stats te;
+
+  lsb_histogram pm_latency;
+  lsb_histogram te_latency;
 };
 
 
@@ -30,6 +35,7 @@ struct lsb_heka_sandbox {
   void                              *parent;
   lsb_lua_sandbox                   *lsb;
   lsb_heka_message                  *msg;
+  lsb_heka_field_index              field_index; // value offsets for msg
   char                              *name;
   char                              *hostname;
   union {
@@ -39,8 +45,15 @@ struct lsb_heka_sandbox {
   struct heka_stats                 stats;
   char                              type;
   bool                              restricted_headers;
+  bool                              fixed_length_encoding;
   int                               pid;
   lsb_heka_update_checkpoint        ucp; // used in output plugins only
+  lsb_ring_buffer                   *im_rb; // replaces cb.aim when set
+  lsb_heka_iovec                    *iov;   // write_iov segments (output only)
+  int                               iov_len;
+  int                               iov_size;
+  int                               iov_pins; // values pinned for the segments
+  size_t                            iov_bytes;
 };
 
 #endif
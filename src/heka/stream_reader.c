@@ -46,7 +46,9 @@ static int hsr_decode_message(lua_State *lua)
     return luaL_error(lua, "buffer must be string");
   }
 
-  if (!lsb_decode_heka_message(&hsr->msg, b->buf, len, NULL)) {
+  bool ok = lsb_decode_heka_message(&hsr->msg, b->buf, len, NULL);
+  lsb_reset_heka_field_index(&hsr->field_index);
+  if (!ok) {
     return luaL_error(lua, "invalid protobuf string");
   }
   return 0;
@@ -96,6 +98,7 @@ static int hsr_find_message(lua_State *lua)
   size_t pos_s = b->scanpos;
   size_t discarded = 0;
   bool found = lsb_find_heka_message(&hsr->msg, b, decode, &discarded, NULL);
+  lsb_reset_heka_field_index(&hsr->field_index);
 
   size_t need = b->size;
   if (found) {
@@ -147,7 +150,7 @@ static int hsr_read_message(lua_State *lua)
   }
   heka_stream_reader *hsr = check_hsr(lua, n);
   lua_remove(lua, 1); // remove the hsr user data
-  return heka_read_message(lua, &hsr->msg);
+  return heka_read_message(lua, &hsr->msg, &hsr->field_index);
 }
 
 
@@ -156,6 +159,7 @@ static int hsr_gc(lua_State *lua)
   heka_stream_reader *hsr = check_hsr(lua, 1);
   free(hsr->name);
   lsb_free_heka_message(&hsr->msg);
+  lsb_free_heka_field_index(&hsr->field_index);
   lsb_free_input_buffer(&hsr->buf);
   return 0;
 }
@@ -205,6 +209,7 @@ int heka_create_stream_reader(lua_State *lua)
     free(hsr);
     return luaL_error(lua, "failed to init the message struct");
   }
+  lsb_init_heka_field_index(&hsr->field_index);
   if (lsb_init_input_buffer(&hsr->buf, mms)) {
     lsb_free_heka_message(&hsr->msg);
     free(hsr);
@@ -0,0 +1,14 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+local msg = {Type = "rb", Payload = "ring buffer"}
+
+function process_message()
+    local ok, err = pcall(inject_message, msg)
+    if not ok then return -1, err end
+    return 0
+end
+
+function timer_event(ns, shutdown)
+end
@@ -10,6 +10,7 @@ assert(add_to_payload)
 assert(inject_payload)
 assert(not encode_message)
 assert(not update_checkpoint)
+assert(not write_iov)
 
 function process_message()
     return 0
@@ -210,9 +210,106 @@ assert(not ok)
 assert(msg == "error in tag: 3 wiretype: 2 offset: 24", msg)
 
 
+--[[
+Lazy message proxy
+--]]
+
+require "string"
+
+local function deep_compare(a, b, path)
+    assert(type(a) == type(b), string.format("%s type mismatch %s ~= %s", path, type(a), type(b)))
+    if type(a) ~= "table" then
+        assert(a == b, string.format("%s value mismatch %s ~= %s", path, tostring(a), tostring(b)))
+        return
+    end
+    for k, v in pairs(a) do
+        deep_compare(v, b[k], path .. "." .. tostring(k))
+    end
+    for k in pairs(b) do
+        assert(a[k] ~= nil, path .. "." .. tostring(k) .. " missing")
+    end
+end
+
+local headers = {"Uuid", "Timestamp", "Type", "Logger", "Severity", "Payload",
+    "EnvVersion", "Pid", "Hostname"}
+
+local lazy_tests = {
+    "\010\016\233\213\137\149\106\254\064\066\175\098\058\163\017\067\202\068\016\000",
+    "\010\016\233\213\137\149\106\254\064\066\175\098\058\163\017\067\202\068\016\128\148\235\220\003\026\004type\034\006logger\040\009\050\007payload\058\011env_version\074\008hostname",
+    "\010\016\111\021\235\034\090\107\077\120\169\175\058\232\153\002\231\132\016\128\148\235\220\003\082\023\010\005names\016\000\034\002s1\034\002s2\026\004keys",
+    "\010\016\243\083\052\234\016\052\066\236\160\084\236\003\227\231\170\203\016\255\255\255\255\255\255\255\255\255\001\040\255\255\255\255\255\255\255\255\255\001\064\255\255\255\255\255\255\255\255\255\001",
+    "\010\016\096\006\214\155\119\188\078\023\172\076\081\127\129\143\250\040\016\128\148\235\220\003\082\019\010\006\110\117\109\098\101\114\016\003\057\000\000\000\000\000\000\240\063\082\044\010\007\110\117\109\098\101\114\115\016\003\026\005\099\111\117\110\116\058\024\000\000\000\000\000\000\240\063\000\000\000\000\000\000\000\064\000\000\000\000\000\000\008\064\082\014\010\005\098\111\111\108\115\016\004\066\003\001\000\000\082\010\010\004\098\111\111\108\016\004\064\001\082\016\010\006\115\116\114\105\110\103\034\006\115\116\114\105\110\103\082\021\010\007\115\116\114\105\110\103\115\034\002\115\049\034\002\115\050\034\002\115\051",
+}
+
+for i, v in ipairs(lazy_tests) do
+    local full = decode_message(v)
+    local proxy = decode_message(v, true)
+    assert(type(proxy) == "userdata", "test: " .. i)
+    for _, h in ipairs(headers) do
+        deep_compare(full[h], proxy[h], string.format("test: %d %s", i, h))
+    end
+    assert((full.Fields == nil) == (proxy.Fields == nil), "test: " .. i)
+    if proxy.Fields then
+        local fields = proxy.Fields
+        assert(fields == proxy.Fields, "Fields should be cached")
+        assert(type(fields) == "userdata")
+        assert(#fields == #full.Fields, "test: " .. i)
+        for j = 1, #fields do
+            deep_compare(full.Fields[j], fields[j], string.format("test: %d Fields[%d]", i, j))
+            local name = full.Fields[j].name
+            assert(fields[name].name == name, name)
+        end
+        assert(fields[0] == nil and fields[#fields + 1] == nil and fields[1.5] == nil)
+        assert(fields.missing == nil)
+        local ok = pcall(function() fields[1] = nil end)
+        assert(not ok, "Fields should be read only")
+        fields[1].name = "modified"
+        deep_compare(full.Fields[1], fields[1], string.format("test: %d modified record", i))
+    end
+    assert(proxy.unknown == nil)
+    assert(proxy[1] == nil)
+    deep_compare(full, decode_message(proxy), "test: " .. i .. " full")
+    local ok = pcall(function() proxy.Type = "foo" end)
+    assert(not ok, "proxy should be read only")
+end
+
+local msg = decode_message(lazy_tests[1], false)
+assert(type(msg) == "table")
+
+-- errors are reported at creation (the Fields records are only validated on
+-- access)
+ok, msg = pcall(decode_message, "\010\016\111\021\235\034\090\107\077\120\169\175\058\232\153\002\231\132", true)
+assert(msg == "invalid message, too short", msg)
+ok, msg = pcall(decode_message, "\016\128\148\235\220\003\082\023\010\005names\016\001\042\002s1\042\002s2\026\004keys", true)
+assert(msg == "missing required field uuid: not found timestamp: found", msg)
+ok, msg = pcall(decode_message, "this is a test item over twenty bytes long", true)
+assert(msg == "error in tag: 14 wiretype: 4 offset: 0", msg)
+ok, msg = pcall(decode_message, "\010\016\233\213\137\149\106\254\064\066\175\098\058\163\017\067\202\068\016\128\148\235\220\003\026\128\148\235\220\220\220\220\220\220\220type", true)
+assert(msg == "error in tag: 3 wiretype: 2 offset: 24", msg)
+ok, msg = pcall(decode_message, lazy_tests[1], 1)
+assert(not ok)
+
+local proxy = decode_message("\010\016\111\021\235\034\090\107\077\120\169\175\058\232\153\002\231\132\016\128\148\235\220\003\082\020\016\003\057\000\000\000\000\000\000\240\063\057\000\000\000\000\000\000\240\063", true)
+assert(proxy.Timestamp == 1e9)
+ok, msg = pcall(function() return proxy.Fields end)
+assert(not ok)
+assert(string.find(msg, "error in tag: 10 wiretype: 2 offset: 24", 1, true), msg)
+
+-- a named record with an invalid value is reported when it is indexed
+proxy = decode_message("\010\016\111\021\235\034\090\107\077\120\169\175\058\232\153\002\231\132\016\128\148\235\220\003\082\005\010\001a\056\001", true)
+assert(#proxy.Fields == 1)
+ok, msg = pcall(function() return proxy.Fields.a end)
+assert(not ok)
+assert(string.find(msg, "error in tag: 10 wiretype: 2 offset: 24", 1, true), msg)
+
+
 function process_message()
     msg = decode_message(read_message("raw", nil, nil, true))
     assert(msg.Timestamp == 1e9)
     assert(#msg.Fields == 6)
+
+    msg = decode_message(read_message("raw", nil, nil, true), true)
+    assert(msg.Timestamp == 1e9)
+    assert(#msg.Fields == 6)
     return 0
 end
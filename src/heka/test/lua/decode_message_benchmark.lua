@@ -4,7 +4,65 @@
 
 local test = "\010\016\096\006\214\155\119\188\078\023\172\076\081\127\129\143\250\040\016\128\148\235\220\003\082\019\010\006\110\117\109\098\101\114\016\003\057\000\000\000\000\000\000\240\063\082\044\010\007\110\117\109\098\101\114\115\016\003\026\005\099\111\117\110\116\058\024\000\000\000\000\000\000\240\063\000\000\000\000\000\000\000\064\000\000\000\000\000\000\008\064\082\014\010\005\098\111\111\108\115\016\004\066\003\001\000\000\082\010\010\004\098\111\111\108\016\004\064\001\082\016\010\006\115\116\114\105\110\103\034\006\115\116\114\105\110\103\082\021\010\007\115\116\114\105\110\103\115\034\002\115\049\034\002\115\050\034\002\115\051"
 
-function process_message()
-    local msg = decode_message(test)
-    return 0
+local benchmark = read_config("benchmark") or "decode_message"
+
+if benchmark == "decode_message" then
+    function process_message()
+        local msg = decode_message(test)
+        return 0
+    end
+elseif benchmark == "decode_message_lazy" then
+    function process_message()
+        local msg = decode_message(test, true)
+        local ts = msg.Timestamp
+        local fields = msg.Fields
+        return 0
+    end
+elseif benchmark == "decode_message_lazy_headers" then
+    function process_message()
+        local msg = decode_message(test, true)
+        local ts = msg.Timestamp
+        local uuid = msg.Uuid
+        return 0
+    end
+elseif benchmark == "read_message" then
+    function process_message()
+        local t = read_message("Type")
+        local h = read_message("Hostname")
+        local p = read_message("Payload")
+        local n = read_message("Fields[number]")
+        local s = read_message("Fields[strings]", 0, 2)
+        return 0
+    end
+elseif benchmark == "message_accessor" then
+    local rm_type     = create_message_accessor("Type")
+    local rm_hostname = create_message_accessor("Hostname")
+    local rm_payload  = create_message_accessor("Payload")
+    local rm_number   = create_message_accessor("Fields[number]")
+    local rm_strings  = create_message_accessor("Fields[strings]", 0, 2)
+    function process_message()
+        local t = read_message(rm_type)
+        local h = read_message(rm_hostname)
+        local p = read_message(rm_payload)
+        local n = read_message(rm_number)
+        local s = read_message(rm_strings)
+        return 0
+    end
+elseif benchmark == "message_projection" then
+    local projection = create_message_projection({"Type", "Hostname",
+        "Payload", "Fields[number]", {"Fields[strings]", 0, 2}})
+    function process_message()
+        local t, h, p, n, s = read_message(projection)
+        return 0
+    end
+elseif benchmark == "message_projection_table" then
+    local projection = create_message_projection({"Type", "Hostname",
+        "Payload", "Fields[number]", {"Fields[strings]", 0, 2}})
+    local values = {}
+    function process_message()
+        read_message(projection, values)
+        return 0
+    end
+else
+    error("unknown benchmark: " .. benchmark)
 end
@@ -0,0 +1,75 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "string"
+
+-- with fixed_length_encoding every nested length is a four byte varint
+local fixed = read_config("fixed_length_encoding")
+local ints = {0}
+for i = 2, 300 do ints[i] = (i - 150) * 1000003 end -- includes ten byte varints
+
+local msg = {Timestamp = 0, Uuid = string.rep("\0", 16), Logger = "l", Hostname = "h",
+    Fields = {
+        {name = "big"       ,value = string.rep("x", 1000)},
+        {name = "small"     ,value = "s", representation = "widget"},
+        {name = "ints"      ,value = ints, value_type = 2, representation = "count"},
+        {name = "int"       ,value = {7}, value_type = 2},
+        {name = "pair"      ,value = {-1, 200}, value_type = 2},
+        {name = "doubles"   ,value = {1.5, 2.5}},
+        {name = "bools"     ,value = {true, false}},
+        {name = "bytes"     ,value = "\0\1\2", value_type = 1}}
+    }
+
+local function verify(rv)
+    local m = decode_message(rv)
+    assert(m.Timestamp == 0)
+    assert(m.Uuid == msg.Uuid)
+    assert(m.Logger == "l")
+    assert(m.Hostname == "h")
+    assert(#m.Fields == #msg.Fields, #m.Fields)
+    for i, f in ipairs(msg.Fields) do
+        local df = m.Fields[i]
+        assert(df.name == f.name, df.name)
+        assert(df.representation == f.representation, f.name)
+        local values = type(f.value) == "table" and f.value or {f.value}
+        local dvalues = type(df.value) == "table" and df.value or {df.value}
+        assert(#dvalues == #values, string.format("%s: %d", f.name, #dvalues))
+        for j, v in ipairs(values) do
+            assert(dvalues[j] == v, string.format("%s[%d]: %s", f.name, j, tostring(dvalues[j])))
+        end
+    end
+
+    -- the lazy decoder parses the lengths independently
+    local lm = decode_message(rv, true)
+    assert(lm.Hostname == "h")
+    assert(#lm.Fields == #msg.Fields, #lm.Fields)
+    assert(lm.Fields[1].value[1] == msg.Fields[1].value)
+end
+
+local rv = encode_message(msg)
+verify(rv)
+if fixed then
+    -- ten nested lengths, each padded from its minimal width to four bytes
+    assert(#rv == 3284, #rv)
+    -- the packed integer length: 2080 bytes as a redundant varint
+    assert(string.find(rv, "\050\160\144\128\000", 1, true))
+else
+    assert(#rv == 3257, #rv)
+    assert(string.find(rv, "\050\160\016\000", 1, true))
+end
+
+local framed = encode_message(msg, true)
+verify(string.sub(framed, string.byte(framed, 2) + 4))
+
+local benchmark = read_config("benchmark")
+
+function process_message()
+    if benchmark then
+        encode_message(msg)
+    end
+    return 0
+end
+
+function timer_event(ns)
+end
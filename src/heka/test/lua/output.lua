@@ -10,6 +10,7 @@ assert(decode_message)
 assert(encode_message)
 assert(update_checkpoint)
 assert(create_message_matcher)
+assert(write_iov)
 assert(not inject_message)
 assert(not add_to_payload)
 assert(not inject_payload)
@@ -46,7 +46,83 @@ local errors = {
 }
 
 
+local accessors = {}
+for i, v in ipairs(tests) do
+    accessors[i] = create_message_accessor(v[1])
+end
+
+local field_accessors = {}
+for i, v in ipairs(fields) do
+    if #v[1] < 4 then field_accessors[i] = create_message_accessor(unpack(v[1])) end
+end
+
+for i, v in ipairs(errors) do
+    local ok, r = pcall(create_message_accessor, unpack(v))
+    assert(not ok, string.format("accessor test: %d should have errored", i))
+end
+
+local projection_items = {}
+for i, v in ipairs(tests) do
+    projection_items[#projection_items + 1] = v[1]
+end
+for i, v in ipairs(fields) do
+    if #v[1] < 4 then projection_items[#projection_items + 1] = v[1] end
+end
+local projection = create_message_projection(projection_items)
+
+local projection_errors = {
+    {},
+    {{"Type"}, 1},
+    {{"Type", "unknown"}},
+    {{"Type", 1}},
+    {{{"Fields[number]", -1}}},
+    {{{"Fields[number]", 0, "a"}}},
+    {{{1}}},
+}
+
+for i, v in ipairs(projection_errors) do
+    local ok, r = pcall(create_message_projection, unpack(v))
+    assert(not ok, string.format("projection test: %d should have errored", i))
+end
+
+local projection_values = {}
+
 function process_message()
+    local results = {read_message(projection)}
+    assert(#projection_items == select("#", read_message(projection)), "projection value count")
+    read_message(projection, projection_values)
+    for i, v in ipairs(projection_items) do
+        local r
+        if type(v) == "table" then
+            r = read_message(unpack(v))
+        else
+            r = read_message(v)
+        end
+        assert(r == results[i], string.format("projection test: %d expected: %s received: %s", i, tostring(r), tostring(results[i])))
+        assert(r == projection_values[i], string.format("projection table test: %d expected: %s received: %s", i, tostring(r), tostring(projection_values[i])))
+    end
+    local ok = pcall(read_message, projection, {}, 1)
+    assert(not ok, "projection with extra arguments should have errored")
+    ok = pcall(read_message, projection, 1)
+    assert(not ok, "projection with a non table should have errored")
+
+    for i, v in ipairs(tests) do
+        local r = read_message(v[1])
+        assert(r == read_message(accessors[i]), string.format("accessor test: %d mismatch", i))
+    end
+
+    for i, v in ipairs(fields) do
+        if field_accessors[i] then
+            local r = read_message(field_accessors[i])
+            assert(v[2] == r, string.format("accessor field test: %d expected: %s received: %s", i, tostring(v[2]), tostring(r)))
+        end
+    end
+
+    local ok = pcall(read_message, accessors[1], 0)
+    assert(not ok, "accessor with extra arguments should have errored")
+    ok = pcall(read_message, read_message("Type", 0, 0, true))
+    assert(not ok, "non accessor userdata should have errored")
+
     for i, v in ipairs(tests) do
         local r = read_message(v[1])
         if v[1] == "raw" or v[1] == "framed" then
@@ -68,5 +144,31 @@ function process_message()
         assert(not ok, string.format("test: %d should have errored", i))
     end
 
+    local a = read_message_array("Fields[strings]")
+    assert(#a == 3, string.format("array length: %d", #a))
+    for i, v in ipairs(a) do
+        local r = read_message("Fields[strings]", 0, i - 1)
+        assert(v == r, string.format("array test: %d expected: %s received: %s", i, tostring(r), tostring(v)))
+    end
+    a = read_message_array("Fields[numbers]", 0)
+    assert(#a == 3 and a[1] == 1 and a[3] == 3, "numbers array")
+    a = {1, 2, 3, 4, 5}
+    assert(a == read_message_array("Fields[bools]", 0, a), "array table not reused")
+    assert(#a == 3 and a[1] == true and a[2] == false and a[4] == nil, "bools array")
+    assert(read_message_array("Fields[notfound]") == nil, "notfound array")
+    assert(read_message_array("Fields[strings]", 1) == nil, "strings array field index 1")
+
+    local array_errors = {
+        {},
+        {"Type"},
+        {"Fields[strings]", -1},
+        {"Fields[strings]", 0, 1},
+        {"Fields[strings]", 0, {}, 1},
+    }
+    for i, v in ipairs(array_errors) do
+        local ok, r = pcall(read_message_array, unpack(v))
+        assert(not ok, string.format("array test: %d should have errored", i))
+    end
+
     return 0
 end
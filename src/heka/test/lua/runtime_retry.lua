@@ -0,0 +1,20 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+local retries = 0
+local calls = 0
+
+function process_message()
+    calls = calls + 1
+    -- a busy retry loop would exhaust this long before the ticks are up
+    if calls > 50 then error("retried too often") end
+    if retries < 3 then
+        retries = retries + 1
+        return -3
+    end
+    return 0
+end
+
+function timer_event(ns, shutdown)
+end
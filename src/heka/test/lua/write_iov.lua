@@ -0,0 +1,29 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "string"
+
+local framed = read_message("framed", nil, nil, true)
+local payload = read_message("Payload", nil, nil, true)
+local prefix = "a"
+
+function process_message()
+    write_iov(framed, "|", 42, payload)
+    write_iov(prefix, "b")
+    prefix = nil
+    collectgarbage() -- the pinned strings must survive
+
+    local ok, err = pcall(write_iov, {})
+    assert(not ok)
+    assert("bad argument #1 to '?' (number, string or userdata expected, got table)" == err, err)
+
+    ok, err = pcall(write_iov, string.rep("x", 2048))
+    assert(not ok)
+    assert("output_limit exceeded" == err, err)
+    return 0
+end
+
+function timer_event(ns)
+    write_iov("timer")
+end
@@ -0,0 +1,283 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Heka runtime unit tests @file */
+
+#include "test.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "luasandbox/heka/runtime.h"
+#include "luasandbox/heka/sandbox.h"
+#include "luasandbox/util/util.h"
+
+// {Type="type", Payload="payload", Fields = {number=1}}
+static char pb[] = "\x0a\x10" "abcdefghijklmnop" "\x10\x80\x94\xeb\xdc\x03\x1a\x04\x74\x79\x70\x65\x32\x07\x70\x61\x79\x6c\x6f\x61\x64\x52\x13\x0a\x06\x6e\x75\x6d\x62\x65\x72\x10\x03\x39\x00\x00\x00\x00\x00\x00\xf0\x3f";
+
+// {Type="boom"}
+static char pb_boom[] = "\x0a\x10" "abcdefghijklmnop" "\x10\x80\x94\xeb\xdc\x03\x1a\x04\x62\x6f\x6f\x6d";
+
+static atomic_int injected;
+
+char *e = NULL;
+
+void dlog(void *context, const char *component, int level, const char *fmt, ...)
+{
+  (void)context;
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "%lld [%d] %s ", (long long)time(NULL), level,
+          component ? component : "unnamed");
+  vfprintf(stderr, fmt, args);
+  fwrite("\n", 1, 1, stderr);
+  va_end(args);
+}
+static lsb_logger logger = { .context = NULL, .cb = dlog };
+
+
+static int aim(void *parent, const char *pb, size_t pb_len)
+{
+  (void)parent;
+  (void)pb;
+  (void)pb_len;
+  atomic_fetch_add(&injected, 1);
+  return 0;
+}
+
+
+static void post(lsb_heka_runtime_task *t, const char *s, size_t len)
+{
+  lsb_err_value ret;
+  while ((ret = lsb_heka_runtime_post(t, s, len)) == LSB_ERR_UTIL_FULL) {
+    usleep(100);
+  }
+}
+
+
+static char* test_stub()
+{
+  return NULL;
+}
+
+
+static char* test_create()
+{
+  lsb_heka_runtime *rt = lsb_heka_create_runtime(0, NULL);
+  mu_assert(!rt, "created a runtime with no threads");
+
+  rt = lsb_heka_create_runtime(2, &logger);
+  mu_assert(rt, "lsb_heka_create_runtime failed");
+  mu_assert(!lsb_heka_runtime_add(rt, NULL, 1024, 0), "added a NULL sandbox");
+  lsb_heka_runtime_drain(rt); // nothing pending
+  lsb_heka_destroy_runtime(rt);
+  lsb_heka_destroy_runtime(NULL);
+
+  mu_assert(lsb_heka_runtime_post(NULL, pb, sizeof(pb) - 1)
+            == LSB_ERR_UTIL_NULL, "accepted a NULL task");
+  return NULL;
+}
+
+
+static char* test_process()
+{
+  const int nsb = 8;
+  const int msgs = 1000;
+  lsb_heka_sandbox *hsbs[nsb];
+  lsb_heka_runtime_task *tasks[nsb];
+
+  lsb_heka_runtime *rt = lsb_heka_create_runtime(3, &logger);
+  mu_assert(rt, "lsb_heka_create_runtime failed");
+  for (int i = 0; i < nsb; ++i) {
+    hsbs[i] = lsb_heka_create_analysis(NULL, "lua/runtime.lua", NULL, NULL,
+                                       &logger, aim);
+    mu_assert(hsbs[i], "lsb_heka_create_analysis failed");
+    tasks[i] = lsb_heka_runtime_add(rt, hsbs[i], 4096, 0);
+    mu_assert(tasks[i], "lsb_heka_runtime_add failed");
+  }
+
+  for (int x = 0; x < msgs; ++x) {
+    for (int i = 0; i < nsb; ++i) {
+      post(tasks[i], pb, sizeof(pb) - 1);
+    }
+  }
+  post(tasks[0], "garbage", 7);
+  lsb_heka_runtime_drain(rt);
+  mu_assert(lsb_heka_runtime_decode_failures(tasks[0]) == 1, "received %llu",
+            lsb_heka_runtime_decode_failures(tasks[0]));
+
+  for (int i = 0; i < nsb; ++i) {
+    lsb_heka_stats stats = lsb_heka_get_stats(hsbs[i]);
+    mu_assert(stats.pm_cnt == (unsigned long long)msgs, "sandbox: %d "
+              "received %llu", i, stats.pm_cnt);
+    mu_assert(stats.pm_failures == 0, "received %llu", stats.pm_failures);
+  }
+  lsb_heka_destroy_runtime(rt);
+  for (int i = 0; i < nsb; ++i) {
+    e = lsb_heka_destroy_sandbox(hsbs[i]);
+    mu_assert(!e, "%s", e);
+  }
+  return NULL;
+}
+
+
+static char* test_timer()
+{
+  atomic_store(&injected, 0);
+  lsb_heka_runtime *rt = lsb_heka_create_runtime(1, &logger);
+  mu_assert(rt, "lsb_heka_create_runtime failed");
+  lsb_heka_sandbox *hsb = lsb_heka_create_analysis(NULL, "lua/runtime.lua",
+                                                   NULL, NULL, &logger, aim);
+  mu_assert(hsb, "lsb_heka_create_analysis failed");
+  mu_assert(lsb_heka_runtime_add(rt, hsb, 1024, 1), "lsb_heka_runtime_add "
+            "failed");
+
+  for (int i = 0; i < 30 && atomic_load(&injected) == 0; ++i) {
+    usleep(100000);
+  }
+  mu_assert(atomic_load(&injected) > 0, "timer_event was not called");
+  lsb_heka_destroy_runtime(rt);
+  e = lsb_heka_destroy_sandbox(hsb);
+  mu_assert(!e, "%s", e);
+  return NULL;
+}
+
+
+static char* test_terminated()
+{
+  lsb_heka_runtime *rt = lsb_heka_create_runtime(2, NULL);
+  mu_assert(rt, "lsb_heka_create_runtime failed");
+  lsb_heka_sandbox *hsb = lsb_heka_create_analysis(NULL, "lua/runtime.lua",
+                                                   NULL, NULL, NULL, aim);
+  mu_assert(hsb, "lsb_heka_create_analysis failed");
+  lsb_heka_runtime_task *t = lsb_heka_runtime_add(rt, hsb, 1024, 0);
+  mu_assert(t, "lsb_heka_runtime_add failed");
+
+  post(t, pb_boom, sizeof(pb_boom) - 1);
+  for (int i = 0; i < 10; ++i) {
+    post(t, pb, sizeof(pb) - 1);
+  }
+  lsb_heka_runtime_drain(rt);
+  lsb_err_value ret = lsb_heka_runtime_post(t, pb, sizeof(pb) - 1);
+  mu_assert(ret == LSB_ERR_TERMINATED, "received: %s", lsb_err_string(ret));
+  lsb_heka_stats stats = lsb_heka_get_stats(hsb);
+  mu_assert(stats.pm_cnt == 0, "received %llu", stats.pm_cnt);
+
+  lsb_heka_destroy_runtime(rt);
+  e = lsb_heka_destroy_sandbox(hsb);
+  free(e);
+  e = NULL;
+  return NULL;
+}
+
+
+static int ucp(void *parent, void *sequence_id)
+{
+  (void)parent;
+  (void)sequence_id;
+  return 0;
+}
+
+
+static char* test_retry()
+{
+  const int msgs = 10;
+  lsb_heka_runtime *rt = lsb_heka_create_runtime(2, &logger);
+  mu_assert(rt, "lsb_heka_create_runtime failed");
+  lsb_heka_sandbox *hsb = lsb_heka_create_output(NULL, "lua/runtime_retry.lua",
+                                                 NULL, NULL, &logger, ucp);
+  mu_assert(hsb, "lsb_heka_create_output failed");
+  lsb_heka_runtime_task *t = lsb_heka_runtime_add(rt, hsb, 1024, 0);
+  mu_assert(t, "lsb_heka_runtime_add failed");
+
+  unsigned long long start = lsb_get_time();
+  for (int i = 0; i < msgs; ++i) {
+    post(t, pb, sizeof(pb) - 1);
+  }
+  lsb_heka_runtime_drain(rt);
+  unsigned long long elapsed = lsb_get_time() - start;
+  lsb_heka_stats stats = lsb_heka_get_stats(hsb);
+  mu_assert(stats.pm_cnt == (unsigned long long)msgs, "received %llu",
+            stats.pm_cnt);
+  // each retry is parked until the next 100ms tick
+  mu_assert(elapsed >= 150000000ULL, "retried after %llu ns", elapsed);
+
+  lsb_heka_destroy_runtime(rt);
+  e = lsb_heka_destroy_sandbox(hsb);
+  mu_assert(!e, "%s", e);
+  return NULL;
+}
+
+
+static char* benchmark_runtime()
+{
+  const int nsb = 64;
+  const int msgs = 5000;
+  const unsigned threads = 4;
+  lsb_heka_sandbox *hsbs[nsb];
+  lsb_heka_runtime_task *tasks[nsb];
+
+  lsb_heka_runtime *rt = lsb_heka_create_runtime(threads, &logger);
+  mu_assert(rt, "lsb_heka_create_runtime failed");
+  for (int i = 0; i < nsb; ++i) {
+    hsbs[i] = lsb_heka_create_analysis(NULL, "lua/runtime.lua", NULL, NULL,
+                                       &logger, aim);
+    mu_assert(hsbs[i], "lsb_heka_create_analysis failed");
+    tasks[i] = lsb_heka_runtime_add(rt, hsbs[i], 64 * 1024, 0);
+    mu_assert(tasks[i], "lsb_heka_runtime_add failed");
+  }
+
+  unsigned long long start = lsb_get_time();
+  for (int x = 0; x < msgs; ++x) {
+    for (int i = 0; i < nsb; ++i) {
+      post(tasks[i], pb, sizeof(pb) - 1);
+    }
+  }
+  lsb_heka_runtime_drain(rt);
+  double elapsed = (lsb_get_time() - start) / 1e9;
+  printf("benchmark_runtime() sandboxes: %d threads: %u %g messages/second\n",
+         nsb, threads, nsb * msgs / elapsed);
+
+  lsb_heka_destroy_runtime(rt);
+  for (int i = 0; i < nsb; ++i) {
+    e = lsb_heka_destroy_sandbox(hsbs[i]);
+    mu_assert(!e, "%s", e);
+  }
+  return NULL;
+}
+
+
+static char* all_tests()
+{
+  mu_run_test(test_stub);
+  mu_run_test(test_create);
+  mu_run_test(test_process);
+  mu_run_test(test_timer);
+  mu_run_test(test_terminated);
+  mu_run_test(test_retry);
+
+  mu_run_test(benchmark_runtime);
+  return NULL;
+}
+
+
+int main()
+{
+  char *result = all_tests();
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", mu_tests_run);
+  free(e);
+
+  return result != 0;
+}
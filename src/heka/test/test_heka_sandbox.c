@@ -423,6 +423,15 @@ static char* test_timer_event()
     mu_assert(0 < stats.te_sd, "received %g", stats.te_sd);
   }
 
+  lsb_histogram pm, te;
+  lsb_heka_get_latency(hsb, &pm, &te, true);
+  mu_assert(0 == pm.count, "received %llu", pm.count);
+  mu_assert(2 == te.count, "received %llu", te.count);
+  mu_assert(te.max == lsb_histogram_percentile(&te, 100), "received %llu",
+            lsb_histogram_percentile(&te, 100));
+  lsb_heka_get_latency(hsb, NULL, &te, false);
+  mu_assert(0 == te.count, "received %llu", te.count);
+
   e = lsb_heka_destroy_sandbox(hsb);
 
   hsb = lsb_heka_create_analysis(NULL, "lua/pm_no_return.lua", NULL, NULL, NULL, aim);
@@ -512,7 +521,11 @@ static char* test_pm_input()
   if (clockres <= 100) {
     mu_assert(0 < stats.pm_avg, "received %g res %llu", stats.pm_avg, clockres);
     mu_assert(0 < stats.pm_sd, "received %g", stats.pm_sd);
+    mu_assert(0 < stats.pm_p99, "received %llu", stats.pm_p99);
   }
+  lsb_histogram pm;
+  lsb_heka_get_latency(hsb, &pm, NULL, false);
+  mu_assert(5 == pm.count, "received %llu", pm.count);
   e = lsb_heka_destroy_sandbox(hsb);
   return NULL;
 }
@@ -679,6 +692,63 @@ static char* test_im_output()
 }
 
 
+static char* test_im_ring_buffer()
+{
+  lsb_heka_message m, im;
+  mu_assert(!lsb_init_heka_message(&m, 1), "failed to init message");
+  mu_assert(!lsb_init_heka_message(&im, 1), "failed to init message");
+  lsb_ring_buffer *rb = lsb_create_ring_buffer(256);
+  mu_assert(rb, "lsb_create_ring_buffer failed");
+
+  lsb_heka_sandbox *hsb;
+  hsb = lsb_heka_create_input(NULL, "lua/input.lua", NULL, NULL, &logger, iim);
+  mu_assert(hsb, "lsb_heka_create_input failed");
+  mu_assert(lsb_heka_set_im_ring_buffer(hsb, rb) == LSB_ERR_HEKA_INPUT,
+            "input sandbox accepted a ring buffer");
+  e = lsb_heka_destroy_sandbox(hsb);
+  mu_assert(lsb_heka_set_im_ring_buffer(NULL, rb) == LSB_ERR_UTIL_NULL,
+            "NULL sandbox accepted a ring buffer");
+
+  hsb = lsb_heka_create_analysis(NULL, "lua/aim_rb.lua", NULL,
+                                 "Hostname = 'rb';Logger = 'aim_rb'",
+                                 &logger, aim);
+  mu_assert(hsb, "lsb_heka_create_analysis failed");
+  mu_assert(!lsb_heka_set_im_ring_buffer(hsb, rb), "set failed");
+
+  int sent = 0;
+  int rv;
+  while ((rv = lsb_heka_pm_analysis(hsb, &m, false)) == 0) {
+    ++sent;
+  }
+  mu_assert(rv == -1, "received: %d %s", rv, lsb_heka_get_error(hsb));
+  const char *eerr = "inject_message() failed: injection limit exceeded";
+  const char *err = lsb_heka_get_error(hsb);
+  mu_assert(strcmp(eerr, err) == 0, "expected: %s received: %s", eerr, err);
+  mu_assert(sent > 1, "received: %d", sent);
+
+  int received = 0;
+  size_t len;
+  const char *pb;
+  while ((pb = lsb_ring_buffer_peek(rb, &len))) {
+    mu_assert(lsb_decode_heka_message(&im, pb, len, &logger), "decode failed");
+    mu_assert(im.type.len == 2 && memcmp(im.type.s, "rb", 2) == 0,
+              "invalid type");
+    lsb_ring_buffer_pop(rb);
+    ++received;
+  }
+  mu_assert(sent == received, "sent: %d received: %d", sent, received);
+  mu_assert_rv(0, lsb_heka_pm_analysis(hsb, &m, false));
+
+  lsb_heka_stats stats = lsb_heka_get_stats(hsb);
+  mu_assert(sent + 1 == (int)stats.im_cnt, "received %llu", stats.im_cnt);
+  e = lsb_heka_destroy_sandbox(hsb);
+  lsb_destroy_ring_buffer(rb);
+  lsb_free_heka_message(&im);
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
 static char* test_encode_message()
 {
   lsb_heka_sandbox *hsb;
@@ -697,6 +767,18 @@ static char* test_encode_message()
 }
 
 
+static char* test_encode_message_fixed()
+{
+  lsb_heka_sandbox *hsb;
+  hsb = lsb_heka_create_output(NULL, "lua/encode_message_fixed.lua", NULL,
+                               "fixed_length_encoding = true\n",
+                               &logger, ucp);
+  mu_assert(hsb, "lsb_heka_create_output failed");
+  e = lsb_heka_destroy_sandbox(hsb);
+  return NULL;
+}
+
+
 static char* test_decode_message()
 {
   lsb_heka_message m;
@@ -727,8 +809,20 @@ static char* test_read_message()
   int rv = lsb_heka_pm_analysis(hsb, &m, false);
   mu_assert(0 == rv, "expected: %d received: %d %s", 0, rv,
             lsb_heka_get_error(hsb));
-  e = lsb_heka_destroy_sandbox(hsb);
+
+  // the field value index belongs to the sandbox and must follow the message
+  char copy[sizeof(pb)];
+  memcpy(copy, pb, sizeof(pb));
+  lsb_heka_message m2;
+  mu_assert(!lsb_init_heka_message(&m2, 1), "failed to init message");
+  mu_assert(lsb_decode_heka_message(&m2, copy, sizeof(copy) - 1, &logger),
+            "failed");
   lsb_free_heka_message(&m);
+  rv = lsb_heka_pm_analysis(hsb, &m2, false);
+  mu_assert(0 == rv, "expected: %d received: %d %s", 0, rv,
+            lsb_heka_get_error(hsb));
+  e = lsb_heka_destroy_sandbox(hsb);
+  lsb_free_heka_message(&m2);
   return NULL;
 }
 
@@ -795,6 +889,69 @@ static char* test_read_message_zc()
 }
 
 
+static char* test_write_iov()
+{
+  lsb_heka_message m;
+  mu_assert(!lsb_init_heka_message(&m, 1), "failed to init message");
+  mu_assert(lsb_decode_heka_message(&m, pb, sizeof(pb) - 1, &logger), "failed");
+
+  lsb_heka_sandbox *hsb;
+  hsb = lsb_heka_create_output(NULL, "lua/write_iov.lua", NULL,
+                               "output_limit = 1024\n", &logger, ucp);
+  mu_assert(hsb, "lsb_heka_create_output failed");
+  int cnt;
+  mu_assert(!lsb_heka_get_iov(hsb, &cnt) && cnt == 0, "received: %d", cnt);
+
+  int rv = lsb_heka_pm_output(hsb, &m, NULL, false);
+  mu_assert(0 == rv, "expected: %d received: %d %s", 0, rv,
+            lsb_heka_get_error(hsb));
+  const lsb_heka_iovec *iov = lsb_heka_get_iov(hsb, &cnt);
+  mu_assert(iov && cnt == 7, "received: %d", cnt);
+  // the message bytes are referenced not copied
+  mu_assert(iov[1].iov_base == m.raw.s && iov[1].iov_len == m.raw.len,
+            "raw was copied");
+  mu_assert(iov[4].iov_base == m.payload.s, "payload was copied");
+
+  char header[LSB_MIN_HDR_SIZE];
+  size_t hlen = lsb_write_heka_header(header, m.raw.len);
+  char expected[512], received[512];
+  size_t elen = 0, rlen = 0;
+  memcpy(expected, header, hlen);
+  elen += hlen;
+  memcpy(expected + elen, m.raw.s, m.raw.len);
+  elen += m.raw.len;
+  memcpy(expected + elen, "|42payloadab", 12);
+  elen += 12;
+  for (int i = 0; i < cnt; ++i) {
+    mu_assert(rlen + iov[i].iov_len <= sizeof(received), "overflow");
+    memcpy(received + rlen, iov[i].iov_base, iov[i].iov_len);
+    rlen += iov[i].iov_len;
+  }
+  mu_assert(elen == rlen && memcmp(expected, received, elen) == 0,
+            "received: %.*s", (int)rlen, received);
+
+  // the next call resets the segments
+  mu_assert(0 == lsb_heka_timer_event(hsb, 0, false), "%s",
+            lsb_heka_get_error(hsb));
+  iov = lsb_heka_get_iov(hsb, &cnt);
+  mu_assert(iov && cnt == 1, "received: %d", cnt);
+  mu_assert(iov[0].iov_len == 5 && memcmp(iov[0].iov_base, "timer", 5) == 0,
+            "received: %.*s", (int)iov[0].iov_len, (char *)iov[0].iov_base);
+
+  lsb_heka_sandbox *ahsb;
+  ahsb = lsb_heka_create_analysis(NULL, "lua/analysis.lua", NULL, NULL,
+                                  &logger, aim);
+  mu_assert(!lsb_heka_get_iov(ahsb, &cnt) && cnt == 0, "received: %d", cnt);
+  mu_assert(!lsb_heka_get_iov(NULL, &cnt) && cnt == 0, "received: %d", cnt);
+  mu_assert(!lsb_heka_get_iov(hsb, NULL), "succeeded");
+  e = lsb_heka_destroy_sandbox(ahsb);
+  mu_assert(!e, "%s", e);
+  e = lsb_heka_destroy_sandbox(hsb);
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
 static char* test_get_message()
 {
   lsb_heka_sandbox *hsb;
@@ -844,6 +1001,103 @@ static char* benchmark_decode_message()
 }
 
 
+static char* benchmark_encode_message()
+{
+  int iter = 100000;
+  const char *cfgs[] = {
+    "benchmark = true\n",
+    "benchmark = true\nfixed_length_encoding = true\n"
+  };
+
+  lsb_heka_message m;
+  mu_assert(!lsb_init_heka_message(&m, 1), "failed to init message");
+  for (int i = 0; i < 2; ++i) {
+    lsb_heka_sandbox *hsb;
+    hsb = lsb_heka_create_output(NULL, "lua/encode_message_fixed.lua", NULL,
+                                 cfgs[i], &logger, ucp);
+    mu_assert(hsb, "lsb_heka_create_output failed");
+    clock_t t = clock();
+    for (int x = 0; x < iter; ++x) {
+      mu_assert(0 == lsb_heka_pm_output(hsb, &m, NULL, false), "%s",
+                lsb_heka_get_error(hsb));
+    }
+    t = clock() - t;
+    printf("benchmark_encode_message() %s %g seconds\n",
+           i ? "reserved lengths" : "updated lengths",
+           ((double)t) / CLOCKS_PER_SEC / iter);
+    e = lsb_heka_destroy_sandbox(hsb);
+  }
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
+static char* benchmark_read_message_cfg(const char *name, const char *cfg)
+{
+  int iter = 1000000;
+
+  lsb_heka_message m;
+  mu_assert(!lsb_init_heka_message(&m, 8), "failed to init message");
+  mu_assert(lsb_decode_heka_message(&m, pb, sizeof(pb) - 1, &logger), "failed");
+  lsb_heka_sandbox *hsb;
+  hsb = lsb_heka_create_output(NULL, "lua/decode_message_benchmark.lua", NULL,
+                               cfg, &logger, ucp);
+  mu_assert(hsb, "lsb_heka_create_output failed");
+  clock_t t = clock();
+  for (int x = 0; x < iter; ++x) {
+    mu_assert(0 == lsb_heka_pm_output(hsb, &m, NULL, false), "%s",
+              lsb_heka_get_error(hsb));
+  }
+  t = clock() - t;
+  printf("%s() %g seconds\n", name, ((double)t) / CLOCKS_PER_SEC / iter);
+
+  e = lsb_heka_destroy_sandbox(hsb);
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
+static char* benchmark_decode_message_lazy()
+{
+  return benchmark_read_message_cfg(__func__,
+                                    "benchmark = 'decode_message_lazy'");
+}
+
+
+static char* benchmark_decode_message_lazy_headers()
+{
+  return benchmark_read_message_cfg(
+      __func__, "benchmark = 'decode_message_lazy_headers'");
+}
+
+
+static char* benchmark_read_message()
+{
+  return benchmark_read_message_cfg(__func__, "benchmark = 'read_message'");
+}
+
+
+static char* benchmark_message_accessor()
+{
+  return benchmark_read_message_cfg(__func__,
+                                    "benchmark = 'message_accessor'");
+}
+
+
+static char* benchmark_message_projection()
+{
+  return benchmark_read_message_cfg(__func__,
+                                    "benchmark = 'message_projection'");
+}
+
+
+static char* benchmark_message_projection_table()
+{
+  return benchmark_read_message_cfg(__func__,
+                                    "benchmark = 'message_projection_table'");
+}
+
+
 static char* all_tests()
 {
 #ifdef HAVE_CLOCK_GETTIME
@@ -867,14 +1121,24 @@ static char* all_tests()
   mu_run_test(test_im_input);
   mu_run_test(test_im_analysis);
   mu_run_test(test_im_output);
+  mu_run_test(test_im_ring_buffer);
   mu_run_test(test_encode_message);
+  mu_run_test(test_encode_message_fixed);
   mu_run_test(test_decode_message);
   mu_run_test(test_read_message);
   mu_run_test(test_read_message_zc);
+  mu_run_test(test_write_iov);
   mu_run_test(test_get_message);
   mu_run_test(test_get_type);
 
+  mu_run_test(benchmark_encode_message);
   mu_run_test(benchmark_decode_message);
+  mu_run_test(benchmark_decode_message_lazy);
+  mu_run_test(benchmark_decode_message_lazy_headers);
+  mu_run_test(benchmark_read_message);
+  mu_run_test(benchmark_message_accessor);
+  mu_run_test(benchmark_message_projection);
+  mu_run_test(benchmark_message_projection_table);
   return NULL;
 }
 
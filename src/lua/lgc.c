@@ -609,7 +609,15 @@ static l_mem singlestep (lua_State *L) {
 
 void luaC_step (lua_State *L) {
   global_State *g = G(L);
-  l_mem lim = (GCSTEPSIZE/100) * g->gcstepmul;
+  l_mem lim;
+  if (g->emergencygc) {
+    /* the allocator cannot collect safely; it defers to this safe point */
+    lua_CFunction f = g->emergencygc;
+    g->emergencygc = NULL;
+    f(L);
+    return;
+  }
+  lim = (GCSTEPSIZE/100) * g->gcstepmul;
   if (lim == 0)
     lim = (MAX_LUMEM-1)/2;  /* no limit */
   g->gcdept += g->totalbytes - g->GCthreshold;
@@ -6,6 +6,7 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #define lmathlib_c
@@ -16,6 +17,9 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#include "luasandbox.h"
+#include "luasandbox/util/random.h"
+
 
 #undef PI
 #define PI (3.14159265358979323846)
@@ -178,10 +182,11 @@ static int math_max (lua_State *L) {
 }
 
 
+/* the generator state is an upvalue: the sandbox's own generator when
+   available otherwise a private one owned by the library */
 static int math_random (lua_State *L) {
-  /* the `%' avoids the (rare) case of r==1, and is needed also because on
-     some systems (SunOS!) `rand()' may return a value larger than RAND_MAX */
-  lua_Number r = (lua_Number)(rand()%RAND_MAX) / (lua_Number)RAND_MAX;
+  lsb_prng *p = (lsb_prng *)lua_touserdata(L, lua_upvalueindex(1));
+  lua_Number r = (lua_Number)lsb_prng_double(p);  /* [0,1) */
   switch (lua_gettop(L)) {  /* check number of arguments */
     case 0: {  /* no arguments */
       lua_pushnumber(L, r);  /* Number between 0 and 1 */
@@ -207,7 +212,16 @@ static int math_random (lua_State *L) {
 
 
 static int math_randomseed (lua_State *L) {
-  srand(luaL_checkint(L, 1));
+  lsb_prng *p = (lsb_prng *)lua_touserdata(L, lua_upvalueindex(1));
+  lua_Number n = luaL_checknumber(L, 1);
+  uint64_t seed;
+  if (n >= -9223372036854775808.0 && n < 9223372036854775808.0) {
+    seed = (uint64_t)(long long)n;
+  }
+  else {  /* NaN, infinite or out of range: seed with the bit pattern */
+    memcpy(&seed, &n, sizeof(seed));
+  }
+  lsb_prng_seed(p, seed);
   return 0;
 }
 
@@ -248,8 +262,6 @@ static const luaL_Reg mathlib[] = {
   {"modf",   math_modf},
   {"pow",   math_pow},
   {"rad",   math_rad},
-  {"random",     math_random},
-  {"randomseed", math_randomseed},
   {"sinh",   math_sinh},
   {"sin",   math_sin},
   {"sqrt",  math_sqrt},
@@ -264,6 +276,16 @@ static const luaL_Reg mathlib[] = {
 */
 LUALIB_API int luaopen_math (lua_State *L) {
   luaL_register(L, LUA_MATHLIBNAME, mathlib);
+  lua_getfield(L, LUA_REGISTRYINDEX, LSB_PRNG);
+  if (!lua_islightuserdata(L, -1)) {
+    lua_pop(L, 1);
+    lsb_prng_seed_random((lsb_prng *)lua_newuserdata(L, sizeof(lsb_prng)));
+  }
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, math_random, 1);
+  lua_setfield(L, -3, "random");
+  lua_pushcclosure(L, math_randomseed, 1);
+  lua_setfield(L, -2, "randomseed");
   lua_pushnumber(L, PI);
   lua_setfield(L, -2, "pi");
   lua_pushnumber(L, HUGE_VAL);
@@ -21,10 +21,14 @@
 #include "luasandbox/lua.h"
 #include "luasandbox/lualib.h"
 #include "luasandbox/util/output_buffer.h"
+#include "luasandbox/util/random.h"
+#include "luasandbox_bytecode.h"
 #include "luasandbox_defines.h"
 #include "luasandbox_impl.h"
 #include "luasandbox_serialize.h"
 
+#include "lua/lstate.h"
+
 lsb_err_id LSB_ERR_INIT       = "already initialized";
 lsb_err_id LSB_ERR_LUA        = "lua error"; // use lsb_get_error for details
 lsb_err_id LSB_ERR_TERMINATED = "sandbox already terminated";
@@ -63,6 +67,56 @@ static void preload_modules(lua_State *lua)
 }
 
 
+// Re-arms the soft limit half way between the live set and the hard limit (and
+// never below the configured soft limit) so a live set sitting near the soft
+// limit does not collect continuously.
+static void set_gc_trigger(lsb_lua_sandbox *lsb, size_t live)
+{
+  size_t soft = lsb->usage[LSB_UT_SOFT_GC][LSB_US_LIMIT];
+  size_t hard = lsb->usage[LSB_UT_MEMORY][LSB_US_LIMIT];
+  size_t ceiling = hard > live ? hard : live * 2;
+  size_t trigger = live + (ceiling - live) / 2;
+  lsb->gc_trigger = trigger > soft ? trigger : soft;
+}
+
+
+static int soft_limit_gc(lua_State *lua)
+{
+  void *ud = NULL;
+  lua_getallocf(lua, &ud);
+  lsb_lua_sandbox *lsb = ud;
+
+  size_t before = lsb->usage[LSB_UT_MEMORY][LSB_US_CURRENT];
+  unsigned long long start = lsb_get_time();
+  lua_gc(lua, LUA_GCCOLLECT, 0);
+  size_t pause = (size_t)(lsb_get_time() - start);
+  size_t live = lsb->usage[LSB_UT_MEMORY][LSB_US_CURRENT];
+
+  size_t freed = before > live ? before - live : 0;
+  lsb->usage[LSB_UT_SOFT_GC][LSB_US_CURRENT]++;
+  if (freed > lsb->usage[LSB_UT_SOFT_GC][LSB_US_MAXIMUM]) {
+    lsb->usage[LSB_UT_SOFT_GC][LSB_US_MAXIMUM] = freed;
+  }
+  lsb->usage[LSB_UT_GC_PAUSE][LSB_US_CURRENT] = pause;
+  if (pause > lsb->usage[LSB_UT_GC_PAUSE][LSB_US_MAXIMUM]) {
+    lsb->usage[LSB_UT_GC_PAUSE][LSB_US_MAXIMUM] = pause;
+  }
+  set_gc_trigger(lsb, live);
+  return 0;
+}
+
+
+// A collection cannot run inside the allocator (the caller may be holding
+// unanchored objects) so it is requested for the next luaC_checkGC safe point.
+static void request_soft_limit_gc(lsb_lua_sandbox *lsb)
+{
+  global_State *g = G(lsb->lua);
+  if (g->emergencygc || g->GCthreshold == MAX_LUMEM) return; // pending/stopped
+  g->emergencygc = soft_limit_gc;
+  g->GCthreshold = 0;
+}
+
+
 /**
 * Implementation of the memory allocator for the Lua state.
 *
@@ -98,6 +152,10 @@ static void* memory_manager(void *ud, void *ptr, size_t osize, size_t nsize)
           lsb->usage[LSB_UT_MEMORY][LSB_US_MAXIMUM] =
               lsb->usage[LSB_UT_MEMORY][LSB_US_CURRENT];
         }
+        if (lsb->gc_trigger && new_state_memory > lsb->gc_trigger
+            && lsb->lua) {
+          request_soft_limit_gc(lsb);
+        }
       }
     }
   }
@@ -107,7 +165,8 @@ static void* memory_manager(void *ud, void *ptr, size_t osize, size_t nsize)
 
 static size_t instruction_usage(lsb_lua_sandbox *lsb)
 {
-  return lua_gethookcount(lsb->lua) - lua_gethookcountremaining(lsb->lua);
+  return lsb->instructions + lua_gethookcount(lsb->lua)
+      - lua_gethookcountremaining(lsb->lua);
 }
 
 
@@ -119,6 +178,48 @@ static void instruction_manager(lua_State *lua, lua_Debug *ar)
 }
 
 
+// samples the stack every profile interval and enforces the instruction limit
+// in its place; the hook count is shortened for the final interval so the
+// limit is hit exactly
+static void profile_hook(lua_State *lua, lua_Debug *ar)
+{
+  if (LUA_HOOKCOUNT != ar->event) return;
+
+  void *ud = NULL;
+  lua_getallocf(lua, &ud);
+  lsb_lua_sandbox *lsb = ud;
+  lsb->instructions += (size_t)lua_gethookcount(lua);
+  lsb_profiler_sample(lsb->profiler, lua);
+
+  size_t limit = lsb->usage[LSB_UT_INSTRUCTION][LSB_US_LIMIT];
+  if (limit) {
+    if (lsb->instructions >= limit) {
+      luaL_error(lua, "instruction_limit exceeded");
+    }
+    size_t remaining = limit - lsb->instructions;
+    if (remaining < lsb_profiler_interval(lsb->profiler)) {
+      lua_sethook(lua, profile_hook, LUA_MASKCOUNT, (int)remaining);
+    }
+  }
+}
+
+
+static void set_instruction_hook(lsb_lua_sandbox *lsb)
+{
+  size_t limit = lsb->usage[LSB_UT_INSTRUCTION][LSB_US_LIMIT];
+  lsb->instructions = 0;
+  if (lsb->profiling) {
+    size_t interval = lsb_profiler_interval(lsb->profiler);
+    if (limit && limit < interval) interval = limit;
+    lua_sethook(lsb->lua, profile_hook, LUA_MASKCOUNT, (int)interval);
+  } else if (limit != 0) {
+    lua_sethook(lsb->lua, instruction_manager, LUA_MASKCOUNT, (int)limit);
+  } else {
+    lua_sethook(lsb->lua, NULL, 0, 0);
+  }
+}
+
+
 static int output(lua_State *lua)
 {
   lua_getfield(lua, LUA_REGISTRYINDEX, LSB_THIS_PTR);
@@ -319,9 +420,23 @@ static lua_State* load_sandbox_config(const char *cfg, lsb_logger *logger)
   ret = check_size(L, LUA_GLOBALSINDEX, LSB_MEMORY_LIMIT, 8 * 1024 * 1024);
   if (ret) goto cleanup;
 
+  ret = check_size(L, LUA_GLOBALSINDEX, LSB_SOFT_MEMORY_LIMIT, 0);
+  if (ret) goto cleanup;
+
+  size_t hard = get_size(L, LUA_GLOBALSINDEX, LSB_MEMORY_LIMIT);
+  if (hard && get_size(L, LUA_GLOBALSINDEX, LSB_SOFT_MEMORY_LIMIT) > hard) {
+    lua_pushfstring(L, "%s must be <= %s", LSB_SOFT_MEMORY_LIMIT,
+                    LSB_MEMORY_LIMIT);
+    ret = 1;
+    goto cleanup;
+  }
+
   ret = check_size(L, LUA_GLOBALSINDEX, LSB_INSTRUCTION_LIMIT, 1000000);
   if (ret) goto cleanup;
 
+  ret = check_size(L, LUA_GLOBALSINDEX, LSB_PROFILE_INTERVAL, 0);
+  if (ret) goto cleanup;
+
   ret = check_unsigned(L, LUA_GLOBALSINDEX, LSB_LOG_LEVEL, 3);
   if (ret) goto cleanup;
 
@@ -344,13 +459,92 @@ cleanup:
 }
 
 
-static void copy_table(lua_State *sb, lua_State *cfg, lsb_logger *logger)
+typedef struct config_value config_value;
+
+typedef struct config_table {
+  config_value  *items;
+  int           cnt;
+  int           narr; // integer keyed entries (presizing hint)
+} config_table;
+
+struct config_value {
+  char        *key;   // NULL for integer keys
+  int         ikey;
+  int         type;
+  union {
+    struct {
+      char    *s;
+      size_t  len;
+    } str;
+    lua_Number    n;
+    int           b;
+    config_table  t;
+  } u;
+};
+
+struct lsb_config {
+  config_table  root;
+  size_t        memory_limit;
+  size_t        soft_memory_limit;
+  size_t        instruction_limit;
+  size_t        profile_interval;
+  size_t        output_limit;
+  size_t        log_level;
+};
+
+
+static void free_config_table(config_table *t)
+{
+  for (int i = 0; i < t->cnt; ++i) {
+    config_value *v = &t->items[i];
+    free(v->key);
+    switch (v->type) {
+    case LUA_TSTRING:
+      free(v->u.str.s);
+      break;
+    case LUA_TTABLE:
+      free_config_table(&v->u.t);
+      break;
+    }
+  }
+  free(t->items);
+  t->items = NULL;
+  t->cnt = 0;
+}
+
+
+static char* dup_lstring(const char *s, size_t len)
+{
+  char *d = malloc(len + 1);
+  if (d) {
+    memcpy(d, s, len);
+    d[len] = 0;
+  }
+  return d;
+}
+
+
+/* Converts the table on the top of the cfg stack into an immutable C
+ * representation; returns false on allocation failure. */
+static bool copy_table(config_table *t, lua_State *cfg, lsb_logger *logger)
 {
-  lua_newtable(sb);
+  int size = 0;
+  lua_pushnil(cfg);
+  while (lua_next(cfg, -2) != 0) {
+    ++size;
+    lua_pop(cfg, 1);
+  }
+  if (size == 0) return true;
+
+  t->items = calloc(size, sizeof(config_value));
+  if (!t->items) return false;
+
   lua_pushnil(cfg);
   while (lua_next(cfg, -2) != 0) {
     int kt = lua_type(cfg, -2);
     int vt = lua_type(cfg, -1);
+    config_value *v = &t->items[t->cnt];
+    bool ok = true;
     switch (kt) {
     case LUA_TNUMBER:
     case LUA_TSTRING:
@@ -359,42 +553,41 @@ static void copy_table(lua_State *sb, lua_State *cfg, lsb_logger *logger)
         {
           size_t len;
           const char *tmp = lua_tolstring(cfg, -1, &len);
-          if (tmp) {
-            lua_pushlstring(sb, tmp, len);
-            if (kt == LUA_TSTRING) {
-              lua_setfield(sb, -2, lua_tostring(cfg, -2));
-            } else {
-              lua_rawseti(sb, -2, (int)lua_tointeger(cfg, -2));
-            }
-          }
+          v->u.str.s = dup_lstring(tmp, len);
+          v->u.str.len = len;
+          ok = v->u.str.s != NULL;
         }
         break;
       case LUA_TNUMBER:
-        lua_pushnumber(sb, lua_tonumber(cfg, -1));
-        if (kt == LUA_TSTRING) {
-          lua_setfield(sb, -2, lua_tostring(cfg, -2));
-        } else {
-          lua_rawseti(sb, -2, (int)lua_tointeger(cfg, -2));
-        }
+        v->u.n = lua_tonumber(cfg, -1);
         break;
       case LUA_TBOOLEAN:
-        lua_pushboolean(sb, lua_toboolean(cfg, -1));
-        if (kt == LUA_TSTRING) {
-          lua_setfield(sb, -2, lua_tostring(cfg, -2));
-        } else {
-          lua_rawseti(sb, -2, (int)lua_tointeger(cfg, -2));
-        }
+        v->u.b = lua_toboolean(cfg, -1);
         break;
       case LUA_TTABLE:
-        copy_table(sb, cfg, logger);
+        ok = copy_table(&v->u.t, cfg, logger);
         break;
       default:
         if (logger->cb) {
           logger->cb(logger->context, __func__, 4,
                      "skipping config value type: %s", lua_typename(cfg, vt));
         }
+        vt = LUA_TNONE;
         break;
       }
+      if (vt != LUA_TNONE) {
+        v->type = vt;
+        ++t->cnt;
+        if (kt == LUA_TSTRING) {
+          size_t len;
+          const char *key = lua_tolstring(cfg, -2, &len);
+          v->key = dup_lstring(key, len);
+          ok = ok && v->key != NULL;
+        } else {
+          v->ikey = (int)lua_tointeger(cfg, -2);
+          ++t->narr;
+        }
+      }
       break;
     default:
       if (logger->cb) {
@@ -404,44 +597,80 @@ static void copy_table(lua_State *sb, lua_State *cfg, lsb_logger *logger)
       break;
     }
     lua_pop(cfg, 1);
+    if (!ok) {
+      lua_pop(cfg, 1); // remove the key
+      return false;
+    }
   }
+  return true;
+}
 
-  switch (lua_type(cfg, -2)) {
-  case LUA_TSTRING:
-    lua_setfield(sb, -2, lua_tostring(cfg, -2));
-    break;
-  case LUA_TNUMBER:
-    lua_rawseti(sb, -2, (int)lua_tointeger(cfg, -2));
-    break;
+
+static void push_config_table(lua_State *lua, const config_table *t)
+{
+  lua_createtable(lua, t->narr, t->cnt - t->narr);
+  for (int i = 0; i < t->cnt; ++i) {
+    const config_value *v = &t->items[i];
+    switch (v->type) {
+    case LUA_TSTRING:
+      lua_pushlstring(lua, v->u.str.s, v->u.str.len);
+      break;
+    case LUA_TNUMBER:
+      lua_pushnumber(lua, v->u.n);
+      break;
+    case LUA_TBOOLEAN:
+      lua_pushboolean(lua, v->u.b);
+      break;
+    case LUA_TTABLE:
+      push_config_table(lua, &v->u.t);
+      break;
+    }
+    if (v->key) {
+      lua_setfield(lua, -2, v->key);
+    } else {
+      lua_rawseti(lua, -2, v->ikey);
+    }
   }
 }
 
 
-static void set_random_seed()
+lsb_config* lsb_create_config(const char *cfg, lsb_logger *logger)
 {
-  bool seeded = false;
-#ifdef _WIN32
-  // todo use CryptGenRandom to seed srand
-#else
-  FILE *fh = fopen("/dev/urandom", "r" CLOSE_ON_EXEC);
-  if (fh) {
-    unsigned seed;
-    unsigned char advance;
-    if (fread(&seed, sizeof(unsigned), 1, fh) == 1 &&
-        fread(&advance, sizeof(char), 1, fh) == 1) {
-      srand(seed);
-      // advance the sequence a random amount
-      for (unsigned i = 0; i < advance; ++i) {
-        rand();
-      }
-      seeded = true;
+  lsb_logger nl = { .context = NULL, .cb = NULL };
+  if (!logger) logger = &nl;
+
+  lua_State *lua_cfg = load_sandbox_config(cfg, logger);
+  if (!lua_cfg) return NULL;
+
+  lsb_config *c = calloc(1, sizeof(*c));
+  lua_pushvalue(lua_cfg, LUA_GLOBALSINDEX);
+  if (!c || !copy_table(&c->root, lua_cfg, logger)) {
+    if (logger->cb) {
+      logger->cb(logger->context, __func__, 3, "memory allocation failed");
     }
-    fclose(fh);
-  }
-#endif
-  if (!seeded) {
-    srand((unsigned)time(NULL));
+    lsb_destroy_config(c);
+    lua_close(lua_cfg);
+    return NULL;
   }
+  c->memory_limit = get_size(lua_cfg, LUA_GLOBALSINDEX, LSB_MEMORY_LIMIT);
+  c->soft_memory_limit = get_size(lua_cfg, LUA_GLOBALSINDEX,
+                                  LSB_SOFT_MEMORY_LIMIT);
+  c->instruction_limit = get_size(lua_cfg, LUA_GLOBALSINDEX,
+                                  LSB_INSTRUCTION_LIMIT);
+  c->profile_interval = get_size(lua_cfg, LUA_GLOBALSINDEX,
+                                 LSB_PROFILE_INTERVAL);
+  c->output_limit = get_size(lua_cfg, LUA_GLOBALSINDEX, LSB_OUTPUT_LIMIT);
+  c->log_level = get_size(lua_cfg, LUA_GLOBALSINDEX, LSB_LOG_LEVEL);
+  lua_close(lua_cfg);
+  return c;
+}
+
+
+void lsb_destroy_config(lsb_config *cfg)
+{
+  if (!cfg) return;
+  free_config_table(&cfg->root);
+  free(cfg);
 }
 
 
@@ -457,14 +686,33 @@ lsb_lua_sandbox* lsb_create(void *parent,
     return NULL;
   }
 
-  if (!lsb_set_tz(NULL)) {
+  lsb_config *c = lsb_create_config(cfg, logger);
+  if (!c) return NULL;
+  lsb_lua_sandbox *lsb = lsb_create_with_config(parent, lua_file, c, logger);
+  lsb_destroy_config(c);
+  return lsb;
+}
+
+
+lsb_lua_sandbox* lsb_create_with_config(void *parent,
+                                        const char *lua_file,
+                                        const lsb_config *cfg,
+                                        lsb_logger *logger)
+{
+  if (!lua_file || !cfg) {
     if (logger && logger->cb) {
-      logger->cb(logger->context, __func__, 3, "fail to set the TZ to UTC");
+      logger->cb(logger->context, __func__, 3, "%s must be specified",
+                 lua_file ? "cfg" : "lua_file");
     }
     return NULL;
   }
 
-  set_random_seed();
+  if (!lsb_process_init()) {
+    if (logger && logger->cb) {
+      logger->cb(logger->context, __func__, 3, "fail to set the TZ to UTC");
+    }
+    return NULL;
+  }
 
   lsb_lua_sandbox *lsb = calloc(1, sizeof(*lsb));
   if (!lsb) {
@@ -490,24 +738,18 @@ lsb_lua_sandbox* lsb_create(void *parent,
 
 
   // add the config to the lsb_config registry table
-  lua_State *lua_cfg = load_sandbox_config(cfg, &lsb->logger);
-  if (!lua_cfg) {
-    lua_close(lsb->lua);
-    free(lsb);
-    return NULL;
-  }
-  lua_pushnil(lua_cfg);
-  lua_pushvalue(lua_cfg, LUA_GLOBALSINDEX);
-  copy_table(lsb->lua, lua_cfg, &lsb->logger);
-  lua_pop(lua_cfg, 2);
-  lua_close(lua_cfg);
-  size_t ml = get_size(lsb->lua, -1, LSB_MEMORY_LIMIT);
-  size_t il = get_size(lsb->lua, -1, LSB_INSTRUCTION_LIMIT);
-  size_t ol = get_size(lsb->lua, -1, LSB_OUTPUT_LIMIT);
-  size_t log_level = get_size(lsb->lua, -1, LSB_LOG_LEVEL);
+  push_config_table(lsb->lua, &cfg->root);
+  size_t ml = cfg->memory_limit;
+  size_t il = cfg->instruction_limit;
+  size_t ol = cfg->output_limit;
+  size_t log_level = cfg->log_level;
   lua_setfield(lsb->lua, LUA_REGISTRYINDEX, LSB_CONFIG_TABLE);
   lua_pushlightuserdata(lsb->lua, lsb);
   lua_setfield(lsb->lua, LUA_REGISTRYINDEX, LSB_THIS_PTR);
+  lsb_prng_seed_random(&lsb->prng);
+  lua_pushlightuserdata(lsb->lua, &lsb->prng);
+  lua_setfield(lsb->lua, LUA_REGISTRYINDEX, LSB_PRNG);
+  lsb_bytecode_attach(lsb->lua);
   lua_pushcfunction(lsb->lua, &read_config);
   lua_setglobal(lsb->lua, "read_config");
 
@@ -517,6 +759,8 @@ lsb_lua_sandbox* lsb_create(void *parent,
 
   lsb->parent = parent;
   lsb->usage[LSB_UT_MEMORY][LSB_US_LIMIT] = ml;
+  lsb->usage[LSB_UT_SOFT_GC][LSB_US_LIMIT] = cfg->soft_memory_limit;
+  lsb->gc_trigger = cfg->soft_memory_limit;
   lsb->usage[LSB_UT_INSTRUCTION][LSB_US_LIMIT] = il;
   lsb->usage[LSB_UT_OUTPUT][LSB_US_LIMIT] = ol;
   lsb->state = LSB_UNKNOWN;
@@ -528,12 +772,19 @@ lsb_lua_sandbox* lsb_create(void *parent,
                            // when debugging
   }
 
-  if (!lsb->lua_file || lsb_init_output_buffer(&lsb->output, ol)) {
+  if (cfg->profile_interval) {
+    lsb->profiler = lsb_create_profiler((unsigned)cfg->profile_interval);
+    lsb->profiling = true;
+  }
+
+  if (!lsb->lua_file || lsb_init_output_buffer(&lsb->output, ol)
+      || (lsb->profiling && !lsb->profiler)) {
     if (lsb->logger.cb) {
       lsb->logger.cb(lsb->logger.context, __func__, 3, "memory allocation "
                      "failed");
     }
     lsb_free_output_buffer(&lsb->output);
+    lsb_destroy_profiler(lsb->profiler);
     free(lsb->lua_file);
     lua_close(lsb->lua);
     lsb->lua = NULL;
@@ -594,16 +845,12 @@ lsb_err_value lsb_init(lsb_lua_sandbox *lsb, const char *state_file)
   }
   lsb_add_function(lsb, output_print, "print");
 
-  if (lsb->usage[LSB_UT_INSTRUCTION][LSB_US_LIMIT] != 0) {
-    lua_sethook(lsb->lua, instruction_manager, LUA_MASKCOUNT,
-                (int)lsb->usage[LSB_UT_INSTRUCTION][LSB_US_LIMIT]);
-  } else {
-    lua_sethook(lsb->lua, NULL, 0, 0);
-  }
+  set_instruction_hook(lsb);
   lsb->usage[LSB_UT_MEMORY][LSB_US_LIMIT] = mem_limit;
   lua_CFunction pf = lua_atpanic(lsb->lua, unprotected_panic);
   int jump = setjmp(g_jbuf);
-  if (jump || luaL_dofile(lsb->lua, lsb->lua_file) != 0) {
+  if (jump || lsb_bytecode_loadfile(lsb->lua, lsb->lua_file)
+      || lua_pcall(lsb->lua, 0, LUA_MULTRET, 0)) {
     int len = snprintf(lsb->error_message, LSB_ERROR_SIZE, "%s",
                        lua_tostring(lsb->lua, -1));
     if (len >= LSB_ERROR_SIZE || len < 0) {
@@ -660,6 +907,45 @@ void lsb_stop_sandbox(lsb_lua_sandbox *lsb)
 }
 
 
+lsb_lua_sandbox* lsb_clone(lsb_lua_sandbox *proto, void *parent,
+                           const lsb_config *cfg, lsb_logger *logger)
+{
+  if (!proto || proto->state != LSB_RUNNING) {
+    if (logger && logger->cb) {
+      logger->cb(logger->context, __func__, 3, "the prototype must be "
+                 "running");
+    }
+    return NULL;
+  }
+
+  lsb_lua_sandbox *lsb = lsb_create_with_config(parent, proto->lua_file, cfg,
+                                                logger);
+  if (!lsb) return NULL;
+
+  size_t mem_limit = lsb->usage[LSB_UT_MEMORY][LSB_US_LIMIT];
+  lsb->usage[LSB_UT_MEMORY][LSB_US_LIMIT] = 0;
+  lsb_err_value ret = lsb_copy_heap(lsb, proto);
+  lsb->usage[LSB_UT_MEMORY][LSB_US_LIMIT] = mem_limit;
+  if (!ret && mem_limit
+      && lsb->usage[LSB_UT_MEMORY][LSB_US_CURRENT] > mem_limit) {
+    snprintf(lsb->error_message, LSB_ERROR_SIZE, "clone failed: "
+             "memory_limit exceeded");
+    ret = LSB_ERR_LUA;
+  }
+  if (ret) {
+    if (logger && logger->cb) {
+      logger->cb(logger->context, __func__, 3, "%s", lsb->error_message);
+    }
+    free(lsb_destroy(lsb));
+    return NULL;
+  }
+
+  set_instruction_hook(lsb);
+  lsb->state = LSB_RUNNING;
+  return lsb;
+}
+
+
 char* lsb_destroy(lsb_lua_sandbox *lsb)
 {
   char *err = NULL;
@@ -681,6 +967,7 @@ char* lsb_destroy(lsb_lua_sandbox *lsb)
   }
 
   lsb_free_output_buffer(&lsb->output);
+  lsb_destroy_profiler(lsb->profiler);
   free(lsb->state_file);
   free(lsb->lua_file);
   free(lsb);
@@ -763,12 +1050,7 @@ lsb_err_value lsb_pcall_setup(lsb_lua_sandbox *lsb, const char *func_name)
   if (!lsb || !func_name) return LSB_ERR_UTIL_NULL;
   if (lsb->state == LSB_TERMINATED) return LSB_ERR_TERMINATED;
 
-  if (lsb->usage[LSB_UT_INSTRUCTION][LSB_US_LIMIT] != 0) {
-    lua_sethook(lsb->lua, instruction_manager, LUA_MASKCOUNT,
-                (int)lsb->usage[LSB_UT_INSTRUCTION][LSB_US_LIMIT]);
-  } else {
-    lua_sethook(lsb->lua, NULL, 0, 0);
-  }
+  set_instruction_hook(lsb);
   lua_getglobal(lsb->lua, func_name);
   if (!lua_isfunction(lsb->lua, -1)) {
     int len = snprintf(lsb->error_message, LSB_ERROR_SIZE, "%s() not found",
@@ -796,6 +1078,43 @@ void lsb_pcall_teardown(lsb_lua_sandbox *lsb)
 }
 
 
+lsb_err_value lsb_start_profiler(lsb_lua_sandbox *lsb, unsigned interval)
+{
+  if (!lsb) return LSB_ERR_UTIL_NULL;
+  if (lsb->state == LSB_TERMINATED) return LSB_ERR_TERMINATED;
+
+  if (!lsb->profiler) {
+    lsb->profiler = lsb_create_profiler(interval);
+    if (!lsb->profiler) return LSB_ERR_UTIL_OOM;
+  } else {
+    lsb_profiler_set_interval(lsb->profiler, interval);
+  }
+  lsb->profiling = true;
+  return NULL;
+}
+
+
+void lsb_stop_profiler(lsb_lua_sandbox *lsb)
+{
+  if (lsb) lsb->profiling = false;
+}
+
+
+lsb_err_value lsb_get_profile(lsb_lua_sandbox *lsb, lsb_output_buffer *ob)
+{
+  if (!lsb || !ob) return LSB_ERR_UTIL_NULL;
+  if (!lsb->lua) return LSB_ERR_TERMINATED;
+  if (!lsb->profiler) return NULL;
+  return lsb_profiler_output(lsb->profiler, lsb->lua, ob);
+}
+
+
+void lsb_reset_profile(lsb_lua_sandbox *lsb)
+{
+  if (lsb && lsb->profiler) lsb_profiler_reset(lsb->profiler, lsb->lua);
+}
+
+
 void lsb_terminate(lsb_lua_sandbox *lsb, const char *err)
 {
   if (!lsb) return;
@@ -0,0 +1,433 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Sandbox bytecode cache implementation @file */
+
+#include "luasandbox_bytecode.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "luasandbox.h"
+#include "luasandbox/lauxlib.h"
+#include "luasandbox/util/random.h"
+#include "luasandbox/util/util.h"
+#include "luasandbox_defines.h"
+
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+#define FILE_MAGIC  "lsbluac1"
+
+// entries are immutable once published; the slot table is open addressed and
+// only ever transitions from NULL to an entry so readers need no lock. The
+// source is kept so a hash collision can never return another chunk.
+typedef struct cache_entry {
+  uint64_t  hash;
+  size_t    src_len;
+  size_t    len;
+  char      *name;
+  char      *src;
+  char      data[];
+} cache_entry;
+
+// persisted chunk: the header, the source and then the bytecode
+typedef struct file_header {
+  char      magic[8];
+  uint64_t  src_len;
+} file_header;
+
+struct lsb_bytecode_cache {
+  char                    *dir;
+  size_t                  mask;
+  lsb_atomic_u64          hits;
+  lsb_atomic_u64          misses;
+  lsb_atomic_ptr          *slots; // cache_entry *
+};
+
+typedef struct dump_buffer {
+  char    *buf;
+  size_t  len;
+  size_t  size;
+} dump_buffer;
+
+static lsb_atomic_ptr g_cache; // lsb_bytecode_cache *
+
+
+static uint64_t fnv1a(uint64_t h, const char *s, size_t len)
+{
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (unsigned char)s[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+
+static char* read_file(const char *fn, size_t *len)
+{
+  char *str = NULL;
+  FILE *fh = fopen(fn, "rb" CLOSE_ON_EXEC);
+  if (!fh) return NULL;
+
+  if (fseek(fh, 0, SEEK_END)) goto cleanup;
+  long pos = ftell(fh);
+  if (pos == -1) goto cleanup;
+  rewind(fh);
+
+  str = malloc(pos + 1);
+  if (!str) goto cleanup;
+
+  if (fread(str, 1, pos, fh) == (size_t)pos) {
+    str[pos] = 0;
+    *len = (size_t)pos;
+  } else {
+    free(str);
+    str = NULL;
+  }
+
+cleanup:
+  fclose(fh);
+  return str;
+}
+
+
+#ifndef _WIN32
+// only files owned by this user and not writable by anyone else are loaded,
+// the bytecode is executed without verification
+static bool trusted(const struct stat *st, bool dir)
+{
+  return (dir ? S_ISDIR(st->st_mode) : S_ISREG(st->st_mode))
+      && st->st_uid == geteuid()
+      && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+
+static char* read_cache_file(const char *fn, size_t *len)
+{
+  int fd = open(fn, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) || !trusted(&st, false)) {
+    close(fd);
+    return NULL;
+  }
+
+  char *str = malloc((size_t)st.st_size + 1);
+  size_t pos = 0;
+  while (str && pos < (size_t)st.st_size) {
+    ssize_t n = read(fd, str + pos, (size_t)st.st_size - pos);
+    if (n <= 0) {
+      free(str);
+      str = NULL;
+    } else {
+      pos += (size_t)n;
+    }
+  }
+  close(fd);
+  if (str) {
+    str[pos] = 0;
+    *len = pos;
+  }
+  return str;
+}
+#endif
+
+
+static char* cache_path(const lsb_bytecode_cache *c, uint64_t hash)
+{
+  size_t len = strlen(c->dir) + 24;
+  char *path = malloc(len);
+  if (path) {
+    snprintf(path, len, "%s/%016llx.luac", c->dir, (unsigned long long)hash);
+  }
+  return path;
+}
+
+
+static bool matches(const cache_entry *e, uint64_t hash, const char *name,
+                    const char *src, size_t src_len)
+{
+  return e->hash == hash && e->src_len == src_len && !strcmp(e->name, name)
+      && !memcmp(e->src, src, src_len);
+}
+
+
+static const cache_entry* lookup(lsb_bytecode_cache *c, uint64_t hash,
+                                 const char *name, const char *src,
+                                 size_t src_len)
+{
+  size_t idx = (size_t)hash & c->mask;
+  for (size_t i = 0; i <= c->mask; ++i, idx = (idx + 1) & c->mask) {
+    cache_entry *e = lsb_atomic_load(&c->slots[idx]);
+    if (!e) return NULL;
+    if (matches(e, hash, name, src, src_len)) return e;
+  }
+  return NULL;
+}
+
+
+static cache_entry* create_entry(uint64_t hash, const char *name,
+                                 const char *src, size_t src_len,
+                                 const char *data, size_t len)
+{
+  size_t nlen = strlen(name) + 1;
+  cache_entry *e = malloc(sizeof(cache_entry) + len + nlen + src_len);
+  if (!e) return NULL;
+  e->hash = hash;
+  e->src_len = src_len;
+  e->len = len;
+  memcpy(e->data, data, len);
+  e->name = e->data + len;
+  memcpy(e->name, name, nlen);
+  e->src = e->name + nlen;
+  memcpy(e->src, src, src_len);
+  return e;
+}
+
+
+static void insert(lsb_bytecode_cache *c, cache_entry *ne)
+{
+  size_t idx = (size_t)ne->hash & c->mask;
+  for (size_t i = 0; i <= c->mask; ++i, idx = (idx + 1) & c->mask) {
+    if (lsb_atomic_cas_ptr(&c->slots[idx], NULL, ne)) return;
+    cache_entry *e = lsb_atomic_load(&c->slots[idx]); // never reset to NULL
+    if (matches(e, ne->hash, ne->name, ne->src, ne->src_len)) {
+      break; // another sandbox compiled it first
+    }
+  }
+  free(ne); // duplicate or the cache is full
+}
+
+
+#ifndef _WIN32
+static void write_cache_file(const lsb_bytecode_cache *c, uint64_t hash,
+                             const char *src, size_t src_len,
+                             const char *data, size_t len)
+{
+  char *path = cache_path(c, hash);
+  if (!path) return;
+  size_t tlen = strlen(path) + 18;
+  char *tmp = malloc(tlen);
+  if (tmp) {
+    snprintf(tmp, tlen, "%s.%016llx", path,
+             (unsigned long long)lsb_prng_next(lsb_prng_thread()));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR);
+    FILE *fh = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (fh) {
+      file_header hdr = { .magic = FILE_MAGIC, .src_len = src_len };
+      bool ok = fwrite(&hdr, sizeof(hdr), 1, fh) == 1
+          && fwrite(src, 1, src_len, fh) == src_len
+          && fwrite(data, 1, len, fh) == len;
+      ok = fclose(fh) == 0 && ok;
+      if (!ok || rename(tmp, path) != 0) {
+        remove(tmp);
+      }
+    } else if (fd >= 0) {
+      close(fd);
+      remove(tmp);
+    }
+    free(tmp);
+  }
+  free(path);
+}
+#endif
+
+
+static int dump_writer(lua_State *lua, const void *p, size_t sz, void *ud)
+{
+  (void)lua;
+  dump_buffer *db = ud;
+  if (db->len + sz > db->size) {
+    size_t size = db->size ? db->size * 2 : 1024;
+    while (size < db->len + sz) size *= 2;
+    char *buf = realloc(db->buf, size);
+    if (!buf) return 1;
+    db->buf = buf;
+    db->size = size;
+  }
+  memcpy(db->buf + db->len, p, sz);
+  db->len += sz;
+  return 0;
+}
+
+
+static int load_cached(lua_State *lua, lsb_bytecode_cache *c, uint64_t hash,
+                       const char *name, const char *src, size_t src_len)
+{
+  const cache_entry *e = lookup(c, hash, name, src, src_len);
+  if (e) {
+    if (!luaL_loadbuffer(lua, e->data, e->len, name)) return 0;
+    lua_pop(lua, 1); // error message
+    return 1;
+  }
+
+#ifdef _WIN32
+  return 1;
+#else
+  if (!c->dir) return 1;
+  char *path = cache_path(c, hash);
+  if (!path) return 1;
+  size_t len;
+  char *data = read_cache_file(path, &len);
+  free(path);
+  if (!data) return 1;
+
+  // the file must have been written for exactly this source
+  file_header hdr;
+  int ret = 1;
+  if (len >= sizeof(hdr)) {
+    memcpy(&hdr, data, sizeof(hdr));
+  }
+  if (len >= sizeof(hdr)
+      && !memcmp(hdr.magic, FILE_MAGIC, sizeof(hdr.magic))
+      && hdr.src_len == src_len
+      && len - sizeof(hdr) >= src_len
+      && !memcmp(data + sizeof(hdr), src, src_len)) {
+    const char *bc = data + sizeof(hdr) + src_len;
+    size_t bc_len = len - sizeof(hdr) - src_len;
+    ret = luaL_loadbuffer(lua, bc, bc_len, name);
+    if (!ret) {
+      cache_entry *ne = create_entry(hash, name, src, src_len, bc, bc_len);
+      if (ne) insert(c, ne);
+    } else {
+      lua_pop(lua, 1); // incompatible file, recompile it
+    }
+  }
+  free(data);
+  return ret;
+#endif
+}
+
+
+int lsb_bytecode_loadfile(lua_State *lua, const char *filename)
+{
+  lua_getfield(lua, LUA_REGISTRYINDEX, LSB_BYTECODE_CACHE);
+  lsb_bytecode_cache *c = lua_touserdata(lua, -1);
+  lua_pop(lua, 1);
+  if (!c) return luaL_loadfile(lua, filename);
+
+  // allocate the chunk name first so nothing can raise a Lua error while the
+  // source buffer is held
+  const char *name = lua_pushfstring(lua, "@%s", filename);
+  size_t len;
+  char *src = read_file(filename, &len);
+  const char *s = src;
+  if (src && len && *s == '#') { // skip the exec line, keep the line count
+    const char *nl = memchr(s, '\n', len);
+    size_t skip = nl ? (size_t)(nl - s) : len;
+    s += skip;
+    len -= skip;
+  }
+  if (!src || (len && *s == LUA_SIGNATURE[0])) { // error or precompiled
+    free(src);
+    lua_pop(lua, 1);
+    return luaL_loadfile(lua, filename);
+  }
+
+  uint64_t hash = fnv1a(fnv1a(FNV_OFFSET, name, strlen(name) + 1), s, len);
+  int ret = load_cached(lua, c, hash, name, s, len);
+  if (!ret) {
+    lsb_atomic_add_u64(&c->hits, 1);
+  } else {
+    lsb_atomic_add_u64(&c->misses, 1);
+    ret = luaL_loadbuffer(lua, s, len, name);
+    if (!ret) {
+      dump_buffer db = { .buf = NULL, .len = 0, .size = 0 };
+      if (!lua_dump(lua, dump_writer, &db)) {
+        cache_entry *ne = create_entry(hash, name, s, len, db.buf, db.len);
+        if (ne) insert(c, ne);
+#ifndef _WIN32
+        if (c->dir) write_cache_file(c, hash, s, len, db.buf, db.len);
+#endif
+      }
+      free(db.buf);
+    }
+  }
+  lua_remove(lua, -2); // chunk name
+  free(src);
+  return ret;
+}
+
+
+void lsb_bytecode_attach(lua_State *lua)
+{
+  lsb_bytecode_cache *c = lsb_atomic_load(&g_cache);
+  if (c) {
+    lua_pushlightuserdata(lua, c);
+    lua_setfield(lua, LUA_REGISTRYINDEX, LSB_BYTECODE_CACHE);
+  }
+}
+
+
+lsb_bytecode_cache* lsb_create_bytecode_cache(size_t max_entries,
+                                              const char *dir)
+{
+  if (max_entries == 0) return NULL;
+  if (dir) {
+#ifdef _WIN32
+    return NULL; // the directory ownership cannot be verified
+#else
+    struct stat st;
+    if (stat(dir, &st) || !trusted(&st, true)) return NULL;
+#endif
+  }
+
+  lsb_bytecode_cache *c = calloc(1, sizeof(*c));
+  if (!c) return NULL;
+
+  size_t size = lsb_lp2(max_entries) * 2; // keep the probe sequences short
+  c->slots = calloc(size, sizeof(*c->slots));
+  if (dir) {
+    c->dir = malloc(strlen(dir) + 1);
+    if (c->dir) strcpy(c->dir, dir);
+  }
+  if (!c->slots || (dir && !c->dir)) {
+    free(c->slots);
+    free(c->dir);
+    free(c);
+    return NULL;
+  }
+  c->mask = size - 1;
+  return c;
+}
+
+
+void lsb_destroy_bytecode_cache(lsb_bytecode_cache *c)
+{
+  if (!c) return;
+  lsb_atomic_cas_ptr(&g_cache, c, NULL);
+  for (size_t i = 0; i <= c->mask; ++i) {
+    free(lsb_atomic_load(&c->slots[i]));
+  }
+  free(c->slots);
+  free(c->dir);
+  free(c);
+}
+
+
+void lsb_set_bytecode_cache(lsb_bytecode_cache *c)
+{
+  lsb_atomic_store(&g_cache, c);
+}
+
+
+void lsb_get_bytecode_cache_stats(lsb_bytecode_cache *c,
+                                  unsigned long long *hits,
+                                  unsigned long long *misses)
+{
+  if (hits) *hits = c ? lsb_atomic_load(&c->hits) : 0;
+  if (misses) *misses = c ? lsb_atomic_load(&c->misses) : 0;
+}
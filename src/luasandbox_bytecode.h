@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** Sandbox bytecode cache internals @file */
+
+#ifndef luasandbox_bytecode_h_
+#define luasandbox_bytecode_h_
+
+#include "luasandbox/lua.h"
+
+#define LSB_BYTECODE_CACHE "lsb_bytecode_cache"
+
+/**
+ * Drop in replacement for luaL_loadfile. When the state has a bytecode cache
+ * (light userdata stored in the registry under LSB_BYTECODE_CACHE) the
+ * precompiled chunk is used if the file content has been seen before,
+ * otherwise the file is compiled and the result added to the cache.
+ *
+ * @param lua Lua state
+ * @param filename Lua source file
+ *
+ * @return int Same as luaL_loadfile
+ */
+int lsb_bytecode_loadfile(lua_State *lua, const char *filename);
+
+/**
+ * Stores the current process wide bytecode cache (if any) in the registry of a
+ * newly created sandbox state.
+ *
+ * @param lua Lua state
+ */
+void lsb_bytecode_attach(lua_State *lua);
+
+#endif
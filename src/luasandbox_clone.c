@@ -0,0 +1,330 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Sandbox heap cloning implementation @file */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "luasandbox/lauxlib.h"
+#include "luasandbox_bytecode.h"
+#include "luasandbox_impl.h"
+
+#include "lua/lfunc.h"
+#include "lua/lgc.h"
+#include "lua/lmem.h"
+#include "lua/lobject.h"
+#include "lua/lstate.h"
+#include "lua/lstring.h"
+#include "lua/ltable.h"
+
+typedef struct clone_ctx {
+  lua_State       *lua;
+  lsb_lua_sandbox *dst;
+  lsb_lua_sandbox *src;
+  Table           *shared_data_mt;
+  // maps a source object to its copy so shared references (tables, closures,
+  // upvalues and prototypes) stay shared and cycles terminate
+  lsb_ptr_map     map;
+} clone_ctx;
+
+static void copy_value(clone_ctx *c, TValue *d, const TValue *s);
+
+
+static void map_put(clone_ctx *c, const void *key, void *val)
+{
+  if (lsb_ptr_map_put(&c->map, key, val) < 0) {
+    luaL_error(c->lua, "clone failed: memory allocation failed");
+  }
+}
+
+
+static TString* copy_string(clone_ctx *c, const TString *ts)
+{
+  return luaS_newlstr(c->lua, getstr(ts), ts->tsv.len);
+}
+
+
+static Proto* copy_proto(clone_ctx *c, Proto *p)
+{
+  Proto *n = lsb_ptr_map_get(&c->map, p);
+  if (n) return n;
+
+  lua_State *L = c->lua;
+  n = luaF_newproto(L);
+  map_put(c, p, n);
+  // every array is allocated and initialized before its size is recorded so
+  // the prototype is always consistent if an allocation fails
+  n->code = luaM_newvector(L, p->sizecode, Instruction);
+  memcpy(n->code, p->code, p->sizecode * sizeof(Instruction));
+  n->sizecode = p->sizecode;
+
+  n->lineinfo = luaM_newvector(L, p->sizelineinfo, int);
+  memcpy(n->lineinfo, p->lineinfo, p->sizelineinfo * sizeof(int));
+  n->sizelineinfo = p->sizelineinfo;
+
+  n->k = luaM_newvector(L, p->sizek, TValue);
+  for (int i = 0; i < p->sizek; ++i) setnilvalue(&n->k[i]);
+  n->sizek = p->sizek;
+
+  n->p = luaM_newvector(L, p->sizep, Proto *);
+  for (int i = 0; i < p->sizep; ++i) n->p[i] = NULL;
+  n->sizep = p->sizep;
+
+  n->locvars = luaM_newvector(L, p->sizelocvars, LocVar);
+  for (int i = 0; i < p->sizelocvars; ++i) n->locvars[i].varname = NULL;
+  n->sizelocvars = p->sizelocvars;
+
+  n->upvalues = luaM_newvector(L, p->sizeupvalues, TString *);
+  for (int i = 0; i < p->sizeupvalues; ++i) n->upvalues[i] = NULL;
+  n->sizeupvalues = p->sizeupvalues;
+
+  n->linedefined = p->linedefined;
+  n->lastlinedefined = p->lastlinedefined;
+  n->nups = p->nups;
+  n->numparams = p->numparams;
+  n->is_vararg = p->is_vararg;
+  n->maxstacksize = p->maxstacksize;
+  if (p->source) n->source = copy_string(c, p->source);
+
+  for (int i = 0; i < p->sizek; ++i) {
+    copy_value(c, &n->k[i], &p->k[i]);
+  }
+  for (int i = 0; i < p->sizep; ++i) {
+    n->p[i] = copy_proto(c, p->p[i]);
+  }
+  for (int i = 0; i < p->sizelocvars; ++i) {
+    n->locvars[i].startpc = p->locvars[i].startpc;
+    n->locvars[i].endpc = p->locvars[i].endpc;
+    if (p->locvars[i].varname) {
+      n->locvars[i].varname = copy_string(c, p->locvars[i].varname);
+    }
+  }
+  for (int i = 0; i < p->sizeupvalues; ++i) {
+    if (p->upvalues[i]) n->upvalues[i] = copy_string(c, p->upvalues[i]);
+  }
+  return n;
+}
+
+
+static void fill_table(clone_ctx *c, Table *n, const Table *t,
+                       const char **skip)
+{
+  TValue k, v;
+  for (int i = 0; i < t->sizearray; ++i) {
+    if (ttisnil(&t->array[i])) continue;
+    copy_value(c, &v, &t->array[i]);
+    setobj(c->lua, luaH_setnum(c->lua, n, i + 1), &v);
+  }
+  for (int i = 0; i < sizenode(t); ++i) {
+    Node *nd = gnode(t, i);
+    if (ttisnil(gval(nd))) continue;
+    const TValue *key = key2tval(nd);
+    if (skip && ttisstring(key)) {
+      const char **s = skip;
+      while (*s && strcmp(*s, svalue(key))) ++s;
+      if (*s) continue;
+    }
+    copy_value(c, &k, key);
+    copy_value(c, &v, gval(nd));
+    setobj(c->lua, luaH_set(c->lua, n, &k), &v);
+  }
+  n->flags = 0; // clear the metamethod absence cache
+}
+
+
+static Table* copy_table(clone_ctx *c, Table *t)
+{
+  Table *n = lsb_ptr_map_get(&c->map, t);
+  if (n) return n;
+
+  int nhash = 0;
+  for (int i = 0; i < sizenode(t); ++i) {
+    if (!ttisnil(gval(gnode(t, i)))) ++nhash;
+  }
+  n = luaH_new(c->lua, t->sizearray, nhash);
+  map_put(c, t, n);
+  if (t->metatable) n->metatable = copy_table(c, t->metatable);
+  fill_table(c, n, t, NULL);
+  return n;
+}
+
+
+static Closure* copy_closure(clone_ctx *c, Closure *cl)
+{
+  Closure *n = lsb_ptr_map_get(&c->map, cl);
+  if (n) return n;
+
+  lua_State *L = c->lua;
+  Table *env = hvalue(gt(L)); // placeholder until the real env is copied
+  if (cl->c.isC) {
+    n = luaF_newCclosure(L, cl->c.nupvalues, env);
+    n->c.f = cl->c.f;
+    for (int i = 0; i < cl->c.nupvalues; ++i) setnilvalue(&n->c.upvalue[i]);
+    map_put(c, cl, n);
+    n->c.env = copy_table(c, cl->c.env);
+    for (int i = 0; i < cl->c.nupvalues; ++i) {
+      copy_value(c, &n->c.upvalue[i], &cl->c.upvalue[i]);
+    }
+    return n;
+  }
+
+  Proto *p = copy_proto(c, cl->l.p);
+  n = luaF_newLclosure(L, cl->l.nupvalues, env);
+  n->l.p = p;
+  map_put(c, cl, n);
+  n->l.env = copy_table(c, cl->l.env);
+  // all upvalues are bound before any value is copied so the closure never
+  // holds a NULL upvalue
+  int nups = cl->l.nupvalues;
+  int fresh[LUAI_MAXUPVALUES];
+  for (int i = 0; i < nups; ++i) {
+    UpVal *uv = cl->l.upvals[i];
+    UpVal *nuv = lsb_ptr_map_get(&c->map, uv);
+    fresh[i] = nuv == NULL;
+    if (fresh[i]) {
+      if (uv->v != &uv->u.value) {
+        luaL_error(L, "clone failed: open upvalue");
+      }
+      nuv = luaF_newupval(L);
+      map_put(c, uv, nuv);
+    }
+    n->l.upvals[i] = nuv;
+  }
+  for (int i = 0; i < nups; ++i) {
+    if (fresh[i]) copy_value(c, n->l.upvals[i]->v, cl->l.upvals[i]->v);
+  }
+  return n;
+}
+
+
+// shared data is immutable so the clone gets its own handle to the same
+// mapping; any other userdata is opaque and cannot be copied
+static Udata* copy_userdata(clone_ctx *c, Udata *u)
+{
+  Udata *n = lsb_ptr_map_get(&c->map, u);
+  if (n) return n;
+
+  if (!c->shared_data_mt || u->uv.metatable != c->shared_data_mt) {
+    luaL_error(c->lua, "clone failed: cannot clone a userdata");
+  }
+  n = luaS_newudata(c->lua, sizeof(lsb_shared_data *), hvalue(gt(c->lua)));
+  lsb_shared_data **ud = (lsb_shared_data **)(n + 1);
+  *ud = NULL;
+  map_put(c, u, n);
+  n->uv.metatable = copy_table(c, u->uv.metatable);
+  n->uv.env = copy_table(c, u->uv.env);
+  lsb_shared_data *d = *(lsb_shared_data **)(u + 1);
+  if (d) {
+    lsb_shared_data_ref(d);
+    *ud = d;
+  }
+  return n;
+}
+
+
+static void copy_value(clone_ctx *c, TValue *d, const TValue *s)
+{
+  switch (ttype(s)) {
+  case LUA_TNIL:
+  case LUA_TBOOLEAN:
+  case LUA_TNUMBER:
+    setobj(c->lua, d, s);
+    break;
+  case LUA_TLIGHTUSERDATA:
+    {
+      // references to the prototype sandbox are redirected to the clone
+      void *p = pvalue(s);
+      if (p == c->src) {
+        p = c->dst;
+      } else if (p == &c->src->prng) {
+        p = &c->dst->prng;
+      }
+      setpvalue(d, p);
+    }
+    break;
+  case LUA_TSTRING:
+    setsvalue(c->lua, d, copy_string(c, rawtsvalue(s)));
+    break;
+  case LUA_TTABLE:
+    sethvalue(c->lua, d, copy_table(c, hvalue(s)));
+    break;
+  case LUA_TFUNCTION:
+    setclvalue(c->lua, d, copy_closure(c, clvalue(s)));
+    break;
+  case LUA_TUSERDATA:
+    setuvalue(c->lua, d, copy_userdata(c, rawuvalue(s)));
+    break;
+  default:
+    luaL_error(c->lua, "clone failed: cannot clone a %s",
+               lua_typename(c->lua, ttype(s)));
+    break;
+  }
+}
+
+
+static int copy_heap(lua_State *lua)
+{
+  clone_ctx *c = lua_touserdata(lua, 1);
+  lua_State *src = c->src->lua;
+  static const char *skip[] = { LSB_CONFIG_TABLE, LSB_THIS_PTR, LSB_PRNG,
+    LSB_BYTECODE_CACHE, NULL };
+
+  Table *sreg = hvalue(registry(src));
+  Table *dreg = hvalue(registry(lua));
+  Table *sgt = hvalue(gt(src));
+  Table *dgt = hvalue(gt(lua));
+  // located without touching the prototype's allocator
+  for (int i = 0; i < sizenode(sreg); ++i) {
+    Node *nd = gnode(sreg, i);
+    if (ttisstring(gkey(nd)) && ttistable(gval(nd))
+        && strcmp(getstr(rawtsvalue(gkey(nd))), LSB_SHARED_DATA) == 0) {
+      c->shared_data_mt = hvalue(gval(nd));
+      break;
+    }
+  }
+  map_put(c, sreg, dreg);
+  map_put(c, sgt, dgt);
+  fill_table(c, dreg, sreg, skip);
+  fill_table(c, dgt, sgt, NULL);
+  if (sgt->metatable) dgt->metatable = copy_table(c, sgt->metatable);
+  for (int i = 0; i < NUM_TAGS; ++i) {
+    Table *mt = G(src)->mt[i];
+    G(lua)->mt[i] = mt ? copy_table(c, mt) : NULL;
+  }
+  return 0;
+}
+
+
+lsb_err_value lsb_copy_heap(lsb_lua_sandbox *dst, lsb_lua_sandbox *src)
+{
+  // finish any pending cycle and stop the collector: while the copy is in
+  // progress objects are only reachable through the pointer map, and with the
+  // collector idle there are no black objects so no write barriers are needed
+  if (G(dst->lua)->gcstate != GCSpause) lua_gc(dst->lua, LUA_GCCOLLECT, 0);
+  lua_gc(dst->lua, LUA_GCSTOP, 0);
+
+  clone_ctx c = { .lua = dst->lua, .dst = dst, .src = src,
+    .shared_data_mt = NULL,
+    .map = { .keys = NULL, .vals = NULL, .size = 0, .cnt = 0 } };
+  lsb_err_value ret = NULL;
+  if (lua_cpcall(dst->lua, copy_heap, &c)) {
+    const char *err = lua_tostring(dst->lua, -1);
+    int len = snprintf(dst->error_message, LSB_ERROR_SIZE, "%s",
+                       err ? err : LSB_NIL_ERROR);
+    if (len >= LSB_ERROR_SIZE || len < 0) {
+      dst->error_message[LSB_ERROR_SIZE - 1] = 0;
+    }
+    lua_pop(dst->lua, 1);
+    ret = LSB_ERR_LUA;
+  }
+  lsb_free_ptr_map(&c.map);
+
+  // the copy creates no garbage so unlike lsb_init no full collection is
+  // needed; a failed clone may be inconsistent, it is only ever freed
+  if (!ret) lua_gc(dst->lua, LUA_GCRESTART, 0);
+  return ret;
+}
@@ -27,4 +27,82 @@
 #endif
 #endif
 
+/*
+ * Minimal atomics: C11 stdatomic where available and the Interlocked API on
+ * MSVC (whose volatile accesses have acquire/release semantics on x86/x64).
+ * Loads are acquire, stores are release and the read-modify-write operations
+ * are sequentially consistent.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+
+typedef volatile long lsb_atomic_int;
+typedef volatile size_t lsb_atomic_size;
+typedef volatile LONGLONG lsb_atomic_u64;
+typedef void * volatile lsb_atomic_ptr;
+
+#define lsb_atomic_load(p) (*(p))
+#define lsb_atomic_store(p, v) (*(p) = (v))
+
+static __inline bool
+lsb_atomic_cas_int(lsb_atomic_int *p, int expected, int desired)
+{
+  return InterlockedCompareExchange(p, desired, expected) == expected;
+}
+
+static __inline bool
+lsb_atomic_cas_ptr(lsb_atomic_ptr *p, void *expected, void *desired)
+{
+  return InterlockedCompareExchangePointer(p, desired, expected) == expected;
+}
+
+static __inline int lsb_atomic_add_int(lsb_atomic_int *p, int v)
+{
+  return InterlockedExchangeAdd(p, v);
+}
+
+static __inline unsigned long long
+lsb_atomic_add_u64(lsb_atomic_u64 *p, unsigned long long v)
+{
+  return (unsigned long long)InterlockedExchangeAdd64(p, (LONGLONG)v);
+}
+#else
+#include <stdatomic.h>
+
+typedef atomic_int lsb_atomic_int;
+typedef atomic_size_t lsb_atomic_size;
+typedef atomic_ullong lsb_atomic_u64;
+typedef _Atomic(void *) lsb_atomic_ptr;
+
+#define lsb_atomic_load(p) atomic_load_explicit((p), memory_order_acquire)
+#define lsb_atomic_store(p, v) \
+  atomic_store_explicit((p), (v), memory_order_release)
+
+static inline bool
+lsb_atomic_cas_int(lsb_atomic_int *p, int expected, int desired)
+{
+  return atomic_compare_exchange_strong(p, &expected, desired);
+}
+
+static inline bool
+lsb_atomic_cas_ptr(lsb_atomic_ptr *p, void *expected, void *desired)
+{
+  return atomic_compare_exchange_strong(p, &expected, desired);
+}
+
+static inline int lsb_atomic_add_int(lsb_atomic_int *p, int v)
+{
+  return atomic_fetch_add(p, v);
+}
+
+static inline unsigned long long
+lsb_atomic_add_u64(lsb_atomic_u64 *p, unsigned long long v)
+{
+  return atomic_fetch_add(p, v);
+}
+#endif
+
 #endif
@@ -0,0 +1,335 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Sandbox heap profile implementation @file */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luasandbox/lauxlib.h"
+#include "luasandbox/util/util.h"
+#include "luasandbox_defines.h"
+#include "luasandbox_impl.h"
+
+#include "lua/lfunc.h"
+#include "lua/lobject.h"
+#include "lua/lstate.h"
+#include "lua/lstring.h"
+#include "lua/ltable.h"
+#include "lua/ltm.h"
+
+#define WALK_MIN_SIZE 64
+
+// a table reached from the globals, its path is rebuilt from the parent chain
+typedef struct walk_node {
+  const Table *t;
+  size_t      parent;
+  TValue      key;
+} walk_node;
+
+typedef struct ranked_table {
+  size_t  idx;
+  size_t  bytes;
+  size_t  entries;
+} ranked_table;
+
+typedef struct heap_walk {
+  walk_node   *nodes;
+  size_t      cnt;
+  size_t      size;
+  lsb_ptr_map seen;
+} heap_walk;
+
+
+static lsb_atomic_ptr g_dummy_node;
+
+// every table with an empty hash part shares the static dummy node in
+// ltable.c; its address is taken once from a scratch state so the walk never
+// allocates from the sandbox being inspected
+static const Node* dummy_node(void)
+{
+  const Node *n = lsb_atomic_load(&g_dummy_node);
+  if (!n) {
+    lua_State *L = luaL_newstate();
+    if (!L) return NULL;
+    lua_createtable(L, 0, 0);
+    n = hvalue(L->top - 1)->node;
+    lua_close(L);
+    lsb_atomic_store(&g_dummy_node, (void *)n);
+  }
+  return n;
+}
+
+
+static size_t table_size(const Table *t, const Node *dummy)
+{
+  size_t size = sizeof(Table) + sizeof(TValue) * t->sizearray;
+  if (t->node != dummy) size += sizeof(Node) * sizenode(t);
+  return size;
+}
+
+
+static size_t thread_size(const lua_State *L)
+{
+  return sizeof(lua_State) + sizeof(TValue) * L->stacksize
+      + sizeof(CallInfo) * L->size_ci;
+}
+
+
+static size_t proto_size(const Proto *p)
+{
+  return sizeof(Proto) + sizeof(Instruction) * p->sizecode
+      + sizeof(Proto *) * p->sizep + sizeof(TValue) * p->sizek
+      + sizeof(int) * p->sizelineinfo + sizeof(LocVar) * p->sizelocvars
+      + sizeof(TString *) * p->sizeupvalues;
+}
+
+
+static void add_object(lsb_heap_stats *s, lsb_heap_type t, size_t bytes)
+{
+  s->count[t]++;
+  s->bytes[t] += bytes;
+}
+
+
+lsb_err_value lsb_get_heap_stats(lsb_lua_sandbox *lsb, bool collect,
+                                 lsb_heap_stats *stats)
+{
+  if (!lsb || !stats) return LSB_ERR_UTIL_NULL;
+  if (lsb->state == LSB_TERMINATED) return LSB_ERR_TERMINATED;
+  const Node *dummy = dummy_node();
+  if (!dummy) return LSB_ERR_UTIL_OOM;
+
+  if (collect) lua_gc(lsb->lua, LUA_GCCOLLECT, 0);
+  memset(stats, 0, sizeof(*stats));
+
+  global_State *g = G(lsb->lua);
+  for (GCObject *o = g->rootgc; o; o = o->gch.next) {
+    switch (o->gch.tt) {
+    case LUA_TTABLE:
+      add_object(stats, LSB_HT_TABLE, table_size(gco2h(o), dummy));
+      break;
+    case LUA_TFUNCTION:
+      {
+        Closure *cl = gco2cl(o);
+        add_object(stats, LSB_HT_FUNCTION, cl->c.isC
+                   ? (size_t)sizeCclosure(cl->c.nupvalues)
+                   : (size_t)sizeLclosure(cl->l.nupvalues));
+      }
+      break;
+    case LUA_TUSERDATA:
+      add_object(stats, LSB_HT_USERDATA, sizeudata(&rawgco2u(o)->uv));
+      break;
+    case LUA_TTHREAD:
+      {
+        lua_State *th = gco2th(o);
+        add_object(stats, LSB_HT_THREAD, thread_size(th));
+        for (GCObject *uv = th->openupval; uv; uv = uv->gch.next) {
+          add_object(stats, LSB_HT_UPVALUE, sizeof(UpVal));
+        }
+      }
+      break;
+    case LUA_TPROTO:
+      add_object(stats, LSB_HT_PROTO, proto_size(gco2p(o)));
+      break;
+    case LUA_TUPVAL:
+      add_object(stats, LSB_HT_UPVALUE, sizeof(UpVal));
+      break;
+    }
+  }
+  for (int i = 0; i < g->strt.size; ++i) {
+    for (GCObject *o = g->strt.hash[i]; o; o = o->gch.next) {
+      add_object(stats, LSB_HT_STRING, sizestring(&rawgco2ts(o)->tsv));
+    }
+  }
+
+  size_t accounted = 0;
+  for (int i = 0; i < LSB_HT_MAX; ++i) {
+    accounted += stats->bytes[i];
+  }
+  size_t total = lsb->usage[LSB_UT_MEMORY][LSB_US_CURRENT];
+  stats->other = total > accounted ? total - accounted : 0;
+  return NULL;
+}
+
+
+static int add_node(heap_walk *w, const Table *t, size_t parent,
+                    const TValue *key)
+{
+  int added = lsb_ptr_map_put(&w->seen, t, NULL);
+  if (added <= 0) return added;
+  if (w->cnt == w->size) {
+    size_t size = w->size ? w->size * 2 : WALK_MIN_SIZE;
+    walk_node *nodes = realloc(w->nodes, size * sizeof(walk_node));
+    if (!nodes) return -1;
+    w->nodes = nodes;
+    w->size = size;
+  }
+  walk_node *n = &w->nodes[w->cnt++];
+  n->t = t;
+  n->parent = parent;
+  n->key = *key;
+  return 1;
+}
+
+
+static size_t table_entries(const Table *t, const Node *dummy)
+{
+  size_t cnt = 0;
+  for (int i = 0; i < t->sizearray; ++i) {
+    if (!ttisnil(&t->array[i])) ++cnt;
+  }
+  if (t->node != dummy) {
+    for (int i = 0; i < sizenode(t); ++i) {
+      if (!ttisnil(gval(gnode(t, i)))) ++cnt;
+    }
+  }
+  return cnt;
+}
+
+
+static void append(char *buf, size_t size, size_t *pos, const char *s,
+                   size_t len)
+{
+  if (*pos >= size - 1) return;
+  size_t avail = size - 1 - *pos;
+  if (len > avail) len = avail;
+  memcpy(buf + *pos, s, len);
+  *pos += len;
+  buf[*pos] = 0;
+}
+
+
+// same naming as the preservation code: _G["key"][1]
+static void append_key(char *buf, size_t size, size_t *pos, const TValue *k)
+{
+  char tmp[64];
+  switch (ttype(k)) {
+  case LUA_TSTRING:
+    {
+      const TString *ts = rawtsvalue(k);
+      const char *s = getstr(ts);
+      append(buf, size, pos, "[\"", 2);
+      for (size_t i = 0; i < ts->tsv.len; ++i) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+          tmp[0] = '\\';
+          tmp[1] = (char)c;
+          append(buf, size, pos, tmp, 2);
+        } else if (c < 0x20 || c == 0x7f) {
+          int len = snprintf(tmp, sizeof(tmp), "\\%03d", c);
+          append(buf, size, pos, tmp, (size_t)len);
+        } else {
+          append(buf, size, pos, (const char *)&c, 1);
+        }
+      }
+      append(buf, size, pos, "\"]", 2);
+    }
+    break;
+  case LUA_TNUMBER:
+    {
+      int len = snprintf(tmp, sizeof(tmp), "[" LUA_NUMBER_FMT "]", nvalue(k));
+      append(buf, size, pos, tmp, (size_t)len);
+    }
+    break;
+  case LUA_TBOOLEAN:
+    append(buf, size, pos, bvalue(k) ? "[true]" : "[false]",
+           bvalue(k) ? 6 : 7);
+    break;
+  default:
+    {
+      int len = snprintf(tmp, sizeof(tmp), "[%s]", luaT_typenames[ttype(k)]);
+      append(buf, size, pos, tmp, (size_t)len);
+    }
+    break;
+  }
+}
+
+
+static void build_path(const heap_walk *w, size_t idx, char *buf, size_t size)
+{
+  size_t pos = 0;
+  buf[0] = 0;
+  append(buf, size, &pos, "_G", 2);
+
+  size_t depth = 0;
+  for (size_t i = idx; i != 0; i = w->nodes[i].parent) ++depth;
+  size_t *chain = malloc(depth * sizeof(size_t));
+  if (!chain) return;
+  for (size_t i = idx, d = depth; i != 0; i = w->nodes[i].parent) {
+    chain[--d] = i;
+  }
+  for (size_t d = 0; d < depth && pos < size - 1; ++d) {
+    append_key(buf, size, &pos, &w->nodes[chain[d]].key);
+  }
+  free(chain);
+}
+
+
+static void rank(ranked_table *ranked, size_t n, size_t *cnt,
+                 const ranked_table *rt)
+{
+  if (*cnt == n && ranked[n - 1].bytes >= rt->bytes) return;
+  size_t i = *cnt < n ? (*cnt)++ : n - 1;
+  for (; i > 0 && ranked[i - 1].bytes < rt->bytes; --i) {
+    ranked[i] = ranked[i - 1];
+  }
+  ranked[i] = *rt;
+}
+
+
+size_t lsb_get_largest_tables(lsb_lua_sandbox *lsb, lsb_heap_table *tables,
+                              size_t n)
+{
+  if (!lsb || !tables || !n || lsb->state == LSB_TERMINATED) return 0;
+  const Node *dummy = dummy_node();
+  if (!dummy) return 0;
+
+  ranked_table *ranked = malloc(n * sizeof(ranked_table));
+  if (!ranked) return 0;
+
+  // the walk uses the Lua internals directly so it never allocates from (or
+  // runs code in) the sandbox; objects cannot move while it is in progress
+  heap_walk w = { .nodes = NULL, .cnt = 0, .size = 0,
+    .seen = { .keys = NULL, .vals = NULL, .size = 0, .cnt = 0 } };
+  TValue nokey;
+  setnilvalue(&nokey);
+  size_t cnt = 0;
+  bool ok = add_node(&w, hvalue(gt(lsb->lua)), 0, &nokey) > 0;
+
+  for (size_t i = 0; ok && i < w.cnt; ++i) {
+    const Table *t = w.nodes[i].t;
+    ranked_table rt = { .idx = i, .bytes = table_size(t, dummy),
+      .entries = table_entries(t, dummy) };
+    rank(ranked, n, &cnt, &rt);
+    for (int j = 0; ok && j < t->sizearray; ++j) {
+      if (ttistable(&t->array[j])) {
+        TValue k;
+        setnvalue(&k, (lua_Number)(j + 1));
+        ok = add_node(&w, hvalue(&t->array[j]), i, &k) >= 0;
+      }
+    }
+    if (t->node == dummy) continue;
+    for (int j = 0; ok && j < sizenode(t); ++j) {
+      Node *nd = gnode(t, j);
+      if (ttistable(gval(nd))) {
+        ok = add_node(&w, hvalue(gval(nd)), i, key2tval(nd)) >= 0;
+      }
+    }
+  }
+
+  if (!ok) cnt = 0;
+  for (size_t i = 0; i < cnt; ++i) {
+    tables[i].bytes = ranked[i].bytes;
+    tables[i].entries = ranked[i].entries;
+    build_path(&w, ranked[i].idx, tables[i].path, sizeof(tables[i].path));
+  }
+  free(ranked);
+  free(w.nodes);
+  lsb_free_ptr_map(&w.seen);
+  return cnt;
+}
@@ -0,0 +1,84 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Lua sandbox private helpers @file */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "luasandbox_impl.h"
+
+#define PTR_MAP_MIN_SIZE 64
+
+
+static size_t ptr_hash(const void *p, size_t mask)
+{
+  uint64_t h = (uint64_t)(uintptr_t)p * 0x9E3779B97F4A7C15ULL;
+  return (size_t)(h >> 32) & mask;
+}
+
+
+static bool grow_ptr_map(lsb_ptr_map *m)
+{
+  size_t size = m->size ? m->size * 2 : PTR_MAP_MIN_SIZE;
+  const void **keys = calloc(size, sizeof(void *));
+  void **vals = malloc(size * sizeof(void *));
+  if (!keys || !vals) {
+    free(keys);
+    free(vals);
+    return false;
+  }
+  for (size_t i = 0; i < m->size; ++i) {
+    if (!m->keys[i]) continue;
+    size_t j = ptr_hash(m->keys[i], size - 1);
+    while (keys[j]) j = (j + 1) & (size - 1);
+    keys[j] = m->keys[i];
+    vals[j] = m->vals[i];
+  }
+  free(m->keys);
+  free(m->vals);
+  m->keys = keys;
+  m->vals = vals;
+  m->size = size;
+  return true;
+}
+
+
+void* lsb_ptr_map_get(const lsb_ptr_map *m, const void *key)
+{
+  if (!m->size) return NULL;
+  size_t mask = m->size - 1;
+  for (size_t i = ptr_hash(key, mask); m->keys[i]; i = (i + 1) & mask) {
+    if (m->keys[i] == key) return m->vals[i];
+  }
+  return NULL;
+}
+
+
+int lsb_ptr_map_put(lsb_ptr_map *m, const void *key, void *val)
+{
+  if ((m->cnt + 1) * 2 > m->size && !grow_ptr_map(m)) return -1;
+  size_t mask = m->size - 1;
+  size_t i = ptr_hash(key, mask);
+  for (; m->keys[i]; i = (i + 1) & mask) {
+    if (m->keys[i] == key) return 0;
+  }
+  m->keys[i] = key;
+  m->vals[i] = val;
+  m->cnt++;
+  return 1;
+}
+
+
+void lsb_free_ptr_map(lsb_ptr_map *m)
+{
+  free(m->keys);
+  free(m->vals);
+  m->keys = NULL;
+  m->vals = NULL;
+  m->size = 0;
+  m->cnt = 0;
+}
@@ -10,8 +10,21 @@
 #define luasandbox_impl_h_
 
 #include "luasandbox.h"
+#include "luasandbox_shared_data.h"
 #include "luasandbox/lua.h"
 #include "luasandbox/util/output_buffer.h"
+#include "luasandbox/util/random.h"
+
+typedef struct lsb_profiler lsb_profiler;
+
+// open addressed object pointer to value map (keys are never removed); used
+// by the heap walk, heap clone and profiler to track Lua objects
+typedef struct lsb_ptr_map {
+  const void  **keys;
+  void        **vals;
+  size_t      size;
+  size_t      cnt;
+} lsb_ptr_map;
 
 struct lsb_lua_sandbox {
   lua_State         *lua;
@@ -21,10 +34,130 @@ struct lsb_lua_sandbox {
   lsb_logger        logger;
   lsb_state         state;
   lsb_output_buffer output;
+  lsb_prng          prng;
+  size_t            gc_trigger;
+  lsb_profiler      *profiler;
+  bool              profiling;
+  size_t            instructions; // counted by completed profiler intervals
   size_t            usage[LSB_UT_MAX][LSB_US_MAX];
   char              error_message[LSB_ERROR_SIZE];
 };
 
+/**
+ * Deep copies the Lua heap of a running prototype sandbox into a freshly
+ * created one (everything except the config, this pointer, PRNG and bytecode
+ * cache registry entries).
+ *
+ * @param dst Newly created sandbox
+ * @param src Running prototype sandbox
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+lsb_err_value lsb_copy_heap(lsb_lua_sandbox *dst, lsb_lua_sandbox *src);
+
+/**
+ * Looks up a pointer in the map.
+ *
+ * @param m Map (zero initialized before first use)
+ * @param key Object pointer
+ *
+ * @return void* Value stored with the key, NULL if it is not present
+ */
+void* lsb_ptr_map_get(const lsb_ptr_map *m, const void *key);
+
+/**
+ * Adds a pointer to the map, growing it as needed; an existing entry is left
+ * unchanged.
+ *
+ * @param m Map (zero initialized before first use)
+ * @param key Object pointer (not NULL)
+ * @param val Value to store with the key
+ *
+ * @return int 1 if added, 0 if already present, -1 on allocation failure
+ */
+int lsb_ptr_map_put(lsb_ptr_map *m, const void *key, void *val);
+
+/**
+ * Releases the map storage (the values are not freed) and resets it to empty.
+ *
+ * @param m Map
+ */
+void lsb_free_ptr_map(lsb_ptr_map *m);
+
+#define LSB_SHARED_DATA "lsb.shared_data"
+
+#define LSB_PROFILE_INTERVAL_DEFAULT 10000
+
+/**
+ * Allocates an empty profile.
+ *
+ * @param interval Number of instructions between samples (0 for the default)
+ *
+ * @return lsb_profiler* NULL on failure
+ */
+lsb_profiler* lsb_create_profiler(unsigned interval);
+
+/**
+ * Frees the profile.
+ *
+ * @param p Profiler
+ */
+void lsb_destroy_profiler(lsb_profiler *p);
+
+/**
+ * Returns the sampling interval in instructions.
+ *
+ * @param p Profiler
+ *
+ * @return unsigned
+ */
+unsigned lsb_profiler_interval(const lsb_profiler *p);
+
+/**
+ * Changes the sampling interval (takes effect when the hook is next set).
+ *
+ * @param p Profiler
+ * @param interval Number of instructions between samples (0 for the default)
+ */
+void lsb_profiler_set_interval(lsb_profiler *p, unsigned interval);
+
+/**
+ * Records the current call stack of the Lua state (called from the count
+ * hook).
+ *
+ * @param p Profiler
+ * @param lua Lua state being executed
+ */
+void lsb_profiler_sample(lsb_profiler *p, lua_State *lua);
+
+/**
+ * Writes the profile in the folded stack format.
+ *
+ * @param p Profiler
+ * @param lua Lua state used to resolve the function names
+ * @param ob Output buffer
+ *
+ * @return lsb_err_value NULL on success error message on failure
+ */
+lsb_err_value lsb_profiler_output(lsb_profiler *p, lua_State *lua,
+                                  lsb_output_buffer *ob);
+
+/**
+ * Discards all samples and releases the functions pinned by them.
+ *
+ * @param p Profiler
+ * @param lua Lua state the samples were taken from (NULL if it is closed)
+ */
+void lsb_profiler_reset(lsb_profiler *p, lua_State *lua);
+
+/**
+ * Adds a reference to the shared data mapping (released by
+ * lsb_close_shared_data).
+ *
+ * @param d Shared data
+ */
+void lsb_shared_data_ref(lsb_shared_data *d);
+
 /**
  * Serialize all user global data to disk.
  *
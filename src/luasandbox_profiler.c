@@ -0,0 +1,345 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Sandbox sampling profiler implementation @file */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luasandbox/util/output_buffer.h"
+#include "luasandbox_impl.h"
+
+#include "lua/lobject.h"
+#include "lua/lstate.h"
+#include "lua/ltable.h"
+
+#define FNV_OFFSET        0xcbf29ce484222325ULL
+#define FNV_PRIME         0x100000001b3ULL
+#define PROFILE_MAX_DEPTH 64
+#define PROFILE_MAX_STACKS 4096
+
+// a frame is identified by its function prototype (Lua) or function pointer
+// (C); the label is captured when it is first sampled. A closure of every
+// sampled prototype is pinned in the registry until the profile is reset so
+// the address cannot be reused by another function in the meantime.
+
+typedef struct stack_entry {
+  uint64_t    hash;
+  size_t      count;
+  unsigned    depth;
+  const void  *ids[]; // leaf first
+} stack_entry;
+
+struct lsb_profiler {
+  unsigned    interval;
+  size_t      samples;
+  size_t      dropped;
+  lsb_ptr_map frames; // id -> label
+  stack_entry **stacks;
+  size_t      stacks_cnt;
+};
+
+
+// frees the labels of a frame or name map
+static void free_labels(lsb_ptr_map *m)
+{
+  for (size_t i = 0; i < m->size; ++i) {
+    if (m->keys[i]) free(m->vals[i]);
+  }
+  lsb_free_ptr_map(m);
+}
+
+
+static bool add_frame(lsb_profiler *p, const void *id, const Closure *cl)
+{
+  char label[LUA_IDSIZE + 32];
+  if (cl->c.isC) {
+    snprintf(label, sizeof(label), "[C]");
+  } else {
+    char src[LUA_IDSIZE];
+    luaO_chunkid(src, getstr(cl->l.p->source), LUA_IDSIZE);
+    if (cl->l.p->linedefined == 0) {
+      snprintf(label, sizeof(label), "%s:main", src);
+    } else {
+      snprintf(label, sizeof(label), "%s:%d", src, cl->l.p->linedefined);
+    }
+  }
+  size_t len = strlen(label) + 1;
+  char *copy = malloc(len);
+  if (!copy) return false;
+  memcpy(copy, label, len);
+  if (lsb_ptr_map_put(&p->frames, id, copy) < 0) {
+    free(copy);
+    return false;
+  }
+  return true;
+}
+
+
+typedef struct pin_request {
+  lsb_profiler  *p;
+  Closure       *cl;
+} pin_request;
+
+
+static int pin_closure(lua_State *lua)
+{
+  pin_request *pr = lua_touserdata(lua, 1);
+  lua_pushlightuserdata(lua, pr->p);
+  lua_rawget(lua, LUA_REGISTRYINDEX);
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    lua_newtable(lua);
+    lua_pushlightuserdata(lua, pr->p);
+    lua_pushvalue(lua, -2);
+    lua_rawset(lua, LUA_REGISTRYINDEX);
+  }
+  setclvalue(lua, lua->top, pr->cl);
+  lua->top++;
+  lua_pushboolean(lua, 1);
+  lua_rawset(lua, -3);
+  return 0;
+}
+
+
+// runs protected (it is called from the hook), a memory error only drops the
+// sample
+static bool pin_frame(lsb_profiler *p, lua_State *lua, const Closure *cl)
+{
+  if (cl->c.isC) return true; // C function addresses are never reused
+  pin_request pr = { .p = p, .cl = (Closure *)cl };
+  if (lua_cpcall(lua, pin_closure, &pr)) {
+    lua_pop(lua, 1); // error message
+    return false;
+  }
+  return true;
+}
+
+
+static stack_entry* find_stack(lsb_profiler *p, uint64_t hash,
+                               const void **ids, unsigned depth, size_t *idx)
+{
+  size_t mask = PROFILE_MAX_STACKS * 2 - 1;
+  size_t i = (size_t)hash & mask;
+  for (; p->stacks[i]; i = (i + 1) & mask) {
+    stack_entry *e = p->stacks[i];
+    if (e->hash == hash && e->depth == depth
+        && memcmp(e->ids, ids, depth * sizeof(void *)) == 0) {
+      return e;
+    }
+  }
+  *idx = i;
+  return NULL;
+}
+
+
+lsb_profiler* lsb_create_profiler(unsigned interval)
+{
+  lsb_profiler *p = calloc(1, sizeof(lsb_profiler));
+  if (!p) return NULL;
+  p->interval = interval ? interval : LSB_PROFILE_INTERVAL_DEFAULT;
+  p->stacks = calloc(PROFILE_MAX_STACKS * 2, sizeof(stack_entry *));
+  if (!p->stacks) {
+    free(p);
+    return NULL;
+  }
+  return p;
+}
+
+
+static void clear_profile(lsb_profiler *p)
+{
+  for (size_t i = 0; i < PROFILE_MAX_STACKS * 2; ++i) {
+    free(p->stacks[i]);
+    p->stacks[i] = NULL;
+  }
+  free_labels(&p->frames);
+  p->stacks_cnt = 0;
+  p->samples = 0;
+  p->dropped = 0;
+}
+
+
+void lsb_destroy_profiler(lsb_profiler *p)
+{
+  if (!p) return;
+  clear_profile(p);
+  free(p->stacks);
+  free(p);
+}
+
+
+unsigned lsb_profiler_interval(const lsb_profiler *p)
+{
+  return p->interval;
+}
+
+
+void lsb_profiler_set_interval(lsb_profiler *p, unsigned interval)
+{
+  p->interval = interval ? interval : LSB_PROFILE_INTERVAL_DEFAULT;
+}
+
+
+void lsb_profiler_sample(lsb_profiler *p, lua_State *lua)
+{
+  const void *ids[PROFILE_MAX_DEPTH];
+  const Closure *cls[PROFILE_MAX_DEPTH];
+  unsigned depth = 0;
+  uint64_t hash = FNV_OFFSET;
+
+  // walk the call info directly (leaf first); lua_getstack/lua_getinfo would
+  // format every frame on every sample
+  for (CallInfo *ci = lua->ci; ci > lua->base_ci && depth < PROFILE_MAX_DEPTH;
+       --ci) {
+    if (!ttisfunction(ci->func)) continue;
+    const Closure *cl = clvalue(ci->func);
+    const void *id = cl->c.isC ? (const void *)(uintptr_t)cl->c.f
+        : (const void *)cl->l.p;
+    cls[depth] = cl;
+    ids[depth++] = id;
+    hash = (hash ^ (uint64_t)(uintptr_t)id) * FNV_PRIME;
+  }
+  p->samples++;
+
+  size_t idx = 0;
+  stack_entry *e = find_stack(p, hash, ids, depth, &idx);
+  if (e) {
+    e->count++;
+    return;
+  }
+  if (p->stacks_cnt == PROFILE_MAX_STACKS) {
+    p->dropped++;
+    return;
+  }
+  for (unsigned i = 0; i < depth; ++i) {
+    if (!lsb_ptr_map_get(&p->frames, ids[i])
+        && (!pin_frame(p, lua, cls[i]) || !add_frame(p, ids[i], cls[i]))) {
+      p->dropped++;
+      return;
+    }
+  }
+  e = malloc(sizeof(stack_entry) + depth * sizeof(void *));
+  if (!e) {
+    p->dropped++;
+    return;
+  }
+  e->hash = hash;
+  e->count = 1;
+  e->depth = depth;
+  memcpy(e->ids, ids, depth * sizeof(void *));
+  p->stacks[idx] = e;
+  p->stacks_cnt++;
+}
+
+
+static void add_name(lsb_ptr_map *m, const void *id, const char *prefix,
+                     const TString *key)
+{
+  if (lsb_ptr_map_get(m, id)) return; // keep the first (shortest) name
+  size_t plen = prefix ? strlen(prefix) + 1 : 0;
+  char *name = malloc(plen + key->tsv.len + 1);
+  if (!name) return;
+  if (prefix) {
+    memcpy(name, prefix, plen - 1);
+    name[plen - 1] = '.';
+  }
+  memcpy(name + plen, getstr(key), key->tsv.len + 1);
+  if (lsb_ptr_map_put(m, id, name) < 0) free(name);
+}
+
+
+static void name_functions(lsb_ptr_map *m, const Table *t, const char *prefix)
+{
+  for (int i = 0; i < sizenode(t); ++i) {
+    const Node *n = gnode(t, i);
+    if (!ttisstring(gkey(n))) continue;
+    const TValue *v = gval(n);
+    if (ttisfunction(v)) {
+      const Closure *cl = clvalue(v);
+      const void *id = cl->c.isC ? (const void *)(uintptr_t)cl->c.f
+          : (const void *)cl->l.p;
+      add_name(m, id, prefix, rawtsvalue(gkey(n)));
+    } else if (!prefix && ttistable(v) && hvalue(v) != t) {
+      name_functions(m, hvalue(v), getstr(rawtsvalue(gkey(n))));
+    }
+  }
+}
+
+
+// functions are named after the global (or module table field) referencing
+// them; the map is only built when the profile is retrieved
+static void build_names(lsb_ptr_map *m, lua_State *lua)
+{
+  // globals first so plain global names win over module qualified ones
+  const Table *g = hvalue(gt(lua));
+  for (int i = 0; i < sizenode(g); ++i) {
+    const Node *n = gnode(g, i);
+    if (ttisstring(gkey(n)) && ttisfunction(gval(n))) {
+      const Closure *cl = clvalue(gval(n));
+      const void *id = cl->c.isC ? (const void *)(uintptr_t)cl->c.f
+          : (const void *)cl->l.p;
+      add_name(m, id, NULL, rawtsvalue(gkey(n)));
+    }
+  }
+  name_functions(m, g, NULL);
+}
+
+
+lsb_err_value lsb_profiler_output(lsb_profiler *p, lua_State *lua,
+                                  lsb_output_buffer *ob)
+{
+  lsb_ptr_map names = { .keys = NULL, .vals = NULL, .size = 0, .cnt = 0 };
+  build_names(&names, lua);
+
+  lsb_err_value ret = NULL;
+  for (size_t i = 0; !ret && i < PROFILE_MAX_STACKS * 2; ++i) {
+    const stack_entry *e = p->stacks[i];
+    if (!e) continue;
+    for (unsigned d = e->depth; !ret && d > 0; --d) {
+      const void *id = e->ids[d - 1];
+      const char *label = lsb_ptr_map_get(&p->frames, id);
+      const char *name = lsb_ptr_map_get(&names, id);
+      const char *sep = d > 1 ? ";" : "";
+      if (name && strcmp(label, "[C]") == 0) {
+        ret = lsb_outputf(ob, "%s%s", name, sep);
+      } else if (name) {
+        ret = lsb_outputf(ob, "%s (%s)%s", name, label, sep);
+      } else {
+        ret = lsb_outputf(ob, "%s%s", label, sep);
+      }
+    }
+    if (!ret) ret = lsb_outputc(ob, ' ');
+    if (!ret) ret = lsb_outputfd(ob, (double)e->count);
+    if (!ret) ret = lsb_outputc(ob, '\n');
+  }
+  if (!ret && p->dropped) {
+    ret = lsb_outputs(ob, "[dropped] ", 10);
+    if (!ret) ret = lsb_outputfd(ob, (double)p->dropped);
+    if (!ret) ret = lsb_outputc(ob, '\n');
+  }
+  free_labels(&names);
+  return ret;
+}
+
+
+void lsb_profiler_reset(lsb_profiler *p, lua_State *lua)
+{
+  clear_profile(p);
+  if (lua) { // release the pinned closures
+    lua_pushlightuserdata(lua, p);
+    lua_rawget(lua, LUA_REGISTRYINDEX);
+    bool pinned = !lua_isnil(lua, -1);
+    lua_pop(lua, 1);
+    if (pinned) { // clearing an existing key cannot allocate
+      lua_pushlightuserdata(lua, p);
+      lua_pushnil(lua);
+      lua_rawset(lua, LUA_REGISTRYINDEX);
+    }
+  }
+}
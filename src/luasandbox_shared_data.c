@@ -0,0 +1,470 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Read only data shared across sandboxes implementation @file */
+
+#include "luasandbox_shared_data.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "luasandbox/lauxlib.h"
+#include "luasandbox/util/util.h"
+#include "luasandbox_defines.h"
+#include "luasandbox_impl.h"
+
+lsb_err_id LSB_ERR_SHARED_DATA_IO = "shared data i/o error";
+
+static const char shared_data_magic[4] = { 'L', 'S', 'B', 'D' };
+#define SHARED_DATA_VERSION 1
+
+/* File layout (native byte order, produced and consumed on the same host)
+ *
+ * header  | magic[4] | version u32 | count u64 | size u64 |
+ * index   | count * { key offset u64 | key length u32 | value length u32 } |
+ * data    | key bytes immediately followed by value bytes, per entry |
+ *
+ * The index is sorted by key (memcmp order, shorter first on a tie) so
+ * lookups are a binary search directly over the mapping.
+ */
+typedef struct sd_header {
+  char      magic[4];
+  uint32_t  version;
+  uint64_t  count;
+  uint64_t  size;
+} sd_header;
+
+typedef struct sd_entry {
+  uint64_t  off;
+  uint32_t  klen;
+  uint32_t  vlen;
+} sd_entry;
+
+struct lsb_shared_data {
+  const char      *base;
+  size_t          size;
+  const sd_entry  *index;
+  size_t          count;
+  lsb_atomic_int  refs;
+};
+
+typedef struct builder_entry {
+  const char *key; // only valid while writing (the buffer can move on add)
+  size_t off;
+  size_t klen;
+  size_t vlen;
+  size_t seq;
+} builder_entry;
+
+struct lsb_shared_data_builder {
+  builder_entry *entries;
+  size_t        cnt;
+  size_t        size;
+  char          *buf;
+  size_t        len;
+  size_t        cap;
+};
+
+
+static int key_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+  int r = memcmp(a, b, alen < blen ? alen : blen);
+  if (r) return r;
+  return alen < blen ? -1 : alen > blen;
+}
+
+
+lsb_shared_data_builder* lsb_create_shared_data_builder()
+{
+  return calloc(1, sizeof(lsb_shared_data_builder));
+}
+
+
+void lsb_destroy_shared_data_builder(lsb_shared_data_builder *b)
+{
+  if (!b) return;
+  free(b->entries);
+  free(b->buf);
+  free(b);
+}
+
+
+lsb_err_value
+lsb_shared_data_builder_add(lsb_shared_data_builder *b, const char *key,
+                            size_t klen, const char *val, size_t vlen)
+{
+  if (!b || (!key && klen) || (!val && vlen)) return LSB_ERR_UTIL_NULL;
+  if (klen > UINT32_MAX || vlen > UINT32_MAX) return LSB_ERR_UTIL_PRANGE;
+
+  if (b->cnt == b->size) {
+    size_t size = b->size ? b->size * 2 : 64;
+    builder_entry *entries = realloc(b->entries, size * sizeof(builder_entry));
+    if (!entries) return LSB_ERR_UTIL_OOM;
+    b->entries = entries;
+    b->size = size;
+  }
+  if (b->len + klen + vlen > b->cap) {
+    size_t cap = b->cap ? b->cap : 1024;
+    while (cap < b->len + klen + vlen) cap *= 2;
+    char *buf = realloc(b->buf, cap);
+    if (!buf) return LSB_ERR_UTIL_OOM;
+    b->buf = buf;
+    b->cap = cap;
+  }
+  builder_entry *e = &b->entries[b->cnt];
+  e->off = b->len;
+  e->klen = klen;
+  e->vlen = vlen;
+  e->seq = b->cnt++;
+  if (klen) memcpy(b->buf + b->len, key, klen);
+  if (vlen) memcpy(b->buf + b->len + klen, val, vlen);
+  b->len += klen + vlen;
+  return NULL;
+}
+
+
+static int builder_entry_cmp(const void *a, const void *b)
+{
+  const builder_entry *ea = a;
+  const builder_entry *eb = b;
+  int r = key_cmp(ea->key, ea->klen, eb->key, eb->klen);
+  if (r) return r;
+  return ea->seq < eb->seq ? -1 : 1;
+}
+
+
+lsb_err_value
+lsb_shared_data_builder_write(lsb_shared_data_builder *b, const char *filename)
+{
+  if (!b || !filename) return LSB_ERR_UTIL_NULL;
+
+  for (size_t i = 0; i < b->cnt; ++i) {
+    b->entries[i].key = b->buf + b->entries[i].off;
+  }
+  qsort(b->entries, b->cnt, sizeof(builder_entry), builder_entry_cmp);
+
+  // drop the earlier duplicates so the last value added wins
+  size_t cnt = 0;
+  for (size_t i = 0; i < b->cnt; ++i) {
+    if (i + 1 < b->cnt && key_cmp(b->entries[i].key, b->entries[i].klen,
+                                  b->entries[i + 1].key,
+                                  b->entries[i + 1].klen) == 0) {
+      continue;
+    }
+    b->entries[cnt++] = b->entries[i];
+  }
+  b->cnt = cnt;
+
+  sd_header h;
+  memcpy(h.magic, shared_data_magic, sizeof(h.magic));
+  h.version = SHARED_DATA_VERSION;
+  h.count = cnt;
+  uint64_t off = sizeof(sd_header) + cnt * sizeof(sd_entry);
+  for (size_t i = 0; i < cnt; ++i) {
+    off += b->entries[i].klen + b->entries[i].vlen;
+  }
+  h.size = off;
+
+  FILE *fh = fopen(filename, "wb" CLOSE_ON_EXEC);
+  if (!fh) return LSB_ERR_SHARED_DATA_IO;
+
+  bool ok = fwrite(&h, sizeof(h), 1, fh) == 1;
+  off = sizeof(sd_header) + cnt * sizeof(sd_entry);
+  for (size_t i = 0; ok && i < cnt; ++i) {
+    sd_entry se = { .off = off, .klen = (uint32_t)b->entries[i].klen,
+      .vlen = (uint32_t)b->entries[i].vlen };
+    ok = fwrite(&se, sizeof(se), 1, fh) == 1;
+    off += se.klen + se.vlen;
+  }
+  for (size_t i = 0; ok && i < cnt; ++i) {
+    size_t len = b->entries[i].klen + b->entries[i].vlen;
+    ok = fwrite(b->buf + b->entries[i].off, 1, len, fh) == len;
+  }
+  ok = fclose(fh) == 0 && ok;
+  if (!ok) {
+    remove(filename);
+    return LSB_ERR_SHARED_DATA_IO;
+  }
+  return NULL;
+}
+
+
+static bool validate(lsb_shared_data *d)
+{
+  if (d->size < sizeof(sd_header)) return false;
+  const sd_header *h = (const sd_header *)d->base;
+  if (memcmp(h->magic, shared_data_magic, sizeof(h->magic))
+      || h->version != SHARED_DATA_VERSION || h->size != d->size
+      || h->count > (d->size - sizeof(sd_header)) / sizeof(sd_entry)) {
+    return false;
+  }
+  d->count = (size_t)h->count;
+  d->index = (const sd_entry *)(d->base + sizeof(sd_header));
+
+  // bounds and ordering are verified once so lookups can trust the index
+  uint64_t data = sizeof(sd_header) + h->count * sizeof(sd_entry);
+  for (size_t i = 0; i < d->count; ++i) {
+    const sd_entry *e = &d->index[i];
+    if (e->off < data || e->off > d->size
+        || (uint64_t)e->klen + e->vlen > d->size - e->off) {
+      return false;
+    }
+    if (i && key_cmp(d->base + d->index[i - 1].off, d->index[i - 1].klen,
+                     d->base + e->off, e->klen) >= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static void unmap(lsb_shared_data *d)
+{
+#ifdef _WIN32
+  UnmapViewOfFile(d->base);
+#else
+  munmap((void *)d->base, d->size);
+#endif
+  free(d);
+}
+
+
+lsb_shared_data* lsb_open_shared_data(const char *filename)
+{
+  if (!filename) return NULL;
+
+  lsb_shared_data *d = calloc(1, sizeof(lsb_shared_data));
+  if (!d) return NULL;
+  lsb_atomic_store(&d->refs, 1);
+
+#ifdef _WIN32
+  HANDLE fh = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (fh == INVALID_HANDLE_VALUE) {
+    free(d);
+    return NULL;
+  }
+  LARGE_INTEGER fsize;
+  void *base = NULL;
+  if (GetFileSizeEx(fh, &fsize) && fsize.QuadPart > 0
+      && (unsigned long long)fsize.QuadPart <= SIZE_MAX) {
+    HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mh) {
+      base = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mh); // the view keeps the mapping alive
+    }
+  }
+  CloseHandle(fh);
+  if (!base) {
+    free(d);
+    return NULL;
+  }
+  d->base = base;
+  d->size = (size_t)fsize.QuadPart;
+#else
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    free(d);
+    return NULL;
+  }
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (!fstat(fd, &st) && st.st_size > 0) {
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) {
+    free(d);
+    return NULL;
+  }
+  d->base = base;
+  d->size = (size_t)st.st_size;
+#endif
+
+  if (!validate(d)) {
+    unmap(d);
+    return NULL;
+  }
+  return d;
+}
+
+
+void lsb_close_shared_data(lsb_shared_data *d)
+{
+  if (d && lsb_atomic_add_int(&d->refs, -1) == 1) unmap(d);
+}
+
+
+void lsb_shared_data_ref(lsb_shared_data *d)
+{
+  lsb_atomic_add_int(&d->refs, 1);
+}
+
+
+size_t lsb_shared_data_count(const lsb_shared_data *d)
+{
+  return d ? d->count : 0;
+}
+
+
+// returns the index of the greatest key <= key, or -1
+static ptrdiff_t floor_entry(const lsb_shared_data *d, const char *key,
+                             size_t klen)
+{
+  size_t lo = 0, hi = d->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const sd_entry *e = &d->index[mid];
+    if (key_cmp(d->base + e->off, e->klen, key, klen) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return (ptrdiff_t)lo - 1;
+}
+
+
+const char* lsb_shared_data_find(const lsb_shared_data *d, const char *key,
+                                 size_t klen, size_t *vlen)
+{
+  if (!d || (!key && klen)) return NULL;
+  ptrdiff_t i = floor_entry(d, key, klen);
+  if (i < 0) return NULL;
+  const sd_entry *e = &d->index[i];
+  if (e->klen != klen || memcmp(d->base + e->off, key, klen)) return NULL;
+  if (vlen) *vlen = e->vlen;
+  return d->base + e->off + e->klen;
+}
+
+
+static lsb_shared_data* check_shared_data(lua_State *lua)
+{
+  lsb_shared_data **ud = luaL_checkudata(lua, 1, LSB_SHARED_DATA);
+  return *ud;
+}
+
+
+static int sd_index(lua_State *lua)
+{
+  lsb_shared_data *d = check_shared_data(lua);
+  size_t klen;
+  const char *key = lua_tolstring(lua, 2, &klen);
+  size_t vlen;
+  const char *val = key ? lsb_shared_data_find(d, key, klen, &vlen) : NULL;
+  if (val) {
+    lua_pushlstring(lua, val, vlen);
+  } else {
+    lua_pushnil(lua);
+  }
+  return 1;
+}
+
+
+static int sd_floor(lua_State *lua)
+{
+  lsb_shared_data *d = check_shared_data(lua);
+  size_t klen;
+  const char *key = luaL_checklstring(lua, 2, &klen);
+  ptrdiff_t i = floor_entry(d, key, klen);
+  if (i < 0) {
+    lua_pushnil(lua);
+    return 1;
+  }
+  const sd_entry *e = &d->index[i];
+  lua_pushlstring(lua, d->base + e->off, e->klen);
+  lua_pushlstring(lua, d->base + e->off + e->klen, e->vlen);
+  return 2;
+}
+
+
+static int sd_len(lua_State *lua)
+{
+  lua_pushnumber(lua, (lua_Number)check_shared_data(lua)->count);
+  return 1;
+}
+
+
+static int sd_newindex(lua_State *lua)
+{
+  return luaL_error(lua, "shared data is read only");
+}
+
+
+static int sd_gc(lua_State *lua)
+{
+  lsb_shared_data **ud = lua_touserdata(lua, 1);
+  lsb_close_shared_data(*ud);
+  *ud = NULL;
+  return 0;
+}
+
+
+static const struct luaL_reg shared_datalib_m[] =
+{
+  { "__index", sd_index },
+  { "__call", sd_floor },
+  { "__len", sd_len },
+  { "__newindex", sd_newindex },
+  { "__gc", sd_gc },
+  { NULL, NULL }
+};
+
+
+static int push_shared_data(lua_State *lua)
+{
+  lsb_shared_data *d = lua_touserdata(lua, 1);
+  lsb_shared_data **ud = lua_newuserdata(lua, sizeof(lsb_shared_data *));
+  *ud = NULL;
+  if (luaL_newmetatable(lua, LSB_SHARED_DATA) == 1) {
+    luaL_register(lua, NULL, shared_datalib_m);
+    lua_pushboolean(lua, 0);
+    lua_setfield(lua, -2, "__metatable");
+  }
+  // the metatable doubles as the environment; it has no serialization
+  // function so the preservation code always skips this userdata
+  lua_pushvalue(lua, -1);
+  lua_setfenv(lua, -3);
+  lua_setmetatable(lua, -2);
+  lsb_shared_data_ref(d);
+  *ud = d; // only set once the reference is held so __gc stays balanced
+  lua_setglobal(lua, lua_tostring(lua, 2));
+  return 0;
+}
+
+
+lsb_err_value lsb_add_shared_data(lsb_lua_sandbox *lsb, lsb_shared_data *d,
+                                  const char *name)
+{
+  if (!lsb || !d || !name) return LSB_ERR_UTIL_NULL;
+  if (lsb->state == LSB_TERMINATED) return LSB_ERR_TERMINATED;
+
+  lua_pushcfunction(lsb->lua, push_shared_data);
+  lua_pushlightuserdata(lsb->lua, d);
+  lua_pushstring(lsb->lua, name);
+  if (lua_pcall(lsb->lua, 2, 0, 0)) {
+    int len = snprintf(lsb->error_message, LSB_ERROR_SIZE, "%s",
+                       lua_tostring(lsb->lua, -1));
+    if (len >= LSB_ERROR_SIZE || len < 0) {
+      lsb->error_message[LSB_ERROR_SIZE - 1] = 0;
+    }
+    lua_pop(lsb->lua, 1);
+    return LSB_ERR_LUA;
+  }
+  return NULL;
+}
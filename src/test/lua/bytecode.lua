@@ -0,0 +1,12 @@
+#!/usr/bin/env lua
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+local bm = require "bytecode_module"
+
+function process(tc)
+    if bm.value() ~= 42 then error("invalid module value") end
+    if tc == 1 then error("line 10") end -- must match the source line
+    return 0
+end
@@ -0,0 +1,37 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "string"
+local bm = require "bytecode_module"
+
+local count = 0 -- upvalue shared by inc and process
+local function inc() count = count + 1 end
+
+local function fib(n) -- self referencing upvalue
+    if n < 2 then return n end
+    return fib(n - 1) + fib(n - 2)
+end
+
+local mt = {__index = function(t, k) return k .. "!" end}
+local obj = setmetatable({}, mt)
+local cycle = {}
+cycle.self = cycle
+
+items = {}
+name = read_config("name")
+
+function process(tc)
+    inc()
+    if tc == 1 then
+        assert(fib(10) == 55, "fib")
+        assert(obj.foo == "foo!", "metatable")
+        assert(cycle.self == cycle, "cycle")
+        assert(("abc"):upper() == "ABC", "string metatable")
+        assert(bm.value() == 42, "module")
+        assert(_G == getfenv(1), "globals")
+        items[#items + 1] = name
+        for i, v in ipairs(items) do assert(v == name, v) end
+    end
+    return count
+end
@@ -0,0 +1,26 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+big = {}
+for i = 1, 10000 do
+    big[i] = i
+end
+
+nested = {inner = {list = {}}}
+for i = 1, 2000 do
+    nested.inner.list[i] = i
+end
+nested.self = nested
+nested['odd "key"'] = {{1, 2, 3}}
+
+words = {}
+for i = 1, 100 do
+    words[i] = "word" .. i
+end
+
+local count = 0
+function process(tc)
+    count = count + 1
+    return 0
+end
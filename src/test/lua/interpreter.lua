@@ -0,0 +1,25 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- exercises the interpreter fast paths: constant key table reads, comparisons
+-- against constants and numeric for loops
+local cfg = {type = "counter", limit = 50, name = "test"}
+local obj = {}
+function obj:value() return 1 end
+
+total = 0
+
+function process(tc)
+    local sum = 0
+    for i = 1, 100 do
+        if cfg.type == "counter" and i <= cfg.limit then
+            sum = sum + obj:value()
+        elseif i == 75 then
+            sum = sum + 10
+        end
+    end
+    if sum ~= 60 then error("invalid sum: " .. sum) end
+    total = total + sum
+    return 0
+end
@@ -0,0 +1,33 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "string"
+
+function hot(n)
+    local s = 0
+    for i = 1, n do
+        s = s + i % 7
+    end
+    return s
+end
+
+local function cold(n)
+    local t = {}
+    for i = 1, n do
+        t[i] = string.rep("x", 8)
+    end
+    return #t
+end
+
+function process(tc)
+    if tc == 1 then
+        while true do end
+    elseif tc == 2 then
+        hot(5000)
+        return 0
+    end
+    hot(50000)
+    pcall(cold, 1000)
+    return 0
+end
@@ -0,0 +1,52 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "math"
+
+local function sequence(seed)
+    math.randomseed(seed)
+    local t = {}
+    for i = 1, 10 do
+        t[#t + 1] = math.random()
+        t[#t + 1] = math.random(6)
+        t[#t + 1] = math.random(-3, 3)
+    end
+    return t
+end
+
+function process(tc)
+    local a = sequence(42)
+    local b = sequence(42)
+    local c = sequence(43)
+    local same = true
+    for i = 1, #a do
+        if a[i] ~= b[i] then error("sequence mismatch at " .. i) end
+        if a[i] ~= c[i] then same = false end
+    end
+    if same then error("different seeds produced the same sequence") end
+
+    -- seeds that do not fit in an integer are still deterministic
+    for _, seed in ipairs({0/0, 1/0, -1/0, 1e300, -1e300}) do
+        a = sequence(seed)
+        b = sequence(seed)
+        for i = 1, #a do
+            if a[i] ~= b[i] then error("sequence mismatch for seed " .. seed) end
+        end
+    end
+
+    for i = 1, 1000 do
+        local r = math.random()
+        if r < 0 or r >= 1 then error("random() out of range: " .. r) end
+        r = math.random(6)
+        if r < 1 or r > 6 or r % 1 ~= 0 then error("random(6) out of range: " .. r) end
+        r = math.random(-3, 3)
+        if r < -3 or r > 3 or r % 1 ~= 0 then error("random(-3, 3) out of range: " .. r) end
+    end
+
+    local ok = pcall(math.random, 0)
+    if ok then error("random(0) succeeded") end
+    ok = pcall(math.random, 3, 1)
+    if ok then error("random(3, 1) succeeded") end
+    return 0
+end
@@ -0,0 +1,29 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- 'shared' is added by the host with lsb_add_shared_data
+alias = shared
+count = 0
+
+function process(tc)
+    count = count + 1
+    assert(#shared == 10003, #shared)
+    assert(shared.apple == "green", shared.apple)
+    assert(shared.banana == "yellow", shared.banana)
+    assert(shared.durian == nil)
+    assert(shared[1] == nil)
+    assert(shared.k05000 == "v05000", shared.k05000)
+    assert(alias.k00000 == "v00000", alias.k00000)
+
+    local k, v = shared("blueberry")
+    assert(k == "banana" and v == "yellow", tostring(k))
+    assert(shared("aardvark") == nil)
+    k, v = shared("zzz")
+    assert(k == "k09999" and v == "v09999", tostring(k))
+
+    local ok = pcall(function() shared.apple = "red" end)
+    assert(not ok, "shared data is writable")
+    assert(getmetatable(shared) == false)
+    return count
+end
@@ -0,0 +1,17 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- a large live set plus a steady stream of garbage; the collector pacing
+-- alone lets the heap grow past the hard limit
+live = {}
+for i = 1, 3000 do
+    live[i] = {i}
+end
+
+function process(tc)
+    for i = 1, 20000 do
+        local t = {i, i + 1, i + 2}
+    end
+    return 0
+end
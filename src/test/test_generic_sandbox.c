@@ -12,6 +12,12 @@
 #include <string.h>
 #include <time.h>
 
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "../luasandbox_impl.h"
 #include "luasandbox/lauxlib.h"
 #include "luasandbox/lua.h"
@@ -20,6 +26,7 @@
 #include "luasandbox/util/util.h"
 #include "luasandbox_output.h"
 #include "luasandbox_serialize.h"
+#include "luasandbox_shared_data.h"
 
 char *e = NULL;
 static char print_out[2048] = { 0 };
@@ -216,6 +223,10 @@ static char* test_create_error()
   sb = lsb_create(NULL, "lua/counter.lua", "memory_limit = 1.85e19", NULL);
   mu_assert(!sb, "lsb_create() invalid config");
 
+  sb = lsb_create(NULL, "lua/counter.lua", "memory_limit = 1000 "
+                  "soft_memory_limit = 1001", NULL);
+  mu_assert(!sb, "lsb_create() invalid config");
+
   sb = lsb_create(NULL, "lua/counter.lua", "instruction_limit = 'aaa'", NULL);
   mu_assert(!sb, "lsb_create() invalid config");
 
@@ -252,6 +263,500 @@ static char* test_read_config()
 }
 
 
+static char* test_create_config()
+{
+  const char *cfg = "memory_limit = 65765\n"
+      "instruction_limit = 1000\n"
+      "output_limit = 1024\n"
+      "array = {'foo', 99}\n"
+      "hash  = {foo = 'bar', hash1 = {subfoo = 'subbar'}}\n"
+      MODULE_PATH;
+
+  lsb_config *c = lsb_create_config(cfg, NULL);
+  mu_assert(c, "lsb_create_config() failed");
+  lsb_lua_sandbox *sb[2];
+  for (int i = 0; i < 2; ++i) {
+    sb[i] = lsb_create_with_config(NULL, "lua/read_config.lua", c, NULL);
+    mu_assert(sb[i], "lsb_create_with_config() failed");
+  }
+  lsb_destroy_config(c); // the sandboxes own a copy
+  for (int i = 0; i < 2; ++i) {
+    lsb_err_value ret = lsb_init(sb[i], NULL);
+    mu_assert(!ret, "lsb_init() received: %s", ret);
+    size_t u = lsb_usage(sb[i], LSB_UT_MEMORY, LSB_US_LIMIT);
+    mu_assert(u == 65765, "received: %" PRIuSIZE, u);
+    e = lsb_destroy(sb[i]);
+    mu_assert(!e, "lsb_destroy() received: %s", e);
+  }
+
+  mu_assert(!lsb_create_config("memory_limit = -1", NULL), "invalid config");
+  mu_assert(!lsb_create_config("test = {", &lsb_test_logger),
+            "invalid config");
+  lsb_destroy_config(NULL);
+
+  c = lsb_create_config(NULL, NULL);
+  mu_assert(c, "lsb_create_config() failed");
+  mu_assert(!lsb_create_with_config(NULL, NULL, c, NULL), "null lua_file");
+  mu_assert(!lsb_create_with_config(NULL, "lua/counter.lua", NULL, NULL),
+            "null cfg");
+  lsb_destroy_config(c);
+  return NULL;
+}
+
+
+static char* run_bytecode_sandbox()
+{
+  lsb_lua_sandbox *sb = lsb_create(NULL, "lua/bytecode.lua",
+                                   "path = 'lua/?.lua'", NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  lsb_err_value ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  int result = lsb_test_process(sb, 0);
+  mu_assert(result == 0, "process() received: %d %s", result,
+            lsb_get_error(sb));
+  result = lsb_test_process(sb, 1);
+  const char *expected = "process() lua/bytecode.lua:10: line 10";
+  mu_assert(result == 1 && strcmp(lsb_get_error(sb), expected) == 0,
+            "received: %s", lsb_get_error(sb));
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  return NULL;
+}
+
+
+#ifndef _WIN32
+static void chmod_cache_files(const char *dir, mode_t mode)
+{
+  char path[260];
+  DIR *d = opendir(dir);
+  if (!d) return;
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    size_t len = strlen(de->d_name);
+    if (len > 5 && strcmp(de->d_name + len - 5, ".luac") == 0) {
+      snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+      chmod(path, mode);
+    }
+  }
+  closedir(d);
+}
+#endif
+
+
+static char* test_bytecode_cache()
+{
+  unsigned long long hits, misses;
+  mu_assert(!lsb_create_bytecode_cache(0, NULL), "zero entries");
+  lsb_bytecode_cache *c = lsb_create_bytecode_cache(8, NULL);
+  mu_assert(c, "lsb_create_bytecode_cache() failed");
+  lsb_set_bytecode_cache(c);
+  for (int i = 0; i < 3; ++i) {
+    char *msg = run_bytecode_sandbox();
+    if (msg) return msg;
+  }
+  lsb_get_bytecode_cache_stats(c, &hits, &misses);
+  mu_assert(misses == 2 && hits == 4, "hits: %llu misses: %llu", hits, misses);
+
+  // load errors are reported as usual
+  lsb_lua_sandbox *sb = lsb_create(NULL, "lua/simple1.lua", NULL, NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  mu_assert(lsb_init(sb, NULL) == LSB_ERR_LUA, "lsb_init() succeeded");
+  const char *expected = "cannot open lua/simple1.lua";
+  mu_assert(strncmp(lsb_get_error(sb), expected, strlen(expected)) == 0,
+            "received: %s", lsb_get_error(sb));
+  e = lsb_destroy(sb);
+  lsb_destroy_bytecode_cache(c); // also unsets it
+
+#ifdef _WIN32
+  mu_assert(!lsb_create_bytecode_cache(8, "lua"), "persisted on Windows");
+#else
+  // persisted chunks are only loaded from a trusted directory and files
+  mkdir("bytecode_untrusted", S_IRWXU);
+  chmod("bytecode_untrusted", S_IRWXU | S_IRWXG | S_IRWXO);
+  c = lsb_create_bytecode_cache(8, "bytecode_untrusted");
+  rmdir("bytecode_untrusted");
+  mu_assert(!c, "accepted a world writable directory");
+
+  // persisted chunks are found by a new cache
+  for (int i = 0; i < 4; ++i) {
+    c = lsb_create_bytecode_cache(8, "lua");
+    mu_assert(c, "lsb_create_bytecode_cache() failed");
+    lsb_set_bytecode_cache(c);
+    char *msg = run_bytecode_sandbox();
+    if (msg) return msg;
+    lsb_get_bytecode_cache_stats(c, &hits, &misses);
+    if (i == 0) { // the files may exist from a previous run
+      mu_assert(misses + hits == 2, "hits: %llu misses: %llu", hits, misses);
+    } else if (i == 2) { // group writable files are recompiled and replaced
+      mu_assert(misses == 2 && hits == 0, "hits: %llu misses: %llu", hits,
+                misses);
+    } else {
+      mu_assert(misses == 0 && hits == 2, "hits: %llu misses: %llu", hits,
+                misses);
+    }
+    lsb_set_bytecode_cache(NULL);
+    lsb_destroy_bytecode_cache(c);
+    if (i == 1) chmod_cache_files("lua", S_IRUSR | S_IWUSR | S_IWGRP);
+  }
+#endif
+  lsb_get_bytecode_cache_stats(NULL, &hits, &misses);
+  mu_assert(misses == 0 && hits == 0, "hits: %llu misses: %llu", hits, misses);
+  return run_bytecode_sandbox(); // no cache
+}
+
+
+static char* test_clone()
+{
+  lsb_config *cfg = lsb_create_config("name = 'proto' path = 'lua/?.lua'",
+                                      NULL);
+  mu_assert(cfg, "lsb_create_config() failed");
+  lsb_lua_sandbox *proto = lsb_create_with_config(NULL, "lua/clone.lua", cfg,
+                                                  NULL);
+  mu_assert(proto, "lsb_create_with_config() failed");
+  mu_assert(!lsb_clone(proto, NULL, cfg, NULL), "cloned an uninitialized "
+            "sandbox");
+  lsb_err_value ret = lsb_init(proto, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(proto));
+  int result = lsb_test_process(proto, 0);
+  mu_assert(result == 1, "process() received: %d %s", result,
+            lsb_get_error(proto));
+  lsb_destroy_config(cfg);
+
+  lsb_config *ccfg = lsb_create_config("name = 'clone' memory_limit = 0"
+                                       " path = 'lua/?.lua'", NULL);
+  lsb_lua_sandbox *clone = lsb_clone(proto, NULL, ccfg, NULL);
+  lsb_destroy_config(ccfg);
+  mu_assert(clone, "lsb_clone() failed");
+  mu_assert(lsb_get_state(clone) == LSB_RUNNING, "not running");
+  size_t u = lsb_usage(clone, LSB_UT_MEMORY, LSB_US_CURRENT);
+  mu_assert(u > 0, "received: %" PRIuSIZE, u);
+
+  // the clone starts from the prototype's state and diverges from there
+  result = lsb_test_process(clone, 1);
+  mu_assert(result == 2, "process() received: %d %s", result,
+            lsb_get_error(clone));
+  result = lsb_test_process(clone, 0);
+  mu_assert(result == 3, "process() received: %d %s", result,
+            lsb_get_error(clone));
+  result = lsb_test_process(proto, 0);
+  mu_assert(result == 2, "process() received: %d %s", result,
+            lsb_get_error(proto));
+  lua_State *lua = lsb_get_lua(clone);
+  lua_getglobal(lua, "name");
+  mu_assert(strcmp(lua_tostring(lua, -1), "proto") == 0, "received: %s",
+            lua_tostring(lua, -1));
+  lua_pop(lua, 1);
+  lua_getglobal(lua, "read_config");
+  lua_pushstring(lua, "name");
+  lua_call(lua, 1, 1);
+  mu_assert(strcmp(lua_tostring(lua, -1), "clone") == 0, "received: %s",
+            lua_tostring(lua, -1));
+  lua_pop(lua, 1);
+
+  e = lsb_destroy(proto);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  result = lsb_test_process(clone, 1);
+  mu_assert(result == 4, "process() received: %d %s", result,
+            lsb_get_error(clone));
+  e = lsb_destroy(clone);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+
+  // the clone must fit in its own memory limit
+  cfg = lsb_create_config("path = 'lua/?.lua'", NULL);
+  proto = lsb_create_with_config(NULL, "lua/clone.lua", cfg, NULL);
+  mu_assert(proto, "lsb_create_with_config() failed");
+  lsb_destroy_config(cfg);
+  ret = lsb_init(proto, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(proto));
+  cfg = lsb_create_config("memory_limit = 8000", NULL);
+  mu_assert(!lsb_clone(proto, NULL, cfg, NULL), "exceeded the memory limit");
+  lsb_destroy_config(cfg);
+
+  // userdata cannot be cloned
+  lua = lsb_get_lua(proto);
+  lua_newuserdata(lua, 8);
+  lua_setglobal(lua, "udata");
+  cfg = lsb_create_config(NULL, NULL);
+  mu_assert(!lsb_clone(proto, NULL, cfg, &lsb_test_logger), "cloned userdata");
+  lsb_destroy_config(cfg);
+  e = lsb_destroy(proto);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  return NULL;
+}
+
+
+static char* test_shared_data()
+{
+  const char *data_file = "shared_data.dat";
+  const char *state_file = "shared_data.preserve";
+  remove(state_file);
+
+  lsb_shared_data_builder *b = lsb_create_shared_data_builder();
+  mu_assert(b, "lsb_create_shared_data_builder() failed");
+  char key[16], val[16];
+  for (int i = 9999; i >= 0; --i) {
+    snprintf(key, sizeof key, "k%05d", i);
+    snprintf(val, sizeof val, "v%05d", i);
+    e = (char *)lsb_shared_data_builder_add(b, key, 6, val, 6);
+    mu_assert(!e, "lsb_shared_data_builder_add() received: %s", e);
+  }
+  lsb_shared_data_builder_add(b, "apple", 5, "red", 3);
+  lsb_shared_data_builder_add(b, "banana", 6, "yellow", 6);
+  lsb_shared_data_builder_add(b, "cherry", 6, "dark red", 8);
+  lsb_shared_data_builder_add(b, "apple", 5, "green", 5);
+  e = (char *)lsb_shared_data_builder_write(b, data_file);
+  mu_assert(!e, "lsb_shared_data_builder_write() received: %s", e);
+  lsb_destroy_shared_data_builder(b);
+
+  mu_assert(!lsb_open_shared_data("lua/shared_data.lua"), "opened garbage");
+  lsb_shared_data *d = lsb_open_shared_data(data_file);
+  mu_assert(d, "lsb_open_shared_data() failed");
+  remove(data_file); // the mapping stays valid
+  mu_assert(lsb_shared_data_count(d) == 10003, "received: %" PRIuSIZE,
+            lsb_shared_data_count(d));
+  size_t len;
+  const char *v = lsb_shared_data_find(d, "cherry", 6, &len);
+  mu_assert(v && len == 8 && memcmp(v, "dark red", 8) == 0, "find failed");
+  mu_assert(!lsb_shared_data_find(d, "cherr", 5, &len), "prefix matched");
+
+  // the mapping is not charged against the memory limit
+  lsb_lua_sandbox *sb = lsb_create(NULL, "lua/shared_data.lua",
+                                   "memory_limit = 65536", NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  e = (char *)lsb_add_shared_data(sb, d, "shared");
+  mu_assert(!e, "lsb_add_shared_data() received: %s", e);
+  lsb_err_value ret = lsb_init(sb, state_file);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  int result = lsb_test_process(sb, 0);
+  mu_assert(result == 1, "process() received: %d %s", result,
+            lsb_get_error(sb));
+
+  lsb_config *cfg = lsb_create_config(NULL, NULL);
+  lsb_lua_sandbox *clone = lsb_clone(sb, NULL, cfg, NULL);
+  lsb_destroy_config(cfg);
+  mu_assert(clone, "lsb_clone() failed");
+
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  lsb_close_shared_data(d); // the clone still holds a reference
+  result = lsb_test_process(clone, 0);
+  mu_assert(result == 2, "process() received: %d %s", result,
+            lsb_get_error(clone));
+  e = lsb_destroy(clone);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+
+  char *preserved = lsb_read_file(state_file);
+  mu_assert(preserved, "lsb_read_file() failed");
+  mu_assert(strstr(preserved, "_G[\"count\"] = 1"), "received: %s",
+            preserved);
+  mu_assert(!strstr(preserved, "shared") && !strstr(preserved, "alias"),
+            "received: %s", preserved);
+  free(preserved);
+  remove(state_file);
+  return NULL;
+}
+
+
+static char* test_soft_memory_limit()
+{
+  // without a soft limit the collector pacing lets the heap hit the hard limit
+  lsb_lua_sandbox *sb = lsb_create(NULL, "lua/soft_memory_limit.lua",
+                                   "memory_limit = 400000", NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  lsb_err_value ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  int result = lsb_test_process(sb, 0);
+  mu_assert(result == 1, "process() received: %d %s", result,
+            lsb_get_error(sb));
+  size_t u = lsb_usage(sb, LSB_UT_SOFT_GC, LSB_US_CURRENT);
+  mu_assert(u == 0, "received: %" PRIuSIZE, u);
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+
+  sb = lsb_create(NULL, "lua/soft_memory_limit.lua", "memory_limit = 400000 "
+                  "soft_memory_limit = 320000", NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  for (int i = 0; i < 3; ++i) {
+    result = lsb_test_process(sb, 0);
+    mu_assert(result == 0, "process() received: %d %s", result,
+              lsb_get_error(sb));
+  }
+  u = lsb_usage(sb, LSB_UT_SOFT_GC, LSB_US_LIMIT);
+  mu_assert(u == 320000, "received: %" PRIuSIZE, u);
+  u = lsb_usage(sb, LSB_UT_SOFT_GC, LSB_US_CURRENT);
+  mu_assert(u > 0, "received: %" PRIuSIZE, u);
+  u = lsb_usage(sb, LSB_UT_SOFT_GC, LSB_US_MAXIMUM);
+  mu_assert(u > 0, "received: %" PRIuSIZE, u);
+  u = lsb_usage(sb, LSB_UT_GC_PAUSE, LSB_US_MAXIMUM);
+  mu_assert(u > 0, "received: %" PRIuSIZE, u);
+  u = lsb_usage(sb, LSB_UT_MEMORY, LSB_US_MAXIMUM);
+  mu_assert(u < 400000, "received: %" PRIuSIZE, u);
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  return NULL;
+}
+
+
+static char* test_heap_profile()
+{
+  lsb_heap_stats stats;
+  lsb_heap_table tables[100];
+  mu_assert(lsb_get_heap_stats(NULL, false, &stats) == LSB_ERR_UTIL_NULL,
+            "no error");
+  mu_assert(lsb_get_largest_tables(NULL, tables, 100) == 0, "no error");
+
+  lsb_lua_sandbox *sb = lsb_create(NULL, "lua/heap.lua", test_cfg, NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  lsb_err_value ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+
+  ret = lsb_get_heap_stats(sb, true, &stats);
+  mu_assert(!ret, "lsb_get_heap_stats() received: %s", ret);
+  size_t total = stats.other;
+  for (int i = 0; i < LSB_HT_MAX; ++i) {
+    total += stats.bytes[i];
+  }
+  size_t u = lsb_usage(sb, LSB_UT_MEMORY, LSB_US_CURRENT);
+  mu_assert(total == u, "received: %" PRIuSIZE " expected: %" PRIuSIZE,
+            total, u);
+  mu_assert(stats.count[LSB_HT_STRING] > 100, "received: %" PRIuSIZE,
+            stats.count[LSB_HT_STRING]);
+  mu_assert(stats.bytes[LSB_HT_TABLE] > 12000 * sizeof(lua_Number),
+            "received: %" PRIuSIZE, stats.bytes[LSB_HT_TABLE]);
+  mu_assert(stats.count[LSB_HT_FUNCTION] > 0, "no functions");
+  mu_assert(stats.count[LSB_HT_PROTO] > 0, "no prototypes");
+  mu_assert(stats.count[LSB_HT_UPVALUE] == 1, "received: %" PRIuSIZE,
+            stats.count[LSB_HT_UPVALUE]);
+  mu_assert(stats.count[LSB_HT_THREAD] == 1, "received: %" PRIuSIZE,
+            stats.count[LSB_HT_THREAD]);
+
+  size_t n = lsb_get_largest_tables(sb, tables, 2);
+  mu_assert(n == 2, "received: %" PRIuSIZE, n);
+  mu_assert(strcmp(tables[0].path, "_G[\"big\"]") == 0, "received: %s",
+            tables[0].path);
+  mu_assert(tables[0].entries == 10000, "received: %" PRIuSIZE,
+            tables[0].entries);
+  mu_assert(tables[0].bytes >= tables[1].bytes, "not sorted");
+
+  n = lsb_get_largest_tables(sb, tables, 100);
+  mu_assert(n > 5 && n < 100, "received: %" PRIuSIZE, n);
+  const char *expected[] = { "_G[\"nested\"][\"inner\"][\"list\"]",
+    "_G[\"nested\"][\"odd \\\"key\\\"\"][1]", "_G" };
+  for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+    bool found = false;
+    for (size_t j = 0; j < n && !found; ++j) {
+      found = strcmp(tables[j].path, expected[i]) == 0;
+    }
+    mu_assert(found, "missing: %s", expected[i]);
+  }
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  return NULL;
+}
+
+
+static char* test_profiler()
+{
+  const char *cfg = "memory_limit = 0\n"
+      "instruction_limit = 0\n"
+      "output_limit = 0\n"
+      "profile_interval = 1000\n"
+      MODULE_PATH;
+  lsb_output_buffer ob;
+  mu_assert(!lsb_init_output_buffer(&ob, 0), "lsb_init_output_buffer failed");
+  mu_assert(lsb_start_profiler(NULL, 0) == LSB_ERR_UTIL_NULL, "no error");
+  mu_assert(lsb_get_profile(NULL, &ob) == LSB_ERR_UTIL_NULL, "no error");
+
+  lsb_lua_sandbox *sb = lsb_create(NULL, "lua/profile.lua", cfg, NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  lsb_err_value ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  for (int i = 0; i < 10; ++i) {
+    mu_assert(lsb_test_process(sb, 0) == 0, "%s", lsb_get_error(sb));
+  }
+  ret = lsb_get_profile(sb, &ob);
+  mu_assert(!ret, "lsb_get_profile() received: %s", ret);
+  lsb_outputc(&ob, 0);
+  const char *expected[] = {
+    "process (lua/profile.lua:23);hot (lua/profile.lua:7) ",
+    "process (lua/profile.lua:23);pcall;lua/profile.lua:15 ",
+  };
+  for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+    mu_assert(strstr(ob.buf, expected[i]), "missing: %s in\n%s", expected[i],
+              ob.buf);
+  }
+  size_t hot = 0, total = 0;
+  for (const char *l = ob.buf; *l; l = strchr(l, '\n') + 1) {
+    const char *eol = strchr(l, '\n');
+    mu_assert(eol, "unterminated line: %s", l);
+    const char *c = eol;
+    while (c > l && *c != ' ') --c;
+    mu_assert(c > l, "invalid line: %s", l);
+    size_t cnt = strtoul(c + 1, NULL, 10);
+    if (strncmp(l, expected[0], strlen(expected[0])) == 0) hot += cnt;
+    total += cnt;
+  }
+  mu_assert(hot * 2 > total, "hot: %" PRIuSIZE " total: %" PRIuSIZE, hot,
+            total);
+
+  lsb_reset_profile(sb);
+  ob.pos = 0;
+  mu_assert(!lsb_get_profile(sb, &ob) && ob.pos == 0, "profile not reset");
+
+  // restarting the profiler applies the new interval
+  mu_assert(!lsb_start_profiler(sb, 100000), "lsb_start_profiler failed");
+  for (int i = 0; i < 10; ++i) {
+    mu_assert(lsb_test_process(sb, 0) == 0, "%s", lsb_get_error(sb));
+  }
+  mu_assert(!lsb_get_profile(sb, &ob), "lsb_get_profile failed");
+  lsb_outputc(&ob, 0);
+  size_t sparse = 0;
+  for (const char *l = ob.buf; *l; l = strchr(l, '\n') + 1) {
+    const char *c = strchr(l, '\n');
+    while (c > l && *c != ' ') --c;
+    sparse += strtoul(c + 1, NULL, 10);
+  }
+  mu_assert(sparse * 20 < total, "sparse: %" PRIuSIZE " total: %" PRIuSIZE,
+            sparse, total);
+  lsb_reset_profile(sb);
+  ob.pos = 0;
+  lsb_stop_profiler(sb);
+  mu_assert(lsb_test_process(sb, 0) == 0, "%s", lsb_get_error(sb));
+  mu_assert(!lsb_get_profile(sb, &ob) && ob.pos == 0, "profiler not stopped");
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+
+  // the instruction limit is enforced by the sampling hook
+  const char *cfgs[] = {
+    "memory_limit = 0\ninstruction_limit = 100000\noutput_limit = 0\n"
+    MODULE_PATH,
+    "memory_limit = 0\ninstruction_limit = 100000\noutput_limit = 0\n"
+    "profile_interval = 3000\n" MODULE_PATH
+  };
+  size_t usage[2];
+  for (int i = 0; i < 2; ++i) {
+    sb = lsb_create(NULL, "lua/profile.lua", cfgs[i], NULL);
+    mu_assert(sb, "lsb_create() received: NULL");
+    ret = lsb_init(sb, NULL);
+    mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+    mu_assert(lsb_test_process(sb, 2) == 0, "%s", lsb_get_error(sb));
+    usage[i] = lsb_usage(sb, LSB_UT_INSTRUCTION, LSB_US_CURRENT);
+    mu_assert(lsb_test_process(sb, 1) == 1, "instruction limit not enforced");
+    const char *err = "process() instruction_limit exceeded";
+    mu_assert(strcmp(lsb_get_error(sb), err) == 0, "received: %s",
+              lsb_get_error(sb));
+    e = lsb_destroy(sb);
+    mu_assert(!e, "lsb_destroy() received: %s", e);
+  }
+  mu_assert(usage[0] > 3000 * 3 && usage[0] == usage[1], "received: %"
+            PRIuSIZE " expected: %" PRIuSIZE, usage[1], usage[0]);
+  lsb_free_output_buffer(&ob);
+  return NULL;
+}
+
+
 static char* test_init_error()
 {
   // null sandbox
@@ -817,6 +1322,180 @@ static char* benchmark_counter()
 }
 
 
+static char* benchmark_create()
+{
+  int iter = 10000;
+  lsb_lua_sandbox *sb;
+
+  clock_t t = clock();
+  for (int x = 0; x < iter; ++x) {
+    sb = lsb_create(NULL, "lua/counter.lua", test_cfg, NULL);
+    lsb_destroy(sb);
+  }
+  t = clock() - t;
+  printf("benchmark_create() %g seconds\n", ((double)t) / CLOCKS_PER_SEC
+         / iter);
+
+  lsb_config *c = lsb_create_config(test_cfg, NULL);
+  mu_assert(c, "lsb_create_config() failed");
+  t = clock();
+  for (int x = 0; x < iter; ++x) {
+    sb = lsb_create_with_config(NULL, "lua/counter.lua", c, NULL);
+    lsb_destroy(sb);
+  }
+  t = clock() - t;
+  lsb_destroy_config(c);
+  printf("benchmark_create_with_config() %g seconds\n", ((double)t)
+         / CLOCKS_PER_SEC / iter);
+  return NULL;
+}
+
+
+static char* benchmark_clone()
+{
+  enum { iter = 1000 };
+  static lsb_lua_sandbox *sb[iter];
+  lsb_config *cfg = lsb_create_config("path = 'lua/?.lua'", NULL);
+  mu_assert(cfg, "lsb_create_config() failed");
+
+  clock_t t = clock();
+  for (int x = 0; x < iter; ++x) {
+    sb[x] = lsb_create_with_config(NULL, "lua/clone.lua", cfg, NULL);
+    lsb_init(sb[x], NULL);
+  }
+  t = clock() - t;
+  for (int x = 0; x < iter; ++x) lsb_destroy(sb[x]);
+  printf("benchmark_clone() init %g seconds\n", ((double)t) / CLOCKS_PER_SEC
+         / iter);
+
+  lsb_lua_sandbox *proto = lsb_create_with_config(NULL, "lua/clone.lua", cfg,
+                                                  NULL);
+  lsb_err_value ret = lsb_init(proto, NULL);
+  mu_assert(!ret, "lsb_init() received: %s", ret);
+  t = clock();
+  for (int x = 0; x < iter; ++x) {
+    sb[x] = lsb_clone(proto, NULL, cfg, NULL);
+  }
+  t = clock() - t;
+  for (int x = 0; x < iter; ++x) lsb_destroy(sb[x]);
+  printf("benchmark_clone() clone %g seconds\n", ((double)t) / CLOCKS_PER_SEC
+         / iter);
+  lsb_destroy(proto);
+  lsb_destroy_config(cfg);
+  return NULL;
+}
+
+
+static char* test_random()
+{
+  lsb_lua_sandbox *sb = lsb_create(NULL, "lua/random.lua", NULL, NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  lsb_err_value ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  int result = lsb_test_process(sb, 0);
+  mu_assert(result == 0, "process() received: %d %s", result,
+            lsb_get_error(sb));
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  return NULL;
+}
+
+
+static char* test_interpreter()
+{
+  lsb_lua_sandbox *sb = lsb_create(NULL, "lua/interpreter.lua",
+                                   "instruction_limit = 10000;", NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  lsb_err_value ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+
+  int result = lsb_test_process(sb, 0);
+  mu_assert(result == 0, "process() received: %d %s", result,
+            lsb_get_error(sb));
+  // the instruction count must not depend on the VM dispatch method
+  size_t u = lsb_usage(sb, LSB_UT_INSTRUCTION, LSB_US_CURRENT);
+  mu_assert(u == 1113, "Current instructions received: %" PRIuSIZE, u);
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+
+  sb = lsb_create(NULL, "lua/interpreter.lua", "instruction_limit = 1000;",
+                  NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s", ret);
+  result = lsb_test_process(sb, 0);
+  mu_assert(result == 1, "process() received: %d", result);
+  const char *expected = "process() instruction_limit exceeded";
+  mu_assert(strcmp(lsb_get_error(sb), expected) == 0, "received: %s",
+            lsb_get_error(sb));
+  e = lsb_destroy(sb);
+  free(e);
+  e = NULL;
+  return NULL;
+}
+
+
+static char* benchmark_interpreter()
+{
+  // existing plugins: a global update and a numeric for loop
+  struct {
+    const char  *file;
+    int         tc;
+    int         iter;
+  } plugins[] = {
+    { "lua/counter.lua", 0, 1000000 },
+    { "lua/profile.lua", 2, 1000 },
+  };
+
+  for (size_t i = 0; i < sizeof(plugins) / sizeof(plugins[0]); ++i) {
+    lsb_lua_sandbox *sb = lsb_create(NULL, plugins[i].file, test_cfg, NULL);
+    mu_assert(sb, "lsb_create() received: NULL");
+    lsb_err_value ret = lsb_init(sb, NULL);
+    mu_assert(!ret, "lsb_init() received: %s", ret);
+    clock_t t = clock();
+    for (int x = 0; x < plugins[i].iter; ++x) {
+      mu_assert(lsb_test_process(sb, plugins[i].tc) == 0, "%s",
+                lsb_get_error(sb));
+    }
+    t = clock() - t;
+    e = lsb_destroy(sb);
+    mu_assert(!e, "lsb_destroy() received: %s", e);
+    printf("benchmark_interpreter() %s %g seconds\n", plugins[i].file,
+           ((double)t) / CLOCKS_PER_SEC / plugins[i].iter);
+  }
+  return NULL;
+}
+
+
+static char* benchmark_profiler()
+{
+  int iter = 1000;
+  const char *cfg[] = {
+    "memory_limit = 0\ninstruction_limit = 1000000\noutput_limit = 0\n"
+    MODULE_PATH,
+    "memory_limit = 0\ninstruction_limit = 1000000\noutput_limit = 0\n"
+    "profile_interval = 10000\n" MODULE_PATH
+  };
+
+  for (int i = 0; i < 2; ++i) {
+    lsb_lua_sandbox *sb = lsb_create(NULL, "lua/profile.lua", cfg[i], NULL);
+    mu_assert(sb, "lsb_create() received: NULL");
+    lsb_err_value ret = lsb_init(sb, NULL);
+    mu_assert(!ret, "lsb_init() received: %s", ret);
+    clock_t t = clock();
+    for (int x = 0; x < iter; ++x) {
+      mu_assert(lsb_test_process(sb, 0) == 0, "%s", lsb_get_error(sb));
+    }
+    t = clock() - t;
+    e = lsb_destroy(sb);
+    mu_assert(!e, "lsb_destroy() received: %s", e);
+    printf("benchmark_profiler() %s %g seconds\n", i ? "on" : "off",
+           ((double)t) / CLOCKS_PER_SEC / iter);
+  }
+  return NULL;
+}
+
+
 static char* benchmark_serialize()
 {
   int iter = 1000;
@@ -897,6 +1576,13 @@ static char* all_tests()
   mu_run_test(test_create);
   mu_run_test(test_create_error);
   mu_run_test(test_read_config);
+  mu_run_test(test_create_config);
+  mu_run_test(test_bytecode_cache);
+  mu_run_test(test_clone);
+  mu_run_test(test_shared_data);
+  mu_run_test(test_soft_memory_limit);
+  mu_run_test(test_heap_profile);
+  mu_run_test(test_profiler);
   mu_run_test(test_init_error);
   mu_run_test(test_destroy_error);
   mu_run_test(test_usage_error);
@@ -914,8 +1600,14 @@ static char* all_tests()
   mu_run_test(test_print_disabled);
   mu_run_test(test_print_lsb_test_logger);
   mu_run_test(test_serialize_binary);
+  mu_run_test(test_random);
+  mu_run_test(test_interpreter);
 
+  mu_run_test(benchmark_create);
+  mu_run_test(benchmark_clone);
   mu_run_test(benchmark_counter);
+  mu_run_test(benchmark_interpreter);
+  mu_run_test(benchmark_profiler);
   mu_run_test(benchmark_serialize);
   mu_run_test(benchmark_deserialize);
   mu_run_test(benchmark_lua_types_output);
@@ -16,6 +16,7 @@
 #include "../luasandbox_defines.h"
 #include "luasandbox/util/output_buffer.h"
 #include "luasandbox/util/protobuf.h"
+#include "luasandbox/util/random.h"
 
 static size_t decode_header(char *buf,
                             size_t len,
@@ -209,6 +210,81 @@ process_fields(lsb_heka_field *f, const char *p, const char *e)
 }
 
 
+static const char*
+read_header(int tag, int wiretype, const char *p, const char *e,
+            lsb_heka_message *m)
+{
+  long long val = 0;
+  switch (tag) {
+  case LSB_PB_UUID:
+    p = read_string(wiretype, p, e, &m->uuid);
+    if (m->uuid.len != LSB_UUID_SIZE) p = NULL;
+    break;
+
+  case LSB_PB_TIMESTAMP:
+    p = process_varint(wiretype, p, e, &m->timestamp);
+    break;
+
+  case LSB_PB_TYPE:
+    p = read_string(wiretype, p, e, &m->type);
+    break;
+
+  case LSB_PB_LOGGER:
+    p = read_string(wiretype, p, e, &m->logger);
+    break;
+
+  case LSB_PB_SEVERITY:
+    p = process_varint(wiretype, p, e, &val);
+    if (p) m->severity = (int)val;
+    break;
+
+  case LSB_PB_PAYLOAD:
+    p = read_string(wiretype, p, e, &m->payload);
+    break;
+
+  case LSB_PB_ENV_VERSION:
+    p = read_string(wiretype, p, e, &m->env_version);
+    break;
+
+  case LSB_PB_PID:
+    p = process_varint(wiretype, p, e, &val);
+    if (p) m->pid = (int)val;
+    break;
+
+  case LSB_PB_HOSTNAME:
+    p = read_string(wiretype, p, e, &m->hostname);
+    break;
+
+  default:
+    p = NULL;
+    break;
+  }
+  return p;
+}
+
+
+static const char* skip_value(int wiretype, const char *p, const char *e)
+{
+  long long vi;
+  switch (wiretype) {
+  case LSB_PB_WT_VARINT:
+    return lsb_pb_read_varint(p, e, &vi);
+  case LSB_PB_WT_FIXED64:
+    return e - p >= 8 ? p + 8 : NULL;
+  case LSB_PB_WT_LENGTH:
+    p = lsb_pb_read_varint(p, e, &vi);
+    if (!p || vi < 0 || vi > e - p) {
+      return NULL;
+    }
+    return p + vi;
+  case LSB_PB_WT_FIXED32:
+    return e - p >= 4 ? p + 4 : NULL;
+  default:
+    return NULL;
+  }
+}
+
+
 bool lsb_decode_heka_message(lsb_heka_message *m,
                              const char *buf,
                              size_t len,
@@ -226,7 +302,6 @@ bool lsb_decode_heka_message(lsb_heka_message *m,
   const char *ep  = buf + len; // end position
   int wiretype    = 0;
   int tag         = 0;
-  long long val   = 0;
   bool timestamp  = false;
 
   lsb_clear_heka_message(m);
@@ -235,46 +310,6 @@ bool lsb_decode_heka_message(lsb_heka_message *m,
     cp = lsb_pb_read_key(cp, &tag, &wiretype);
 
     switch (tag) {
-    case LSB_PB_UUID:
-      cp = read_string(wiretype, cp, ep, &m->uuid);
-      if (m->uuid.len != LSB_UUID_SIZE) cp = NULL;
-      break;
-
-    case LSB_PB_TIMESTAMP:
-      cp = process_varint(wiretype, cp, ep, &m->timestamp);
-      if (cp) timestamp = true;
-      break;
-
-    case LSB_PB_TYPE:
-      cp = read_string(wiretype, cp, ep, &m->type);
-      break;
-
-    case LSB_PB_LOGGER:
-      cp = read_string(wiretype, cp, ep, &m->logger);
-      break;
-
-    case LSB_PB_SEVERITY:
-      cp = process_varint(wiretype, cp, ep, &val);
-      if (cp) m->severity = (int)val;
-      break;
-
-    case LSB_PB_PAYLOAD:
-      cp = read_string(wiretype, cp, ep, &m->payload);
-      break;
-
-    case LSB_PB_ENV_VERSION:
-      cp = read_string(wiretype, cp, ep, &m->env_version);
-      break;
-
-    case LSB_PB_PID:
-      cp = process_varint(wiretype, cp, ep, &val);
-      if (cp) m->pid = (int)val;
-      break;
-
-    case LSB_PB_HOSTNAME:
-      cp = read_string(wiretype, cp, ep, &m->hostname);
-      break;
-
     case LSB_PB_FIELDS:
       if (wiretype != 2) {
         cp = NULL;
@@ -300,7 +335,8 @@ bool lsb_decode_heka_message(lsb_heka_message *m,
       break;
 
     default:
-      cp = NULL;
+      cp = read_header(tag, wiretype, cp, ep, m);
+      if (cp && tag == LSB_PB_TIMESTAMP) timestamp = true;
       break;
     }
     if (cp) lp = cp;
@@ -478,6 +514,135 @@ void lsb_free_heka_message(lsb_heka_message *m)
 }
 
 
+void lsb_init_heka_field_index(lsb_heka_field_index *fx)
+{
+  if (!fx) return;
+  memset(fx, 0, sizeof(lsb_heka_field_index));
+  fx->gen = 1; // zeroed slices are never valid
+}
+
+
+void lsb_reset_heka_field_index(lsb_heka_field_index *fx)
+{
+  if (!fx) return;
+  fx->offsets_len = 0;
+  if (++fx->gen == 0) { // wrapped, invalidate every slice explicitly
+    if (fx->slices) {
+      memset(fx->slices, 0, fx->slices_size * sizeof(lsb_heka_field_slice));
+    }
+    fx->gen = 1;
+  }
+}
+
+
+void lsb_free_heka_field_index(lsb_heka_field_index *fx)
+{
+  if (!fx) return;
+  free(fx->offsets);
+  free(fx->slices);
+  lsb_init_heka_field_index(fx);
+}
+
+
+static lsb_heka_field*
+find_field(const lsb_heka_message *m, lsb_const_string *name, int fi)
+{
+  int fcnt = 0;
+  for (int i = 0; i < m->fields_len; ++i) {
+    if (name->len == m->fields[i].name.len
+        && strncmp(name->s, m->fields[i].name.s, m->fields[i].name.len) == 0) {
+      if (fi == fcnt++) {
+        return &m->fields[i];
+      }
+    }
+  }
+  return NULL;
+}
+
+
+static lsb_heka_field_slice*
+index_field(const lsb_heka_message *m, lsb_heka_field_index *fx,
+            const lsb_heka_field *f)
+{
+  int fpos = (int)(f - m->fields);
+  if (fpos >= fx->slices_size) {
+    lsb_heka_field_slice *tmp = realloc(fx->slices, m->fields_len
+                                        * sizeof(lsb_heka_field_slice));
+    if (!tmp) return NULL;
+    memset(tmp + fx->slices_size, 0, (m->fields_len - fx->slices_size)
+           * sizeof(lsb_heka_field_slice));
+    fx->slices = tmp;
+    fx->slices_size = m->fields_len;
+  }
+  lsb_heka_field_slice *slice = &fx->slices[fpos];
+  if (slice->gen == fx->gen) return slice;
+
+  const char *p = f->value.s;
+  const char *e = p + f->value.len;
+  int pos       = fx->offsets_len;
+  int tag       = 0;
+  int wiretype  = 0;
+  long long ll  = 0;
+  lsb_const_string s;
+
+  while (p && p < e) {
+    if (fx->offsets_len == fx->offsets_size) {
+      int size = fx->offsets_size ? fx->offsets_size * 2 : 64;
+      unsigned *tmp = realloc(fx->offsets, size * sizeof(unsigned));
+      if (!tmp) {
+        fx->offsets_len = pos;
+        return NULL;
+      }
+      fx->offsets = tmp;
+      fx->offsets_size = size;
+    }
+    fx->offsets[fx->offsets_len++] = (unsigned)(p - f->value.s);
+    if (f->value_type == LSB_PB_STRING || f->value_type == LSB_PB_BYTES) {
+      p = lsb_pb_read_key(p, &tag, &wiretype);
+      p = read_string(wiretype, p, e, &s);
+    } else {
+      p = lsb_pb_read_varint(p, e, &ll);
+    }
+    if (!p) --fx->offsets_len; // a truncated value is not readable
+  }
+  slice->gen = fx->gen;
+  slice->pos = pos;
+  slice->len = fx->offsets_len - pos;
+  return slice;
+}
+
+
+bool lsb_read_heka_field_value(const lsb_heka_field *f,
+                               int ai,
+                               lsb_read_value *val)
+{
+  if (!f || !val) {
+    return false;
+  }
+
+  const char *p = f->value.s;
+  const char *e = p + f->value.len;
+  val->type = LSB_READ_NIL;
+  switch (f->value_type) {
+  case LSB_PB_STRING:
+  case LSB_PB_BYTES:
+    return read_string_value(p, e, ai, val);
+  case LSB_PB_INTEGER:
+    return read_integer_value(p, e, ai, val);
+  case LSB_PB_BOOL:
+    if (read_integer_value(p, e, ai, val)) {
+      val->type = LSB_READ_BOOL;
+      return true;
+    }
+    return false;
+  case LSB_PB_DOUBLE:
+    return read_double_value(p, e, ai, val);
+  default:
+    return false;
+  }
+}
+
+
 bool lsb_read_heka_field(const lsb_heka_message *m,
                          lsb_const_string *name,
                          int fi,
@@ -488,35 +653,168 @@ bool lsb_read_heka_field(const lsb_heka_message *m,
     return false;
   }
 
-  int fcnt = 0;
-  const char *p, *e;
   val->type = LSB_READ_NIL;
+  lsb_heka_field *f = find_field(m, name, fi);
+  return f ? lsb_read_heka_field_value(f, ai, val) : false;
+}
 
-  for (int i = 0; i < m->fields_len; ++i) {
-    if (name->len == m->fields[i].name.len
-        && strncmp(name->s, m->fields[i].name.s, m->fields[i].name.len) == 0) {
-      if (fi == fcnt++) {
-        p = m->fields[i].value.s;
-        e = p + m->fields[i].value.len;
-        switch (m->fields[i].value_type) {
-        case LSB_PB_STRING:
-        case LSB_PB_BYTES:
-          return read_string_value(p, e, ai, val);
-        case LSB_PB_INTEGER:
-          return read_integer_value(p, e, ai, val);
-        case LSB_PB_BOOL:
-          if (read_integer_value(p, e, ai, val)) {
-            val->type = LSB_READ_BOOL;
-            return true;
-          }
-          return false;
-        case LSB_PB_DOUBLE:
-          return read_double_value(p, e, ai, val);
-        default:
-          return false;
+
+bool lsb_read_indexed_heka_field(const lsb_heka_message *m,
+                                 lsb_heka_field_index *fx,
+                                 lsb_const_string *name,
+                                 int fi,
+                                 int ai,
+                                 lsb_read_value *val)
+{
+  if (!m || !name || !val) {
+    return false;
+  }
+
+  val->type = LSB_READ_NIL;
+  lsb_heka_field *f = find_field(m, name, fi);
+  if (!f || ai < 0) return false;
+
+  lsb_heka_field_slice *slice = NULL;
+  switch (f->value_type) {
+  case LSB_PB_STRING:
+  case LSB_PB_BYTES:
+  case LSB_PB_INTEGER:
+  case LSB_PB_BOOL:
+    if (ai == 0 || !fx || !(slice = index_field(m, fx, f))) {
+      break; // no need to index or out of memory; fall back to the scan
+    }
+    if (ai >= slice->len) return false;
+    {
+      const char *p = f->value.s + fx->offsets[slice->pos + ai];
+      const char *e = f->value.s + f->value.len;
+      if (f->value_type == LSB_PB_STRING || f->value_type == LSB_PB_BYTES) {
+        return read_string_value(p, e, 0, val);
+      }
+      if (read_integer_value(p, e, 0, val)) {
+        if (f->value_type == LSB_PB_BOOL) val->type = LSB_READ_BOOL;
+        return true;
+      }
+      return false;
+    }
+  default:
+    break;
+  }
+  return lsb_read_heka_field_value(f, ai, val);
+}
+
+
+int lsb_read_heka_field_values(const lsb_heka_field *f,
+                               lsb_read_value *vals,
+                               int n)
+{
+  if (!f) return 0;
+  if (!vals) n = 0;
+
+  const char *p = f->value.s;
+  const char *e = p + f->value.len;
+  int cnt = 0;
+  int tag = 0;
+  int wiretype = 0;
+  lsb_const_string s;
+
+  switch (f->value_type) {
+  case LSB_PB_STRING:
+  case LSB_PB_BYTES:
+    while (p && p < e) {
+      p = lsb_pb_read_key(p, &tag, &wiretype);
+      p = read_string(wiretype, p, e, &s);
+      if (p) {
+        if (cnt < n) {
+          vals[cnt].type = LSB_READ_STRING;
+          vals[cnt].u.s = s;
+        }
+        ++cnt;
+      }
+    }
+    break;
+  case LSB_PB_INTEGER:
+  case LSB_PB_BOOL:
+    while (p && p < e) {
+      long long ll[64];
+      size_t len = sizeof(ll) / sizeof(ll[0]);
+      p = lsb_pb_read_packed_varint(p, e, ll, &len);
+      for (size_t i = 0; i < len; ++i, ++cnt) {
+        if (cnt < n) {
+          vals[cnt].type = f->value_type == LSB_PB_BOOL ? LSB_READ_BOOL
+              : LSB_READ_NUMERIC;
+          vals[cnt].u.d = (double)ll[i];
         }
       }
     }
+    break;
+  case LSB_PB_DOUBLE:
+    cnt = (int)(f->value.len / sizeof(double));
+    for (int i = 0; i < cnt && i < n; ++i) {
+      vals[i].type = LSB_READ_NUMERIC;
+      memcpy(&vals[i].u.d, p + sizeof(double) * i, sizeof(double));
+    }
+    break;
+  default:
+    break;
+  }
+  return cnt;
+}
+
+
+const char* lsb_decode_heka_header(lsb_heka_message *m,
+                                   const char *p,
+                                   const char *e,
+                                   int *tag)
+{
+  if (!m || !p || !tag || p >= e) {
+    return NULL;
+  }
+
+  int wiretype = 0;
+  p = lsb_pb_read_key(p, tag, &wiretype);
+  if (*tag == LSB_PB_FIELDS) {
+    return skip_value(wiretype, p, e);
+  }
+  p = read_header(*tag, wiretype, p, e, m);
+  if (!p && *tag == LSB_PB_UUID) {
+    lsb_init_const_string(&m->uuid);
+  }
+  return p;
+}
+
+
+bool lsb_read_encoded_heka_field(const char *buf,
+                                 size_t len,
+                                 lsb_const_string *name,
+                                 int fi,
+                                 int ai,
+                                 lsb_read_value *val)
+{
+  if (!buf || !name || !val) {
+    return false;
+  }
+
+  const char *p = buf;
+  const char *e = buf + len;
+  int fcnt      = 0;
+  int tag       = 0;
+  int wiretype  = 0;
+  lsb_heka_field f;
+  val->type = LSB_READ_NIL;
+
+  while (p && p < e) {
+    p = lsb_pb_read_key(p, &tag, &wiretype);
+    if (tag != LSB_PB_FIELDS || wiretype != LSB_PB_WT_LENGTH) {
+      p = skip_value(wiretype, p, e);
+      continue;
+    }
+    p = process_fields(&f, p, e);
+    if (p && name->len == f.name.len
+        && memcmp(name->s, f.name.s, f.name.len) == 0) {
+      if (fi == fcnt++) {
+        return lsb_read_heka_field_value(&f, ai, val);
+      }
+    }
   }
   return false;
 }
@@ -568,9 +866,8 @@ lsb_write_heka_uuid(lsb_output_buffer *ob, const char *uuid, size_t len)
   }
 
   if (ob->pos == 2) { // only the header has been written
-    for (int x = 0; x < LSB_UUID_SIZE; ++x) {
-      ob->buf[ob->pos++] = rand() % 256;
-    }
+    lsb_prng_fill(lsb_prng_thread(), ob->buf + ob->pos, LSB_UUID_SIZE);
+    ob->pos += LSB_UUID_SIZE;
     ob->buf[8] = (ob->buf[8] & 0x0F) | 0x40;
     ob->buf[10] = (ob->buf[10] & 0x0F) | 0xA0;
   }
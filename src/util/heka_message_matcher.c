@@ -15,8 +15,201 @@
 
 #include "luasandbox/util/heka_message.h"
 #include "luasandbox/util/heka_message_matcher.h"
+#include "luasandbox/util/protobuf.h"
 #include "luasandbox/util/string.h"
 #include "luasandbox/util/string_matcher.h"
+#include "luasandbox/util/util.h"
+
+#ifdef _WIN32
+#include <windows.h>
+static SRWLOCK cache_lock = SRWLOCK_INIT;
+#define lock_cache() AcquireSRWLockExclusive(&cache_lock)
+#define unlock_cache() ReleaseSRWLockExclusive(&cache_lock)
+#else
+#include <pthread.h>
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_cache() pthread_mutex_lock(&cache_lock)
+#define unlock_cache() pthread_mutex_unlock(&cache_lock)
+#endif
+
+#define SET_MIN_SIZE 8
+#define CACHE_MIN_SIZE 64
+#define PROFILE_SAMPLE_MASK 15 // time one in sixteen messages
+
+typedef struct match_set_entry {
+  uint64_t  hash;
+  char      *s; // NULL for numeric entries
+  size_t    len;
+  double    d;
+  bool      used;
+} match_set_entry;
+
+typedef struct raw_message {
+  lsb_heka_message  m;    // headers decoded so far
+  const char        *buf;
+  size_t            len;
+  const char        *p;   // next undecoded key
+  const char        *e;
+} raw_message;
+
+struct match_set {
+  size_t          size;
+  size_t          cnt;
+  match_set_entry *entries;
+};
+
+// process wide table of the shared matchers, chained by mm->next
+static struct {
+  size_t              size;
+  size_t              cnt;
+  lsb_message_matcher **buckets;
+} cache;
+
+
+static uint64_t hash_string(const char *s, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+
+static uint64_t hash_numeric(double d)
+{
+  if (d == 0) d = 0; // -0 == 0
+  uint64_t h;
+  memcpy(&h, &d, sizeof(h));
+  h *= 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 32);
+}
+
+
+match_set* match_set_create(void)
+{
+  match_set *set = calloc(1, sizeof(match_set));
+  if (!set) return NULL;
+  set->entries = calloc(SET_MIN_SIZE, sizeof(match_set_entry));
+  if (!set->entries) {
+    free(set);
+    return NULL;
+  }
+  set->size = SET_MIN_SIZE;
+  return set;
+}
+
+
+void match_set_destroy(match_set *set)
+{
+  if (!set) return;
+  for (size_t i = 0; i < set->size; ++i) {
+    free(set->entries[i].s);
+  }
+  free(set->entries);
+  free(set);
+}
+
+
+static match_set_entry* find_entry(const match_set *set, uint64_t hash,
+                                   const char *s, size_t len, double d)
+{
+  size_t mask = set->size - 1;
+  size_t i = (size_t)hash & mask;
+  for (; set->entries[i].used; i = (i + 1) & mask) {
+    match_set_entry *e = &set->entries[i];
+    if (e->hash != hash) continue;
+    if (s ? e->len == len && memcmp(e->s, s, len) == 0 : e->d == d) {
+      return e;
+    }
+  }
+  return &set->entries[i];
+}
+
+
+static bool grow_set(match_set *set)
+{
+  if ((set->cnt + 1) * 2 <= set->size) return true;
+
+  size_t size = set->size * 2;
+  match_set_entry *entries = calloc(size, sizeof(match_set_entry));
+  if (!entries) return false;
+  for (size_t i = 0; i < set->size; ++i) {
+    if (!set->entries[i].used) continue;
+    size_t j = (size_t)set->entries[i].hash & (size - 1);
+    while (entries[j].used) j = (j + 1) & (size - 1);
+    entries[j] = set->entries[i];
+  }
+  free(set->entries);
+  set->entries = entries;
+  set->size = size;
+  return true;
+}
+
+
+bool match_set_add_string(match_set *set, char *s, size_t len)
+{
+  if (!grow_set(set)) {
+    free(s);
+    return false;
+  }
+  uint64_t hash = hash_string(s, len);
+  match_set_entry *e = find_entry(set, hash, s, len, 0);
+  if (e->used) {
+    free(s);
+    return true;
+  }
+  e->hash = hash;
+  e->s = s;
+  e->len = len;
+  e->used = true;
+  set->cnt++;
+  return true;
+}
+
+
+bool match_set_add_numeric(match_set *set, double d)
+{
+  if (!grow_set(set)) return false;
+  uint64_t hash = hash_numeric(d);
+  match_set_entry *e = find_entry(set, hash, NULL, 0, d);
+  if (e->used) return true;
+  e->hash = hash;
+  e->d = d;
+  e->used = true;
+  set->cnt++;
+  return true;
+}
+
+
+bool match_set_has_string(const match_set *set, const char *s, size_t len)
+{
+  return find_entry(set, hash_string(s, len), s, len, 0)->used;
+}
+
+
+bool match_set_has_numeric(const match_set *set, double d)
+{
+  return find_entry(set, hash_numeric(d), NULL, 0, d)->used;
+}
+
+
+static match_set* get_set(match_node *mn)
+{
+  match_set *set;
+  memcpy(&set, mn->data + match_set_offset(mn->var_len), sizeof(set));
+  return set;
+}
+
+
+static bool pattern_match(match_node *mn, lsb_const_string *val)
+{
+  lsb_string_pattern *sp;
+  memcpy(&sp, mn->data + match_pattern_offset(mn->var_len, mn->val_len),
+         sizeof(sp));
+  if (sp) return lsb_string_pattern_match(sp, val->s, val->len);
+  return lsb_string_match(val->s, val->len, mn->data + mn->var_len);
+}
 
 
 static bool string_test(match_node *mn, lsb_const_string *val)
@@ -53,14 +246,16 @@ static bool string_test(match_node *mn, lsb_const_string *val)
     if (mn->val_mod == PATTERN_MOD_ESC) {
       return lsb_string_find(val->s, val->len, mn_val, mn->val_len);
     } else {
-      return lsb_string_match(val->s, val->len, mn_val);
+      return pattern_match(mn, val);
     }
   case OP_NRE:
     if (mn->val_mod == PATTERN_MOD_ESC) {
       return !lsb_string_find(val->s, val->len, mn_val, mn->val_len);
     } else {
-      return !lsb_string_match(val->s, val->len, mn_val);
+      return !pattern_match(mn, val);
     }
+  case OP_IN:
+    return val->s && match_set_has_string(get_set(mn), val->s, val->len);
   default:
     break;
   }
@@ -70,6 +265,9 @@ static bool string_test(match_node *mn, lsb_const_string *val)
 
 static bool numeric_test(match_node *mn, double val)
 {
+  if (mn->op == OP_IN) {
+    return match_set_has_numeric(get_set(mn), val);
+  }
   double d = 0;
   memcpy(&d, mn->data + mn->var_len, sizeof(double));
   switch (mn->op) {
@@ -92,6 +290,40 @@ static bool numeric_test(match_node *mn, double val)
 }
 
 
+static bool field_test(match_node *mn, bool found, lsb_read_value *val)
+{
+  if (!found) {
+    return mn->val_type == TYPE_NIL && mn->op == OP_EQ;
+  }
+
+  switch (mn->val_type) {
+  case TYPE_STRING:
+    if (val->type == LSB_READ_STRING) {
+      return string_test(mn, &val->u.s);
+    }
+    break;
+  case TYPE_NUMERIC:
+    if (val->type == LSB_READ_NUMERIC) {
+      return numeric_test(mn, val->u.d);
+    }
+    break;
+  case TYPE_TRUE:
+    if (val->type == LSB_READ_BOOL || val->type == LSB_READ_NUMERIC) {
+      return mn->op == OP_EQ ? val->u.d == true : val->u.d != true;
+    }
+    break;
+  case TYPE_FALSE:
+    if (val->type == LSB_READ_BOOL || val->type == LSB_READ_NUMERIC) {
+      return mn->op == OP_EQ ? val->u.d == false: val->u.d != false;
+    }
+    break;
+  case TYPE_NIL:
+    return mn->op == OP_NE;
+  }
+  return false;
+}
+
+
 static bool eval_node(match_node *mn, lsb_heka_message *m)
 {
   switch (mn->op) {
@@ -147,41 +379,10 @@ static bool eval_node(match_node *mn, lsb_heka_message *m)
       {
         lsb_read_value val;
         lsb_const_string variable = { .s = mn->data, .len = mn->var_len };
-
-        if (!lsb_read_heka_field(m, &variable, mn->u.idx.f, mn->u.idx.a,
-                                 &val)) {
-          if (mn->val_type == TYPE_NIL) {
-            return mn->op == OP_EQ;
-          }
-          return false;
-        }
-
-        switch (mn->val_type) {
-        case TYPE_STRING:
-          if (val.type == LSB_READ_STRING) {
-            return string_test(mn, &val.u.s);
-          }
-          break;
-        case TYPE_NUMERIC:
-          if (val.type == LSB_READ_NUMERIC) {
-            return numeric_test(mn, val.u.d);
-          }
-          break;
-        case TYPE_TRUE:
-          if (val.type == LSB_READ_BOOL || val.type == LSB_READ_NUMERIC) {
-            return mn->op == OP_EQ ? val.u.d == true : val.u.d != true;
-          }
-          break;
-        case TYPE_FALSE:
-          if (val.type == LSB_READ_BOOL || val.type == LSB_READ_NUMERIC) {
-            return mn->op == OP_EQ ? val.u.d == false: val.u.d != false;
-          }
-          break;
-        case TYPE_NIL:
-          return mn->op == OP_NE;
-        }
+        bool found = lsb_read_heka_field(m, &variable, mn->u.idx.f,
+                                         mn->u.idx.a, &val);
+        return field_test(mn, found, &val);
       }
-      break;
     }
     break;
   }
@@ -189,19 +390,255 @@ static bool eval_node(match_node *mn, lsb_heka_message *m)
 }
 
 
+static void resolve_headers(raw_message *rm)
+{
+  int tag;
+  // a repeated header can follow anywhere so all of them are decoded; the last
+  // occurrence is kept, as it is by lsb_decode_heka_message
+  while (rm->p && rm->p < rm->e) {
+    rm->p = lsb_decode_heka_header(&rm->m, rm->p, rm->e, &tag);
+  }
+}
+
+
+static bool eval_raw(match_node *mn, raw_message *rm)
+{
+  switch (mn->field_id) {
+  case 0:
+    break;
+  case LSB_PB_FIELDS:
+    {
+      lsb_read_value val;
+      lsb_const_string variable = { .s = mn->data, .len = mn->var_len };
+      bool found = lsb_read_encoded_heka_field(rm->buf, rm->len, &variable,
+                                               mn->u.idx.f, mn->u.idx.a, &val);
+      return field_test(mn, found, &val);
+    }
+  default:
+    resolve_headers(rm);
+    break;
+  }
+  return eval_node(mn, &rm->m);
+}
+
+
+/**
+ * Collapses each run of whitespace outside of the quoted strings and field
+ * names to a single space and trims the ends. The grammar accepts any amount of
+ * whitespace wherever it accepts one space so the result parses identically.
+ */
+static char* normalize_exp(const char *exp, size_t *len)
+{
+  char *norm = malloc(strlen(exp) + 1);
+  if (!norm) return NULL;
+
+  char *d = norm;
+  char quote = 0;
+  bool field = false;
+  bool space = false;
+  for (const char *p = exp; *p; ++p) {
+    if (quote) {
+      *d++ = *p;
+      if (*p == '\\' && (p[1] == quote || p[1] == '\\')) {
+        *d++ = *++p;
+      } else if (*p == quote) {
+        quote = 0;
+      }
+      continue;
+    }
+    if (field) {
+      *d++ = *p;
+      if (*p == ']') field = false;
+      continue;
+    }
+    switch (*p) {
+    case ' ':
+    case '\r':
+    case '\n':
+    case '\t':
+      space = true;
+      continue;
+    case '\'':
+    case '"':
+      quote = *p;
+      break;
+    case '[':
+      field = true;
+      break;
+    }
+    if (space && d != norm) *d++ = ' ';
+    space = false;
+    *d++ = *p;
+  }
+  *d = 0;
+  *len = d - norm;
+  return norm;
+}
+
+
+static lsb_message_matcher* cache_find(const char *exp, size_t len,
+                                       uint64_t hash)
+{
+  if (!cache.size) return NULL;
+  lsb_message_matcher *mm = cache.buckets[hash & (cache.size - 1)];
+  for (; mm; mm = mm->next) {
+    if (mm->hash == hash && strncmp(mm->exp, exp, len + 1) == 0) break;
+  }
+  return mm;
+}
+
+
+static bool cache_insert(lsb_message_matcher *mm)
+{
+  if (cache.cnt >= cache.size) {
+    size_t size = cache.size ? cache.size * 2 : CACHE_MIN_SIZE;
+    lsb_message_matcher **buckets = calloc(size, sizeof(*buckets));
+    if (!buckets) return false;
+    for (size_t i = 0; i < cache.size; ++i) {
+      lsb_message_matcher *p = cache.buckets[i];
+      while (p) {
+        lsb_message_matcher *next = p->next;
+        p->next = buckets[p->hash & (size - 1)];
+        buckets[p->hash & (size - 1)] = p;
+        p = next;
+      }
+    }
+    free(cache.buckets);
+    cache.buckets = buckets;
+    cache.size = size;
+  }
+  lsb_message_matcher **b = &cache.buckets[mm->hash & (cache.size - 1)];
+  mm->next = *b;
+  *b = mm;
+  ++cache.cnt;
+  return true;
+}
+
+
+static void cache_remove(lsb_message_matcher *mm)
+{
+  lsb_message_matcher **p = &cache.buckets[mm->hash & (cache.size - 1)];
+  while (*p != mm) p = &(*p)->next;
+  *p = mm->next;
+  if (--cache.cnt == 0) {
+    free(cache.buckets);
+    cache.buckets = NULL;
+    cache.size = 0;
+  }
+}
+
+
+lsb_message_matcher* lsb_acquire_message_matcher(const char *exp)
+{
+  if (!exp) return NULL;
+
+  size_t len;
+  char *norm = normalize_exp(exp, &len);
+  if (!norm) return NULL;
+  uint64_t hash = hash_string(norm, len);
+
+  lock_cache();
+  lsb_message_matcher *mm = cache_find(norm, len, hash);
+  if (mm) ++mm->refs;
+  unlock_cache();
+  if (mm) {
+    free(norm);
+    return mm;
+  }
+
+  // parse outside of the lock; if another thread wins the race use its copy
+  lsb_message_matcher *created = lsb_create_message_matcher(norm);
+  if (!created) {
+    free(norm);
+    return NULL;
+  }
+  created->exp = norm;
+  created->hash = hash;
+  created->refs = 1;
+
+  lock_cache();
+  mm = cache_find(norm, len, hash);
+  if (mm) {
+    ++mm->refs;
+  } else {
+    if (!cache_insert(created)) {
+      created->exp = NULL; // the cache cannot grow, the matcher is unshared
+    }
+    mm = created;
+  }
+  unlock_cache();
+  if (!created->exp) {
+    free(norm);
+  } else if (mm != created) {
+    created->exp = NULL;
+    free(norm);
+    lsb_destroy_message_matcher(created);
+  }
+  return mm;
+}
+
+
 void lsb_destroy_message_matcher(lsb_message_matcher *mm)
 {
   if (!mm) return;
+
+  if (mm->exp) {
+    lock_cache();
+    bool last = --mm->refs == 0;
+    if (last) cache_remove(mm);
+    unlock_cache();
+    if (!last) return;
+    free(mm->exp);
+  }
+
+  match_node *e = mm->nodes + (mm->bytes / sizeof(match_node));
+  for (match_node *p = mm->nodes; p < e; p += p->units) {
+    if (match_has_pattern(p->op, p->val_type, p->val_mod)) {
+      lsb_string_pattern *sp;
+      memcpy(&sp, p->data + match_pattern_offset(p->var_len, p->val_len),
+             sizeof(sp));
+      lsb_destroy_string_pattern(sp);
+    } else if (p->op == OP_IN) {
+      match_set_destroy(get_set(p));
+    }
+  }
   free(mm->nodes);
+  free(mm->stats);
   free(mm);
 }
 
 
-bool lsb_eval_message_matcher(lsb_message_matcher *mm, lsb_heka_message *m)
+static inline bool
+eval_test(match_node *mn, lsb_heka_message *m, raw_message *rm)
 {
-  bool match = false;
-  if (!mm) return match;
+  return rm ? eval_raw(mn, rm) : eval_node(mn, m);
+}
+
+
+static bool eval_profiled(lsb_message_matcher *mm, match_node *mn,
+                          lsb_heka_message *m, raw_message *rm)
+{
+  lsb_message_matcher_stats *s = &mm->stats[mn - mm->nodes];
+  bool match;
+  if ((mm->evals & PROFILE_SAMPLE_MASK) == 0) {
+    unsigned long long t = lsb_get_time();
+    match = eval_test(mn, m, rm);
+    s->ns += lsb_get_time() - t;
+    s->timed++;
+  } else {
+    match = eval_test(mn, m, rm);
+  }
+  s->evals++;
+  if (match) s->hits++;
+  return match;
+}
 
+
+static inline bool
+eval_matcher(lsb_message_matcher *mm, lsb_heka_message *m, raw_message *rm)
+{
+  bool match = false;
+  bool profiling = mm->stats != NULL;
   match_node *s = mm->nodes;
   match_node *e = mm->nodes + (mm->bytes / sizeof(match_node));
   for (match_node *p = mm->nodes; p < e;) {
@@ -219,10 +656,263 @@ bool lsb_eval_message_matcher(lsb_message_matcher *mm, lsb_heka_message *m)
       }
       break;
     default:
-      match = eval_node(p, m);
+      match = profiling ? eval_profiled(mm, p, m, rm) : eval_test(p, m, rm);
       break;
     }
     p += p->units;
   }
+  if (profiling && ++mm->evals && mm->interval
+      && mm->evals % mm->interval == 0) {
+    lsb_optimize_message_matcher(mm);
+  }
   return match;
 }
+
+
+bool lsb_eval_message_matcher(lsb_message_matcher *mm, lsb_heka_message *m)
+{
+  if (!mm) return false;
+  return eval_matcher(mm, m, NULL);
+}
+
+
+bool lsb_eval_message_matcher_raw(lsb_message_matcher *mm, const char *buf,
+                                  size_t len)
+{
+  if (!mm || !buf) return false;
+
+  raw_message rm;
+  memset(&rm.m, 0, sizeof(rm.m));
+  lsb_clear_heka_message(&rm.m);
+  rm.buf  = buf;
+  rm.len  = len;
+  rm.p    = buf;
+  rm.e    = buf + len;
+  return eval_matcher(mm, NULL, &rm);
+}
+
+
+static bool is_logical(const match_node *mn)
+{
+  return mn->op == OP_AND || mn->op == OP_OR;
+}
+
+
+bool lsb_profile_message_matcher(lsb_message_matcher *mm, unsigned interval)
+{
+  if (!mm || mm->exp) return false; // shared matchers are immutable
+  if (!mm->stats) {
+    size_t cnt = mm->bytes / sizeof(match_node);
+    mm->stats = calloc(cnt, sizeof(lsb_message_matcher_stats));
+    if (!mm->stats) return false;
+    unsigned test = 0;
+    for (size_t i = 0; i < cnt; i += mm->nodes[i].units) {
+      if (!is_logical(&mm->nodes[i])) mm->stats[i].test = test++;
+    }
+  }
+  mm->interval = interval;
+  return true;
+}
+
+
+size_t lsb_get_message_matcher_stats(const lsb_message_matcher *mm,
+                                     lsb_message_matcher_stats *stats,
+                                     size_t n)
+{
+  if (!mm || !mm->stats) return 0;
+
+  size_t tests = 0;
+  size_t cnt = mm->bytes / sizeof(match_node);
+  for (size_t i = 0; i < cnt; i += mm->nodes[i].units) {
+    if (is_logical(&mm->nodes[i])) continue;
+    ++tests;
+    unsigned test = mm->stats[i].test;
+    if (stats && test < n) stats[test] = mm->stats[i];
+  }
+  return tests;
+}
+
+
+/*
+** The node array is the in order layout of a binary tree where each logical
+** operator stores the node to jump to when it short circuits: its parent
+** operator for a left operand and its own target for a right operand (the
+** result of the right operand is the result of the parent). The tree is
+** rebuilt from the targets, each chain of the same operator is flattened, its
+** operands sorted by rank and then laid out again left deep.
+*/
+typedef struct tree_node {
+  size_t  pos;    // position in the current node array
+  size_t  units;  // size of the whole subtree
+  int     left;   // operand tree nodes (-1 for a test)
+  int     right;
+  double  cost;   // expected cost of evaluating the subtree
+  double  prob;   // probability of the subtree being true
+  bool    known;  // all tests in the subtree have been timed
+} tree_node;
+
+typedef struct tree {
+  const lsb_message_matcher *mm;
+  tree_node                 *n;
+  int                       cnt;
+} tree;
+
+
+static int decode(tree *t, size_t s, size_t e, size_t target)
+{
+  const match_node *nodes = t->mm->nodes;
+  int idx = t->cnt++;
+  tree_node *tn = &t->n[idx];
+  for (size_t i = s; i < e; i += nodes[i].units) {
+    // the leftmost operator exiting to the range target is its root
+    if (is_logical(&nodes[i]) && nodes[i].u.off == target) {
+      tn->pos = i;
+      tn->left = decode(t, s, i, i);
+      tn->right = decode(t, i + 1, e, target);
+      tn->units = e - s;
+      return idx;
+    }
+  }
+  tn->pos = s;
+  tn->units = nodes[s].units;
+  tn->left = -1;
+  tn->right = -1;
+  return idx;
+}
+
+
+static void collect(tree *t, int idx, int op, int *operands, int *ocnt,
+                    int *ops, int *cnt)
+{
+  const tree_node *tn = &t->n[idx];
+  if (tn->left < 0 || t->mm->nodes[tn->pos].op != op) {
+    operands[(*ocnt)++] = idx;
+    return;
+  }
+  collect(t, tn->left, op, operands, ocnt, ops, cnt);
+  ops[(*cnt)++] = idx;
+  collect(t, tn->right, op, operands, ocnt, ops, cnt);
+}
+
+
+// true if a should be evaluated before b
+static bool precedes(const tree_node *a, const tree_node *b, int op)
+{
+  if (op == OP_AND) {
+    // the cost per rejected message
+    return a->cost * (1 - b->prob) < b->cost * (1 - a->prob);
+  }
+  // the cost per accepted message
+  return a->cost * b->prob < b->cost * a->prob;
+}
+
+
+static void optimize(tree *t, int idx)
+{
+  tree_node *tn = &t->n[idx];
+  if (tn->left < 0) {
+    const lsb_message_matcher_stats *s = &t->mm->stats[tn->pos];
+    tn->known = s->evals && s->timed;
+    if (tn->known) {
+      tn->cost = (double)s->ns / s->timed;
+      tn->prob = (double)s->hits / s->evals;
+    }
+    return;
+  }
+
+  int op = t->mm->nodes[tn->pos].op;
+  int operands[t->cnt];
+  int ops[t->cnt];
+  int ocnt = 0, cnt = 0;
+  collect(t, idx, op, operands, &ocnt, ops, &cnt);
+
+  bool known = true;
+  for (int i = 0; i < ocnt; ++i) {
+    optimize(t, operands[i]);
+    known = known && t->n[operands[i]].known;
+  }
+  if (known) { // stable insertion sort, ties keep the written order
+    for (int i = 1; i < ocnt; ++i) {
+      int o = operands[i];
+      int j = i;
+      for (; j > 0 && precedes(&t->n[o], &t->n[operands[j - 1]], op); --j) {
+        operands[j] = operands[j - 1];
+      }
+      operands[j] = o;
+    }
+  }
+
+  // relink left deep keeping idx as the root of the chain
+  for (int i = 0; i < cnt; ++i) {
+    if (ops[i] == idx) {
+      ops[i] = ops[cnt - 1];
+      ops[cnt - 1] = idx;
+      break;
+    }
+  }
+  tree_node *prev = &t->n[operands[0]];
+  double cost = prev->cost, prob = prev->prob;
+  for (int i = 0; i < cnt; ++i) {
+    tree_node *o = &t->n[ops[i]];
+    const tree_node *r = &t->n[operands[i + 1]];
+    o->left = i == 0 ? operands[0] : ops[i - 1];
+    o->right = operands[i + 1];
+    o->units = prev->units + 1 + r->units;
+    if (op == OP_AND) {
+      cost += prob * r->cost;
+      prob *= r->prob;
+    } else {
+      cost += (1 - prob) * r->cost;
+      prob += (1 - prob) * r->prob;
+    }
+    o->cost = cost;
+    o->prob = prob;
+    o->known = known;
+    prev = o;
+  }
+}
+
+
+static size_t emit(const tree *t, int idx, match_node *nodes,
+                   lsb_message_matcher_stats *stats, size_t pos,
+                   size_t target)
+{
+  const tree_node *tn = &t->n[idx];
+  const match_node *src = t->mm->nodes + tn->pos;
+  if (tn->left < 0) {
+    memcpy(nodes + pos, src, tn->units * sizeof(match_node));
+    stats[pos] = t->mm->stats[tn->pos];
+    return pos + tn->units;
+  }
+  size_t x = pos + t->n[tn->left].units;
+  emit(t, tn->left, nodes, stats, pos, x);
+  nodes[x] = *src;
+  nodes[x].u.off = (uint16_t)target;
+  return emit(t, tn->right, nodes, stats, x + 1, target);
+}
+
+
+void lsb_optimize_message_matcher(lsb_message_matcher *mm)
+{
+  if (!mm || !mm->stats) return;
+
+  size_t cnt = mm->bytes / sizeof(match_node);
+  tree t = { .mm = mm, .n = calloc(cnt, sizeof(tree_node)), .cnt = 0 };
+  match_node *nodes = malloc(mm->bytes);
+  lsb_message_matcher_stats *stats = calloc(cnt,
+                                            sizeof(lsb_message_matcher_stats));
+  if (t.n && nodes && stats) {
+    int root = decode(&t, 0, cnt, cnt);
+    optimize(&t, root);
+    emit(&t, root, nodes, stats, 0, cnt);
+    match_node *tmp = mm->nodes;
+    mm->nodes = nodes;
+    nodes = tmp;
+    lsb_message_matcher_stats *stmp = mm->stats;
+    mm->stats = stats;
+    stats = stmp;
+  }
+  free(t.n);
+  free(nodes);
+  free(stats);
+}
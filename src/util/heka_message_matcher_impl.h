@@ -9,9 +9,12 @@
 #ifndef luasandbox_util_heka_message_matcher_impl_h_
 #define luasandbox_util_heka_message_matcher_impl_h_
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "luasandbox/util/heka_message_matcher.h"
+
 typedef enum {
   OP_EQ,
   OP_NE,
@@ -21,6 +24,7 @@ typedef enum {
   OP_LT,
   OP_RE,
   OP_NRE,
+  OP_IN,
   OP_TRUE,
   OP_FALSE,
   OP_OPEN,
@@ -66,9 +70,68 @@ typedef struct match_node {
 } match_node;
 
 
+/**
+ * Returns true if the node carries a compiled Lua pattern; it is stored
+ * (pointer aligned) after the NUL terminated pattern string.
+ */
+static inline bool match_has_pattern(int op, int val_type, int val_mod)
+{
+  return (op == OP_RE || op == OP_NRE) && val_type == TYPE_STRING
+      && val_mod == PATTERN_MOD_NONE;
+}
+
+
+/**
+ * Offset of the compiled pattern pointer within the node data
+ */
+static inline size_t match_pattern_offset(size_t var_len, size_t val_len)
+{
+  size_t off = var_len + val_len + 1;
+  return (off + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+}
+
+
+/**
+ * Offset of the set pointer within the node data of an OP_IN node
+ */
+static inline size_t match_set_offset(size_t var_len)
+{
+  return (var_len + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+}
+
+
+/**
+ * Hash set of the string or numeric values of an OP_IN node (a set only holds
+ * values of a single type)
+ */
+typedef struct match_set match_set;
+
+match_set* match_set_create(void);
+void match_set_destroy(match_set *set);
+
+/**
+ * Adds a string to the set, taking ownership of the memory (it is freed if the
+ * value is a duplicate)
+ *
+ * @return bool false on allocation failure
+ */
+bool match_set_add_string(match_set *set, char *s, size_t len);
+bool match_set_add_numeric(match_set *set, double d);
+
+bool match_set_has_string(const match_set *set, const char *s, size_t len);
+bool match_set_has_numeric(const match_set *set, double d);
+
+
 struct lsb_message_matcher {
-  size_t bytes;
-  match_node *nodes;
+  size_t                    bytes;
+  match_node                *nodes;
+  lsb_message_matcher_stats *stats; // indexed by node, NULL unless profiling
+  unsigned long long        evals;
+  unsigned                  interval;
+  char                      *exp;  // normalized expression, NULL unless cached
+  uint64_t                  hash;
+  size_t                    refs;  // protected by the cache lock
+  lsb_message_matcher       *next; // cache bucket chain
 };
 
 #endif
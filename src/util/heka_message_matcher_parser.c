@@ -3,7 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#define YYRULECOUNT 56
+#define YYRULECOUNT 61
 #line 1 "../src/util/heka_message_matcher_parser.leg"
 
 /* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
@@ -23,6 +23,7 @@
 #include "heka_message_matcher_impl.h"
 #include "luasandbox/util/heka_message.h"
 #include "luasandbox/util/heka_message_matcher.h"
+#include "luasandbox/util/string_matcher.h"
 
 #ifndef _MSC_VER
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -41,6 +42,7 @@ typedef struct match_node_tmp {
   uint8_t fi; // left node index for logical op
   uint8_t ai; // right node index for logical op
   char          *var;
+  match_set     *set; // OP_IN values
 
   union {
     char    *s;
@@ -258,6 +260,33 @@ static void set_match_mod(context *ctx)
 }
 
 
+static void add_set_string(context *ctx)
+{
+  if (!ctx->mn.set) {
+    ctx->mn.set = match_set_create();
+  }
+  if (!ctx->mn.set
+      || !match_set_add_string(ctx->mn.set, ctx->mn.val.s, ctx->mn.val_len)) {
+    fprintf(stderr, "malloc failed\n");
+    exit(1);
+  }
+  ctx->mn.val.s = NULL; // owned by the set
+  ctx->mn.val_len = 0;
+}
+
+
+static void add_set_numeric(context *ctx)
+{
+  if (!ctx->mn.set) {
+    ctx->mn.set = match_set_create();
+  }
+  if (!ctx->mn.set || !match_set_add_numeric(ctx->mn.set, ctx->mn.val.d)) {
+    fprintf(stderr, "malloc failed\n");
+    exit(1);
+  }
+}
+
+
 static bool check_string_len(char *s)
 {
   int i, j;
@@ -547,6 +576,11 @@ YY_LOCAL(void) yySet(yycontext *yy, char *text, int count)   { yy->__val[count]=
 
 #define	YYACCEPT	yyAccept(yy, yythunkpos0)
 
+YY_RULE(int) yy_numeric_elem(yycontext *yy); /* 61 */
+YY_RULE(int) yy_numeric_set(yycontext *yy); /* 60 */
+YY_RULE(int) yy_string_elem(yycontext *yy); /* 59 */
+YY_RULE(int) yy_string_set(yycontext *yy); /* 58 */
+YY_RULE(int) yy_op_in(yycontext *yy); /* 57 */
 YY_RULE(int) yy_second_frac(yycontext *yy); /* 56 */
 YY_RULE(int) yy_second(yycontext *yy); /* 55 */
 YY_RULE(int) yy_minute(yycontext *yy); /* 54 */
@@ -604,6 +638,48 @@ YY_RULE(int) yy_ored(yycontext *yy); /* 3 */
 YY_RULE(int) yy_sp(yycontext *yy); /* 2 */
 YY_RULE(int) yy_match(yycontext *yy); /* 1 */
 
+YY_ACTION(void) yy_1_numeric_elem(yycontext *yy, char *yytext, int yyleng)
+{
+#define __ yy->__
+#define yypos yy->__pos
+#define yythunkpos yy->__thunkpos
+  yyprintf((stderr, "do yy_1_numeric_elem\n"));
+  {
+#line 366
+  add_set_numeric(&yy->ctx);
+  }
+#undef yythunkpos
+#undef yypos
+#undef yy
+}
+YY_ACTION(void) yy_1_string_elem(yycontext *yy, char *yytext, int yyleng)
+{
+#define __ yy->__
+#define yypos yy->__pos
+#define yythunkpos yy->__thunkpos
+  yyprintf((stderr, "do yy_1_string_elem\n"));
+  {
+#line 360
+  add_set_string(&yy->ctx);
+  }
+#undef yythunkpos
+#undef yypos
+#undef yy
+}
+YY_ACTION(void) yy_1_op_in(yycontext *yy, char *yytext, int yyleng)
+{
+#define __ yy->__
+#define yypos yy->__pos
+#define yythunkpos yy->__thunkpos
+  yyprintf((stderr, "do yy_1_op_in\n"));
+  {
+#line 323
+  yy->ctx.mn.op = OP_IN;
+  }
+#undef yythunkpos
+#undef yypos
+#undef yy
+}
 YY_ACTION(void) yy_1_nil(yycontext *yy, char *yytext, int yyleng)
 {
 #define __ yy->__
@@ -1295,6 +1371,59 @@ YY_ACTION(void) yy_1_match(yycontext *yy, char *yytext, int yyleng)
 #undef yy
 }
 
+YY_RULE(int) yy_numeric_elem(yycontext *yy)
+{  int yypos0= yy->__pos, yythunkpos0= yy->__thunkpos;
+  yyprintf((stderr, "%s\n", "numeric_elem"));  if (!yy_numeric_value(yy)) goto l167;  if (!yy_sp(yy)) goto l167;  yyDo(yy, yy_1_numeric_elem, yy->__begin, yy->__end);
+  yyprintf((stderr, "  ok   %s @ %s\n", "numeric_elem", yy->__buf+yy->__pos));
+  return 1;
+  l167:;	  yy->__pos= yypos0; yy->__thunkpos= yythunkpos0;
+  yyprintf((stderr, "  fail %s @ %s\n", "numeric_elem", yy->__buf+yy->__pos));
+  return 0;
+}
+YY_RULE(int) yy_numeric_set(yycontext *yy)
+{  int yypos0= yy->__pos, yythunkpos0= yy->__thunkpos;
+  yyprintf((stderr, "%s\n", "numeric_set"));  if (!yy_op_in(yy)) goto l168;  if (!yymatchChar(yy, '(')) goto l168;  if (!yy_sp(yy)) goto l168;  if (!yy_numeric_elem(yy)) goto l168;
+  l169:;	
+  {  int yypos170= yy->__pos, yythunkpos170= yy->__thunkpos;  if (!yymatchChar(yy, ',')) goto l170;  if (!yy_sp(yy)) goto l170;  if (!yy_numeric_elem(yy)) goto l170;  goto l169;
+  l170:;	  yy->__pos= yypos170; yy->__thunkpos= yythunkpos170;
+  }  if (!yymatchChar(yy, ')')) goto l168;
+  yyprintf((stderr, "  ok   %s @ %s\n", "numeric_set", yy->__buf+yy->__pos));
+  return 1;
+  l168:;	  yy->__pos= yypos0; yy->__thunkpos= yythunkpos0;
+  yyprintf((stderr, "  fail %s @ %s\n", "numeric_set", yy->__buf+yy->__pos));
+  return 0;
+}
+YY_RULE(int) yy_string_elem(yycontext *yy)
+{  int yypos0= yy->__pos, yythunkpos0= yy->__thunkpos;
+  yyprintf((stderr, "%s\n", "string_elem"));  if (!yy_string_value(yy)) goto l171;  if (!yy_sp(yy)) goto l171;  yyDo(yy, yy_1_string_elem, yy->__begin, yy->__end);
+  yyprintf((stderr, "  ok   %s @ %s\n", "string_elem", yy->__buf+yy->__pos));
+  return 1;
+  l171:;	  yy->__pos= yypos0; yy->__thunkpos= yythunkpos0;
+  yyprintf((stderr, "  fail %s @ %s\n", "string_elem", yy->__buf+yy->__pos));
+  return 0;
+}
+YY_RULE(int) yy_string_set(yycontext *yy)
+{  int yypos0= yy->__pos, yythunkpos0= yy->__thunkpos;
+  yyprintf((stderr, "%s\n", "string_set"));  if (!yy_op_in(yy)) goto l172;  if (!yymatchChar(yy, '(')) goto l172;  if (!yy_sp(yy)) goto l172;  if (!yy_string_elem(yy)) goto l172;
+  l173:;	
+  {  int yypos174= yy->__pos, yythunkpos174= yy->__thunkpos;  if (!yymatchChar(yy, ',')) goto l174;  if (!yy_sp(yy)) goto l174;  if (!yy_string_elem(yy)) goto l174;  goto l173;
+  l174:;	  yy->__pos= yypos174; yy->__thunkpos= yythunkpos174;
+  }  if (!yymatchChar(yy, ')')) goto l172;
+  yyprintf((stderr, "  ok   %s @ %s\n", "string_set", yy->__buf+yy->__pos));
+  return 1;
+  l172:;	  yy->__pos= yypos0; yy->__thunkpos= yythunkpos0;
+  yyprintf((stderr, "  fail %s @ %s\n", "string_set", yy->__buf+yy->__pos));
+  return 0;
+}
+YY_RULE(int) yy_op_in(yycontext *yy)
+{  int yypos0= yy->__pos, yythunkpos0= yy->__thunkpos;
+  yyprintf((stderr, "%s\n", "op_in"));  if (!yymatchString(yy, "IN")) goto l175;  if (!yy_sp(yy)) goto l175;  yyDo(yy, yy_1_op_in, yy->__begin, yy->__end);
+  yyprintf((stderr, "  ok   %s @ %s\n", "op_in", yy->__buf+yy->__pos));
+  return 1;
+  l175:;	  yy->__pos= yypos0; yy->__thunkpos= yythunkpos0;
+  yyprintf((stderr, "  fail %s @ %s\n", "op_in", yy->__buf+yy->__pos));
+  return 0;
+}
 YY_RULE(int) yy_second_frac(yycontext *yy)
 {  int yypos0= yy->__pos, yythunkpos0= yy->__thunkpos;
   yyprintf((stderr, "%s\n", "second_frac"));  yyText(yy, yy->__begin, yy->__end);  {
@@ -2013,7 +2142,9 @@ YY_RULE(int) yy_field_test(yycontext *yy)
   }
   l115:;	  goto l113;
   l114:;	  yy->__pos= yypos113; yy->__thunkpos= yythunkpos113;  if (!yy_string_match(yy)) goto l117;  goto l113;
-  l117:;	  yy->__pos= yypos113; yy->__thunkpos= yythunkpos113;
+  l117:;	  yy->__pos= yypos113; yy->__thunkpos= yythunkpos113;  if (!yy_string_set(yy)) goto l181;  goto l113;
+  l181:;	  yy->__pos= yypos113; yy->__thunkpos= yythunkpos113;  if (!yy_numeric_set(yy)) goto l182;  goto l113;
+  l182:;	  yy->__pos= yypos113; yy->__thunkpos= yythunkpos113;
   {  int yypos118= yy->__pos, yythunkpos118= yy->__thunkpos;  if (!yy_op_eq(yy)) goto l119;  goto l118;
   l119:;	  yy->__pos= yypos118; yy->__thunkpos= yythunkpos118;  if (!yy_op_ne(yy)) goto l112;
   }
@@ -2034,7 +2165,8 @@ YY_RULE(int) yy_pid(yycontext *yy)
 {  int yypos0= yy->__pos, yythunkpos0= yy->__thunkpos;
   yyprintf((stderr, "%s\n", "pid"));  if (!yymatchString(yy, "Pid")) goto l122;  yyDo(yy, yy_1_pid, yy->__begin, yy->__end);  if (!yy_sp(yy)) goto l122;
   {  int yypos123= yy->__pos, yythunkpos123= yy->__thunkpos;  if (!yy_relational(yy)) goto l124;  if (!yy_sp(yy)) goto l124;  if (!yy_numeric_value(yy)) goto l124;  goto l123;
-  l124:;	  yy->__pos= yypos123; yy->__thunkpos= yythunkpos123;
+  l124:;	  yy->__pos= yypos123; yy->__thunkpos= yythunkpos123;  if (!yy_numeric_set(yy)) goto l180;  goto l123;
+  l180:;	  yy->__pos= yypos123; yy->__thunkpos= yythunkpos123;
   {  int yypos125= yy->__pos, yythunkpos125= yy->__thunkpos;  if (!yy_op_eq(yy)) goto l126;  goto l125;
   l126:;	  yy->__pos= yypos125; yy->__thunkpos= yythunkpos125;  if (!yy_op_ne(yy)) goto l122;
   }
@@ -2049,7 +2181,11 @@ YY_RULE(int) yy_pid(yycontext *yy)
 }
 YY_RULE(int) yy_severity(yycontext *yy)
 {  int yypos0= yy->__pos, yythunkpos0= yy->__thunkpos;
-  yyprintf((stderr, "%s\n", "severity"));  if (!yymatchString(yy, "Severity")) goto l127;  yyDo(yy, yy_1_severity, yy->__begin, yy->__end);  if (!yy_sp(yy)) goto l127;  if (!yy_relational(yy)) goto l127;  if (!yy_sp(yy)) goto l127;  if (!yy_numeric_value(yy)) goto l127;
+  yyprintf((stderr, "%s\n", "severity"));  if (!yymatchString(yy, "Severity")) goto l127;  yyDo(yy, yy_1_severity, yy->__begin, yy->__end);  if (!yy_sp(yy)) goto l127;
+  {  int yypos178= yy->__pos, yythunkpos178= yy->__thunkpos;  if (!yy_relational(yy)) goto l179;  if (!yy_sp(yy)) goto l179;  if (!yy_numeric_value(yy)) goto l179;  goto l178;
+  l179:;	  yy->__pos= yypos178; yy->__thunkpos= yythunkpos178;  if (!yy_numeric_set(yy)) goto l127;
+  }
+  l178:;	
   yyprintf((stderr, "  ok   %s @ %s\n", "severity", yy->__buf+yy->__pos));
   return 1;
   l127:;	  yy->__pos= yypos0; yy->__thunkpos= yythunkpos0;
@@ -2061,7 +2197,8 @@ YY_RULE(int) yy_optional_string_headers(yycontext *yy)
   yyprintf((stderr, "%s\n", "optional_string_headers"));  if (!yy_string_headers(yy)) goto l128;  if (!yy_sp(yy)) goto l128;
   {  int yypos129= yy->__pos, yythunkpos129= yy->__thunkpos;  if (!yy_relational(yy)) goto l130;  if (!yy_sp(yy)) goto l130;  if (!yy_string_value(yy)) goto l130;  goto l129;
   l130:;	  yy->__pos= yypos129; yy->__thunkpos= yythunkpos129;  if (!yy_string_match(yy)) goto l131;  goto l129;
-  l131:;	  yy->__pos= yypos129; yy->__thunkpos= yythunkpos129;
+  l131:;	  yy->__pos= yypos129; yy->__thunkpos= yythunkpos129;  if (!yy_string_set(yy)) goto l176;  goto l129;
+  l176:;	  yy->__pos= yypos129; yy->__thunkpos= yythunkpos129;
   {  int yypos132= yy->__pos, yythunkpos132= yy->__thunkpos;  if (!yy_op_eq(yy)) goto l133;  goto l132;
   l133:;	  yy->__pos= yypos132; yy->__thunkpos= yythunkpos132;  if (!yy_op_ne(yy)) goto l128;
   }
@@ -2091,7 +2228,8 @@ YY_RULE(int) yy_uuid(yycontext *yy)
 {  int yypos0= yy->__pos, yythunkpos0= yy->__thunkpos;
   yyprintf((stderr, "%s\n", "uuid"));  if (!yymatchString(yy, "Uuid")) goto l137;  yyDo(yy, yy_1_uuid, yy->__begin, yy->__end);  if (!yy_sp(yy)) goto l137;
   {  int yypos138= yy->__pos, yythunkpos138= yy->__thunkpos;  if (!yy_relational(yy)) goto l139;  if (!yy_sp(yy)) goto l139;  if (!yy_string_value(yy)) goto l139;  goto l138;
-  l139:;	  yy->__pos= yypos138; yy->__thunkpos= yythunkpos138;  if (!yy_string_match(yy)) goto l137;
+  l139:;	  yy->__pos= yypos138; yy->__thunkpos= yythunkpos138;  if (!yy_string_match(yy)) goto l177;  goto l138;
+  l177:;	  yy->__pos= yypos138; yy->__thunkpos= yythunkpos138;  if (!yy_string_set(yy)) goto l137;
   }
   l138:;	
   yyprintf((stderr, "  ok   %s @ %s\n", "uuid", yy->__buf+yy->__pos));
@@ -2315,27 +2453,46 @@ static match_node* copy_node(unsigned char parent, match_node *mn,
     mnt->var_len = 0;
   }
 
-  size_t val_len = 0;
-  switch (mnt->val_type) {
-  case TYPE_STRING:
-    val_len = mnt->val_len + 1;
-    memcpy(mn->data + mn->var_len, mnt->val.s, val_len);
-    free(mnt->val.s);
-    mnt->val.s = NULL;
-    mnt->val_len = 0;
-    break;
-  case TYPE_NUMERIC:
-    val_len = sizeof(double);
-    memcpy(mn->data + mn->var_len, &mnt->val.d, val_len);
-    break;
-  default:
-    break;
+  size_t val_len = 0, str_len = 0;
+  if (mn->op == OP_IN) {
+    // the values live in the set, only the pointer is inlined
+    size_t off = match_set_offset(mn->var_len);
+    memcpy(mn->data + off, &mnt->set, sizeof(mnt->set));
+    mnt->set = NULL;
+    val_len = off - mn->var_len + sizeof(match_set *);
+  } else {
+    switch (mnt->val_type) {
+    case TYPE_STRING:
+      str_len = mnt->val_len;
+      val_len = str_len + 1;
+      memcpy(mn->data + mn->var_len, mnt->val.s, val_len);
+      if (match_has_pattern(mn->op, mn->val_type, mn->val_mod)) {
+        // compile once here instead of interpreting the pattern per message;
+        // NULL falls back to lsb_string_match
+        size_t off = match_pattern_offset(mn->var_len, str_len);
+        lsb_string_pattern *sp = lsb_compile_string_pattern(mnt->val.s);
+        memcpy(mn->data + off, &sp, sizeof(sp));
+        val_len = off - mn->var_len + sizeof(sp);
+      }
+      free(mnt->val.s);
+      mnt->val.s = NULL;
+      mnt->val_len = 0;
+      break;
+    case TYPE_NUMERIC:
+      val_len = sizeof(double);
+      memcpy(mn->data + mn->var_len, &mnt->val.d, val_len);
+      break;
+    default:
+      break;
+    }
   }
 
   mn->units = 1 + ((sizeof(match_node) - 1 + mn->var_len + val_len)
                    / sizeof(match_node));
-  if (val_len && mnt->val_type == TYPE_STRING) {
-    mn->val_len = val_len - 1;
+  if (mn->op == OP_IN) {
+    mn->val_len = 0;
+  } else if (val_len && mnt->val_type == TYPE_STRING) {
+    mn->val_len = str_len;
   } else {
     mn->val_len = val_len;
   }
@@ -2367,10 +2524,20 @@ static size_t get_matcher_bytes(match_node_tmp nodes[], size_t size)
 {
   size_t len = 0;
   for (unsigned i = 0; i < size; ++i) {
+    size_t var_len = 0;
+    if (nodes[i].id == LSB_PB_FIELDS) {
+      var_len = nodes[i].var_len;
+    }
+
     size_t val_len = 0;
     switch (nodes[i].val_type) {
     case TYPE_STRING:
       val_len = nodes[i].val_len + 1;
+      if (match_has_pattern(nodes[i].op, nodes[i].val_type,
+                            nodes[i].val_mod)) {
+        val_len = match_pattern_offset(var_len, nodes[i].val_len) - var_len
+            + sizeof(lsb_string_pattern *);
+      }
       break;
     case TYPE_NUMERIC:
       val_len = sizeof(double);
@@ -2378,10 +2545,8 @@ static size_t get_matcher_bytes(match_node_tmp nodes[], size_t size)
     default:
       break;
     }
-
-    size_t var_len = 0;
-    if (nodes[i].id == LSB_PB_FIELDS) {
-      var_len = nodes[i].var_len;
+    if (nodes[i].op == OP_IN) {
+      val_len = match_set_offset(var_len) - var_len + sizeof(match_set *);
     }
 
     len += (sizeof(match_node) * 2 + val_len + var_len - 1)
@@ -2416,7 +2581,7 @@ static void make_tree(match_node_tmp nodes[], size_t size)
 
 static lsb_message_matcher* make_matcher(match_node_tmp nodes[], size_t size)
 {
-  lsb_message_matcher *mm = malloc(sizeof(lsb_message_matcher));
+  lsb_message_matcher *mm = calloc(1, sizeof(lsb_message_matcher));
   if (!mm) { return NULL; }
 
   mm->bytes = get_matcher_bytes(nodes, size);
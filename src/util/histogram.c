@@ -0,0 +1,110 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Log-linear histogram implementation @file */
+
+#include "luasandbox/util/histogram.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define SUB_COUNT (1ULL << LSB_HISTOGRAM_SUB_BITS)
+
+static int msb(unsigned long long v)
+{
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanReverse64(&idx, v);
+  return (int)idx;
+#else
+  return 63 - __builtin_clzll(v);
+#endif
+}
+
+
+static size_t bucket_index(unsigned long long v)
+{
+  if (v < SUB_COUNT) return (size_t)v;
+  if (v >> LSB_HISTOGRAM_MAX_BITS) return LSB_HISTOGRAM_BUCKETS - 1;
+
+  int shift = msb(v) - LSB_HISTOGRAM_SUB_BITS;
+  // the leading bit selects the power of two range, the next SUB_BITS bits the
+  // linear bucket within it
+  return (size_t)(shift + 1) * SUB_COUNT
+      + (size_t)((v >> shift) & (SUB_COUNT - 1));
+}
+
+
+static unsigned long long bucket_high(size_t idx)
+{
+  if (idx < SUB_COUNT) return idx;
+  int shift = (int)(idx >> LSB_HISTOGRAM_SUB_BITS) - 1;
+  unsigned long long low = (SUB_COUNT + (idx & (SUB_COUNT - 1))) << shift;
+  return low + (1ULL << shift) - 1;
+}
+
+
+void lsb_init_histogram(lsb_histogram *h)
+{
+  memset(h, 0, sizeof(*h));
+}
+
+
+void lsb_update_histogram(lsb_histogram *h, unsigned long long v)
+{
+  if (h->count == 0 || v < h->min) h->min = v;
+  if (v > h->max) h->max = v;
+  ++h->count;
+  h->sum += v;
+  ++h->buckets[bucket_index(v)];
+}
+
+
+void lsb_merge_histogram(lsb_histogram *h, const lsb_histogram *src)
+{
+  if (src->count == 0) return;
+  if (h->count == 0 || src->min < h->min) h->min = src->min;
+  if (src->max > h->max) h->max = src->max;
+  h->count += src->count;
+  h->sum += src->sum;
+  for (size_t i = 0; i < LSB_HISTOGRAM_BUCKETS; ++i) {
+    h->buckets[i] += src->buckets[i];
+  }
+}
+
+
+unsigned long long lsb_histogram_percentile(const lsb_histogram *h, double p)
+{
+  if (h->count == 0 || isnan(p)) return 0;
+  if (p <= 0) return h->min;
+  if (p >= 100) return h->max;
+
+  unsigned long long target = (unsigned long long)ceil(p / 100 * h->count);
+  if (target == 0) target = 1;
+  unsigned long long cnt = 0;
+  for (size_t i = 0; i < LSB_HISTOGRAM_BUCKETS; ++i) {
+    cnt += h->buckets[i];
+    if (cnt >= target) {
+      if (i == LSB_HISTOGRAM_BUCKETS - 1) return h->max;
+      unsigned long long v = bucket_high(i);
+      if (v > h->max) return h->max;
+      if (v < h->min) return h->min;
+      return v;
+    }
+  }
+  return h->max;
+}
+
+
+double lsb_histogram_mean(const lsb_histogram *h)
+{
+  if (h->count == 0) return 0;
+  return (double)h->sum / h->count;
+}
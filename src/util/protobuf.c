@@ -12,6 +12,38 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) \
+  && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LSB_VARINT_WORD
+
+/**
+ * Decodes a varint of up to eight bytes out of a single word without a per
+ * byte loop (the caller guarantees eight readable bytes).
+ *
+ * @return int Length of the varint, 0 if it is longer than eight bytes (v then
+ *         holds the 56 bits decoded so far)
+ */
+static inline int read_varint_word(const char *p, unsigned long long *v)
+{
+  unsigned long long x;
+  memcpy(&x, p, sizeof(x));
+  unsigned long long stops = ~x & 0x8080808080808080ULL;
+
+  // keep the payload bits up to the terminating byte and pack the 7 bit groups
+  // (with no terminating byte the mask covers the whole word)
+  x &= (stops ^ (stops - 1)) & 0x7f7f7f7f7f7f7f7fULL;
+  x = ((x & 0x7f007f007f007f00ULL) >> 1) | (x & 0x007f007f007f007fULL);
+  x = ((x & 0x3fff00003fff0000ULL) >> 2) | (x & 0x00003fff00003fffULL);
+  x = ((x & 0x0fffffff00000000ULL) >> 4) | (x & 0x000000000fffffffULL);
+  *v = x;
+  return stops ? (__builtin_ctzll(stops) >> 3) + 1 : 0;
+}
+#endif
+
 const char* lsb_pb_read_key(const char *p, int *tag, int *wiretype)
 {
   if (!p || !tag || !wiretype) return NULL;
@@ -40,8 +72,29 @@ const char* lsb_pb_read_varint(const char *p, const char *e, long long *vi)
   }
 
   *vi = 0;
-  int i, shift = 0;
-  for (i = 0; p != e && i < LSB_MAX_VARINT_BYTES; ++i, ++p) {
+  int i = 0, shift = 0;
+#ifdef LSB_VARINT_WORD
+  if (e - p >= (ptrdiff_t)sizeof(unsigned long long)) {
+    const unsigned char *u = (const unsigned char *)p;
+    if (u[0] < 0x80) { // keys, lengths and small integers
+      *vi = u[0];
+      return p + 1;
+    }
+    if (u[1] < 0x80) {
+      *vi = (u[0] & 0x7f) | (u[1] << 7);
+      return p + 2;
+    }
+    unsigned long long v;
+    int len = read_varint_word(p, &v);
+    *vi = (long long)v;
+    if (len) return p + len;
+    i = 8;
+    shift = 56;
+    p += 8;
+  }
+#endif
+
+  for (; p != e && i < LSB_MAX_VARINT_BYTES; ++i, ++p) {
     *vi |= ((unsigned long long)*p & 0x7f) << shift;
     shift += 7;
     if ((*p & 0x80) == 0) break;
@@ -53,6 +106,61 @@ const char* lsb_pb_read_varint(const char *p, const char *e, long long *vi)
 }
 
 
+const char* lsb_pb_read_packed_varint(const char *p, const char *e,
+                                      long long *vals, size_t *n)
+{
+  if (!p || !e || !vals || !n) {
+    return NULL;
+  }
+
+  size_t cnt = 0;
+  size_t max = *n;
+#ifdef __SSE2__
+  // runs of single byte values (bools, small counters) are widened sixteen at
+  // a time; a multi byte value ends the run and is decoded on its own
+  while (max - cnt >= 16 && e - p >= 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)p);
+    unsigned mask = (unsigned)_mm_movemask_epi8(b);
+    if (!mask) {
+      __m128i z = _mm_setzero_si128();
+      __m128i w[4];
+      w[0] = _mm_unpacklo_epi8(b, z);
+      w[2] = _mm_unpackhi_epi8(b, z);
+      w[1] = _mm_unpackhi_epi16(w[0], z);
+      w[0] = _mm_unpacklo_epi16(w[0], z);
+      w[3] = _mm_unpackhi_epi16(w[2], z);
+      w[2] = _mm_unpacklo_epi16(w[2], z);
+      for (int i = 0; i < 4; ++i) {
+        _mm_storeu_si128((__m128i *)(vals + cnt), _mm_unpacklo_epi32(w[i], z));
+        _mm_storeu_si128((__m128i *)(vals + cnt + 2),
+                         _mm_unpackhi_epi32(w[i], z));
+        cnt += 4;
+      }
+      p += 16;
+      continue;
+    }
+    int k = __builtin_ctz(mask);
+    for (int i = 0; i < k; ++i) {
+      vals[cnt++] = (unsigned char)p[i];
+    }
+    p = lsb_pb_read_varint(p + k, e, &vals[cnt]);
+    if (!p) {
+      *n = cnt;
+      return NULL;
+    }
+    ++cnt;
+  }
+#endif
+  while (cnt < max && p < e) {
+    p = lsb_pb_read_varint(p, e, &vals[cnt]);
+    if (!p) break;
+    ++cnt;
+  }
+  *n = cnt;
+  return p;
+}
+
+
 int lsb_pb_output_varint(char *buf, unsigned long long i)
 {
   int pos = 0;
@@ -149,3 +257,45 @@ lsb_err_value lsb_pb_update_field_length(lsb_output_buffer *ob, size_t len_pos)
   }
   return ret;
 }
+
+
+lsb_err_value lsb_pb_reserve_field_length(lsb_output_buffer *ob)
+{
+  lsb_err_value ret = lsb_expand_output_buffer(ob, LSB_PB_FIXED_LENGTH_BYTES);
+  if (!ret) {
+    memset(ob->buf + ob->pos, 0, LSB_PB_FIXED_LENGTH_BYTES); // length tbd later
+    ob->pos += LSB_PB_FIXED_LENGTH_BYTES;
+  }
+  return ret;
+}
+
+
+lsb_err_value
+lsb_pb_update_reserved_field_length(lsb_output_buffer *ob, size_t len_pos)
+{
+  if (len_pos + LSB_PB_FIXED_LENGTH_BYTES > ob->pos) {
+    return LSB_ERR_UTIL_PRANGE;
+  }
+
+  size_t len = ob->pos - len_pos - LSB_PB_FIXED_LENGTH_BYTES;
+  if (len >> (7 * LSB_PB_FIXED_LENGTH_BYTES)) {
+    char tmp[LSB_MAX_VARINT_BYTES];
+    size_t cnt = lsb_pb_output_varint(tmp, len);
+    size_t needed = cnt - LSB_PB_FIXED_LENGTH_BYTES;
+    lsb_err_value ret = lsb_expand_output_buffer(ob, needed);
+    if (!ret) {
+      ob->pos += needed;
+      memmove(&ob->buf[len_pos + cnt],
+              &ob->buf[len_pos + LSB_PB_FIXED_LENGTH_BYTES], len);
+      memcpy(ob->buf + len_pos, tmp, cnt);
+    }
+    return ret;
+  }
+
+  char *p = ob->buf + len_pos;
+  for (int i = 0; i < LSB_PB_FIXED_LENGTH_BYTES - 1; ++i, len >>= 7) {
+    p[i] = (char)((len & 0x7f) | 0x80);
+  }
+  p[LSB_PB_FIXED_LENGTH_BYTES - 1] = (char)len;
+  return NULL;
+}
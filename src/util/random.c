@@ -0,0 +1,144 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief xoshiro256** pseudo random number generator @file */
+
+#include "luasandbox/util/random.h"
+#include "../luasandbox_defines.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+#define GOLDEN_GAMMA 0x9E3779B97F4A7C15ULL
+
+static lsb_atomic_int g_pool_state; // 0 uninitialized, 1 initializing, 2 ready
+static uint64_t g_pool_base;
+static lsb_atomic_u64 g_pool_counter;
+
+static THREAD_LOCAL lsb_prng tl_prng;
+static THREAD_LOCAL bool tl_seeded;
+
+
+static inline uint64_t rotl(const uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+
+static uint64_t splitmix64(uint64_t *x)
+{
+  uint64_t z = (*x += GOLDEN_GAMMA);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+
+static uint64_t read_entropy()
+{
+  uint64_t seed = 0;
+  bool seeded = false;
+#ifdef _WIN32
+  // todo use CryptGenRandom
+#else
+  FILE *fh = fopen("/dev/urandom", "r" CLOSE_ON_EXEC);
+  if (fh) {
+    seeded = fread(&seed, sizeof(seed), 1, fh) == 1;
+    fclose(fh);
+  }
+#endif
+  if (!seeded) {
+    seed = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32)
+        ^ (uint64_t)(uintptr_t)&seed;
+  }
+  return seed;
+}
+
+
+static void init_pool()
+{
+  if (lsb_atomic_load(&g_pool_state) == 2) return;
+
+  if (lsb_atomic_cas_int(&g_pool_state, 0, 1)) {
+    g_pool_base = read_entropy();
+    lsb_atomic_store(&g_pool_state, 2);
+    return;
+  }
+  while (lsb_atomic_load(&g_pool_state) != 2);
+}
+
+
+void lsb_prng_seed(lsb_prng *p, uint64_t seed)
+{
+  if (!p) return;
+  for (int i = 0; i < 4; ++i) {
+    p->s[i] = splitmix64(&seed);
+  }
+}
+
+
+void lsb_prng_seed_random(lsb_prng *p)
+{
+  if (!p) return;
+  init_pool();
+  uint64_t n = lsb_atomic_add_u64(&g_pool_counter, 1);
+  lsb_prng_seed(p, g_pool_base ^ (n * GOLDEN_GAMMA));
+}
+
+
+uint64_t lsb_prng_next(lsb_prng *p)
+{
+  uint64_t *s = p->s;
+  const uint64_t result = rotl(s[1] * 5, 7) * 9;
+  const uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+
+double lsb_prng_double(lsb_prng *p)
+{
+  return (lsb_prng_next(p) >> 11) * (1.0 / 9007199254740992.0); // 2^53
+}
+
+
+void lsb_prng_fill(lsb_prng *p, void *buf, size_t len)
+{
+  unsigned char *b = buf;
+  while (len >= sizeof(uint64_t)) {
+    uint64_t r = lsb_prng_next(p);
+    memcpy(b, &r, sizeof(r));
+    b += sizeof(r);
+    len -= sizeof(r);
+  }
+  if (len) {
+    uint64_t r = lsb_prng_next(p);
+    memcpy(b, &r, len);
+  }
+}
+
+
+lsb_prng* lsb_prng_thread()
+{
+  if (!tl_seeded) {
+    lsb_prng_seed_random(&tl_prng);
+    tl_seeded = true;
+  }
+  return &tl_prng;
+}
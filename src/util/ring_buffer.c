@@ -0,0 +1,150 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Lock-free SPSC message ring buffer implementation @file */
+
+#include "luasandbox/util/ring_buffer.h"
+#include "../luasandbox_defines.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE_SIZE 64
+#define MIN_SIZE        64
+#define WRAP_MARKER     SIZE_MAX
+
+// head and tail are monotonically increasing byte positions; each side keeps a
+// cached copy of the other side's position so the shared cache line is only
+// touched when the cached view says the buffer is full/empty
+struct lsb_ring_buffer {
+  char            *buf;
+  size_t          size;
+  size_t          mask;
+  char            pad0[CACHE_LINE_SIZE];
+  lsb_atomic_size head;       // written by the producer
+  size_t          tail_cache; // producer's view of tail
+  char            pad1[CACHE_LINE_SIZE];
+  lsb_atomic_size tail;       // written by the consumer
+  size_t          head_cache; // consumer's view of head
+  char            pad2[CACHE_LINE_SIZE];
+};
+
+
+static size_t record_size(size_t len)
+{
+  size_t n = sizeof(size_t) + len;
+  return (n + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+
+lsb_ring_buffer* lsb_create_ring_buffer(size_t size)
+{
+  if (size < MIN_SIZE) size = MIN_SIZE;
+  size = lsb_lp2(size);
+  if (!size) return NULL;
+
+  lsb_ring_buffer *rb = calloc(1, sizeof(lsb_ring_buffer));
+  if (!rb) return NULL;
+
+  rb->buf = malloc(size);
+  if (!rb->buf) {
+    free(rb);
+    return NULL;
+  }
+  rb->size = size;
+  rb->mask = size - 1;
+  lsb_atomic_store(&rb->head, 0);
+  lsb_atomic_store(&rb->tail, 0);
+  return rb;
+}
+
+
+void lsb_destroy_ring_buffer(lsb_ring_buffer *rb)
+{
+  if (!rb) return;
+  free(rb->buf);
+  free(rb);
+}
+
+
+lsb_err_value
+lsb_ring_buffer_push(lsb_ring_buffer *rb, const char *s, size_t len)
+{
+  if (!rb || (!s && len)) return LSB_ERR_UTIL_NULL;
+
+  size_t need = record_size(len);
+  // a record never spans the end of the buffer so the wasted space at the end
+  // (always less than 'need') plus the record must fit in an empty buffer
+  if (len > rb->size || need > rb->size / 2) return LSB_ERR_UTIL_PRANGE;
+
+  size_t head = lsb_atomic_load(&rb->head);
+  size_t off = head & rb->mask;
+  size_t contig = rb->size - off;
+  size_t pad = contig < need ? contig : 0;
+
+  if (head - rb->tail_cache + pad + need > rb->size) {
+    rb->tail_cache = lsb_atomic_load(&rb->tail);
+    if (head - rb->tail_cache + pad + need > rb->size) {
+      return LSB_ERR_UTIL_FULL;
+    }
+  }
+
+  if (pad) {
+    size_t marker = WRAP_MARKER;
+    memcpy(rb->buf + off, &marker, sizeof(size_t));
+    head += pad;
+    off = 0;
+  }
+  memcpy(rb->buf + off, &len, sizeof(size_t));
+  if (len) memcpy(rb->buf + off + sizeof(size_t), s, len);
+  lsb_atomic_store(&rb->head, head + need);
+  return NULL;
+}
+
+
+const char* lsb_ring_buffer_peek(lsb_ring_buffer *rb, size_t *len)
+{
+  if (!rb || !len) return NULL;
+
+  size_t tail = lsb_atomic_load(&rb->tail);
+  if (tail == rb->head_cache) {
+    rb->head_cache = lsb_atomic_load(&rb->head);
+    if (tail == rb->head_cache) return NULL;
+  }
+
+  size_t off = tail & rb->mask;
+  size_t rlen;
+  memcpy(&rlen, rb->buf + off, sizeof(size_t));
+  if (rlen == WRAP_MARKER) {
+    // the producer only writes a marker when a record follows it
+    tail += rb->size - off;
+    lsb_atomic_store(&rb->tail, tail);
+    off = 0;
+    memcpy(&rlen, rb->buf, sizeof(size_t));
+  }
+  *len = rlen;
+  return rb->buf + off + sizeof(size_t);
+}
+
+
+void lsb_ring_buffer_pop(lsb_ring_buffer *rb)
+{
+  size_t len;
+  if (!lsb_ring_buffer_peek(rb, &len)) return;
+
+  size_t tail = lsb_atomic_load(&rb->tail);
+  lsb_atomic_store(&rb->tail, tail + record_size(len));
+}
+
+
+size_t lsb_ring_buffer_used(lsb_ring_buffer *rb)
+{
+  if (!rb) return 0;
+  size_t tail = lsb_atomic_load(&rb->tail);
+  size_t head = lsb_atomic_load(&rb->head);
+  return head - tail;
+}
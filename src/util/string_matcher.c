@@ -24,10 +24,18 @@
 ******************************************************************************/
 
 #include "luasandbox/util/string_matcher.h"
+#include "../luasandbox_defines.h"
 
 #include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LSB_SIMD_FIND
+#include <immintrin.h>
+#endif
+
 /* macro to `unsign' a character */
 #define uchar(c)        ((unsigned char)(c))
 #define L_ESC   '%'
@@ -278,6 +286,104 @@ static const char* lmemfind(const char *s1, size_t l1,
 }
 
 
+/*
+** Vectorized substring search: candidate positions are the ones where both
+** the first and the last byte of the needle match, 16 (SSE2) or 32 (AVX2)
+** positions at a time, and only those are verified with memcmp. This avoids
+** the memchr/memcmp ping-pong of lmemfind when the first byte is common.
+*/
+#ifdef LSB_SIMD_FIND
+static const char* memfind_tail(const char *s, size_t ls, const char *p,
+                                size_t lp)
+{
+  for (size_t i = 0; i + lp <= ls; ++i) {
+    if (s[i] == p[0] && s[i + lp - 1] == p[lp - 1]
+        && memcmp(s + i + 1, p + 1, lp - 2) == 0) {
+      return s + i;
+    }
+  }
+  return NULL;
+}
+
+
+static const char* verify_mask(unsigned mask, const char *s, const char *p,
+                               size_t lp)
+{
+  while (mask) {
+    int bit = __builtin_ctz(mask);
+    if (memcmp(s + bit + 1, p + 1, lp - 2) == 0) return s + bit;
+    mask &= mask - 1;
+  }
+  return NULL;
+}
+
+
+static const char* memfind_sse2(const char *s, size_t ls, const char *p,
+                                size_t lp)
+{
+  const __m128i first = _mm_set1_epi8(p[0]);
+  const __m128i last = _mm_set1_epi8(p[lp - 1]);
+  size_t i = 0;
+  for (; i + lp + 15 <= ls; i += 16) {
+    __m128i bf = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i bl = _mm_loadu_si128((const __m128i *)(s + i + lp - 1));
+    __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(first, bf),
+                               _mm_cmpeq_epi8(last, bl));
+    unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+    const char *r = verify_mask(mask, s + i, p, lp);
+    if (r) return r;
+  }
+  return memfind_tail(s + i, ls - i, p, lp);
+}
+
+
+__attribute__((target("avx2")))
+static const char* memfind_avx2(const char *s, size_t ls, const char *p,
+                                size_t lp)
+{
+  const __m256i first = _mm256_set1_epi8(p[0]);
+  const __m256i last = _mm256_set1_epi8(p[lp - 1]);
+  size_t i = 0;
+  for (; i + lp + 31 <= ls; i += 32) {
+    __m256i bf = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i bl = _mm256_loadu_si256((const __m256i *)(s + i + lp - 1));
+    __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(first, bf),
+                                  _mm256_cmpeq_epi8(last, bl));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(eq);
+    const char *r = verify_mask(mask, s + i, p, lp);
+    if (r) return r;
+  }
+  return memfind_sse2(s + i, ls - i, p, lp);
+}
+
+
+// 0 unresolved, 1 SSE2, 2 AVX2
+static int select_memfind(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? 2 : 1;
+}
+#endif
+
+
+static const char* memfind(const char *s, size_t ls, const char *p, size_t lp)
+{
+  if (lp < 2 || lp > ls) return lmemfind(s, ls, p, lp);
+#ifdef LSB_SIMD_FIND
+  // resolved on first use; concurrent first calls store the same value
+  static lsb_atomic_int selected;
+  int impl = lsb_atomic_load(&selected);
+  if (!impl) {
+    impl = select_memfind();
+    lsb_atomic_store(&selected, impl);
+  }
+  return impl == 2 ? memfind_avx2(s, ls, p, lp) : memfind_sse2(s, ls, p, lp);
+#else
+  return lmemfind(s, ls, p, lp);
+#endif
+}
+
+
 
 bool lsb_string_match(const char *s, size_t len, const char *p)
 {
@@ -300,8 +406,492 @@ bool lsb_string_match(const char *s, size_t len, const char *p)
 bool lsb_string_find(const char *s, size_t ls, const char *p, size_t lp)
 {
   if (!s || !p) { return false; }
-  if (lmemfind(s, ls, p, lp)) {
+  if (memfind(s, ls, p, lp)) {
     return true;
   }
   return false;
 }
+
+
+/*
+** Compiled patterns: the matcher only needs a yes/no answer (no captures) so
+** every construct except %b is regular; the pattern is compiled into a linear
+** program of character set items and simulated as an NFA in O(n * m) time.
+** A pattern consisting of a single %b item is answered by a linear scan; %b
+** combined with other items keeps the backtracking interpreter.
+*/
+
+#define MAX_ITEMS 1024
+#define STATE_WORDS ((MAX_ITEMS + 64) / 64)
+
+typedef enum {
+  ITEM_SET,
+  ITEM_FRONTIER
+} item_type;
+
+typedef enum {
+  QUANT_ONE,
+  QUANT_OPT,
+  QUANT_STAR
+} item_quant;
+
+typedef struct pattern_item {
+  uint8_t set[32];
+  uint8_t type;
+  uint8_t quant;
+} pattern_item;
+
+struct lsb_string_pattern {
+  pattern_item  *items;
+  unsigned      cnt;
+  bool          anchor_start;
+  bool          anchor_end;
+  bool          literal_only;
+  bool          fixed;        // every item matches exactly one character
+  int           first_char;   // single char the match must start with or -1
+  char          *literal;     // longest run of required characters
+  size_t        literal_len;
+  size_t        literal_item; // item index the literal starts at
+  char          *source;      // backtracking fallback (%b)
+  bool          balance;      // the pattern is a single %b item
+  char          bal_open;
+  char          bal_close;
+  uint64_t      *masks;       // per character set items (fewer than 64 items)
+  uint64_t      *front_masks; // per character frontier items
+  uint64_t      skip;         // optional and repeated items
+  uint64_t      star;         // repeated items
+};
+
+
+static bool in_set(const pattern_item *item, int c)
+{
+  return item->set[c >> 3] & (1 << (c & 7));
+}
+
+
+static int single_char(const pattern_item *item)
+{
+  int found = -1;
+  for (int c = 0; c < 256; ++c) {
+    if (in_set(item, c)) {
+      if (found != -1) return -1;
+      found = c;
+    }
+  }
+  return found;
+}
+
+
+static pattern_item* add_item(lsb_string_pattern *sp, item_type type,
+                              item_quant quant, const char *p, const char *ep)
+{
+  if (sp->cnt == MAX_ITEMS) return NULL;
+  pattern_item *item = &sp->items[sp->cnt++];
+  memset(item->set, 0, sizeof(item->set));
+  item->type = (uint8_t)type;
+  item->quant = (uint8_t)quant;
+  for (int c = 0; c < 256; ++c) {
+    int m = type == ITEM_FRONTIER ? matchbracketclass(c, p, ep - 1)
+        : singlematch(c, p, ep);
+    if (m) item->set[c >> 3] |= (uint8_t)(1 << (c & 7));
+  }
+  return item;
+}
+
+
+static bool compile_items(lsb_string_pattern *sp, const char *p)
+{
+  if (*p == '^') {
+    sp->anchor_start = true;
+    ++p;
+  }
+  while (*p) {
+    if (*p == '$' && *(p + 1) == '\0') {
+      sp->anchor_end = true;
+      break;
+    }
+    if (*p == L_ESC && *(p + 1) == 'b') return false;
+    if (*p == L_ESC && *(p + 1) == 'f') {
+      p += 2;
+      if (*p != '[') return false;
+      const char *ep = classend(p);
+      if (!ep || !add_item(sp, ITEM_FRONTIER, QUANT_ONE, p, ep)) return false;
+      p = ep;
+      continue;
+    }
+    const char *ep = classend(p);
+    if (!ep) return false;
+    switch (*ep) {
+    case '?':
+      if (!add_item(sp, ITEM_SET, QUANT_OPT, p, ep)) return false;
+      p = ep + 1;
+      break;
+    case '+':
+      if (!add_item(sp, ITEM_SET, QUANT_ONE, p, ep)) return false;
+      // fall through
+    case '*':
+    case '-': // minimal and maximal expansion are equivalent for a yes/no match
+      if (!add_item(sp, ITEM_SET, QUANT_STAR, p, ep)) return false;
+      p = ep + 1;
+      break;
+    default:
+      if (!add_item(sp, ITEM_SET, QUANT_ONE, p, ep)) return false;
+      p = ep;
+      break;
+    }
+  }
+  return true;
+}
+
+
+static bool compile_literal(lsb_string_pattern *sp)
+{
+  size_t best = 0, best_start = 0;
+  for (unsigned i = 0; i < sp->cnt;) {
+    unsigned j = i;
+    while (j < sp->cnt && sp->items[j].type == ITEM_SET
+           && sp->items[j].quant == QUANT_ONE
+           && single_char(&sp->items[j]) != -1) {
+      ++j;
+    }
+    if (j - i > best) {
+      best = j - i;
+      best_start = i;
+    }
+    i = j + 1;
+  }
+  sp->literal_only = best == sp->cnt;
+  sp->fixed = true;
+  for (unsigned i = 0; i < sp->cnt && sp->fixed; ++i) {
+    sp->fixed = sp->items[i].type == ITEM_SET
+        && sp->items[i].quant == QUANT_ONE;
+  }
+  if (sp->cnt && sp->items[0].type == ITEM_SET
+      && sp->items[0].quant != QUANT_STAR && sp->items[0].quant != QUANT_OPT) {
+    sp->first_char = single_char(&sp->items[0]);
+  }
+  if (!best) return true;
+
+  sp->literal = malloc(best);
+  if (!sp->literal) return false;
+  for (size_t i = 0; i < best; ++i) {
+    sp->literal[i] = (char)single_char(&sp->items[best_start + i]);
+  }
+  sp->literal_len = best;
+  sp->literal_item = best_start;
+  return true;
+}
+
+
+// small programs are simulated a word at a time (one bit per item)
+static bool compile_masks(lsb_string_pattern *sp)
+{
+  if (sp->cnt >= 64) return true;
+
+  sp->masks = calloc(256, sizeof(uint64_t));
+  if (!sp->masks) return false;
+  for (unsigned i = 0; i < sp->cnt; ++i) {
+    const pattern_item *item = &sp->items[i];
+    uint64_t bit = 1ULL << i;
+    if (item->quant != QUANT_ONE) sp->skip |= bit;
+    if (item->quant == QUANT_STAR) sp->star |= bit;
+    if (item->type == ITEM_FRONTIER && !sp->front_masks) {
+      sp->front_masks = calloc(256, sizeof(uint64_t));
+      if (!sp->front_masks) return false;
+    }
+    uint64_t *masks = item->type == ITEM_FRONTIER ? sp->front_masks
+        : sp->masks;
+    for (int c = 0; c < 256; ++c) {
+      if (in_set(item, c)) masks[c] |= bit;
+    }
+  }
+  return true;
+}
+
+
+// recognizes ^?%bxy$?
+static bool compile_balance(lsb_string_pattern *sp, const char *p)
+{
+  bool anchor = *p == '^';
+  if (anchor) ++p;
+  if (p[0] != L_ESC || p[1] != 'b' || !p[2] || !p[3]) return false;
+  if (p[4] && (p[4] != '$' || p[5])) return false;
+  sp->balance = true;
+  sp->anchor_start = anchor;
+  sp->anchor_end = p[4] == '$';
+  sp->bal_open = p[2];
+  sp->bal_close = p[3];
+  return true;
+}
+
+
+lsb_string_pattern* lsb_compile_string_pattern(const char *p)
+{
+  if (!p) return NULL;
+  lsb_string_pattern *sp = calloc(1, sizeof(lsb_string_pattern));
+  if (!sp) return NULL;
+  sp->first_char = -1;
+
+  size_t len = strlen(p);
+  size_t max_items = len * 2 < MAX_ITEMS ? len * 2 : MAX_ITEMS;
+  sp->items = malloc(sizeof(pattern_item) * (max_items ? max_items : 1));
+  if (!sp->items) {
+    free(sp);
+    return NULL;
+  }
+
+  if (!compile_items(sp, p)) {
+    // %b (or a pattern too long to simulate) keeps the backtracking matcher;
+    // invalid patterns never match
+    const char *b = p;
+    while ((b = strchr(b, L_ESC)) && *(b + 1) != 'b') b += *(b + 1) ? 2 : 1;
+    if (!b && sp->cnt < MAX_ITEMS) {
+      lsb_destroy_string_pattern(sp);
+      return NULL;
+    }
+    free(sp->items);
+    sp->items = NULL;
+    sp->cnt = 0;
+    sp->source = malloc(len + 1);
+    if (!sp->source) {
+      lsb_destroy_string_pattern(sp);
+      return NULL;
+    }
+    memcpy(sp->source, p, len + 1);
+    compile_balance(sp, p);
+    return sp;
+  }
+
+  if (!compile_literal(sp) || !compile_masks(sp)) {
+    lsb_destroy_string_pattern(sp);
+    return NULL;
+  }
+  return sp;
+}
+
+
+void lsb_destroy_string_pattern(lsb_string_pattern *sp)
+{
+  if (!sp) return;
+  free(sp->items);
+  free(sp->literal);
+  free(sp->source);
+  free(sp->masks);
+  free(sp->front_masks);
+  free(sp);
+}
+
+
+static void closure(const lsb_string_pattern *sp, uint64_t *states, int prev,
+                    int c)
+{
+  for (unsigned i = 0; i < sp->cnt; ++i) {
+    if (!states[i >> 6]) {
+      i |= 63;
+      continue;
+    }
+    if (!(states[i >> 6] & (1ULL << (i & 63)))) continue;
+    const pattern_item *item = &sp->items[i];
+    if (item->quant != QUANT_ONE
+        || (item->type == ITEM_FRONTIER && !in_set(item, prev)
+            && in_set(item, c))) {
+      states[(i + 1) >> 6] |= 1ULL << ((i + 1) & 63);
+    }
+  }
+}
+
+
+static bool simulate(const lsb_string_pattern *sp, const char *s, size_t len)
+{
+  uint64_t states[STATE_WORDS], next[STATE_WORDS];
+  unsigned words = (sp->cnt >> 6) + 1;
+  unsigned accept = sp->cnt;
+  memset(states, 0, sizeof(uint64_t) * words);
+
+  for (size_t k = 0;; ++k) {
+    if (k == 0 || !sp->anchor_start) {
+      if (!sp->anchor_start && sp->first_char != -1 && k < len) {
+        bool active = false;
+        for (unsigned w = 0; w < words && !active; ++w) active = states[w];
+        if (!active) {
+          // nothing in flight, skip to the next possible start
+          const char *n = memchr(s + k, sp->first_char, len - k);
+          if (!n) return false;
+          k = (size_t)(n - s);
+        }
+      }
+      states[0] |= 1;
+    }
+    int prev = k ? uchar(s[k - 1]) : 0;
+    int c = k < len ? uchar(s[k]) : 0;
+    closure(sp, states, prev, c);
+    if ((states[accept >> 6] & (1ULL << (accept & 63)))
+        && (!sp->anchor_end || k == len)) {
+      return true;
+    }
+    if (k == len) return false;
+
+    bool active = false;
+    memset(next, 0, sizeof(uint64_t) * words);
+    for (unsigned i = 0; i < accept; ++i) {
+      if (!states[i >> 6]) {
+        i |= 63;
+        continue;
+      }
+      if (!(states[i >> 6] & (1ULL << (i & 63)))) continue;
+      const pattern_item *item = &sp->items[i];
+      if (item->type == ITEM_SET && in_set(item, c)) {
+        unsigned to = item->quant == QUANT_STAR ? i : i + 1;
+        next[to >> 6] |= 1ULL << (to & 63);
+        active = true;
+      }
+    }
+    memcpy(states, next, sizeof(uint64_t) * words);
+    if (!active && sp->anchor_start) return false;
+  }
+}
+
+
+static bool simulate_bits(const lsb_string_pattern *sp, const char *s,
+                          size_t len)
+{
+  const uint64_t accept = 1ULL << sp->cnt;
+  uint64_t states = 0;
+  for (size_t k = 0;; ++k) {
+    if (k == 0 || !sp->anchor_start) {
+      if (!states && !sp->anchor_start && sp->first_char != -1 && k < len) {
+        // nothing in flight, skip to the next possible start
+        const char *n = memchr(s + k, sp->first_char, len - k);
+        if (!n) return false;
+        k = (size_t)(n - s);
+      }
+      states |= 1;
+    }
+    int c = k < len ? uchar(s[k]) : 0;
+    uint64_t eps = sp->skip;
+    if (sp->front_masks) {
+      int prev = k ? uchar(s[k - 1]) : 0;
+      eps |= sp->front_masks[c] & ~sp->front_masks[prev];
+    }
+    for (uint64_t add = ((states & eps) << 1) & ~states; add;
+         add = ((add & eps) << 1) & ~states) {
+      states |= add;
+    }
+    if ((states & accept) && (!sp->anchor_end || k == len)) return true;
+    if (k == len) return false;
+
+    uint64_t t = states & sp->masks[c];
+    states = ((t & ~sp->star) << 1) | (t & sp->star);
+    if (!states && sp->anchor_start) return false;
+  }
+}
+
+
+static bool fixed_at(const lsb_string_pattern *sp, const char *s)
+{
+  for (unsigned i = 0; i < sp->cnt; ++i) {
+    if (!in_set(&sp->items[i], uchar(s[i]))) return false;
+  }
+  return true;
+}
+
+
+static bool fixed_match(const lsb_string_pattern *sp, const char *s,
+                        size_t len)
+{
+  if (len < sp->cnt) return false;
+  if (sp->anchor_start) {
+    return (!sp->anchor_end || len == sp->cnt) && fixed_at(sp, s);
+  }
+  if (sp->anchor_end) return fixed_at(sp, s + len - sp->cnt);
+  for (size_t k = 0; k <= len - sp->cnt; ++k) {
+    if (fixed_at(sp, s + k)) return true;
+  }
+  return false;
+}
+
+
+// the balanced span starting at s, as matchbalance
+static const char* balance_end(const lsb_string_pattern *sp, const char *s,
+                               const char *e)
+{
+  if (s == e || *s != sp->bal_open) return NULL;
+  int cont = 1;
+  while (++s < e) {
+    if (*s == sp->bal_close) {
+      if (--cont == 0) return s + 1;
+    } else if (*s == sp->bal_open) cont++;
+  }
+  return NULL;
+}
+
+
+static bool balance_match(const lsb_string_pattern *sp, const char *s,
+                          size_t len)
+{
+  const char *e = s + len;
+  if (sp->anchor_start) {
+    const char *end = balance_end(sp, s, e);
+    return end && (!sp->anchor_end || end == e);
+  }
+  if (!sp->anchor_end) {
+    // the last opener before the first closer that follows any opener always
+    // balances, so only an opener followed by a closer is needed
+    const char *o = memchr(s, sp->bal_open, len);
+    return o && memchr(o + 1, sp->bal_close, (size_t)(e - o - 1));
+  }
+  if (!len || s[len - 1] != sp->bal_close) return false;
+  if (sp->bal_open == sp->bal_close) {
+    // an opener closes at the next occurrence
+    return memchr(s, sp->bal_open, len - 1) != NULL;
+  }
+  // an opener at i balances exactly at the end when the depth before it equals
+  // the final depth and the depth stays above it in between
+  ptrdiff_t depth = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (s[i] == sp->bal_close) --depth;
+    else if (s[i] == sp->bal_open) ++depth;
+  }
+  ptrdiff_t final = depth, low = PTRDIFF_MAX;
+  for (size_t i = len; i-- > 0;) {
+    if (s[i] == sp->bal_close) ++depth;
+    else if (s[i] == sp->bal_open) --depth;
+    // depth is now the depth before position i
+    if (s[i] == sp->bal_open && depth == final && low > depth) return true;
+    if (depth < low) low = depth;
+  }
+  return false;
+}
+
+
+bool lsb_string_pattern_match(const lsb_string_pattern *sp, const char *s,
+                              size_t len)
+{
+  if (!sp || !s) return false;
+  if (sp->balance) return balance_match(sp, s, len);
+  if (sp->source) return lsb_string_match(s, len, sp->source);
+
+  if (sp->literal_len) {
+    const char *lit = sp->literal;
+    size_t ll = sp->literal_len;
+    if (sp->literal_only) {
+      if (sp->anchor_start && sp->anchor_end) {
+        return len == ll && memcmp(s, lit, ll) == 0;
+      } else if (sp->anchor_start) {
+        return len >= ll && memcmp(s, lit, ll) == 0;
+      } else if (sp->anchor_end) {
+        return len >= ll && memcmp(s + len - ll, lit, ll) == 0;
+      }
+      return memfind(s, len, lit, ll) != NULL;
+    }
+    // prefilter on the required literal before running the automaton
+    if (sp->anchor_start && sp->literal_item == 0) {
+      if (len < ll || memcmp(s, lit, ll) != 0) return false;
+    } else if (!memfind(s, len, lit, ll)) {
+      return false;
+    }
+  }
+  if (sp->fixed) return fixed_match(sp, s, len);
+  if (sp->masks) return simulate_bits(sp, s, len);
+  return simulate(sp, s, len);
+}
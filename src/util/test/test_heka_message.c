@@ -11,10 +11,12 @@
 #include <string.h>
 
 #include <stdio.h>
+#include <time.h>
 
 #include "luasandbox/error.h"
 #include "luasandbox/test/mu_test.h"
 #include "luasandbox/util/heka_message.h"
+#include "luasandbox/util/protobuf.h"
 
 #define TEST_UUID "\x0a\x10\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff"
 #define TEST_NS   "\x10\x01"
@@ -278,6 +280,350 @@ static char* test_read_heka_field()
 }
 
 
+static char* test_read_heka_field_value()
+{
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 8);
+  mu_assert(lsb_decode_heka_message(&m, pb, sizeof pb - 1, NULL), "decode failed");
+
+  const lsb_heka_field *f = NULL;
+  for (int i = 0; i < m.fields_len; ++i) {
+    if (m.fields[i].name.len == 7
+        && strncmp(m.fields[i].name.s, "numbers", 7) == 0) {
+      f = &m.fields[i];
+      break;
+    }
+  }
+  mu_assert(f, "numbers field not found");
+
+  lsb_read_value v;
+  mu_assert(lsb_read_heka_field_value(f, 2, &v), "item 2");
+  mu_assert(v.type == LSB_READ_NUMERIC, "%d", v.type);
+  mu_assert(v.u.d == 3, "invalid value: %g", v.u.d);
+
+  mu_assert(!lsb_read_heka_field_value(f, 3, &v), "no item 3");
+  mu_assert(v.type == LSB_READ_NIL, "%d", v.type);
+
+  mu_assert(!lsb_read_heka_field_value(NULL, 0, &v), "succeeded");
+  mu_assert(!lsb_read_heka_field_value(f, 0, NULL), "succeeded");
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
+static char* test_decode_heka_header()
+{
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 1);
+
+  const char *p = pb;
+  const char *e = pb + sizeof pb - 1;
+  int tag = 0;
+  int tags = 0;
+  while ((p = lsb_decode_heka_header(&m, p, e, &tag))) {
+    ++tags;
+  }
+  mu_assert(tags == 14, "received: %d", tags); // 8 headers, 6 fields
+  mu_assert(m.uuid.len == LSB_UUID_SIZE, "received: %" PRIuSIZE, m.uuid.len);
+  mu_assert(m.timestamp == 1000000000, "received: %lld", m.timestamp);
+  mu_assert(strncmp(m.type.s, "type", m.type.len) == 0, "received: %.*s",
+            (int)m.type.len, m.type.s);
+  mu_assert(strncmp(m.hostname.s, "hostname", m.hostname.len) == 0,
+            "received: %.*s", (int)m.hostname.len, m.hostname.s);
+  mu_assert(m.severity == 9, "received: %d", m.severity);
+  mu_assert(m.fields_len == 0, "received: %d", m.fields_len);
+
+  mu_assert(!lsb_decode_heka_header(&m, pb, pb + 10, &tag), "truncated");
+  mu_assert(!lsb_decode_heka_header(&m, "\x78\x00", e, &tag), "unknown tag");
+  mu_assert(!lsb_decode_heka_header(NULL, pb, e, &tag), "succeeded");
+  mu_assert(!lsb_decode_heka_header(&m, pb, e, NULL), "succeeded");
+  mu_assert(!lsb_decode_heka_header(&m, e, e, &tag), "succeeded");
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
+static char* test_read_encoded_heka_field()
+{
+  lsb_read_value v;
+  lsb_const_string cs;
+  cs.s = "strings";
+  cs.len = 7;
+  mu_assert(lsb_read_encoded_heka_field(pb, sizeof pb - 1, &cs, 0, 1, &v),
+            "item 1");
+  mu_assert(v.type == LSB_READ_STRING, "%d", v.type);
+  mu_assert(strncmp(v.u.s.s, "s2", v.u.s.len) == 0, "invalid value: %.*s",
+            (int)v.u.s.len, v.u.s.s);
+
+  cs.s = "numbers";
+  mu_assert(lsb_read_encoded_heka_field(pb, sizeof pb - 1, &cs, 0, 2, &v),
+            "item 2");
+  mu_assert(v.type == LSB_READ_NUMERIC, "%d", v.type);
+  mu_assert(v.u.d == 3, "invalid value: %g", v.u.d);
+
+  mu_assert(!lsb_read_encoded_heka_field(pb, sizeof pb - 1, &cs, 1, 0, &v),
+            "no field 1");
+  mu_assert(v.type == LSB_READ_NIL, "%d", v.type);
+
+  cs.s = "bool";
+  cs.len = 4;
+  mu_assert(lsb_read_encoded_heka_field(pb, sizeof pb - 1, &cs, 0, 0, &v),
+            "standalone");
+  mu_assert(v.type == LSB_READ_BOOL, "%d", v.type);
+  mu_assert(v.u.d == 1, "invalid value: %g", v.u.d);
+
+  // truncated before the field
+  mu_assert(!lsb_read_encoded_heka_field(pb, 40, &cs, 0, 0, &v), "succeeded");
+  mu_assert(!lsb_read_encoded_heka_field(NULL, 0, &cs, 0, 0, &v), "succeeded");
+  mu_assert(!lsb_read_encoded_heka_field(pb, sizeof pb - 1, NULL, 0, 0, &v),
+            "succeeded");
+  mu_assert(!lsb_read_encoded_heka_field(pb, sizeof pb - 1, &cs, 0, 0, NULL),
+            "succeeded");
+  return NULL;
+}
+
+
+#define ARRAY_ITEMS 1000
+
+static size_t write_varint(char *p, unsigned long long v)
+{
+  size_t i = 0;
+  for (; v > 0x7f; v >>= 7) {
+    p[i++] = (char)(0x80 | (v & 0x7f));
+  }
+  p[i++] = (char)v;
+  return i;
+}
+
+
+// message with an integer array field 'a' (0..ARRAY_ITEMS-1) and a string
+// array field 'b'
+static size_t build_array_message(char *buf)
+{
+  char ints[ARRAY_ITEMS * 2];
+  size_t ilen = 0;
+  for (int i = 0; i < ARRAY_ITEMS; ++i) {
+    ilen += write_varint(ints + ilen, i);
+  }
+
+  size_t len = sizeof(TEST_UUID TEST_NS) - 1;
+  memcpy(buf, TEST_UUID TEST_NS, len);
+  char hdr[] = "\x0a\x01" "a" "\x10\x02\x32";
+  buf[len++] = 0x52;
+  len += write_varint(buf + len, sizeof hdr - 1 + 2 + ilen);
+  memcpy(buf + len, hdr, sizeof hdr - 1);
+  len += sizeof hdr - 1;
+  len += write_varint(buf + len, ilen);
+  memcpy(buf + len, ints, ilen);
+  len += ilen;
+
+  buf[len++] = 0x52;
+  len += write_varint(buf + len, 5 + ARRAY_ITEMS * 3);
+  memcpy(buf + len, "\x0a\x01" "b" "\x10\x00", 5);
+  len += 5;
+  for (int i = 0; i < ARRAY_ITEMS; ++i) {
+    buf[len++] = 0x22;
+    buf[len++] = 0x01;
+    buf[len++] = 'a' + i % 26;
+  }
+  return len;
+}
+
+
+static char* test_read_indexed_heka_field()
+{
+  static char buf[ARRAY_ITEMS * 6];
+  size_t len = build_array_message(buf);
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 1);
+  lsb_heka_field_index fx;
+  lsb_init_heka_field_index(&fx);
+
+  lsb_read_value v;
+  lsb_const_string a = { .s = "a", .len = 1 };
+  lsb_const_string b = { .s = "b", .len = 1 };
+  for (int x = 0; x < 2; ++x) { // the index is reset with each decode
+    mu_assert(lsb_decode_heka_message(&m, buf, len, NULL), "decode failed");
+    lsb_reset_heka_field_index(&fx);
+    for (int i = ARRAY_ITEMS - 1; i >= 0; --i) {
+      mu_assert(lsb_read_indexed_heka_field(&m, &fx, &a, 0, i, &v), "item %d",
+                i);
+      mu_assert(v.type == LSB_READ_NUMERIC && v.u.d == i, "item %d: %g", i,
+                v.u.d);
+      mu_assert(lsb_read_indexed_heka_field(&m, &fx, &b, 0, i, &v), "item %d",
+                i);
+      mu_assert(v.type == LSB_READ_STRING && v.u.s.len == 1
+                && v.u.s.s[0] == 'a' + i % 26, "item %d", i);
+    }
+    mu_assert(fx.offsets_len == ARRAY_ITEMS * 2, "received: %d",
+              fx.offsets_len);
+    mu_assert(!lsb_read_indexed_heka_field(&m, &fx, &a, 0, ARRAY_ITEMS, &v),
+              "no item %d", ARRAY_ITEMS);
+    mu_assert(v.type == LSB_READ_NIL, "%d", v.type);
+    mu_assert(!lsb_read_indexed_heka_field(&m, &fx, &a, 1, 1, &v),
+              "no field 1");
+    mu_assert(!lsb_read_indexed_heka_field(&m, &fx, &a, 0, -1, &v),
+              "succeeded");
+  }
+
+  // without an index the values are scanned
+  mu_assert(lsb_read_indexed_heka_field(&m, NULL, &b, 0, 3, &v), "item 3");
+  mu_assert(v.type == LSB_READ_STRING && v.u.s.s[0] == 'd', "item 3");
+
+  mu_assert(lsb_decode_heka_message(&m, pb, sizeof pb - 1, NULL),
+            "decode failed");
+  lsb_reset_heka_field_index(&fx);
+  lsb_const_string cs = { .s = "numbers", .len = 7 };
+  mu_assert(lsb_read_indexed_heka_field(&m, &fx, &cs, 0, 2, &v),
+            "double item 2");
+  mu_assert(v.type == LSB_READ_NUMERIC && v.u.d == 3, "%g", v.u.d);
+  cs.s = "bools";
+  cs.len = 5;
+  mu_assert(lsb_read_indexed_heka_field(&m, &fx, &cs, 0, 0, &v),
+            "bool item 0");
+  mu_assert(v.type == LSB_READ_BOOL && v.u.d == 1, "%g", v.u.d);
+  mu_assert(lsb_read_indexed_heka_field(&m, &fx, &cs, 0, 2, &v),
+            "bool item 2");
+  mu_assert(v.type == LSB_READ_BOOL && v.u.d == 0, "%g", v.u.d);
+
+  mu_assert(!lsb_read_indexed_heka_field(NULL, &fx, &cs, 0, 0, &v),
+            "succeeded");
+  mu_assert(!lsb_read_indexed_heka_field(&m, &fx, NULL, 0, 0, &v),
+            "succeeded");
+  mu_assert(!lsb_read_indexed_heka_field(&m, &fx, &cs, 0, 0, NULL),
+            "succeeded");
+  lsb_free_heka_field_index(&fx);
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
+static char* test_read_heka_field_values()
+{
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 8);
+  mu_assert(lsb_decode_heka_message(&m, pb, sizeof pb - 1, NULL), "decode failed");
+
+  lsb_read_value v[3];
+  for (int i = 0; i < m.fields_len; ++i) {
+    const lsb_heka_field *f = &m.fields[i];
+    int cnt = lsb_read_heka_field_values(f, v, 3);
+    mu_assert(cnt == lsb_read_heka_field_values(f, NULL, 0), "count mismatch");
+    for (int j = 0; j < cnt; ++j) {
+      lsb_read_value e;
+      mu_assert(lsb_read_heka_field_value(f, j, &e), "%.*s item: %d",
+                (int)f->name.len, f->name.s, j);
+      mu_assert(e.type == v[j].type, "%.*s item: %d type: %d", (int)f->name.len,
+                f->name.s, j, v[j].type);
+      if (e.type == LSB_READ_STRING) {
+        mu_assert(e.u.s.s == v[j].u.s.s && e.u.s.len == v[j].u.s.len,
+                  "%.*s item: %d", (int)f->name.len, f->name.s, j);
+      } else {
+        mu_assert(e.u.d == v[j].u.d, "%.*s item: %d", (int)f->name.len,
+                  f->name.s, j);
+      }
+    }
+    mu_assert(!lsb_read_heka_field_value(f, cnt, v), "%.*s extra item",
+              (int)f->name.len, f->name.s);
+  }
+
+  static char buf[ARRAY_ITEMS * 6];
+  size_t len = build_array_message(buf);
+  mu_assert(lsb_decode_heka_message(&m, buf, len, NULL), "decode failed");
+  int cnt = lsb_read_heka_field_values(&m.fields[0], v, 3);
+  mu_assert(cnt == ARRAY_ITEMS, "received: %d", cnt);
+  mu_assert(v[2].type == LSB_READ_NUMERIC && v[2].u.d == 2, "%g", v[2].u.d);
+  mu_assert(lsb_read_heka_field_values(NULL, v, 3) == 0, "succeeded");
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
+static char* test_decode_reserved_lengths()
+{
+  lsb_output_buffer ob;
+  lsb_init_output_buffer(&ob, 0);
+  lsb_err_value ret = lsb_expand_output_buffer(&ob, sizeof(TEST_UUID TEST_NS));
+  mu_assert(!ret, "received %s", ret);
+  memcpy(ob.buf, TEST_UUID TEST_NS, sizeof(TEST_UUID TEST_NS) - 1);
+  ob.pos = sizeof(TEST_UUID TEST_NS) - 1;
+
+  size_t field_pos, packed_pos;
+  ret = lsb_pb_write_key(&ob, LSB_PB_FIELDS, LSB_PB_WT_LENGTH);
+  field_pos = ob.pos;
+  if (!ret) ret = lsb_pb_reserve_field_length(&ob);
+  if (!ret) ret = lsb_pb_write_string(&ob, LSB_PB_NAME, "a", 1);
+  if (!ret) ret = lsb_pb_write_key(&ob, LSB_PB_VALUE_TYPE, LSB_PB_WT_VARINT);
+  if (!ret) ret = lsb_pb_write_varint(&ob, LSB_PB_INTEGER);
+  if (!ret) ret = lsb_pb_write_key(&ob, LSB_PB_VALUE_INTEGER, LSB_PB_WT_LENGTH);
+  packed_pos = ob.pos;
+  if (!ret) ret = lsb_pb_reserve_field_length(&ob);
+  for (int i = 0; !ret && i < ARRAY_ITEMS; ++i) {
+    ret = lsb_pb_write_varint(&ob, i);
+  }
+  if (!ret) ret = lsb_pb_update_reserved_field_length(&ob, packed_pos);
+  if (!ret) ret = lsb_pb_update_reserved_field_length(&ob, field_pos);
+  mu_assert(!ret, "received %s", ret);
+
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 1);
+  mu_assert(lsb_decode_heka_message(&m, ob.buf, ob.pos, NULL), "decode failed");
+  mu_assert(m.fields_len == 1, "received: %d", m.fields_len);
+  mu_assert(m.fields[0].name.len == 1 && m.fields[0].name.s[0] == 'a',
+            "received: %.*s", (int)m.fields[0].name.len, m.fields[0].name.s);
+  static lsb_read_value vals[ARRAY_ITEMS];
+  int cnt = lsb_read_heka_field_values(&m.fields[0], vals, ARRAY_ITEMS);
+  mu_assert(cnt == ARRAY_ITEMS, "received: %d", cnt);
+  for (int i = 0; i < ARRAY_ITEMS; ++i) {
+    mu_assert(vals[i].type == LSB_READ_NUMERIC && vals[i].u.d == i,
+              "item %d: %g", i, vals[i].u.d);
+  }
+  lsb_free_heka_message(&m);
+  lsb_free_output_buffer(&ob);
+  return NULL;
+}
+
+
+static char* benchmark_read_array()
+{
+  int iter = 100;
+  static char buf[ARRAY_ITEMS * 6];
+  size_t len = build_array_message(buf);
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 1);
+  lsb_heka_field_index fx;
+  lsb_init_heka_field_index(&fx);
+  lsb_read_value v;
+  lsb_const_string a = { .s = "a", .len = 1 };
+
+  for (int mode = 0; mode < 3; ++mode) {
+    clock_t t = clock();
+    for (int x = 0; x < iter; ++x) {
+      mu_assert(lsb_decode_heka_message(&m, buf, len, NULL), "decode failed");
+      lsb_reset_heka_field_index(&fx);
+      if (mode == 2) {
+        static lsb_read_value vals[ARRAY_ITEMS];
+        mu_assert(lsb_read_heka_field_values(&m.fields[0], vals, ARRAY_ITEMS)
+                  == ARRAY_ITEMS, "bulk read failed");
+        continue;
+      }
+      for (int i = 0; i < ARRAY_ITEMS; ++i) {
+        bool ok = mode ? lsb_read_indexed_heka_field(&m, &fx, &a, 0, i, &v)
+            : lsb_read_heka_field(&m, &a, 0, i, &v);
+        mu_assert(ok, "item %d", i);
+      }
+    }
+    t = clock() - t;
+    const char *names[] = { "scan", "indexed", "bulk" };
+    printf("benchmark_read_array %d items (%s): %g\n", ARRAY_ITEMS,
+           names[mode], ((double)t) / CLOCKS_PER_SEC / iter);
+  }
+  lsb_free_heka_field_index(&fx);
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
 static char* test_write_heka_uuid()
 {
   lsb_err_value ret;
@@ -389,8 +735,16 @@ static char* all_tests()
   mu_run_test(test_decode_failure);
   mu_run_test(test_find_message);
   mu_run_test(test_read_heka_field);
+  mu_run_test(test_read_heka_field_value);
+  mu_run_test(test_decode_heka_header);
+  mu_run_test(test_read_encoded_heka_field);
+  mu_run_test(test_read_indexed_heka_field);
+  mu_run_test(test_read_heka_field_values);
+  mu_run_test(test_decode_reserved_lengths);
   mu_run_test(test_write_heka_uuid);
   mu_run_test(test_write_heka_header);
+
+  mu_run_test(benchmark_read_array);
   return NULL;
 }
 
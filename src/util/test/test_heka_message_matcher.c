@@ -124,6 +124,9 @@ static char* test_true_matcher()
     , "Type =~ 'ST$'"
     , "Type !~ '^te'"
     , "Type !~ 'st$'"
+    , "Payload =~ '^Test .* with a %a+ string.-unique%-item$'"
+    , "Payload =~ '%f[%w]pattern%s+match'"
+    , "Fields[Timestamp] =~ '%d+:%d+:%d+ [+-]%d%d%d%d'"
     , "Fields[foo][255] == NIL"
     , "Fields[foo][0][255] == NIL"
     , T128
@@ -139,6 +142,18 @@ static char* test_true_matcher()
     , "Uuid < '\\\\'"
     , "Uuid < \"\\\\\""
     , "(Severity == 7 || Logger == 'GoSpec') \r\n\t&& Type == 'TEST'"
+    , "Type IN ('foo', 'TEST')"
+    , "Type IN('TEST')"
+    , "Hostname IN ( 'localhost' , \"trink-x230\" )"
+    , "Logger IN ('GoSpec', 'GoSpec')"
+    , "Severity IN (1, 6, 7)"
+    , "Pid IN (32157)"
+    , "Fields[foo] IN ('x', 'bar')"
+    , "Fields[foo][1] IN ('alternate')"
+    , "Fields[int][0][1] IN (1024, 2048)"
+    , "Fields[double] IN (99.9)"
+    , "Fields[zero] IN (-0)"
+    , "Type IN ('a', 'b') || Severity IN (6) && Logger IN ('GoSpec')"
     , NULL };
 
   lsb_heka_message m;
@@ -148,6 +163,8 @@ static char* test_true_matcher()
     lsb_message_matcher *mm = lsb_create_message_matcher(tests[i]);
     mu_assert(mm, "failed to create the matcher %s", tests[i]);
     mu_assert(lsb_eval_message_matcher(mm, &m), "%s", tests[i]);
+    mu_assert(lsb_eval_message_matcher_raw(mm, pb, pblen - 1), "raw %s",
+              tests[i]);
     lsb_destroy_message_matcher(mm);
   }
   lsb_free_heka_message(&m);
@@ -178,6 +195,8 @@ static char* test_nil_header_true_matcher()
     lsb_message_matcher *mm = lsb_create_message_matcher(tests[i]);
     mu_assert(mm, "failed to create the matcher %s", tests[i]);
     mu_assert(lsb_eval_message_matcher(mm, &m), "%s", tests[i]);
+    mu_assert(lsb_eval_message_matcher_raw(mm, pbmin, pbminlen - 1), "raw %s",
+              tests[i]);
     lsb_destroy_message_matcher(mm);
   }
   lsb_free_heka_message(&m);
@@ -204,6 +223,8 @@ static char* test_nil_header_false_matcher()
     , "Logger == ''"
     , "Payload != NIL"
     , "Payload == ''"
+    , "Type IN ('', 'TEST')"
+    , "Pid IN (0)"
     , NULL };
 
   lsb_heka_message m;
@@ -213,6 +234,8 @@ static char* test_nil_header_false_matcher()
     lsb_message_matcher *mm = lsb_create_message_matcher(tests[i]);
     mu_assert(mm, "failed to create the matcher %s", tests[i]);
     mu_assert(lsb_eval_message_matcher(mm, &m) == false, "%s", tests[i]);
+    mu_assert(lsb_eval_message_matcher_raw(mm, pbmin, pbminlen - 1) == false,
+              "raw %s", tests[i]);
     lsb_destroy_message_matcher(mm);
   }
   lsb_free_heka_message(&m);
@@ -262,6 +285,8 @@ static char* test_false_matcher()
     , "Type =~ 'st$'"
     , "Type !~ '^TE'"
     , "Type !~ 'ST$'"
+    , "Payload =~ '^Test .* with a %d+ string'"
+    , "Payload =~ '%f[%w]attern'"
     , "Logger =~ '.' && Type =~ '^anything'"
     , "Type == '" S255 "'"
     , "Payload =~ 'not.found'%"
@@ -273,6 +298,11 @@ static char* test_false_matcher()
     , "Logger == NIL"
     , "Payload == NIL"
     , "Uuid > '\\\\'"
+    , "Type IN ('test', 'TESTS', 'TES')"
+    , "Severity IN (5, 7)"
+    , "Fields[foo] IN (1, 2)"
+    , "Fields[int] IN ('999')"
+    , "Fields[missing] IN ('bar')"
     , NULL };
 
   lsb_heka_message m;
@@ -282,6 +312,8 @@ static char* test_false_matcher()
     lsb_message_matcher *mm = lsb_create_message_matcher(tests[i]);
     mu_assert(mm, "failed to create the matcher %s", tests[i]);
     mu_assert(lsb_eval_message_matcher(mm, &m) == false, "%s", tests[i]);
+    mu_assert(lsb_eval_message_matcher_raw(mm, pb, pblen - 1) == false,
+              "raw %s", tests[i]);
     lsb_destroy_message_matcher(mm);
   }
   lsb_free_heka_message(&m);
@@ -289,6 +321,93 @@ static char* test_false_matcher()
 }
 
 
+static char* test_raw_matcher()
+{
+  lsb_message_matcher *mm = lsb_create_message_matcher("Type == 'TEST'");
+  mu_assert(mm, "failed to create the matcher");
+  mu_assert(!lsb_eval_message_matcher_raw(NULL, pb, pblen - 1), "succeeded");
+  mu_assert(!lsb_eval_message_matcher_raw(mm, NULL, 0), "succeeded");
+  mu_assert(!lsb_eval_message_matcher_raw(mm, pb, 0), "succeeded");
+  // truncated inside the Type header
+  mu_assert(!lsb_eval_message_matcher_raw(mm, pb, 30), "succeeded");
+  lsb_destroy_message_matcher(mm);
+
+  // the last occurrence of a repeated header is tested, as decoded
+  char dup[] = "\x1a\x01" "a" "\x22\x01" "b" "\x1a\x01" "c";
+  mm = lsb_create_message_matcher("Logger == 'b' && Type == 'c'");
+  mu_assert(mm, "failed to create the matcher");
+  mu_assert(lsb_eval_message_matcher_raw(mm, dup, sizeof dup - 1), "failed");
+  lsb_heka_message m;
+  mu_assert(!lsb_init_heka_message(&m, 1), "failed to init the message");
+  // the decode requires a uuid and timestamp
+  char full[] = "\x0a\x10" "0123456789abcdef" "\x10\x01"
+      "\x1a\x01" "a" "\x22\x01" "b" "\x1a\x01" "c";
+  mu_assert(lsb_decode_heka_message(&m, full, sizeof full - 1, NULL),
+            "decode failed");
+  mu_assert(lsb_eval_message_matcher(mm, &m), "decoded mismatch");
+  mu_assert(lsb_eval_message_matcher_raw(mm, full, sizeof full - 1),
+            "raw mismatch");
+  lsb_free_heka_message(&m);
+  lsb_destroy_message_matcher(mm);
+  mm = lsb_create_message_matcher("Type == 'a'");
+  mu_assert(mm, "failed to create the matcher");
+  mu_assert(!lsb_eval_message_matcher_raw(mm, dup, sizeof dup - 1),
+            "first occurrence tested");
+  lsb_destroy_message_matcher(mm);
+  return NULL;
+}
+
+
+static char* test_acquire_matcher()
+{
+  mu_assert(!lsb_acquire_message_matcher(NULL), "not null");
+  mu_assert(!lsb_acquire_message_matcher("Severity == 1 2"), "not null");
+
+  lsb_message_matcher *mm = lsb_acquire_message_matcher("Type == 'TEST'");
+  mu_assert(mm, "failed to acquire the matcher");
+  lsb_message_matcher *mm1 = lsb_acquire_message_matcher(
+      "\tType  ==\n'TEST' ");
+  mu_assert(mm == mm1, "whitespace variant not shared");
+  mu_assert(!lsb_profile_message_matcher(mm, 0), "profiled a shared matcher");
+
+  // whitespace in strings and field names is significant
+  mm1 = lsb_acquire_message_matcher("Type == 'TEST '");
+  mu_assert(mm1 && mm != mm1, "distinct string shared");
+  lsb_message_matcher *f1 = lsb_acquire_message_matcher("Fields[a b] == 1");
+  lsb_message_matcher *f2 = lsb_acquire_message_matcher("Fields[a  b] == 1");
+  mu_assert(f1 && f2 && f1 != f2, "distinct field name shared");
+  lsb_destroy_message_matcher(f1);
+  lsb_destroy_message_matcher(f2);
+  lsb_destroy_message_matcher(mm1);
+
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 16);
+  mu_assert(lsb_decode_heka_message(&m, pb, pblen - 1, NULL), "decode failed");
+  mu_assert(lsb_eval_message_matcher(mm, &m), "no match");
+  lsb_destroy_message_matcher(mm);
+  mu_assert(lsb_eval_message_matcher(mm, &m), "released too early");
+  lsb_destroy_message_matcher(mm);
+  lsb_free_heka_message(&m);
+
+  // many distinct expressions force the table to grow
+  lsb_message_matcher *mms[200];
+  char exp[32];
+  for (int i = 0; i < 200; ++i) {
+    snprintf(exp, sizeof exp, "Pid == %d", i);
+    mms[i] = lsb_acquire_message_matcher(exp);
+    mu_assert(mms[i], "failed to acquire %s", exp);
+  }
+  for (int i = 0; i < 200; ++i) {
+    snprintf(exp, sizeof exp, "Pid  ==  %d", i);
+    mm = lsb_acquire_message_matcher(exp);
+    mu_assert(mm == mms[i], "not shared %s", exp);
+    lsb_destroy_message_matcher(mm);
+    lsb_destroy_message_matcher(mms[i]);
+  }
+  return NULL;
+}
+
+
 static char* test_malformed_matcher()
 {
   char *tests[] = {
@@ -324,6 +443,13 @@ static char* test_malformed_matcher()
     , "Fields[test][0][256] == 1"                                   // array index out of bounds
     , "Payload =~ 'foo'i"                                           // invalid string match pattern modifier
     , "Uuid < '\\'"                                                 // unescaped backslash leaving an open string '\'
+    , "Type IN ()"                                                  // empty set
+    , "Type IN ('a',)"                                              // trailing comma
+    , "Type IN ('a', 1)"                                            // mixed value types
+    , "Type IN 'a'"                                                 // missing parens
+    , "Severity IN ('6')"                                           // Severity is not a string
+    , "Timestamp IN (0)"                                            // set not supported on the timestamp
+    , "Fields[test] IN (TRUE)"                                      // set not supported on booleans
     , NULL };
 
   lsb_heka_message m;
@@ -338,6 +464,83 @@ static char* test_malformed_matcher()
 }
 
 
+static char* test_profiled_matcher()
+{
+  char *tests[] = {
+    "Payload =~ 'unique' && Type == 'foo'"
+    , "Type == 'foo' || Payload =~ 'longer' || Severity == 6"
+    , "(Fields[foo] == 'bar' || Type == 'x') && (Severity == 7 || Logger == 'GoSpec') && Hostname != NIL"
+    , "Type == 'TEST' && Severity == 6 || Pid == NIL && Fields[missing] == NIL"
+    , "TRUE || FALSE && Type == 'x'"
+    , "Fields[int] IN (1, 999) && (Payload =~ '%d' || Uuid > '#') || Type =~ 'ST$'"
+    , "Severity == 6"
+    , NULL };
+
+  lsb_heka_message m[2];
+  lsb_init_heka_message(&m[0], 8);
+  lsb_init_heka_message(&m[1], 1);
+  mu_assert(lsb_decode_heka_message(&m[0], pb, pblen - 1, NULL), "decode failed");
+  mu_assert(lsb_decode_heka_message(&m[1], pbmin, pbminlen - 1, NULL), "decode failed");
+  for (int i = 0; tests[i]; ++i) {
+    lsb_message_matcher *mm = lsb_create_message_matcher(tests[i]);
+    lsb_message_matcher *pmm = lsb_create_message_matcher(tests[i]);
+    mu_assert(mm && pmm, "failed to create the matcher %s", tests[i]);
+    mu_assert(lsb_profile_message_matcher(pmm, 3), "%s", tests[i]);
+    for (int x = 0; x < 200; ++x) {
+      lsb_heka_message *hm = &m[(x / 7) % 2];
+      mu_assert(lsb_eval_message_matcher(mm, hm)
+                == lsb_eval_message_matcher(pmm, hm), "%s iteration: %d",
+                tests[i], x);
+    }
+    lsb_destroy_message_matcher(pmm);
+    lsb_destroy_message_matcher(mm);
+  }
+  lsb_free_heka_message(&m[0]);
+  lsb_free_heka_message(&m[1]);
+  return NULL;
+}
+
+
+static char* test_matcher_reorder()
+{
+  lsb_message_matcher_stats stats[2];
+  lsb_message_matcher *mm = lsb_create_message_matcher(
+      "Payload =~ 'string.*unique' && Type == 'foo'");
+  mu_assert(mm, "failed to create the matcher");
+  mu_assert(lsb_get_message_matcher_stats(mm, stats, 2) == 0, "not profiled");
+  mu_assert(lsb_profile_message_matcher(mm, 0), "profile failed");
+
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 8);
+  mu_assert(lsb_decode_heka_message(&m, pb, pblen - 1, NULL), "decode failed");
+  for (int x = 0; x < 100; ++x) {
+    mu_assert(!lsb_eval_message_matcher(mm, &m), "matched");
+  }
+  size_t n = lsb_get_message_matcher_stats(mm, stats, 2);
+  mu_assert(n == 2, "received %" PRIuSIZE, n);
+  mu_assert(stats[0].test == 0 && stats[0].evals == 100 && stats[0].hits == 100
+            && stats[0].timed == 7, "evals: %llu hits: %llu timed: %llu",
+            stats[0].evals, stats[0].hits, stats[0].timed);
+  mu_assert(stats[1].test == 1 && stats[1].evals == 100 && stats[1].hits == 0,
+            "evals: %llu hits: %llu", stats[1].evals, stats[1].hits);
+
+  // the cheap, always false type test moves in front of the pattern
+  lsb_optimize_message_matcher(mm);
+  for (int x = 0; x < 100; ++x) {
+    mu_assert(!lsb_eval_message_matcher(mm, &m), "matched");
+  }
+  n = lsb_get_message_matcher_stats(mm, stats, 1);
+  mu_assert(n == 2, "received %" PRIuSIZE, n);
+  mu_assert(stats[0].evals == 100, "evals: %llu", stats[0].evals);
+  lsb_get_message_matcher_stats(mm, stats, 2);
+  mu_assert(stats[1].evals == 200, "evals: %llu", stats[1].evals);
+
+  lsb_destroy_message_matcher(mm);
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
 static char* benchmark_matcher_create()
 {
   int iter = 100000;
@@ -356,6 +559,27 @@ static char* benchmark_matcher_create()
 }
 
 
+static char* benchmark_matcher_acquire()
+{
+  int iter = 100000;
+  const char *exp = "Type == 'TEST' && Severity == 6";
+
+  lsb_message_matcher *held = lsb_acquire_message_matcher(exp);
+  mu_assert(held, "lsb_acquire_message_matcher failed");
+  clock_t t = clock();
+  for (int x = 0; x < iter; ++x) {
+    lsb_message_matcher *mm = lsb_acquire_message_matcher(exp);
+    mu_assert(mm == held, "lsb_acquire_message_matcher failed");
+    lsb_destroy_message_matcher(mm);
+  }
+  t = clock() - t;
+  lsb_destroy_message_matcher(held);
+  printf("benchmark_matcher_acquire: %g\n", ((double)t) / CLOCKS_PER_SEC
+         / iter);
+  return NULL;
+}
+
+
 static char* benchmark_match_hs()
 {
   // see what a single sample looks like for a better comparison with Hindsight
@@ -437,6 +661,123 @@ static char* benchmark_match()
 }
 
 
+static char* benchmark_match_set()
+{
+  int iter = 1000000;
+  char exp[4096];
+  char *p = exp;
+  size_t len = 0;
+
+  // 200 hostnames with the match last vs the longest equivalent OR chain
+  len += snprintf(p + len, sizeof(exp) - len, "Hostname IN (");
+  for (int i = 0; i < 199; ++i) {
+    len += snprintf(p + len, sizeof(exp) - len, "'host-%d', ", i);
+  }
+  snprintf(p + len, sizeof(exp) - len, "'trink-x230')");
+
+  char chain[4096];
+  len = 0;
+  for (int i = 0; i < 127; ++i) {
+    len += snprintf(chain + len, sizeof(chain) - len,
+                    "Hostname == 'host-%d' || ", i);
+  }
+  snprintf(chain + len, sizeof(chain) - len, "Hostname == 'trink-x230'");
+
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 8);
+  mu_assert(lsb_decode_heka_message(&m, pb, pblen - 1, NULL), "decode failed");
+
+  const char *tests[] = { exp, chain, NULL };
+  const char *names[] = { "IN (200 values)", "|| (128 tests)" };
+  for (int i = 0; tests[i]; i++) {
+    lsb_message_matcher *mm = lsb_create_message_matcher(tests[i]);
+    mu_assert(mm, "lsb_create_message_matcher failed: %s", names[i]);
+    clock_t t = clock();
+    for (int x = 0; x < iter; ++x) {
+      mu_assert(lsb_eval_message_matcher(mm, &m),
+                "lsb_eval_message_matcher failed");
+    }
+    t = clock() - t;
+    lsb_destroy_message_matcher(mm);
+    printf("matcher: '%s': %g\n", names[i], ((double)t) / CLOCKS_PER_SEC
+           / iter);
+  }
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
+static char* benchmark_match_reorder()
+{
+  int iter = 1000000;
+  const char *exp = "Payload =~ 'string.*unique' && Fields[foo] == 'bar' "
+      "&& Type == 'foo'";
+
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 8);
+  mu_assert(lsb_decode_heka_message(&m, pb, pblen - 1, NULL), "decode failed");
+
+  for (unsigned i = 0; i < 2; i++) {
+    lsb_message_matcher *mm = lsb_create_message_matcher(exp);
+    mu_assert(mm, "lsb_create_message_matcher failed");
+    if (i) mu_assert(lsb_profile_message_matcher(mm, 10000), "profile failed");
+    clock_t t = clock();
+    for (int x = 0; x < iter; ++x) {
+      mu_assert(!lsb_eval_message_matcher(mm, &m),
+                "lsb_eval_message_matcher failed");
+    }
+    t = clock() - t;
+    lsb_destroy_message_matcher(mm);
+    printf("matcher: '%s' %s: %g\n", exp, i ? "reordered" : "written order",
+           ((double)t) / CLOCKS_PER_SEC / iter);
+  }
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
+static char* benchmark_match_raw()
+{
+  int iter = 1000000;
+  // typical router expressions that reject most of the stream
+  char *tests[] = {
+    "Type == 'foo'"
+    , "Logger == 'foo' && Fields[foo] == 'bar'"
+    , "Fields[string] == 'foo'"
+    , NULL };
+
+  lsb_heka_message m;
+  lsb_init_heka_message(&m, 8);
+
+  for (int i = 0; tests[i]; i++) {
+    lsb_message_matcher *mm = lsb_create_message_matcher(tests[i]);
+    mu_assert(mm, "lsb_create_message_matcher failed: %s", tests[i]);
+    clock_t t = clock();
+    for (int x = 0; x < iter; ++x) {
+      mu_assert(lsb_decode_heka_message(&m, pb, pblen - 1, NULL),
+                "decode failed");
+      mu_assert(!lsb_eval_message_matcher(mm, &m),
+                "lsb_eval_message_matcher failed");
+    }
+    t = clock() - t;
+    printf("matcher: '%s' decoded: %g\n", tests[i],
+           ((double)t) / CLOCKS_PER_SEC / iter);
+
+    t = clock();
+    for (int x = 0; x < iter; ++x) {
+      mu_assert(!lsb_eval_message_matcher_raw(mm, pb, pblen - 1),
+                "lsb_eval_message_matcher_raw failed");
+    }
+    t = clock() - t;
+    lsb_destroy_message_matcher(mm);
+    printf("matcher: '%s' raw: %g\n", tests[i],
+           ((double)t) / CLOCKS_PER_SEC / iter);
+  }
+  lsb_free_heka_message(&m);
+  return NULL;
+}
+
+
 static char* all_tests()
 {
   mu_run_test(test_stub);
@@ -445,11 +786,19 @@ static char* all_tests()
   mu_run_test(test_nil_header_true_matcher);
   mu_run_test(test_false_matcher);
   mu_run_test(test_nil_header_false_matcher);
+  mu_run_test(test_raw_matcher);
+  mu_run_test(test_acquire_matcher);
   mu_run_test(test_malformed_matcher);
+  mu_run_test(test_profiled_matcher);
+  mu_run_test(test_matcher_reorder);
 
   mu_run_test(benchmark_match_hs);
   mu_run_test(benchmark_matcher_create);
+  mu_run_test(benchmark_matcher_acquire);
   mu_run_test(benchmark_match);
+  mu_run_test(benchmark_match_set);
+  mu_run_test(benchmark_match_reorder);
+  mu_run_test(benchmark_match_raw);
   return NULL;
 }
 
@@ -0,0 +1,173 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief lsb_histogram unit tests @file */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "luasandbox/test/mu_test.h"
+#include "luasandbox/util/histogram.h"
+
+static lsb_histogram h, h1;
+
+static char* test_stub()
+{
+  return NULL;
+}
+
+
+static char* test_init()
+{
+  lsb_init_histogram(&h);
+  mu_assert(h.count == 0, "received: %llu", h.count);
+  unsigned long long v = lsb_histogram_percentile(&h, 50);
+  mu_assert(v == 0, "received: %llu", v);
+  mu_assert(lsb_histogram_mean(&h) == 0, "received: %g",
+            lsb_histogram_mean(&h));
+  return NULL;
+}
+
+
+static char* test_exact()
+{
+  lsb_init_histogram(&h);
+  for (unsigned long long i = 1; i <= 10; ++i) {
+    lsb_update_histogram(&h, i);
+  }
+  mu_assert(h.count == 10, "received: %llu", h.count);
+  mu_assert(h.min == 1, "received: %llu", h.min);
+  mu_assert(h.max == 10, "received: %llu", h.max);
+  mu_assert(lsb_histogram_mean(&h) == 5.5, "received: %g",
+            lsb_histogram_mean(&h));
+  unsigned long long v = lsb_histogram_percentile(&h, 50);
+  mu_assert(v == 5, "received: %llu", v);
+  v = lsb_histogram_percentile(&h, 0);
+  mu_assert(v == 1, "received: %llu", v);
+  v = lsb_histogram_percentile(&h, 100);
+  mu_assert(v == 10, "received: %llu", v);
+  return NULL;
+}
+
+
+static char* test_precision()
+{
+  srand(1);
+  for (int i = 0; i < 100000; ++i) {
+    unsigned long long v = (((unsigned long long)rand() << 12) ^ rand())
+        & ((1ULL << LSB_HISTOGRAM_MAX_BITS) - 1);
+    lsb_init_histogram(&h);
+    lsb_update_histogram(&h, 0);
+    lsb_update_histogram(&h, v);
+    lsb_update_histogram(&h, ~0ULL);
+    unsigned long long r = lsb_histogram_percentile(&h, 50);
+    mu_assert(r >= v && (double)(r - v) <= v / 32.0, "value: %llu received: "
+              "%llu", v, r);
+  }
+  return NULL;
+}
+
+
+static char* test_tail()
+{
+  // a 10us mean hides the 500ms spikes
+  lsb_init_histogram(&h);
+  for (int i = 0; i < 9990; ++i) {
+    lsb_update_histogram(&h, 10000);
+  }
+  for (int i = 0; i < 10; ++i) {
+    lsb_update_histogram(&h, 500000000);
+  }
+  unsigned long long v = lsb_histogram_percentile(&h, 99);
+  mu_assert(v >= 10000 && v < 10400, "received: %llu", v);
+  v = lsb_histogram_percentile(&h, 99.95);
+  mu_assert(v == 500000000, "received: %llu", v);
+  v = lsb_histogram_percentile(&h, 99.8);
+  mu_assert(v < 10400, "received: %llu", v);
+  return NULL;
+}
+
+
+static char* test_overflow()
+{
+  lsb_init_histogram(&h);
+  lsb_update_histogram(&h, 1ULL << 50);
+  lsb_update_histogram(&h, 1ULL << 45);
+  unsigned long long v = lsb_histogram_percentile(&h, 10);
+  mu_assert(v == 1ULL << 50, "received: %llu", v);
+  mu_assert(h.buckets[LSB_HISTOGRAM_BUCKETS - 1] == 2, "received: %llu",
+            h.buckets[LSB_HISTOGRAM_BUCKETS - 1]);
+  return NULL;
+}
+
+
+static char* test_merge()
+{
+  lsb_init_histogram(&h);
+  lsb_init_histogram(&h1);
+  for (unsigned long long i = 1; i <= 1000; ++i) {
+    lsb_update_histogram(i % 2 ? &h : &h1, i * 1000);
+  }
+  lsb_merge_histogram(&h, &h1);
+  mu_assert(h.count == 1000, "received: %llu", h.count);
+  mu_assert(h.min == 1000, "received: %llu", h.min);
+  mu_assert(h.max == 1000000, "received: %llu", h.max);
+  mu_assert(lsb_histogram_mean(&h) == 500500, "received: %g",
+            lsb_histogram_mean(&h));
+  unsigned long long v = lsb_histogram_percentile(&h, 50);
+  mu_assert(v >= 500000 && v <= 500000 + 500000 / 32, "received: %llu", v);
+
+  lsb_init_histogram(&h1);
+  lsb_merge_histogram(&h1, &h);
+  mu_assert(h1.min == 1000, "received: %llu", h1.min);
+  mu_assert(lsb_histogram_percentile(&h1, 50) == v, "received: %llu",
+            lsb_histogram_percentile(&h1, 50));
+  return NULL;
+}
+
+
+static char* benchmark_update()
+{
+  int iter = 10000000;
+  lsb_init_histogram(&h);
+  clock_t t = clock();
+  for (int x = 0; x < iter; ++x) {
+    lsb_update_histogram(&h, (unsigned long long)x * 7919);
+  }
+  t = clock() - t;
+  mu_assert(h.count == (unsigned long long)iter, "received: %llu", h.count);
+  printf("benchmark_update() %g seconds\n", ((double)t) / CLOCKS_PER_SEC
+         / iter);
+  return NULL;
+}
+
+
+static char* all_tests()
+{
+  mu_run_test(test_stub);
+  mu_run_test(test_init);
+  mu_run_test(test_exact);
+  mu_run_test(test_precision);
+  mu_run_test(test_tail);
+  mu_run_test(test_overflow);
+  mu_run_test(test_merge);
+
+  mu_run_test(benchmark_update);
+  return NULL;
+}
+
+
+int main()
+{
+  char* result = all_tests();
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", mu_tests_run);
+  return result != NULL;
+}
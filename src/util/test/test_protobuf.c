@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "luasandbox/error.h"
 #include "luasandbox/test/mu_test.h"
@@ -121,6 +122,126 @@ static char* test_varint()
 }
 
 
+// the original byte at a time decoder, used as the reference implementation
+static const char* ref_read_varint(const char *p, const char *e, long long *vi)
+{
+  *vi = 0;
+  int i, shift = 0;
+  for (i = 0; p != e && i < LSB_MAX_VARINT_BYTES; ++i, ++p) {
+    *vi |= ((unsigned long long)*p & 0x7f) << shift;
+    shift += 7;
+    if ((*p & 0x80) == 0) break;
+  }
+  if (i == LSB_MAX_VARINT_BYTES || p == e) {
+    return NULL;
+  }
+  return ++p;
+}
+
+
+static unsigned long long next_rand(unsigned long long *state)
+{
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return *state;
+}
+
+
+// random value with a random bit width so every varint length is covered
+static unsigned long long rand_value(unsigned long long *state)
+{
+  unsigned bits = next_rand(state) >> 58; // 0-63
+  return next_rand(state) >> (63 - bits);
+}
+
+
+static char* test_varint_fast_path()
+{
+  unsigned long long state = 1;
+  char buf[LSB_MAX_VARINT_BYTES + 16];
+  for (int i = 0; i < 100000; ++i) {
+    memset(buf, i & 1 ? 0xff : 0, sizeof buf); // junk after the varint
+    unsigned long long v = rand_value(&state);
+    int len = lsb_pb_output_varint(buf, v);
+    // with plenty of trailing bytes and with the varint at the end of the buffer
+    for (int tail = 0; tail < 2; ++tail) {
+      const char *e = tail ? buf + len : buf + sizeof buf;
+      long long vi, ri;
+      const char *p = lsb_pb_read_varint(buf, e, &vi);
+      const char *r = ref_read_varint(buf, e, &ri);
+      mu_assert(p == r && p == buf + len, "value: %llu len: %d", v, len);
+      mu_assert(vi == ri && (unsigned long long)vi == v,
+                "expected: %llu received: %llu", v, (unsigned long long)vi);
+    }
+  }
+
+  // non canonical (padded) encodings
+  const char pad[] = "\x80\x80\x80\x00junkjunkjunk";
+  long long vi;
+  const char *p = lsb_pb_read_varint(pad, pad + sizeof(pad) - 1, &vi);
+  mu_assert(p == pad + 4 && vi == 0, "received: %lld", vi);
+
+  const char tl[] = "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01junk";
+  mu_assert(!lsb_pb_read_varint(tl, tl + sizeof(tl) - 1, &vi),
+            "parsed invalid varint (too long)");
+  return NULL;
+}
+
+
+static char* test_packed_varint()
+{
+  unsigned long long state = 7;
+  enum { items = 1000 };
+  static char buf[items * LSB_MAX_VARINT_BYTES];
+  static long long expected[items];
+  static long long vals[items];
+  size_t len = 0;
+  for (int i = 0; i < items; ++i) {
+    // mostly single byte runs broken up by the occasional wide value
+    unsigned long long v = next_rand(&state);
+    expected[i] = (v & 0xf00) ? (long long)(v & 0x7f) : (long long)v;
+    len += lsb_pb_output_varint(buf + len, expected[i]);
+  }
+
+  size_t n = items + 10;
+  const char *p = lsb_pb_read_packed_varint(buf, buf + len, vals, &n);
+  mu_assert(p == buf + len, "received: %p", (void *)p);
+  mu_assert(n == items, "received: %" PRIuSIZE, n);
+  mu_assert(memcmp(vals, expected, sizeof(vals)) == 0, "value mismatch");
+
+  // read in chunks that do not line up with the vector width
+  p = buf;
+  size_t total = 0;
+  memset(vals, 0, sizeof(vals));
+  while (p < buf + len) {
+    n = 17;
+    p = lsb_pb_read_packed_varint(p, buf + len, vals + total, &n);
+    mu_assert(p && n, "chunk read failed at: %" PRIuSIZE, total);
+    total += n;
+  }
+  mu_assert(total == items, "received: %" PRIuSIZE, total);
+  mu_assert(memcmp(vals, expected, sizeof(vals)) == 0, "value mismatch");
+
+  // a truncated value ends the read; the preceding values are returned
+  char tr[40];
+  memset(tr, 1, sizeof(tr));
+  tr[sizeof(tr) - 1] = (char)0xff;
+  n = items;
+  mu_assert(!lsb_pb_read_packed_varint(tr, tr + sizeof(tr), vals, &n),
+            "parsed a truncated varint");
+  mu_assert(n == sizeof(tr) - 1, "received: %" PRIuSIZE, n);
+
+  n = 0;
+  mu_assert(lsb_pb_read_packed_varint(buf, buf + len, vals, &n) == buf,
+            "read into an empty array");
+  mu_assert(n == 0, "received: %" PRIuSIZE, n);
+  mu_assert(!lsb_pb_read_packed_varint(NULL, buf, vals, &n), "null start");
+  mu_assert(!lsb_pb_read_packed_varint(buf, NULL, vals, &n), "null end");
+  mu_assert(!lsb_pb_read_packed_varint(buf, buf + len, NULL, &n), "null vals");
+  mu_assert(!lsb_pb_read_packed_varint(buf, buf + len, vals, NULL), "null n");
+  return NULL;
+}
+
+
 static char* test_lsb_pb_write_bool()
 {
   lsb_output_buffer ob;
@@ -229,16 +350,158 @@ static char* test_lsb_pb_update_field_length()
   return NULL;
 }
 
+
+static char* test_lsb_pb_update_reserved_field_length()
+{
+  lsb_output_buffer ob;
+  lsb_init_output_buffer(&ob, 1024);
+  ob.buf[0] = 'a';
+  ob.pos = 1;
+  lsb_err_value ret = lsb_pb_reserve_field_length(&ob);
+  mu_assert(!ret, "received %s", ret);
+  mu_assert(ob.pos == 1 + LSB_PB_FIXED_LENGTH_BYTES, "received: %" PRIuSIZE,
+            ob.pos);
+  ob.buf[ob.pos++] = 'b';
+  ret = lsb_pb_update_reserved_field_length(&ob, 1);
+  mu_assert(!ret, "received %s", ret);
+  mu_assert(memcmp("a\x81\x80\x80\x00" "b", ob.buf, 6) == 0, "received: "
+            "%02hhx%02hhx%02hhx%02hhx", ob.buf[1], ob.buf[2], ob.buf[3],
+            ob.buf[4]);
+  mu_assert(ob.pos == 6, "received: %" PRIuSIZE, ob.pos);
+
+  memset(ob.buf + ob.pos, 'x', 300);
+  ob.pos += 300;
+  ret = lsb_pb_update_reserved_field_length(&ob, 1);
+  mu_assert(!ret, "received %s", ret);
+  mu_assert(ob.buf[5] == 'b', "received: %02hhx", ob.buf[5]);
+  mu_assert(ob.pos == 306, "received: %" PRIuSIZE, ob.pos);
+
+  // the redundant varint decodes to the field length
+  long long len = 0;
+  const char *p = lsb_pb_read_varint(ob.buf + 1, ob.buf + ob.pos, &len);
+  mu_assert(p == ob.buf + 1 + LSB_PB_FIXED_LENGTH_BYTES, "received: %p",
+            (void *)p);
+  mu_assert(len == 301, "received: %lld", len);
+  p = lsb_pb_read_varint(ob.buf + 1, ob.buf + LSB_PB_FIXED_LENGTH_BYTES,
+                         &len);
+  mu_assert(!p, "the varint should be truncated");
+
+  // position is out of bounds
+  ret = lsb_pb_update_reserved_field_length(&ob, 303);
+  mu_assert(ret == LSB_ERR_UTIL_PRANGE, "received %s", lsb_err_string(ret));
+
+  // buffer full
+  ob.pos = 1022;
+  ret = lsb_pb_reserve_field_length(&ob);
+  mu_assert(ret == LSB_ERR_UTIL_FULL, "received %s", lsb_err_string(ret));
+
+  lsb_free_output_buffer(&ob);
+  return NULL;
+}
+
+static char* benchmark_read_varint()
+{
+  int iter = 10000;
+  enum { items = 1000 };
+  static char buf[items * LSB_MAX_VARINT_BYTES];
+  const unsigned long long values[] = { 1, 300, 5000000000LL, ~0ULL, 0 };
+  unsigned long long state = 5;
+
+  for (unsigned v = 0; v < sizeof(values) / sizeof(values[0]); ++v) {
+    size_t len = 0;
+    long long expected = 0;
+    for (int i = 0; i < items; ++i) {
+      // the last data set mixes every length
+      unsigned long long value = values[v] ? values[v] : rand_value(&state);
+      len += lsb_pb_output_varint(buf + len, value);
+      expected += value;
+    }
+    for (int mode = 0; mode < 2; ++mode) {
+      // called through a pointer so the reference is not inlined either
+      const char* (*volatile fn)(const char *, const char *, long long *) =
+          mode ? lsb_pb_read_varint : ref_read_varint;
+      long long vi, sum = 0;
+      clock_t t = clock();
+      for (int x = 0; x < iter; ++x) {
+        const char *p = buf;
+        const char *e = buf + len;
+        while (p < e) {
+          p = fn(p, e, &vi);
+          sum += vi;
+        }
+      }
+      t = clock() - t;
+      mu_assert(sum == (long long)((unsigned long long)expected * iter),
+                "sum mismatch");
+      char name[16] = "mixed";
+      if (values[v]) {
+        snprintf(name, sizeof(name), "%d byte(s)",
+                 lsb_pb_output_varint(buf + len, values[v]));
+      }
+      printf("benchmark_read_varint %s %s: %g\n", name,
+             mode ? "lsb_pb_read_varint" : "byte loop",
+             ((double)t) / CLOCKS_PER_SEC / iter / items);
+    }
+  }
+  return NULL;
+}
+
+
+static char* benchmark_read_packed_varint()
+{
+  int iter = 10000;
+  enum { items = 1000 };
+  static char buf[items * LSB_MAX_VARINT_BYTES];
+  static long long vals[items];
+  const char *names[] = { "single byte", "mixed" };
+  unsigned long long state = 3;
+
+  for (int data = 0; data < 2; ++data) {
+    size_t len = 0;
+    for (int i = 0; i < items; ++i) {
+      unsigned long long v = data ? rand_value(&state) : i & 0x7f;
+      len += lsb_pb_output_varint(buf + len, v);
+    }
+    for (int mode = 0; mode < 2; ++mode) {
+      clock_t t = clock();
+      for (int x = 0; x < iter; ++x) {
+        size_t n = items;
+        if (mode) {
+          lsb_pb_read_packed_varint(buf, buf + len, vals, &n);
+        } else {
+          const char *p = buf;
+          for (n = 0; p < buf + len; ++n) {
+            p = lsb_pb_read_varint(p, buf + len, &vals[n]);
+          }
+        }
+        mu_assert(n == items, "received: %" PRIuSIZE, n);
+      }
+      t = clock() - t;
+      printf("benchmark_read_packed_varint %s %s: %g\n", names[data],
+             mode ? "lsb_pb_read_packed_varint" : "lsb_pb_read_varint loop",
+             ((double)t) / CLOCKS_PER_SEC / iter / items);
+    }
+  }
+  return NULL;
+}
+
+
 static char* all_tests()
 {
   mu_run_test(test_stub);
   mu_run_test(test_lsb_pb_read_key);
   mu_run_test(test_lsb_pb_write_key);
   mu_run_test(test_varint);
+  mu_run_test(test_varint_fast_path);
+  mu_run_test(test_packed_varint);
   mu_run_test(test_lsb_pb_write_bool);
   mu_run_test(test_lsb_pb_write_double);
   mu_run_test(test_lsb_pb_write_string);
   mu_run_test(test_lsb_pb_update_field_length);
+  mu_run_test(test_lsb_pb_update_reserved_field_length);
+
+  mu_run_test(benchmark_read_varint);
+  mu_run_test(benchmark_read_packed_varint);
   return NULL;
 }
 
@@ -0,0 +1,153 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief lsb_prng unit tests @file */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "luasandbox/test/mu_test.h"
+#include "luasandbox/util/random.h"
+
+static char* test_stub()
+{
+  return NULL;
+}
+
+
+static char* test_seed()
+{
+  static const uint64_t expected[] = {
+    0x99ec5f36cb75f2b4ULL, 0xbf6e1f784956452aULL, 0x1a5f849d4933e6e0ULL
+  };
+  lsb_prng p, q;
+  lsb_prng_seed(&p, 0);
+  for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+    uint64_t r = lsb_prng_next(&p);
+    mu_assert(r == expected[i], "%d received: %llx", (int)i,
+              (unsigned long long)r);
+  }
+
+  lsb_prng_seed(&p, 42);
+  lsb_prng_seed(&q, 42);
+  for (int i = 0; i < 100; ++i) {
+    mu_assert(lsb_prng_next(&p) == lsb_prng_next(&q), "%d mismatch", i);
+  }
+  lsb_prng_seed(&q, 43);
+  mu_assert(lsb_prng_next(&p) != lsb_prng_next(&q), "same sequence");
+  lsb_prng_seed(NULL, 0);
+  return NULL;
+}
+
+
+static char* test_seed_random()
+{
+  lsb_prng p, q;
+  lsb_prng_seed_random(&p);
+  lsb_prng_seed_random(&q);
+  mu_assert(memcmp(&p, &q, sizeof(p)) != 0, "identical states");
+  mu_assert(lsb_prng_next(&p) != lsb_prng_next(&q), "same sequence");
+  lsb_prng_seed_random(NULL);
+  return NULL;
+}
+
+
+static char* test_double()
+{
+  lsb_prng p;
+  lsb_prng_seed(&p, 1);
+  double sum = 0;
+  int iter = 100000;
+  for (int i = 0; i < iter; ++i) {
+    double d = lsb_prng_double(&p);
+    mu_assert(d >= 0 && d < 1, "out of range: %g", d);
+    sum += d;
+  }
+  sum /= iter;
+  mu_assert(sum > 0.49 && sum < 0.51, "mean: %g", sum);
+  return NULL;
+}
+
+
+static char* test_fill()
+{
+  lsb_prng p, q;
+  lsb_prng_seed(&p, 7);
+  lsb_prng_seed(&q, 7);
+  unsigned char buf[20];
+  memset(buf, 0, sizeof(buf));
+  lsb_prng_fill(&p, buf, 13);
+  uint64_t r[2] = { lsb_prng_next(&q), lsb_prng_next(&q) };
+  mu_assert(memcmp(buf, r, 13) == 0, "fill mismatch");
+  for (size_t i = 13; i < sizeof(buf); ++i) {
+    mu_assert(buf[i] == 0, "overrun at %d", (int)i);
+  }
+  return NULL;
+}
+
+
+static char* test_thread()
+{
+  lsb_prng *p = lsb_prng_thread();
+  mu_assert(p, "NULL thread generator");
+  mu_assert(p == lsb_prng_thread(), "thread generator changed");
+  mu_assert(lsb_prng_next(p) != lsb_prng_next(p), "same value");
+  return NULL;
+}
+
+
+static char* benchmark_next()
+{
+  int iter = 10000000;
+  lsb_prng p;
+  lsb_prng_seed(&p, 1);
+  uint64_t x = 0;
+  clock_t t = clock();
+  for (int i = 0; i < iter; ++i) {
+    x ^= lsb_prng_next(&p);
+  }
+  t = clock() - t;
+  printf("benchmark_next() %g seconds (%llx)\n", ((double)t)
+         / CLOCKS_PER_SEC / iter, (unsigned long long)x);
+
+  t = clock();
+  for (int i = 0; i < iter; ++i) {
+    x ^= (uint64_t)rand();
+  }
+  t = clock() - t;
+  printf("benchmark_rand() %g seconds (%llx)\n", ((double)t)
+         / CLOCKS_PER_SEC / iter, (unsigned long long)x);
+  return NULL;
+}
+
+
+static char* all_tests()
+{
+  mu_run_test(test_stub);
+  mu_run_test(test_seed);
+  mu_run_test(test_seed_random);
+  mu_run_test(test_double);
+  mu_run_test(test_fill);
+  mu_run_test(test_thread);
+
+  mu_run_test(benchmark_next);
+  return NULL;
+}
+
+
+int main()
+{
+  char *result = all_tests();
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", mu_tests_run);
+  return result != NULL;
+}
@@ -0,0 +1,177 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief lsb_ring_buffer unit tests @file */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "luasandbox/test/mu_test.h"
+#include "luasandbox/util/ring_buffer.h"
+
+static char* test_stub()
+{
+  return NULL;
+}
+
+
+static char* test_create()
+{
+  lsb_ring_buffer *rb = lsb_create_ring_buffer(0);
+  mu_assert(rb, "create failed");
+  mu_assert(lsb_ring_buffer_used(rb) == 0, "not empty");
+  lsb_destroy_ring_buffer(rb);
+  lsb_destroy_ring_buffer(NULL);
+  mu_assert(lsb_ring_buffer_used(NULL) == 0, "not empty");
+  return NULL;
+}
+
+
+static char* test_push_peek_pop()
+{
+  lsb_ring_buffer *rb = lsb_create_ring_buffer(128);
+  mu_assert(rb, "create failed");
+
+  size_t len = 99;
+  mu_assert(!lsb_ring_buffer_peek(rb, &len), "peek on an empty buffer");
+  lsb_ring_buffer_pop(rb); // no-op
+
+  lsb_err_value ret = lsb_ring_buffer_push(rb, "foo", 3);
+  mu_assert(!ret, "received: %s", ret);
+  ret = lsb_ring_buffer_push(rb, "", 0);
+  mu_assert(!ret, "received: %s", ret);
+  ret = lsb_ring_buffer_push(rb, "barbaz", 6);
+  mu_assert(!ret, "received: %s", ret);
+
+  const char *s = lsb_ring_buffer_peek(rb, &len);
+  mu_assert(s && len == 3 && memcmp(s, "foo", 3) == 0, "invalid record");
+  s = lsb_ring_buffer_peek(rb, &len);
+  mu_assert(s && len == 3 && memcmp(s, "foo", 3) == 0, "peek consumed");
+  lsb_ring_buffer_pop(rb);
+  s = lsb_ring_buffer_peek(rb, &len);
+  mu_assert(s && len == 0, "invalid empty record");
+  lsb_ring_buffer_pop(rb);
+  s = lsb_ring_buffer_peek(rb, &len);
+  mu_assert(s && len == 6 && memcmp(s, "barbaz", 6) == 0, "invalid record");
+  lsb_ring_buffer_pop(rb);
+  mu_assert(!lsb_ring_buffer_peek(rb, &len), "not empty");
+  mu_assert(lsb_ring_buffer_used(rb) == 0, "not empty");
+
+  lsb_destroy_ring_buffer(rb);
+  return NULL;
+}
+
+
+static char* test_full()
+{
+  lsb_ring_buffer *rb = lsb_create_ring_buffer(64);
+  mu_assert(rb, "create failed");
+
+  char data[32] = { 0 };
+  lsb_err_value ret = lsb_ring_buffer_push(rb, data, 25);
+  mu_assert(ret == LSB_ERR_UTIL_PRANGE, "received: %s", lsb_err_string(ret));
+  ret = lsb_ring_buffer_push(rb, NULL, 1);
+  mu_assert(ret == LSB_ERR_UTIL_NULL, "received: %s", lsb_err_string(ret));
+
+  mu_assert(!lsb_ring_buffer_push(rb, data, 24), "push failed");
+  mu_assert(!lsb_ring_buffer_push(rb, data, 24), "push failed");
+  ret = lsb_ring_buffer_push(rb, data, 1);
+  mu_assert(ret == LSB_ERR_UTIL_FULL, "received: %s", lsb_err_string(ret));
+  lsb_ring_buffer_pop(rb);
+  mu_assert(!lsb_ring_buffer_push(rb, data, 1), "push failed");
+  lsb_destroy_ring_buffer(rb);
+  return NULL;
+}
+
+
+static char* test_wrap()
+{
+  lsb_ring_buffer *rb = lsb_create_ring_buffer(64);
+  mu_assert(rb, "create failed");
+
+  char data[24];
+  size_t len;
+  for (int i = 0; i < 1000; ++i) {
+    size_t n = (size_t)(i % 24) + 1;
+    memset(data, i & 0xff, n);
+    lsb_err_value ret = lsb_ring_buffer_push(rb, data, n);
+    if (ret == LSB_ERR_UTIL_FULL) {
+      while (lsb_ring_buffer_peek(rb, &len)) {
+        lsb_ring_buffer_pop(rb);
+      }
+      ret = lsb_ring_buffer_push(rb, data, n);
+    }
+    mu_assert(!ret, "iteration: %d received: %s", i, ret);
+  }
+
+  while (lsb_ring_buffer_peek(rb, &len)) {
+    lsb_ring_buffer_pop(rb);
+  }
+
+  for (int i = 0; i < 1000; ++i) {
+    size_t n = (size_t)(i % 24) + 1;
+    memset(data, i & 0xff, n);
+    mu_assert(!lsb_ring_buffer_push(rb, data, n), "iteration: %d", i);
+    const char *s = lsb_ring_buffer_peek(rb, &len);
+    mu_assert(s, "iteration: %d peek failed", i);
+    mu_assert(len == n, "iteration: %d expected: %" PRIuSIZE " received: %"
+              PRIuSIZE, i, n, len);
+    mu_assert(memcmp(s, data, n) == 0, "iteration: %d data mismatch", i);
+    lsb_ring_buffer_pop(rb);
+  }
+  lsb_destroy_ring_buffer(rb);
+  return NULL;
+}
+
+
+static char* benchmark_push_pop()
+{
+  int iter = 1000000;
+  char data[200] = { 0 };
+  size_t len;
+  lsb_ring_buffer *rb = lsb_create_ring_buffer(64 * 1024);
+  mu_assert(rb, "create failed");
+
+  clock_t t = clock();
+  for (int x = 0; x < iter; ++x) {
+    lsb_ring_buffer_push(rb, data, sizeof data);
+    if (lsb_ring_buffer_peek(rb, &len)) {
+      lsb_ring_buffer_pop(rb);
+    }
+  }
+  t = clock() - t;
+  lsb_destroy_ring_buffer(rb);
+  printf("benchmark_push_pop() %g seconds\n", ((double)t)
+         / CLOCKS_PER_SEC / iter);
+  return NULL;
+}
+
+
+static char* all_tests()
+{
+  mu_run_test(test_stub);
+  mu_run_test(test_create);
+  mu_run_test(test_push_peek_pop);
+  mu_run_test(test_full);
+  mu_run_test(test_wrap);
+
+  mu_run_test(benchmark_push_pop);
+  return NULL;
+}
+
+
+int main()
+{
+  char *result = all_tests();
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", mu_tests_run);
+  return result != NULL;
+}
@@ -6,7 +6,9 @@
 
 /** @brief lsb_input_buffer unit tests @file */
 
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "luasandbox/test/mu_test.h"
 #include "luasandbox/util/string_matcher.h"
@@ -17,6 +19,15 @@ static char* test_stub()
 }
 
 
+static bool compiled_match(const char *s, size_t len, const char *p)
+{
+  lsb_string_pattern *sp = lsb_compile_string_pattern(p);
+  bool m = lsb_string_pattern_match(sp, s, len);
+  lsb_destroy_string_pattern(sp);
+  return m;
+}
+
+
 static char* test_success()
 {
   char *tests[] = {
@@ -63,8 +74,12 @@ static char* test_success()
     mu_assert(lsb_string_match(tests[i], strlen(tests[i]), tests[i + 1]),
               "no match test: %d string: %s pattern: %s", i / 2, tests[i],
               tests[i + 1]);
+    mu_assert(compiled_match(tests[i], strlen(tests[i]), tests[i + 1]),
+              "no compiled match test: %d string: %s pattern: %s", i / 2,
+              tests[i], tests[i + 1]);
   }
   mu_assert(lsb_string_match("\0", 1, "%z"), "NULL match");
+  mu_assert(compiled_match("\0", 1, "%z"), "NULL compiled match");
   return NULL;
 }
 
@@ -115,6 +130,9 @@ static char* test_failure()
     mu_assert(!lsb_string_match(tests[i], strlen(tests[i]), tests[i + 1]),
               "match test: %d string: %s pattern: %s", i / 2, tests[i],
               tests[i + 1]);
+    mu_assert(!compiled_match(tests[i], strlen(tests[i]), tests[i + 1]),
+              "compiled match test: %d string: %s pattern: %s", i / 2,
+              tests[i], tests[i + 1]);
   }
   return NULL;
 }
@@ -158,6 +176,9 @@ static char* test_invalid()
     mu_assert(!lsb_string_match(tests[i], strlen(tests[i]), tests[i + 1]),
               "invalid test: %d string: %s pattern: %s", i / 2, tests[i],
               tests[i + 1]);
+    mu_assert(!compiled_match(tests[i], strlen(tests[i]), tests[i + 1]),
+              "invalid compiled test: %d string: %s pattern: %s", i / 2,
+              tests[i], tests[i + 1]);
   }
   mu_assert(!lsb_string_match(NULL, 0, tests[1]),
             "invalid test: string: NULL pattern: %s", tests[1]);
@@ -167,6 +188,246 @@ static char* test_invalid()
 }
 
 
+static char* test_compiled_equivalence()
+{
+  // random patterns over a small alphabet must agree with the interpreter
+  const char *atoms[] = { "a", "b", ".", "%a", "[ab]", "[^a]", "%f[%a]",
+    "%%", "%b()", "(" };
+  const char *quant[] = { "", "", "?", "*", "+", "-" };
+  const char alphabet[] = "ab(). ";
+  srand(7);
+  for (int i = 0; i < 20000; ++i) {
+    char p[256], s[32];
+    size_t pos = 0;
+    if (rand() % 4 == 0) p[pos++] = '^';
+    if (i & 1) {
+      // never matching optional items push the program past one word
+      for (int j = 0; j < 64; ++j) {
+        p[pos++] = 'x';
+        p[pos++] = '?';
+      }
+    }
+    int n = rand() % 5 + 1;
+    for (int j = 0; j < n; ++j) {
+      const char *a = atoms[rand() % (sizeof(atoms) / sizeof(atoms[0]))];
+      memcpy(p + pos, a, strlen(a));
+      pos += strlen(a);
+      if (a[1] != 'f' && a[1] != 'b') {
+        const char *q = quant[rand() % (sizeof(quant) / sizeof(quant[0]))];
+        memcpy(p + pos, q, strlen(q));
+        pos += strlen(q);
+      }
+    }
+    if (rand() % 4 == 0) p[pos++] = '$';
+    p[pos] = 0;
+    size_t len = (size_t)(rand() % 16);
+    for (size_t j = 0; j < len; ++j) {
+      s[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+    }
+    s[len] = 0;
+    bool expected = lsb_string_match(s, len, p);
+    mu_assert(compiled_match(s, len, p) == expected, "string: '%s' pattern: "
+              "'%s' expected: %d", s, p, expected);
+  }
+
+  // near misses: every opener but the last scans to the end before the match
+  const char *balanced[] = { "%b()", "^%b()", "%b()$", "^%b()$", "%b((",
+    "%b(($", "x?%b()" };
+  static char near[4001];
+  size_t sizes[] = { 2, 3, 160, 200, 1000, 4000 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    size_t len = sizes[i];
+    memset(near, '(', len - 1);
+    near[len - 1] = ')';
+    near[len] = 0;
+    for (size_t j = 0; j < sizeof(balanced) / sizeof(balanced[0]); ++j) {
+      bool expected = lsb_string_match(near, len, balanced[j]);
+      mu_assert(compiled_match(near, len, balanced[j]) == expected,
+                "len: %" PRIuSIZE " pattern: '%s' expected: %d", len,
+                balanced[j], expected);
+    }
+  }
+  mu_assert(compiled_match(near, 4000, "%b()"), "no match");
+  for (int i = 0; i < 20000; ++i) {
+    char s[32];
+    size_t len = (size_t)(rand() % 24);
+    for (size_t j = 0; j < len; ++j) s[j] = "()a"[rand() % 3];
+    s[len] = 0;
+    const char *p = balanced[rand() % (sizeof(balanced) / sizeof(balanced[0]))];
+    bool expected = lsb_string_match(s, len, p);
+    mu_assert(compiled_match(s, len, p) == expected, "string: '%s' pattern: "
+              "'%s' expected: %d", s, p, expected);
+  }
+  return NULL;
+}
+
+
+static bool naive_find(const char *s, size_t ls, const char *p, size_t lp)
+{
+  if (lp == 0) return true;
+  for (size_t i = 0; i + lp <= ls; ++i) {
+    if (memcmp(s + i, p, lp) == 0) return true;
+  }
+  return false;
+}
+
+
+static char* test_find_equivalence()
+{
+  // a two letter alphabet produces many first/last byte candidates
+  char buf[300];
+  char needle[40];
+  srand(42);
+  for (int x = 0; x < 20000; ++x) {
+    size_t off = (size_t)(rand() % 16);
+    size_t ls = (size_t)(rand() % (int)(sizeof(buf) - off));
+    size_t lp = (size_t)(rand() % (int)sizeof(needle));
+    char *s = buf + off;
+    for (size_t i = 0; i < ls; ++i) s[i] = "ab"[rand() % 2];
+    if (lp && lp <= ls && rand() % 2) {
+      memcpy(needle, s + (size_t)rand() % (ls - lp + 1), lp);
+    } else {
+      for (size_t i = 0; i < lp; ++i) needle[i] = "ab"[rand() % 2];
+    }
+    mu_assert(lsb_string_find(s, ls, needle, lp) == naive_find(s, ls, needle,
+                                                               lp),
+              "iteration: %d ls: %" PRIuSIZE " lp: %" PRIuSIZE, x, ls, lp);
+  }
+  return NULL;
+}
+
+
+static char* test_compiled_errors()
+{
+  mu_assert(!lsb_compile_string_pattern(NULL), "compiled a NULL pattern");
+  mu_assert(!lsb_compile_string_pattern("[a"), "compiled an invalid pattern");
+  mu_assert(!lsb_compile_string_pattern("a%"), "compiled an invalid pattern");
+  lsb_string_pattern *sp = lsb_compile_string_pattern("a");
+  mu_assert(!lsb_string_pattern_match(sp, NULL, 0), "matched NULL");
+  mu_assert(!lsb_string_pattern_match(NULL, "a", 1), "matched NULL pattern");
+  lsb_destroy_string_pattern(sp);
+  lsb_destroy_string_pattern(NULL);
+  return NULL;
+}
+
+
+static char* test_compiled_balance()
+{
+  // unbalanced openers make every interpreted start position scan to the end
+  size_t len = 200000;
+  char *s = malloc(len + 1);
+  mu_assert(s, "malloc failed");
+  memset(s, '(', len);
+  s[len] = 0;
+  lsb_string_pattern *sp = lsb_compile_string_pattern("%b()");
+  mu_assert(sp, "compile failed");
+  mu_assert(!lsb_string_pattern_match(sp, s, len), "matched");
+  s[len - 1] = ')';
+  mu_assert(lsb_string_pattern_match(sp, s, len), "no match");
+  lsb_destroy_string_pattern(sp);
+
+  sp = lsb_compile_string_pattern("%b()$");
+  mu_assert(sp, "compile failed");
+  mu_assert(lsb_string_pattern_match(sp, s, len), "no match");
+  s[0] = ')';
+  s[1] = ')';
+  mu_assert(lsb_string_pattern_match(sp, s, len), "no match");
+  lsb_destroy_string_pattern(sp);
+  free(s);
+  return NULL;
+}
+
+
+static char* benchmark_backtracking()
+{
+  // the interpreter is polynomial in the number of stars on a near miss
+  char s[4097];
+  memset(s, 'a', sizeof(s) - 1);
+  s[sizeof(s) - 1] = 0;
+  const char *p = "a*a*a*a*[bc]"; // no literal to prefilter on
+  lsb_string_pattern *sp = lsb_compile_string_pattern(p);
+  mu_assert(sp, "compile failed");
+
+  clock_t t = clock();
+  mu_assert(!lsb_string_pattern_match(sp, s, sizeof(s) - 1), "matched");
+  t = clock() - t;
+  printf("benchmark_backtracking() compiled %g seconds\n",
+         ((double)t) / CLOCKS_PER_SEC);
+
+  t = clock();
+  mu_assert(!lsb_string_match(s, 64, p), "matched");
+  t = clock() - t;
+  printf("benchmark_backtracking() interpreted (64 bytes) %g seconds\n",
+         ((double)t) / CLOCKS_PER_SEC);
+  lsb_destroy_string_pattern(sp);
+  return NULL;
+}
+
+
+static char* benchmark_prefilter()
+{
+  const char *s = "2016-01-01T00:00:00 INFO some log line without the "
+      "interesting token in it but long enough to matter";
+  size_t len = strlen(s);
+  const char *p = "ERROR %d+ failed";
+  int iter = 1000000;
+  lsb_string_pattern *sp = lsb_compile_string_pattern(p);
+  mu_assert(sp, "compile failed");
+
+  clock_t t = clock();
+  for (int x = 0; x < iter; ++x) {
+    mu_assert(!lsb_string_pattern_match(sp, s, len), "matched");
+  }
+  t = clock() - t;
+  printf("benchmark_prefilter() compiled %g seconds\n", ((double)t)
+         / CLOCKS_PER_SEC / iter);
+
+  t = clock();
+  for (int x = 0; x < iter; ++x) {
+    mu_assert(!lsb_string_match(s, len, p), "matched");
+  }
+  t = clock() - t;
+  printf("benchmark_prefilter() interpreted %g seconds\n", ((double)t)
+         / CLOCKS_PER_SEC / iter);
+  lsb_destroy_string_pattern(sp);
+  return NULL;
+}
+
+
+static char* benchmark_find()
+{
+  // every position matches the first byte of the needle
+  const char *p = "aaaaaaab";
+  size_t lp = strlen(p);
+  size_t sizes[] = { 64, 1024, 65536 };
+  for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); ++n) {
+    size_t len = sizes[n];
+    char *s = malloc(len);
+    mu_assert(s, "malloc failed");
+    memset(s, 'a', len);
+    int iter = (int)(10000000 / len);
+
+    clock_t t = clock();
+    for (int x = 0; x < iter; ++x) {
+      mu_assert(!lsb_string_find(s, len, p, lp), "found");
+    }
+    t = clock() - t;
+    printf("benchmark_find() %" PRIuSIZE " bytes %g seconds\n", len,
+           ((double)t) / CLOCKS_PER_SEC / iter);
+
+    t = clock();
+    for (int x = 0; x < iter; ++x) {
+      mu_assert(!naive_find(s, len, p, lp), "found");
+    }
+    t = clock() - t;
+    printf("benchmark_find() %" PRIuSIZE " bytes naive %g seconds\n", len,
+           ((double)t) / CLOCKS_PER_SEC / iter);
+    free(s);
+  }
+  return NULL;
+}
+
+
 static char* all_tests()
 {
   mu_run_test(test_stub);
@@ -175,6 +436,14 @@ static char* all_tests()
   mu_run_test(test_failure);
   mu_run_test(test_find_failure);
   mu_run_test(test_invalid);
+  mu_run_test(test_compiled_equivalence);
+  mu_run_test(test_compiled_errors);
+  mu_run_test(test_compiled_balance);
+  mu_run_test(test_find_equivalence);
+
+  mu_run_test(benchmark_backtracking);
+  mu_run_test(benchmark_prefilter);
+  mu_run_test(benchmark_find);
   return NULL;
 }
 
@@ -9,6 +9,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "luasandbox/error.h"
@@ -64,6 +65,20 @@ static char* test_lsb_set_tz()
 }
 
 
+static char* test_lsb_process_init()
+{
+  mu_assert(lsb_process_init(), "process_init failed");
+  const char *tz = getenv("TZ");
+  mu_assert(tz && strcmp(tz, "UTC") == 0, "received: %s", tz ? tz : "NULL");
+  mu_assert(lsb_set_tz("America/Los_Angeles"), "set_tz failed");
+  mu_assert(lsb_process_init(), "process_init failed");
+  tz = getenv("TZ");
+  mu_assert(tz && strcmp(tz, "America/Los_Angeles") == 0, "TZ was reset");
+  mu_assert(lsb_set_tz(NULL), "set_tz failed");
+  return NULL;
+}
+
+
 static char* benchmark_lsb_get_time()
 {
   int iter = 1000000;
@@ -113,6 +128,7 @@ static char* all_tests()
   mu_run_test(test_stub);
   mu_run_test(test_lsb_lp2);
   mu_run_test(test_lsb_read_file);
+  mu_run_test(test_lsb_process_init);
   mu_run_test(test_lsb_set_tz);
 
   mu_run_test(benchmark_lsb_get_time);
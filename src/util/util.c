@@ -7,6 +7,7 @@
 /** General purpose utility functions @file */
 
 #include "luasandbox/util/util.h"
+#include "luasandbox/util/random.h"
 #include "../luasandbox_defines.h"
 
 #include <stdio.h>
@@ -158,3 +159,21 @@ bool lsb_set_tz(const char *tz)
 #endif
   return true;
 }
+
+
+bool lsb_process_init()
+{
+  static lsb_atomic_int state; // 0 uninitialized, 1 initializing, 2 ready
+  static bool result;
+
+  if (lsb_atomic_load(&state) == 2) return result;
+
+  if (lsb_atomic_cas_int(&state, 0, 1)) {
+    result = lsb_set_tz(NULL);
+    srand((unsigned)lsb_prng_next(lsb_prng_thread()));
+    lsb_atomic_store(&state, 2);
+    return result;
+  }
+  while (lsb_atomic_load(&state) != 2);
+  return result;
+}